@@ -0,0 +1,706 @@
+/* xdelta 3 - delta compression tools and library
+ * Copyright (C) 2007.  Joshua P. MacDonald
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* xdelta3bench: times the encoder and decoder kernels one at a time.
+ *
+ *   xdelta3bench [-n SIZE] [-r TRIALS] [-o FILE] [-c FILE] [KERNEL ...]
+ *
+ * Each kernel runs over SIZE bytes (default 4M) of text-like input,
+ * generated as for "xdelta3 bench".  The best of TRIALS runs is
+ * reported as ticks per unit and millions of units per second, where
+ * a tick is a TSC cycle on x86 and a nanosecond elsewhere, and a unit
+ * is a byte except for kernels that work on whole items (hashes,
+ * addresses).
+ *
+ * To compare two builds, save the results of one with "-o FILE" and
+ * run the other with "-c FILE"; the table then shows the saved result
+ * and the speedup relative to it.  Naming kernels on the command line
+ * runs only those. */
+
+#include "../xdelta3.c"
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define MB_TICK_NAME "cycles"
+static xoff_t mb_ticks (void) { return __builtin_ia32_rdtsc (); }
+#else
+#define MB_TICK_NAME "ns"
+static xoff_t mb_ticks (void) { return main_bench_usecs () * 1000; }
+#endif
+
+#define MB_DEFAULT_SIZE   (4U << 20)
+#define MB_DEFAULT_TRIALS 5
+#define MB_MAX_SAVED      64
+#define MB_COPY_PREFIX    256
+
+typedef struct _mb_state  mb_state;
+typedef struct _mb_kernel mb_kernel;
+
+struct _mb_state
+{
+  xd3_stream        stream;
+  main_bench_config gen;       /* input and random numbers */
+  usize_t           size;
+  usize_t           nitems;    /* size / 8 */
+  uint8_t          *data;      /* the input */
+  uint8_t          *data2;     /* the input with scattered changes */
+  usize_t          *cksums;    /* small checksums for checksum_hash */
+  usize_t          *addrs;     /* copy addresses for encode_address */
+  xd3_hinst        *copies;    /* copy instructions for decode_copy */
+  usize_t           ncopies;
+  uint8_t          *out;       /* decode_copy output */
+  xd3_output       *sec_in;    /* secondary compressor input */
+  uint8_t          *sec_buf;   /* secondary compressor output */
+  usize_t           sec_size;
+  usize_t           sink;
+};
+
+/* A kernel returns the number of units it processed, or 0 on error. */
+struct _mb_kernel
+{
+  const char *name;
+  const char *unit;
+  usize_t   (*run) (mb_state *m);
+  int       (*setup) (mb_state *m);
+};
+
+static usize_t
+mb_lcksum (mb_state *m)
+{
+  usize_t look = m->stream.smatcher.large_look;
+  usize_t pos;
+
+  for (pos = 0; pos + look <= m->size; pos += look)
+    {
+      m->sink += xd3_lcksum (m->data + pos, look);
+    }
+
+  return pos;
+}
+
+static usize_t
+mb_large_cksum_update (mb_state *m)
+{
+  usize_t look = m->stream.smatcher.large_look;
+  uint32_t cksum = xd3_lcksum (m->data, look);
+  usize_t pos;
+
+  for (pos = 0; pos + look < m->size; pos += 1)
+    {
+      cksum = xd3_large_cksum_update (cksum, m->data + pos, look);
+    }
+
+  m->sink += cksum;
+  return pos;
+}
+
+static usize_t
+mb_scksum (mb_state *m)
+{
+  usize_t look = m->stream.smatcher.small_look;
+  uint32_t state;
+  usize_t pos;
+
+  for (pos = 0; pos + look <= m->size; pos += 1)
+    {
+      m->sink += xd3_scksum (& state, m->data + pos, look);
+    }
+
+  return pos;
+}
+
+static usize_t
+mb_checksum_hash (mb_state *m)
+{
+  usize_t i;
+
+  for (i = 0; i < m->nitems; i += 1)
+    {
+      m->sink += xd3_checksum_hash (& m->stream.small_hash, m->cksums[i]);
+    }
+
+  return m->nitems;
+}
+
+static usize_t
+mb_forward_match (mb_state *m)
+{
+  usize_t pos = 0;
+
+  while (pos < m->size)
+    {
+      pos += xd3_forward_match (m->data + pos, m->data2 + pos,
+				(int) (m->size - pos)) + 1;
+    }
+
+  return m->size;
+}
+
+/* The small-match search loop of the encoder: checksum, hash, test
+ * the bucket with xd3_smatch, insert, and skip past any match. */
+static usize_t
+mb_smatch (mb_state *m)
+{
+  xd3_stream *stream = & m->stream;
+  usize_t look = stream->smatcher.small_look;
+  usize_t pos = 0;
+  uint32_t state;
+
+  stream->small_reset = 1;
+
+  if (xd3_string_match_init (stream)) { return 0; }
+
+  stream->next_in  = m->data;
+  stream->avail_in = m->size;
+  stream->min_match = MIN_MATCH;
+
+  while (pos + look < m->size)
+    {
+      usize_t scksum = xd3_scksum (& state, m->data + pos, look);
+      usize_t inx = xd3_checksum_hash (& stream->small_hash, scksum);
+      usize_t base = stream->small_table[inx];
+      usize_t match_offset, match_length = 0;
+
+      stream->input_position = pos;
+
+      if (base != 0)
+	{
+	  match_length = xd3_smatch (stream, base, scksum, & match_offset);
+	}
+
+      xd3_scksum_insert (stream, inx, scksum, pos);
+
+      pos += match_length >= MIN_MATCH ? match_length : 1;
+      m->sink += match_length;
+    }
+
+  stream->next_in  = NULL;
+  stream->avail_in = 0;
+  return m->size;
+}
+
+static usize_t
+mb_encode_address (mb_state *m)
+{
+  xd3_stream *stream = & m->stream;
+  usize_t i;
+
+  xd3_freelist_output (stream, ADDR_HEAD (stream)->next_page);
+  ADDR_HEAD (stream)->next = 0;
+  ADDR_HEAD (stream)->next_page = NULL;
+  ADDR_TAIL (stream) = ADDR_HEAD (stream);
+  xd3_init_cache (& stream->acache);
+
+  for (i = 1; i < m->nitems; i += 1)
+    {
+      uint8_t mode = 0;
+
+      if (xd3_encode_address (stream, m->addrs[i], i, & mode)) { return 0; }
+
+      m->sink += mode;
+    }
+
+  return m->nitems - 1;
+}
+
+static usize_t
+mb_adler32 (mb_state *m)
+{
+  m->sink += adler32 (1, m->data, m->size);
+  return m->size;
+}
+
+/* Overlapping target-window copies through xd3_decode_output_halfinst. */
+static usize_t
+mb_decode_copy (mb_state *m)
+{
+  xd3_stream *stream = & m->stream;
+  usize_t i;
+
+  memcpy (m->out, m->data, MB_COPY_PREFIX);
+  stream->next_out  = m->out;
+  stream->avail_out = MB_COPY_PREFIX;
+  stream->dec_cpylen = 0;
+  stream->dec_tgtaddrbase = m->out;
+
+  for (i = 0; i < m->ncopies; i += 1)
+    {
+      xd3_hinst inst = m->copies[i];
+
+      if (xd3_decode_output_halfinst (stream, & inst)) { return 0; }
+    }
+
+  m->sink += m->out[stream->avail_out - 1];
+  i = stream->avail_out - MB_COPY_PREFIX;
+  stream->next_out  = NULL;
+  stream->avail_out = 0;
+  return i;
+}
+
+#if SECONDARY_ANY
+/* On success the caller frees *outp; on failure it is freed here. */
+static int
+mb_sec_encode (mb_state *m, const xd3_sec_type *sec, xd3_output **outp)
+{
+  xd3_stream *stream = & m->stream;
+  xd3_sec_stream *sec_stream;
+  xd3_sec_cfg cfg;
+  int ret;
+
+  memset (& cfg, 0, sizeof (cfg));
+  cfg.inefficient = 1;
+
+  if ((*outp = xd3_alloc_output (stream, NULL)) == NULL)
+    {
+      return ENOMEM;
+    }
+
+  if ((sec_stream = sec->alloc (stream)) == NULL)
+    {
+      xd3_freelist_output (stream, *outp);
+      *outp = NULL;
+      return ENOMEM;
+    }
+
+  if ((ret = sec->init (stream, sec_stream, 1)) == 0)
+    {
+      ret = sec->encode (stream, sec_stream, m->sec_in, *outp, & cfg);
+    }
+
+  sec->destroy (stream, sec_stream);
+
+  if (ret != 0)
+    {
+      xd3_freelist_output (stream, *outp);
+      *outp = NULL;
+    }
+
+  return ret;
+}
+
+static usize_t
+mb_sec_encode_run (mb_state *m, const xd3_sec_type *sec)
+{
+  xd3_output *out;
+
+  if (mb_sec_encode (m, sec, & out) != 0)
+    {
+      return 0;
+    }
+
+  m->sink += xd3_sizeof_output (out);
+  xd3_freelist_output (& m->stream, out);
+  return m->size;
+}
+
+static usize_t
+mb_sec_decode_run (mb_state *m, const xd3_sec_type *sec)
+{
+  xd3_stream *stream = & m->stream;
+  xd3_sec_stream *sec_stream;
+  const uint8_t *inp = m->sec_buf;
+  uint8_t *outp = m->out;
+  int ret;
+
+  if ((sec_stream = sec->alloc (stream)) == NULL) { return 0; }
+
+  if ((ret = sec->init (stream, sec_stream, 0)) == 0)
+    {
+      ret = sec->decode (stream, sec_stream, & inp, m->sec_buf + m->sec_size,
+			 & outp, m->out + m->size);
+    }
+
+  sec->destroy (stream, sec_stream);
+
+  if (ret != 0 || memcmp (m->out, m->data, m->size) != 0)
+    {
+      return 0;
+    }
+
+  return m->size;
+}
+
+/* Encodes the input once to produce the decoder's input. */
+static int
+mb_sec_setup (mb_state *m, const xd3_sec_type *sec)
+{
+  xd3_output *out, *p;
+  int ret;
+
+  if ((ret = mb_sec_encode (m, sec, & out))) { return ret; }
+
+  m->sec_size = 0;
+
+  for (p = out; p != NULL; p = p->next_page)
+    {
+      memcpy (m->sec_buf + m->sec_size, p->base, p->next);
+      m->sec_size += p->next;
+    }
+
+  xd3_freelist_output (& m->stream, out);
+  return 0;
+}
+#endif
+
+#if SECONDARY_DJW
+static usize_t mb_djw_encode (mb_state *m)
+{ return mb_sec_encode_run (m, & djw_sec_type); }
+static usize_t mb_djw_decode (mb_state *m)
+{ return mb_sec_decode_run (m, & djw_sec_type); }
+static int mb_djw_setup (mb_state *m)
+{ return mb_sec_setup (m, & djw_sec_type); }
+#endif
+
+#if SECONDARY_FGK
+static usize_t mb_fgk_encode (mb_state *m)
+{ return mb_sec_encode_run (m, & fgk_sec_type); }
+static usize_t mb_fgk_decode (mb_state *m)
+{ return mb_sec_decode_run (m, & fgk_sec_type); }
+static int mb_fgk_setup (mb_state *m)
+{ return mb_sec_setup (m, & fgk_sec_type); }
+#endif
+
+static const mb_kernel mb_kernels[] =
+{
+  { "lcksum",             "byte", mb_lcksum, NULL },
+  { "large_cksum_update", "byte", mb_large_cksum_update, NULL },
+  { "scksum",             "byte", mb_scksum, NULL },
+  { "checksum_hash",      "hash", mb_checksum_hash, NULL },
+  { "forward_match",      "byte", mb_forward_match, NULL },
+  { "smatch",             "byte", mb_smatch, NULL },
+  { "encode_address",     "addr", mb_encode_address, NULL },
+  { "adler32",            "byte", mb_adler32, NULL },
+#if SECONDARY_DJW
+  { "djw_encode",         "byte", mb_djw_encode, NULL },
+  { "djw_decode",         "byte", mb_djw_decode, mb_djw_setup },
+#endif
+#if SECONDARY_FGK
+  { "fgk_encode",         "byte", mb_fgk_encode, NULL },
+  { "fgk_decode",         "byte", mb_fgk_decode, mb_fgk_setup },
+#endif
+  { "decode_copy",        "byte", mb_decode_copy, NULL },
+};
+
+/* Builds the inputs shared by all kernels. */
+static int
+mb_setup (mb_state *m, usize_t size)
+{
+  xd3_stream *stream = & m->stream;
+  xd3_config config;
+  xd3_output *tail;
+  usize_t i, pos, avail;
+  int ret;
+
+  memset (m, 0, sizeof (*m));
+  m->size   = size;
+  m->nitems = size / 8;
+
+  xd3_init_config (& config, XD3_DEFAULT_LEVEL << XD3_COMPLEVEL_SHIFT);
+  config.winsize = max (size, XD3_ALLOCSIZE);
+
+  if ((ret = xd3_config_stream (stream, & config)) ||
+      (ret = xd3_encode_init_full (stream)))
+    {
+      return ret;
+    }
+
+  if ((m->data    = (uint8_t*) main_bufalloc (size)) == NULL ||
+      (m->data2   = (uint8_t*) main_bufalloc (size)) == NULL ||
+      (m->out     = (uint8_t*) main_bufalloc (size + 2 * size / 10)) == NULL ||
+      (m->sec_buf = (uint8_t*) main_bufalloc (size + 2 * size / 10)) == NULL ||
+      (m->cksums  = (usize_t*) main_bufalloc (m->nitems * sizeof (usize_t))) == NULL ||
+      (m->addrs   = (usize_t*) main_bufalloc (m->nitems * sizeof (usize_t))) == NULL ||
+      (m->copies  = (xd3_hinst*) main_bufalloc (size / 4 * sizeof (xd3_hinst))) == NULL ||
+      (m->sec_in  = xd3_alloc_output (stream, NULL)) == NULL)
+    {
+      return ENOMEM;
+    }
+
+  m->gen.rand   = 0x9f73f7fc;
+  m->gen.size   = size;
+  m->gen.source = m->data;
+  main_bench_make_source (& m->gen);
+
+  /* data2 differs from data at random intervals. */
+  memcpy (m->data2, m->data, size);
+  for (pos = main_bench_random (& m->gen) % 512; pos < size;
+       pos += 1 + main_bench_random (& m->gen) % 512)
+    {
+      m->data2[pos] ^= 1;
+    }
+
+  for (i = 0; i < m->nitems; i += 1)
+    {
+      uint32_t state;
+      m->cksums[i] = xd3_scksum (& state, m->data + i * 8,
+				 stream->smatcher.small_look);
+    }
+
+  /* A mix of repeated, nearby and random addresses, as in
+   * test_address_cache. */
+  m->addrs[0] = 0;
+  for (i = 1; i < m->nitems; i += 1)
+    {
+      uint32_t r = main_bench_random (& m->gen);
+      usize_t prev = main_bench_random (& m->gen) % i;
+      usize_t near = max (1U, (main_bench_random (& m->gen) % 256) % i);
+
+      if (r % 10 == 0)     { m->addrs[i] = m->addrs[i - near]; }
+      else if (r % 10 < 4) { m->addrs[i] = min (m->addrs[prev] + near, i - 1); }
+      else                 { m->addrs[i] = prev; }
+    }
+
+  /* Copies of 4 to 67 bytes from anywhere earlier in the output,
+   * including overlapping ones, until the output is full. */
+  for (avail = MB_COPY_PREFIX; ; m->ncopies += 1)
+    {
+      xd3_hinst *inst = & m->copies[m->ncopies];
+
+      inst->type = XD3_CPY;
+      inst->size = 4 + main_bench_random (& m->gen) % 64;
+      inst->addr = main_bench_random (& m->gen) % avail;
+
+      if (avail + inst->size > size) { break; }
+
+      avail += inst->size;
+    }
+
+  tail = m->sec_in;
+  return xd3_emit_bytes (stream, & tail, m->data, size);
+}
+
+/* Runs KERN once to warm up and then TRIALS times, keeping the best. */
+static int
+mb_time (mb_state *m, const mb_kernel *kern, usize_t trials,
+	 double *ticks_per_unit, double *mups)
+{
+  double best_ticks = 0, best_usecs = 0;
+  usize_t i, units = 0;
+
+  if (kern->setup != NULL && kern->setup (m))
+    {
+      return XD3_INTERNAL;
+    }
+
+  for (i = 0; i <= trials; i += 1)
+    {
+      xoff_t usecs = main_bench_usecs ();
+      xoff_t ticks = mb_ticks ();
+
+      if ((units = kern->run (m)) == 0)
+	{
+	  return XD3_INTERNAL;
+	}
+
+      ticks = mb_ticks () - ticks;
+      usecs = main_bench_usecs () - usecs;
+
+      if (i == 1 || (i > 1 && (double) ticks < best_ticks))
+	{
+	  best_ticks = (double) ticks;
+	}
+      if (i == 1 || (i > 1 && (double) usecs < best_usecs))
+	{
+	  best_usecs = (double) usecs;
+	}
+    }
+
+  *ticks_per_unit = best_ticks / units;
+  *mups = best_usecs > 0 ? (double) units / best_usecs : 0;
+  return 0;
+}
+
+static int
+mb_selected (const char *name, int argc, char **argv)
+{
+  int i;
+
+  if (argc == 0) { return 1; }
+
+  for (i = 0; i < argc; i += 1)
+    {
+      if (strcmp (argv[i], name) == 0) { return 1; }
+    }
+
+  return 0;
+}
+
+static void
+mb_usage (void)
+{
+  size_t i;
+
+  fprintf (stderr, "usage: xdelta3bench [-n SIZE] [-r TRIALS] "
+	   "[-o FILE] [-c FILE] [KERNEL ...]\nkernels:");
+
+  for (i = 0; i < SIZEOF_ARRAY (mb_kernels); i += 1)
+    {
+      fprintf (stderr, " %s", mb_kernels[i].name);
+    }
+
+  fprintf (stderr, "\n");
+}
+
+int
+main (int argc, char **argv)
+{
+  static mb_state m;
+  char   saved_names[MB_MAX_SAVED][32];
+  double saved_ticks[MB_MAX_SAVED];
+  int    nsaved = 0;
+  usize_t size = MB_DEFAULT_SIZE;
+  usize_t trials = MB_DEFAULT_TRIALS;
+  const char *save = NULL;
+  const char *compare = NULL;
+  FILE *savef = NULL;
+  size_t i;
+  int c, j, ret;
+
+  for (c = 1; c + 1 < argc && argv[c][0] == '-' && argv[c][2] == 0; c += 2)
+    {
+      const char *val = argv[c + 1];
+
+      switch (argv[c][1])
+	{
+	case 'n':
+	  if (main_bench_size ("size", val, & size)) { return 1; }
+	  break;
+	case 'r':
+	  if (main_bench_size ("trials", val, & trials)) { return 1; }
+	  break;
+	case 'o': save = val; break;
+	case 'c': compare = val; break;
+	default: mb_usage (); return 1;
+	}
+    }
+
+  argc -= c;
+  argv += c;
+
+  if (size < 4 * MB_COPY_PREFIX || trials == 0)
+    {
+      mb_usage ();
+      return 1;
+    }
+
+  for (j = 0; j < argc; j += 1)
+    {
+      for (i = 0; i < SIZEOF_ARRAY (mb_kernels); i += 1)
+	{
+	  if (strcmp (argv[j], mb_kernels[i].name) == 0) { break; }
+	}
+
+      if (i == SIZEOF_ARRAY (mb_kernels))
+	{
+	  fprintf (stderr, "xdelta3bench: unknown kernel: %s\n", argv[j]);
+	  mb_usage ();
+	  return 1;
+	}
+    }
+
+  if (compare != NULL)
+    {
+      FILE *cf = fopen (compare, "r");
+      char unit[32];
+
+      if (cf == NULL)
+	{
+	  fprintf (stderr, "xdelta3bench: %s: %s\n", compare,
+		   strerror (errno));
+	  return 1;
+	}
+
+      if (fscanf (cf, "# xdelta3bench %31s", unit) != 1 ||
+	  strcmp (unit, MB_TICK_NAME) != 0)
+	{
+	  fprintf (stderr, "xdelta3bench: %s: not measured in %s\n",
+		   compare, MB_TICK_NAME);
+	  fclose (cf);
+	  return 1;
+	}
+
+      while (nsaved < MB_MAX_SAVED &&
+	     fscanf (cf, "%31s %lf", saved_names[nsaved],
+		     & saved_ticks[nsaved]) == 2)
+	{
+	  nsaved += 1;
+	}
+
+      fclose (cf);
+    }
+
+  if (save != NULL)
+    {
+      if ((savef = fopen (save, "w")) == NULL)
+	{
+	  fprintf (stderr, "xdelta3bench: %s: %s\n", save, strerror (errno));
+	  return 1;
+	}
+
+      fprintf (savef, "# xdelta3bench %s\n", MB_TICK_NAME);
+    }
+
+  if ((ret = mb_setup (& m, size)))
+    {
+      fprintf (stderr, "xdelta3bench: setup: %s\n", xd3_strerror (ret));
+      return 1;
+    }
+
+  printf ("%u bytes, best of %u trials\n", size, trials);
+  printf ("%-20s %6s %10s %9s", "kernel", "unit",
+	  MB_TICK_NAME "/unit", "Munit/s");
+  if (nsaved > 0) { printf (" %10s %8s", "saved", "speedup"); }
+  printf ("\n");
+
+  for (i = 0; i < SIZEOF_ARRAY (mb_kernels); i += 1)
+    {
+      const mb_kernel *kern = & mb_kernels[i];
+      double ticks, mups;
+
+      if (! mb_selected (kern->name, argc, argv)) { continue; }
+
+      if (mb_time (& m, kern, trials, & ticks, & mups))
+	{
+	  fprintf (stderr, "xdelta3bench: %s failed: %s\n", kern->name,
+		   m.stream.msg ? m.stream.msg : "internal error");
+	  return 1;
+	}
+
+      printf ("%-20s %6s %10.3f %9.1f", kern->name, kern->unit, ticks, mups);
+
+      for (j = 0; j < nsaved; j += 1)
+	{
+	  if (strcmp (saved_names[j], kern->name) == 0)
+	    {
+	      printf (" %10.3f %7.2fx", saved_ticks[j], saved_ticks[j] / ticks);
+	      break;
+	    }
+	}
+
+      printf ("\n");
+
+      if (savef != NULL) { fprintf (savef, "%s %.4f\n", kern->name, ticks); }
+    }
+
+  if (savef != NULL && fclose (savef) != 0)
+    {
+      fprintf (stderr, "xdelta3bench: %s: %s\n", save, strerror (errno));
+      return 1;
+    }
+
+  return m.sink == 0;
+}
@@ -761,7 +761,7 @@ void FourWayMergeTest(const FileSpec &spec0,
   ExtFile d01, d12, d23;
   Options options;
   options.encode_srcwin_maxsz = 
-    std::max(spec0.Size(), options.encode_srcwin_maxsz);
+    (std::max)(spec0.Size(), options.encode_srcwin_maxsz);
 
   spec0.WriteTmpFile(&f0);
   spec1.WriteTmpFile(&f1);
@@ -953,6 +953,118 @@ void TestMergeCommand2() {
   }
 }
 
+//////////////////////////////////////////////////////////////////////
+// Performance regression mode.  Each workload is a fixed-seed source
+// and a target made from it by a ChangeList, encoded and decoded in
+// memory.  The best of PERF_REPS runs is compared with the baseline.
+
+struct PerfResult {
+  PerfResult() : encode_mbps(0), decode_mbps(0), delta_size(0) { }
+  double encode_mbps;
+  double decode_mbps;
+  size_t delta_size;
+};
+
+struct PerfWorkload {
+  const char *name;
+  uint32_t seed;
+  xoff_t size;
+  size_t count;         // Changes of each kind
+  xoff_t mean;          // Mean change size
+  typename Change::Kind kinds[6];
+  size_t nkinds;
+};
+
+static double PerfSeconds() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Builds a list of changes, keeping every address inside the file as
+// it grows and shrinks.
+static void PerfChanges(const PerfWorkload &w, MTRandom *rand,
+			ChangeList *cl) {
+  xoff_t size = w.size;
+
+  for (size_t i = 0; i < w.count; i++) {
+    for (size_t k = 0; k < w.nkinds; k++) {
+      xoff_t len = 1 + min((xoff_t) rand->ExpRand32(w.mean), size / 4);
+      xoff_t addr1 = rand->Rand32() % (size - len);
+      xoff_t addr2 = rand->Rand32() % (size - len);
+
+      if (addr1 == addr2) {
+	addr2 = (addr1 + len) % (size - len);
+      }
+
+      switch (w.kinds[k]) {
+      case Change::MODIFY:
+      case Change::ADD:
+      case Change::DELETE:
+	cl->push_back(Change(w.kinds[k], len, addr1));
+	break;
+      case Change::COPY:
+      case Change::MOVE:
+      case Change::COPYOVER:
+	cl->push_back(Change(w.kinds[k], len, addr1, addr2));
+	break;
+      }
+
+      if (w.kinds[k] == Change::ADD || w.kinds[k] == Change::COPY) {
+	size += len;
+      } else if (w.kinds[k] == Change::DELETE) {
+	size -= len;
+      }
+    }
+  }
+}
+
+void PerfRun(const PerfWorkload &w, int reps, PerfResult *result) {
+  MTRandom rand(w.seed);
+  FileSpec spec0(&rand);
+  FileSpec spec1(&rand);
+  ChangeList cl;
+  Block source, target, delta, recon;
+
+  spec0.GenerateFixedSize(w.size);
+  PerfChanges(w, &rand, &cl);
+  spec0.ModifyTo(ChangeListMutator(cl), &spec1);
+
+  spec0.Get(&source, 0, spec0.Size());
+  spec1.Get(&target, 0, spec1.Size());
+  delta.SetSize(target.Size() * 2 + XD3_ALLOCSIZE);
+  recon.SetSize(target.Size());
+
+  for (int r = 0; r < reps; r++) {
+    usize_t delta_size, recon_size;
+    double t0 = PerfSeconds();
+
+    CHECK_EQ(0, xd3_encode_memory(target.Data(), target.Size(),
+				  source.Data(), source.Size(),
+				  delta.Data(), &delta_size,
+				  delta.Size(), 0));
+
+    double t1 = PerfSeconds();
+
+    CHECK_EQ(0, xd3_decode_memory(delta.Data(), delta_size,
+				  source.Data(), source.Size(),
+				  recon.Data(), &recon_size,
+				  recon.Size(), 0));
+
+    double t2 = PerfSeconds();
+
+    CHECK_EQ(target.Size(), recon_size);
+    CHECK_EQ(0, memcmp(target.Data(), recon.Data(), recon_size));
+
+    double mb = target.Size() / 1e6;
+    result->encode_mbps = max(result->encode_mbps, mb / max(t1 - t0, 1e-6));
+    result->decode_mbps = max(result->decode_mbps, mb / max(t2 - t1, 1e-6));
+    result->delta_size = delta_size;
+  }
+}
+
+//////////////////////////////////////////////////////////////////////
+
 };  // class Regtest<Constants>
 
 #define TEST(x) XPR(NTR #x "...\n"); regtest.x()
@@ -988,6 +1100,160 @@ void MainTest() {
 
 #undef TEST
 
+// "xdelta3perf perf" runs the workloads below and compares them
+// with a baseline file of "name encode_mbps decode_mbps delta_bytes"
+// lines.  It fails if a workload encodes or decodes more than
+// speed_tol slower, or its delta is more than size_tol larger.  With
+// -r the results are written to a new baseline instead.  Throughput
+// depends on the machine, so the speed tolerance is loose by default
+// and the checked-in baseline should be re-recorded where it is used.
+// xdelta3perf is this program built with XD3_DEBUG=0; the debug
+// checks in xdelta3regtest would dominate the timings.
+typedef Regtest<LargeBlock> PerfRegtest;
+typedef PerfRegtest::PerfWorkload PerfWorkload;
+typedef PerfRegtest::PerfResult PerfResult;
+typedef PerfRegtest::Change PerfChange;
+
+static const int PERF_REPS = 5;
+
+static const PerfWorkload perf_workloads[] = {
+  { "modify", 0x1001, 4 << 20, 64, 256,
+    { PerfChange::MODIFY }, 1 },
+  { "insert_delete", 0x1002, 4 << 20, 32, 1024,
+    { PerfChange::ADD, PerfChange::DELETE }, 2 },
+  { "move_copy", 0x1003, 4 << 20, 16, 4096,
+    { PerfChange::MOVE, PerfChange::COPY, PerfChange::COPYOVER }, 3 },
+  { "mixed", 0x1004, 8 << 20, 16, 1024,
+    { PerfChange::MODIFY, PerfChange::ADD, PerfChange::DELETE,
+      PerfChange::MOVE, PerfChange::COPY, PerfChange::COPYOVER }, 6 },
+};
+
+static int PerfMain(int argc, char **argv, const string &dir) {
+  string baseline = dir + "testing/regtest-perf.txt";
+  const char *record = NULL;
+  double speed_tol = 0.25;
+  double size_tol = 0.01;
+
+  if (XD3_DEBUG) {
+    XPR(NT "perf mode times a debug build; use xdelta3perf perf\n");
+    return 2;
+  }
+
+  for (int i = 0; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "-b") == 0) {
+      baseline = argv[i + 1];
+    } else if (strcmp(argv[i], "-r") == 0) {
+      record = argv[i + 1];
+    } else if (strcmp(argv[i], "-s") == 0) {
+      speed_tol = atof(argv[i + 1]) / 100.0;
+    } else if (strcmp(argv[i], "-z") == 0) {
+      size_tol = atof(argv[i + 1]) / 100.0;
+    } else {
+      argc = -1;
+    }
+  }
+
+  if (argc < 0 || argc % 2 != 0) {
+    XPR(NT "usage: xdelta3perf perf [-b BASELINE] [-r RECORD] "
+	"[-s SPEED_TOL%%] [-z SIZE_TOL%%]\n");
+    return 2;
+  }
+
+  map<string, PerfResult> expect;
+  if (record == NULL) {
+    FILE *f = fopen(baseline.c_str(), "r");
+    char line[256], name[64];
+    PerfResult r;
+
+    if (f == NULL) {
+      XPR(NT "%s: %s\n", baseline.c_str(), strerror(errno));
+      return 2;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+      if (line[0] != '#' &&
+	  sscanf(line, "%63s %lf %lf %zu", name, &r.encode_mbps,
+		 &r.decode_mbps, &r.delta_size) == 4) {
+	expect[name] = r;
+      }
+    }
+    fclose(f);
+  }
+
+  PerfRegtest regtest;
+  FILE *out = NULL;
+  int failures = 0;
+
+  if (record != NULL) {
+    if ((out = fopen(record, "w")) == NULL) {
+      XPR(NT "%s: %s\n", record, strerror(errno));
+      return 2;
+    }
+    fprintf(out,
+	    "# Baseline for \"xdelta3perf perf\", recorded with "
+	    "\"xdelta3perf perf -r\"\n"
+	    "# (best of PERF_REPS=%d runs).  Throughput is machine-specific: "
+	    "re-record\n"
+	    "# this file on the machine that runs the check.  Delta sizes "
+	    "are\n"
+	    "# deterministic and should only change with the encoder.\n"
+	    "# name encode_mbps decode_mbps delta_bytes\n", PERF_REPS);
+  }
+
+  XPR(NTR "%-14s %10s %10s %10s\n", "workload", "enc MB/s", "dec MB/s",
+      "delta");
+
+  for (size_t i = 0; i < SIZEOF_ARRAY(perf_workloads); i++) {
+    const PerfWorkload &w = perf_workloads[i];
+    PerfResult r;
+
+    regtest.PerfRun(w, PERF_REPS, &r);
+
+    XPR(NTR "%-14s %10.1f %10.1f %10zu", w.name, r.encode_mbps,
+	r.decode_mbps, r.delta_size);
+
+    if (out != NULL) {
+      fprintf(out, "%s %.1f %.1f %zu\n", w.name, r.encode_mbps,
+	      r.decode_mbps, r.delta_size);
+      XPR(NTR "\n");
+      continue;
+    }
+
+    map<string, PerfResult>::const_iterator e = expect.find(w.name);
+    if (e == expect.end()) {
+      XPR(NTR "  (no baseline)\n");
+      continue;
+    }
+
+    const PerfResult &b = e->second;
+    bool slow_enc = r.encode_mbps < b.encode_mbps * (1.0 - speed_tol);
+    bool slow_dec = r.decode_mbps < b.decode_mbps * (1.0 - speed_tol);
+    bool larger = r.delta_size > b.delta_size * (1.0 + size_tol);
+
+    XPR(NTR "  %+.1f%% %+.1f%% %+.2f%%%s%s%s\n",
+	100.0 * (r.encode_mbps / b.encode_mbps - 1.0),
+	100.0 * (r.decode_mbps / b.decode_mbps - 1.0),
+	100.0 * ((double) r.delta_size / b.delta_size - 1.0),
+	slow_enc ? " ENCODE REGRESSION" : "",
+	slow_dec ? " DECODE REGRESSION" : "",
+	larger ? " SIZE REGRESSION" : "");
+
+    failures += slow_enc || slow_dec || larger;
+  }
+
+  if (out != NULL && fclose(out) != 0) {
+    XPR(NT "%s: %s\n", record, strerror(errno));
+    return 2;
+  }
+
+  if (failures != 0) {
+    XPR(NT "%d workload(s) regressed against %s\n", failures,
+	baseline.c_str());
+    return 1;
+  }
+
+  return 0;
+}
+
 int main(int argc, char **argv) 
 {
   vector<const char*> mcmd;
@@ -996,6 +1262,11 @@ int main(int argc, char **argv)
   if (sp != NULL) {
     pn.append(argv[0], sp - argv[0] + 1);
   }
+
+  if (argc > 1 && strcmp(argv[1], "perf") == 0) {
+    return PerfMain(argc - 2, argv + 2, pn);
+  }
+
   pn.append("xdelta3");
   mcmd.push_back(pn.c_str());
   mcmd.push_back("test");
@@ -1,14 +1,22 @@
 // -*- Mode: C++ -*-
 
+// The standard headers come first: xdelta3.h defines min() and max()
+// as macros, which break the declarations in <algorithm>.
+#include <unistd.h>
+#include <math.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <map>
+#include <list>
+
 extern "C" {
 #include "../xdelta3.h"
 #include "../xdelta3-internal.h"
 }
 
-#include <unistd.h>
-#include <math.h>
-#include <string>
-
 #define CHECK_EQ(x,y) CHECK_OP(x,y,==)
 #define CHECK_NE(x,y) CHECK_OP(x,y,!=)
 #define CHECK_LT(x,y) CHECK_OP(x,y,<)
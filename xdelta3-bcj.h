@@ -0,0 +1,160 @@
+/* xdelta 3 - delta compression tools and library
+ * Copyright (C) 2007.  Joshua P. MacDonald
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Branch/call filters for executables (--bcj).  Relative call targets
+ * change whenever code moves, even when the callee does not, which
+ * breaks long source copies into many short ones.  The filter rewrites
+ * them as absolute addresses, as the BCJ filters of xz do:
+ *
+ *   x86    the rel32 operand of E8 (call) and E9 (jmp), when its high
+ *          byte is 00 or FF, plus the offset of the next instruction,
+ *          kept to 25 bits so the filtered high byte is 00 or FF too
+ *   arm64  the imm26 field of BL, plus the word offset
+ *
+ * The encoder filters the source and the target before matching, the
+ * decoder filters the source the same way and applies the inverse to
+ * its output.  The filter depends only on the absolute offset, and x86
+ * scanning restarts at every MAIN_BCJ_BLKSIZE boundary, so it gives
+ * the same result for any source block size, provided every buffer
+ * starts at a multiple of MAIN_BCJ_BLKSIZE.  Whole files are filtered;
+ * no attempt is made to find the code sections. */
+
+#ifndef _XDELTA3_BCJ_H_
+#define _XDELTA3_BCJ_H_
+
+#define MAIN_BCJ_BLKSIZE 4096
+
+typedef enum
+{
+  MAIN_BCJ_NONE  = 0,
+  MAIN_BCJ_X86   = 1,
+  MAIN_BCJ_ARM64 = 2,
+} main_bcj_type;
+
+static const char* const main_bcj_names[] = { "none", "x86", "arm64" };
+
+/* Returns the filter named NAME, or -1. */
+static int
+main_bcj_lookup (const char *name)
+{
+  int i;
+
+  for (i = 0; i < (int) (sizeof (main_bcj_names) /
+			 sizeof (main_bcj_names[0])); i += 1)
+    {
+      if (strcmp (name, main_bcj_names[i]) == 0)
+	{
+	  return i;
+	}
+    }
+
+  return -1;
+}
+
+static void
+main_bcj_x86 (uint8_t *buf, usize_t size, xoff_t pos, int encode)
+{
+  usize_t i = 0;
+
+  while (i < size)
+    {
+      usize_t end = i + MAIN_BCJ_BLKSIZE -
+	(usize_t) ((pos + i) % MAIN_BCJ_BLKSIZE);
+
+      end = min (end, size);
+
+      while (i + 5 <= end)
+	{
+	  uint32_t next, val;
+
+	  if ((buf[i] != 0xe8 && buf[i] != 0xe9) ||
+	      (buf[i+4] != 0x00 && buf[i+4] != 0xff))
+	    {
+	      i += 1;
+	      continue;
+	    }
+
+	  next = (uint32_t) (pos + i + 5);
+	  val = (uint32_t) buf[i+1] | ((uint32_t) buf[i+2] << 8) |
+	    ((uint32_t) buf[i+3] << 16) | ((uint32_t) buf[i+4] << 24);
+
+	  val = encode ? val + next : val - next;
+
+	  /* Sign-extend from bit 24. */
+	  val &= 0x01ffffffU;
+	  val |= 0U - (val & 0x01000000U);
+
+	  buf[i+1] = (uint8_t) val;
+	  buf[i+2] = (uint8_t) (val >> 8);
+	  buf[i+3] = (uint8_t) (val >> 16);
+	  buf[i+4] = (uint8_t) (val >> 24);
+	  i += 5;
+	}
+
+      i = end;
+    }
+}
+
+static void
+main_bcj_arm64 (uint8_t *buf, usize_t size, xoff_t pos, int encode)
+{
+  usize_t i;
+
+  for (i = (usize_t) ((4 - pos % 4) % 4); i + 4 <= size; i += 4)
+    {
+      uint32_t insn = (uint32_t) buf[i] | ((uint32_t) buf[i+1] << 8) |
+	((uint32_t) buf[i+2] << 16) | ((uint32_t) buf[i+3] << 24);
+      uint32_t word = (uint32_t) ((pos + i) >> 2);
+
+      if ((insn & 0xfc000000U) != 0x94000000U)
+	{
+	  continue;
+	}
+
+      insn = 0x94000000U |
+	(((encode ? insn + word : insn - word)) & 0x03ffffffU);
+
+      buf[i]   = (uint8_t) insn;
+      buf[i+1] = (uint8_t) (insn >> 8);
+      buf[i+2] = (uint8_t) (insn >> 16);
+      buf[i+3] = (uint8_t) (insn >> 24);
+    }
+}
+
+/* Filters SIZE bytes at absolute offset POS in place.  ENCODE selects
+ * the forward filter, otherwise its inverse. */
+static void
+main_bcj_filter (int type, uint8_t *buf, usize_t size,
+		 xoff_t pos, int encode)
+{
+  XD3_ASSERT (pos % MAIN_BCJ_BLKSIZE == 0);
+
+  switch (type)
+    {
+    case MAIN_BCJ_X86:
+      main_bcj_x86 (buf, size, pos, encode);
+      break;
+    case MAIN_BCJ_ARM64:
+      main_bcj_arm64 (buf, size, pos, encode);
+      break;
+    default:
+      break;
+    }
+}
+
+#endif /* _XDELTA3_BCJ_H_ */
@@ -0,0 +1,721 @@
+/* xdelta 3 - delta compression tools and library
+ * Copyright (C) 2007.  Joshua P. MacDonald
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* The "bench" command generates a reproducible source and target pair
+ * and times in-memory encoding and decoding of it across compression
+ * levels, window sizes and secondary compressors.  Arguments are
+ * name=value pairs:
+ *
+ *   size=16M          source size (K, M and G suffixes are accepted)
+ *   seed=1            random seed for the workload
+ *   change=256        mean length of a change
+ *   insert=4 delete=4 move=4 overwrite=4 copy=4
+ *                     changes per MiB of source, of each kind
+ *   levels=1,3,6,9    compression levels
+ *   winsizes=8M       encoder window sizes
+ *   secondary=none    secondary compressors (none, djw, fgk, lzma)
+ *   csv=FILE          also write the results as CSV
+ *
+ * The source is text-like: words drawn from a random vocabulary.  The
+ * target applies the same kinds of change as testing/modify.h: insert
+ * and overwrite with random bytes, delete, copy from elsewhere in the
+ * source, and move a block past the data that follows it.
+ *
+ * The peak memory column is the most the library had allocated at
+ * once during the encode, measured through the xd3_config alloc
+ * callback.  Each measurement repeats until MAIN_BENCH_MIN_USECS have
+ * elapsed and reports the average rate. */
+
+#ifndef _XDELTA3_BENCH_H_
+#define _XDELTA3_BENCH_H_
+
+#define MAIN_BENCH_MAX_LIST  16
+#define MAIN_BENCH_VOCAB     4096
+#define MAIN_BENCH_MIN_USECS 200000
+
+typedef struct _main_bench_config main_bench_config;
+typedef struct _main_bench_alloc  main_bench_alloc;
+
+typedef enum
+{
+  BENCH_INSERT,
+  BENCH_DELETE,
+  BENCH_MOVE,
+  BENCH_OVERWRITE,
+  BENCH_COPY,
+  BENCH_KINDS,
+} main_bench_kind;
+
+static const char* main_bench_kind_names[BENCH_KINDS] =
+{
+  "insert", "delete", "move", "overwrite", "copy",
+};
+
+struct _main_bench_config
+{
+  usize_t  size;
+  usize_t  seed;
+  usize_t  change;
+  usize_t  rates[BENCH_KINDS];
+
+  usize_t  levels[MAIN_BENCH_MAX_LIST];
+  usize_t  nlevels;
+  usize_t  winsizes[MAIN_BENCH_MAX_LIST];
+  usize_t  nwinsizes;
+  int      secondary[MAIN_BENCH_MAX_LIST];
+  usize_t  nsecondary;
+  const char *csv;
+
+  uint32_t rand;
+  uint8_t *source;
+  uint8_t *target;
+  usize_t  target_size;
+};
+
+/* Counts the bytes the library has allocated, through a size header
+ * in front of each allocation. */
+struct _main_bench_alloc
+{
+  size_t current;
+  size_t peak;
+};
+
+static void*
+main_bench_alloc_func (void *opaque, size_t items, usize_t size)
+{
+  main_bench_alloc *ba = (main_bench_alloc*) opaque;
+  size_t bytes = items * size;
+  size_t *p;
+
+  if ((p = (size_t*) main_malloc1 (bytes + sizeof (size_t) * 2)) == NULL)
+    {
+      return NULL;
+    }
+
+  p[0] = bytes;
+  ba->current += bytes;
+  ba->peak = max (ba->peak, ba->current);
+  return p + 2;
+}
+
+static void
+main_bench_free_func (void *opaque, void *ptr)
+{
+  main_bench_alloc *ba = (main_bench_alloc*) opaque;
+  size_t *p = ((size_t*) ptr) - 2;
+
+  ba->current -= p[0];
+  free (p);
+}
+
+/* xorshift32: the same sequence on every platform for a given seed. */
+static uint32_t
+main_bench_random (main_bench_config *b)
+{
+  uint32_t x = b->rand;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return b->rand = x;
+}
+
+static xoff_t
+main_bench_usecs (void)
+{
+#if XD3_PERF_COUNTERS
+  return xd3_perf_usecs ();
+#else
+  return (xoff_t) get_millisecs_now () * 1000;
+#endif
+}
+
+/* Parses a size with an optional K, M or G suffix. */
+static int
+main_bench_size (const char *name, const char *arg, usize_t *val)
+{
+  char *e;
+  unsigned long x = strtoul (arg, & e, 10);
+  int shift = 0;
+
+  switch (*e)
+    {
+    case 'k': case 'K': shift = 10; e += 1; break;
+    case 'm': case 'M': shift = 20; e += 1; break;
+    case 'g': case 'G': shift = 30; e += 1; break;
+    }
+
+  if (e == arg || *e != 0 || x > (USIZE_T_MAX >> shift))
+    {
+      XPR(NT "bench: invalid %s: %s\n", name, arg);
+      return EXIT_FAILURE;
+    }
+
+  *val = (usize_t) x << shift;
+  return 0;
+}
+
+/* Parses a comma-separated list of sizes. */
+static int
+main_bench_list (const char *name, const char *arg,
+		 usize_t *vals, usize_t *count)
+{
+  char buf[64];
+  int ret;
+
+  *count = 0;
+
+  while (*arg != 0)
+    {
+      size_t len = strcspn (arg, ",");
+
+      if (len == 0 || len >= sizeof (buf) || *count == MAIN_BENCH_MAX_LIST)
+	{
+	  XPR(NT "bench: invalid %s list\n", name);
+	  return EXIT_FAILURE;
+	}
+
+      memcpy (buf, arg, len);
+      buf[len] = 0;
+
+      if ((ret = main_bench_size (name, buf, & vals[(*count)++])))
+	{
+	  return ret;
+	}
+
+      arg += len;
+      if (*arg == ',') { arg += 1; }
+    }
+
+  return 0;
+}
+
+static int
+main_bench_secondary (const char *arg, main_bench_config *b)
+{
+  b->nsecondary = 0;
+
+  while (*arg != 0)
+    {
+      size_t len = strcspn (arg, ",");
+      int flag = -1;
+
+      if (len == 4 && strncmp (arg, "none", 4) == 0) { flag = 0; }
+#if SECONDARY_DJW
+      if (len == 3 && strncmp (arg, "djw", 3) == 0) { flag = XD3_SEC_DJW; }
+#endif
+#if SECONDARY_FGK
+      if (len == 3 && strncmp (arg, "fgk", 3) == 0) { flag = XD3_SEC_FGK; }
+#endif
+#if SECONDARY_LZMA
+      if (len == 4 && strncmp (arg, "lzma", 4) == 0) { flag = XD3_SEC_LZMA; }
+#endif
+
+      if (flag < 0 || b->nsecondary == MAIN_BENCH_MAX_LIST)
+	{
+	  XPR(NT "bench: unsupported secondary: %.*s\n", (int) len, arg);
+	  return EXIT_FAILURE;
+	}
+
+      b->secondary[b->nsecondary++] = flag;
+
+      arg += len;
+      if (*arg == ',') { arg += 1; }
+    }
+
+  return 0;
+}
+
+static const char*
+main_bench_secondary_name (int flag)
+{
+  switch (flag)
+    {
+    case XD3_SEC_DJW:  return "djw";
+    case XD3_SEC_FGK:  return "fgk";
+    case XD3_SEC_LZMA: return "lzma";
+    }
+  return "none";
+}
+
+static int
+main_bench_args (main_bench_config *b, int argc, char **argv)
+{
+  int i, k, ret;
+
+  memset (b, 0, sizeof (*b));
+  b->size = 16 << 20;
+  b->seed = 1;
+  b->change = 256;
+  for (k = 0; k < BENCH_KINDS; k += 1) { b->rates[k] = 4; }
+  b->levels[0] = 1;
+  b->levels[1] = 3;
+  b->levels[2] = 6;
+  b->levels[3] = 9;
+  b->nlevels = 4;
+  b->winsizes[0] = XD3_DEFAULT_WINSIZE;
+  b->nwinsizes = 1;
+  b->nsecondary = 1;
+
+  for (i = 0; i < argc; i += 1)
+    {
+      const char *arg = argv[i];
+      const char *val = strchr (arg, '=');
+      size_t len;
+
+      if (val == NULL)
+	{
+	  XPR(NT "bench: expected name=value: %s\n", arg);
+	  return EXIT_FAILURE;
+	}
+
+      len = val - arg;
+      val += 1;
+
+#define BENCH_ARG(s) (len == sizeof (s) - 1 && strncmp (arg, s, len) == 0)
+      if (BENCH_ARG ("size"))
+	{
+	  if ((ret = main_bench_size ("size", val, & b->size))) { return ret; }
+	}
+      else if (BENCH_ARG ("seed"))
+	{
+	  if ((ret = main_bench_size ("seed", val, & b->seed))) { return ret; }
+	}
+      else if (BENCH_ARG ("change"))
+	{
+	  if ((ret = main_bench_size ("change", val, & b->change)))
+	    {
+	      return ret;
+	    }
+	}
+      else if (BENCH_ARG ("levels"))
+	{
+	  if ((ret = main_bench_list ("levels", val,
+				      b->levels, & b->nlevels)))
+	    {
+	      return ret;
+	    }
+	}
+      else if (BENCH_ARG ("winsizes"))
+	{
+	  if ((ret = main_bench_list ("winsizes", val,
+				      b->winsizes, & b->nwinsizes)))
+	    {
+	      return ret;
+	    }
+	}
+      else if (BENCH_ARG ("secondary"))
+	{
+	  if ((ret = main_bench_secondary (val, b))) { return ret; }
+	}
+      else if (BENCH_ARG ("csv"))
+	{
+	  b->csv = val;
+	}
+      else
+	{
+	  for (k = 0; k < BENCH_KINDS; k += 1)
+	    {
+	      if (BENCH_ARG (main_bench_kind_names[k])) { break; }
+	    }
+
+	  if (k == BENCH_KINDS)
+	    {
+	      XPR(NT "bench: unrecognized parameter: %s\n", arg);
+	      return EXIT_FAILURE;
+	    }
+
+	  if ((ret = main_bench_size (main_bench_kind_names[k], val,
+				      & b->rates[k])))
+	    {
+	      return ret;
+	    }
+	}
+#undef BENCH_ARG
+    }
+
+  if (b->size == 0 || b->change == 0 || b->nlevels == 0 ||
+      b->nwinsizes == 0 || b->nsecondary == 0)
+    {
+      XPR(NT "bench: size, change and the lists must not be empty\n");
+      return EXIT_FAILURE;
+    }
+
+  for (i = 0; i < (int) b->nlevels; i += 1)
+    {
+      if (b->levels[i] > 9)
+	{
+	  XPR(NT "bench: invalid level: %u\n", b->levels[i]);
+	  return EXIT_FAILURE;
+	}
+    }
+
+  for (i = 0; i < (int) b->nwinsizes; i += 1)
+    {
+      if (b->winsizes[i] < XD3_ALLOCSIZE ||
+	  b->winsizes[i] > XD3_LARGEMAXWINSIZE)
+	{
+	  XPR(NT "bench: invalid window size: %u\n", b->winsizes[i]);
+	  return EXIT_FAILURE;
+	}
+    }
+
+  return 0;
+}
+
+/* Fills the source with words from a random vocabulary, so that it
+ * has the kind of redundancy found in text. */
+static void
+main_bench_make_source (main_bench_config *b)
+{
+  uint8_t vocab[MAIN_BENCH_VOCAB][12];
+  usize_t vlen[MAIN_BENCH_VOCAB];
+  usize_t i, j, pos = 0;
+
+  for (i = 0; i < MAIN_BENCH_VOCAB; i += 1)
+    {
+      vlen[i] = 2 + main_bench_random (b) % 10;
+
+      for (j = 0; j < vlen[i] - 1; j += 1)
+	{
+	  vocab[i][j] = (uint8_t) ('a' + main_bench_random (b) % 26);
+	}
+
+      vocab[i][j] = (main_bench_random (b) % 8) ? ' ' : '\n';
+    }
+
+  while (pos < b->size)
+    {
+      /* Favor the front of the vocabulary, as word use is skewed. */
+      uint32_t r = main_bench_random (b);
+      usize_t w = (r % MAIN_BENCH_VOCAB) & ((r >> 16) % MAIN_BENCH_VOCAB);
+      usize_t n = min (vlen[w], b->size - pos);
+
+      memcpy (b->source + pos, vocab[w], n);
+      pos += n;
+    }
+}
+
+/* Applies the changes to the source to produce the target.  Changes
+ * are spread evenly in expectation, and each kind is chosen in
+ * proportion to its rate. */
+static void
+main_bench_make_target (main_bench_config *b, usize_t nchanges, usize_t capacity)
+{
+  usize_t total_rate = 0;
+  usize_t gap = nchanges ? b->size / nchanges : b->size;
+  usize_t spos = 0;
+  usize_t tpos = 0;
+  usize_t i, k;
+
+  for (k = 0; k < BENCH_KINDS; k += 1) { total_rate += b->rates[k]; }
+
+  while (spos < b->size)
+    {
+      usize_t keep = min (1 + main_bench_random (b) % (2 * gap),
+			  b->size - spos);
+      usize_t len = 1 + main_bench_random (b) % (2 * b->change);
+      usize_t pick;
+
+      memcpy (b->target + tpos, b->source + spos, keep);
+      spos += keep;
+      tpos += keep;
+
+      /* Changes that would overflow the target buffer are skipped. */
+      if (spos == b->size || total_rate == 0 ||
+	  tpos + len + (b->size - spos) > capacity)
+	{
+	  continue;
+	}
+
+      pick = main_bench_random (b) % total_rate;
+      for (k = 0; pick >= b->rates[k]; k += 1) { pick -= b->rates[k]; }
+
+      switch (k)
+	{
+	case BENCH_INSERT:
+	case BENCH_OVERWRITE:
+	  for (i = 0; i < len; i += 1)
+	    {
+	      b->target[tpos++] = (uint8_t) main_bench_random (b);
+	    }
+	  if (k == BENCH_OVERWRITE) { spos += min (len, b->size - spos); }
+	  break;
+
+	case BENCH_DELETE:
+	  spos += min (len, b->size - spos);
+	  break;
+
+	case BENCH_COPY:
+	  {
+	    usize_t from;
+	    len = min (len, b->size);
+	    from = main_bench_random (b) % (b->size - len + 1);
+	    memcpy (b->target + tpos, b->source + from, len);
+	    tpos += len;
+	  }
+	  break;
+
+	case BENCH_MOVE:
+	  {
+	    /* Move the next LEN bytes past the DIST bytes after them. */
+	    usize_t dist;
+	    len = min (len, b->size - spos);
+	    dist = min (1 + main_bench_random (b) % (2 * gap),
+			b->size - spos - len);
+	    memcpy (b->target + tpos, b->source + spos + len, dist);
+	    memcpy (b->target + tpos + dist, b->source + spos, len);
+	    spos += len + dist;
+	    tpos += len + dist;
+	  }
+	  break;
+	}
+    }
+
+  b->target_size = tpos;
+}
+
+/* Encodes or decodes INPUT against SOURCE, held in memory as a single
+ * block, with the given configuration. */
+static int
+main_bench_stream (xd3_config *config, const uint8_t *src, usize_t src_size,
+		   int is_encode, const uint8_t *input, usize_t input_size,
+		   uint8_t *output, usize_t *output_size, usize_t output_max)
+{
+  xd3_stream stream;
+  xd3_source source;
+  int ret;
+
+  memset (& stream, 0, sizeof (stream));
+  memset (& source, 0, sizeof (source));
+
+  source.blksize = src_size;
+  source.onblk = src_size;
+  source.curblk = src;
+  source.curblkno = 0;
+  source.max_winsize = src_size;
+
+  if ((ret = xd3_config_stream (& stream, config)) ||
+      (ret = xd3_set_source_and_size (& stream, & source, src_size)) ||
+      (ret = (is_encode ?
+	      xd3_encode_stream (& stream, input, input_size,
+				 output, output_size, output_max) :
+	      xd3_decode_stream (& stream, input, input_size,
+				 output, output_size, output_max))))
+    {
+      XPR(NT "%s: %s\n", is_encode ? "encode" : "decode",
+	  xd3_errstring (& stream));
+    }
+
+  xd3_free_stream (& stream);
+  return ret;
+}
+
+/* Encodes or decodes INPUT against the generated source. */
+static int
+main_bench_process (main_bench_config *b, int is_encode, int flags,
+		    usize_t winsize, main_bench_alloc *ba,
+		    const uint8_t *input, usize_t input_size,
+		    uint8_t *output, usize_t *output_size,
+		    usize_t output_max)
+{
+  xd3_config config;
+
+  xd3_init_config (& config, flags);
+  config.winsize = winsize;
+  config.dec_maxwinsize = winsize;
+  config.alloc = main_bench_alloc_func;
+  config.freef = main_bench_free_func;
+  config.opaque = ba;
+
+  return main_bench_stream (& config, b->source, b->size, is_encode,
+			    input, input_size, output, output_size,
+			    output_max);
+}
+
+/* Repeats the operation for at least MAIN_BENCH_MIN_USECS and returns
+ * the rate in MB/s of target bytes. */
+static int
+main_bench_time (main_bench_config *b, int is_encode, int flags,
+		 usize_t winsize, main_bench_alloc *ba,
+		 const uint8_t *input, usize_t input_size,
+		 uint8_t *output, usize_t *output_size,
+		 usize_t output_max, double *rate)
+{
+  xoff_t start = main_bench_usecs ();
+  xoff_t elapsed;
+  usize_t reps = 0;
+  int ret;
+
+  do
+    {
+      if ((ret = main_bench_process (b, is_encode, flags, winsize, ba,
+				     input, input_size, output,
+				     output_size, output_max)))
+	{
+	  return ret;
+	}
+
+      reps += 1;
+      elapsed = main_bench_usecs () - start;
+    }
+  while (elapsed < MAIN_BENCH_MIN_USECS);
+
+  *rate = (double) b->target_size * reps / (double) elapsed;
+  return 0;
+}
+
+static int
+main_bench (int argc, char **argv)
+{
+  main_bench_config b;
+  main_file tfile;
+  main_file cfile;
+  main_file *xfile;
+  uint8_t *delta = NULL;
+  uint8_t *recon = NULL;
+  usize_t nchanges, delta_max;
+  usize_t li, wi, si;
+  int k, ret;
+
+  if ((ret = main_bench_args (& b, argc, argv)))
+    {
+      return ret;
+    }
+
+  main_file_init (& tfile);
+  main_file_init (& cfile);
+  XSTDOUT_XF (& tfile);
+
+  /* Changes are counted per MiB of source, at least one each. */
+  nchanges = 0;
+  for (k = 0; k < BENCH_KINDS; k += 1)
+    {
+      nchanges += (usize_t)
+	((b.rates[k] * (xoff_t) b.size + (1 << 20) - 1) >> 20);
+    }
+
+  b.rand = b.seed ? b.seed : 1;
+  delta_max = b.size + nchanges * 2 * b.change;
+  delta_max = delta_max + delta_max / 2 + XD3_ALLOCSIZE;
+  ret = EXIT_FAILURE;
+
+  if ((b.source = (uint8_t*) main_bufalloc (b.size)) == NULL ||
+      (b.target = (uint8_t*) main_bufalloc (delta_max)) == NULL ||
+      (delta = (uint8_t*) main_bufalloc (delta_max)) == NULL ||
+      (recon = (uint8_t*) main_bufalloc (delta_max)) == NULL ||
+      (tfile.snprintf_buf = (uint8_t*) main_malloc (SNPRINTF_BUFSIZE)) == NULL)
+    {
+      goto done;
+    }
+
+  main_bench_make_source (& b);
+  main_bench_make_target (& b, nchanges, delta_max);
+
+  if (b.csv != NULL)
+    {
+      if (main_file_open (& cfile, b.csv, XO_WRITE) ||
+	  (cfile.snprintf_buf =
+	   (uint8_t*) main_malloc (SNPRINTF_BUFSIZE)) == NULL)
+	{
+	  goto done;
+	}
+
+      xfile = & cfile;
+      VC(UT "level,winsize,secondary,source_bytes,target_bytes,"
+	 "delta_bytes,ratio,encode_mbps,decode_mbps,peak_kib\n")VE;
+    }
+
+  xfile = & tfile;
+  VC(UT "source %u bytes, target %u bytes, seed %u, change %u\n",
+     b.size, b.target_size, b.seed, b.change)VE;
+  VC(UT "level   winsize secondary      delta   ratio "
+     "enc MB/s dec MB/s  peak KiB\n")VE;
+
+  for (wi = 0; wi < b.nwinsizes; wi += 1)
+    {
+      for (si = 0; si < b.nsecondary; si += 1)
+	{
+	  for (li = 0; li < b.nlevels; li += 1)
+	    {
+	      int flags = b.secondary[si] | XD3_ADLER32;
+	      main_bench_alloc ba, dba;
+	      usize_t delta_size, recon_size;
+	      double enc_rate, dec_rate, ratio;
+
+	      if (b.levels[li] == 0) { flags |= XD3_NOCOMPRESS; }
+	      else { flags |= b.levels[li] << XD3_COMPLEVEL_SHIFT; }
+
+	      memset (& ba, 0, sizeof (ba));
+	      memset (& dba, 0, sizeof (dba));
+
+	      if (main_bench_time (& b, 1, flags, b.winsizes[wi], & ba,
+				   b.target, b.target_size,
+				   delta, & delta_size, delta_max,
+				   & enc_rate) ||
+		  main_bench_time (& b, 0, 0, b.winsizes[wi], & dba,
+				   delta, delta_size,
+				   recon, & recon_size, delta_max,
+				   & dec_rate))
+		{
+		  ret = EXIT_FAILURE;
+		  goto done;
+		}
+
+	      if (recon_size != b.target_size ||
+		  memcmp (recon, b.target, recon_size) != 0)
+		{
+		  XPR(NT "bench: decoded target differs\n");
+		  ret = EXIT_FAILURE;
+		  goto done;
+		}
+
+	      ratio = (double) delta_size / (double) b.target_size;
+
+	      xfile = & tfile;
+	      VC(UT "%5u %9u %9s %10u %7.4f %8.2f %8.2f %9u\n",
+		 b.levels[li], b.winsizes[wi],
+		 main_bench_secondary_name (b.secondary[si]),
+		 delta_size, ratio, enc_rate, dec_rate,
+		 (usize_t) (ba.peak >> 10))VE;
+
+	      if (main_file_isopen (& cfile))
+		{
+		  xfile = & cfile;
+		  VC(UT "%u,%u,%s,%u,%u,%u,%.6f,%.3f,%.3f,%u\n",
+		     b.levels[li], b.winsizes[wi],
+		     main_bench_secondary_name (b.secondary[si]),
+		     b.size, b.target_size, delta_size, ratio,
+		     enc_rate, dec_rate, (usize_t) (ba.peak >> 10))VE;
+		}
+	    }
+	}
+    }
+
+  ret = main_file_close (& cfile) ? EXIT_FAILURE : EXIT_SUCCESS;
+
+ done:
+  main_buffree (b.source);
+  main_buffree (b.target);
+  main_buffree (delta);
+  main_buffree (recon);
+  main_file_cleanup (& cfile);
+  main_file_cleanup (& tfile);
+  return ret;
+}
+
+#endif /* _XDELTA3_BENCH_H_ */
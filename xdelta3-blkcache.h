@@ -42,7 +42,6 @@ struct _main_blklru
 
 #define MAX_LRU_SIZE 32U
 #define XD3_MINSRCWINSZ (XD3_ALLOCSIZE * MAX_LRU_SIZE)
-#define XD3_MAXSRCWINSZ (1ULL << 31)
 
 XD3_MAKELIST(main_blklru_list,main_blklru,link);
 
@@ -55,6 +54,18 @@ static int lru_hits   = 0;
 static int lru_misses = 0;
 static int lru_filled = 0;
 
+/* Several -s sources are read as one concatenated source.  The first
+ * is the sfile passed to main_set_source(), the others are kept in
+ * srcset_extra.  srcset_start[i] is the offset of source i in the
+ * concatenation, srcset_start[srcset_extras+1] is the total size. */
+#define MAX_SRCSET_SIZE 16U
+
+static main_file  srcset_extra[MAX_SRCSET_SIZE - 1];
+static main_file *srcset_file[MAX_SRCSET_SIZE];
+static xoff_t     srcset_start[MAX_SRCSET_SIZE + 1];
+static usize_t    srcset_extras = 0;
+static xoff_t     srcset_pos = 0;
+
 static void main_lru_reset (void)
 {
   lru_size = 0;
@@ -80,6 +91,175 @@ static void main_lru_cleanup (void)
   lru_filled = 0;
 }
 
+/* Adds a source after the first, filename may be NULL when the
+ * decoder takes it from the application header. */
+static int
+main_srcset_add (const char *filename)
+{
+  main_file *xfile;
+
+  if (srcset_extras == MAX_SRCSET_SIZE - 1)
+    {
+      XPR(NT "too many source files (max %u)\n", MAX_SRCSET_SIZE);
+      return EXIT_FAILURE;
+    }
+
+  xfile = & srcset_extra[srcset_extras++];
+  main_file_init (xfile);
+  xfile->filename = filename;
+  return 0;
+}
+
+static void
+main_srcset_cleanup (void)
+{
+  usize_t i;
+
+  for (i = 0; i < srcset_extras; i += 1)
+    {
+      main_file_cleanup (& srcset_extra[i]);
+    }
+
+  srcset_extras = 0;
+  srcset_pos = 0;
+}
+
+/* Opens the remaining sources and computes their offsets.  Every
+ * source in a set must be a regular file, since blocks are read by
+ * seeking into the file that holds them. */
+static int
+main_srcset_open (main_file *sfile, xoff_t *source_size)
+{
+  int ret;
+  usize_t i;
+  xoff_t size;
+
+  if (! sfile->size_known)
+    {
+      XPR(NT "multiple sources must be regular files: %s\n",
+	  sfile->filename);
+      return XD3_INVALID;
+    }
+
+  srcset_file[0] = sfile;
+  srcset_start[0] = 0;
+  srcset_start[1] = *source_size;
+
+  for (i = 0; i < srcset_extras; i += 1)
+    {
+      main_file *xfile = & srcset_extra[i];
+
+      if (xfile->filename == NULL)
+	{
+	  XPR(NT "source %u has no filename\n", i + 2);
+	  return XD3_INVALID;
+	}
+
+      if ((ret = main_file_open (xfile, xfile->filename, XO_READ)))
+	{
+	  return ret;
+	}
+
+      if (main_file_stat (xfile, &size) != 0)
+	{
+	  XPR(NT "multiple sources must be regular files: %s\n",
+	      xfile->filename);
+	  return XD3_INVALID;
+	}
+
+      srcset_file[i + 1] = xfile;
+      srcset_start[i + 2] = srcset_start[i + 1] + size;
+    }
+
+  srcset_pos = 0;
+  *source_size = srcset_start[srcset_extras + 1];
+  return 0;
+}
+
+static int
+main_source_seek (main_file *sfile, xoff_t pos)
+{
+  if (srcset_extras == 0)
+    {
+      return main_file_seek (sfile, pos);
+    }
+
+  if (pos > srcset_start[srcset_extras + 1])
+    {
+      return XD3_INVALID;
+    }
+
+  srcset_pos = pos;
+  return 0;
+}
+
+/* Reads the source at its current position.  With a set of sources
+ * a read may span several files.  Sources in a set are read as-is,
+ * without checking for external compression. */
+static int
+main_source_read_raw (main_file *sfile, uint8_t *buf, size_t size,
+		      size_t *nread)
+{
+  int ret;
+  usize_t i;
+
+  if (srcset_extras == 0)
+    {
+      return main_read_primary_input (sfile, buf, size, nread);
+    }
+
+  (*nread) = 0;
+
+  while ((*nread) < size && srcset_pos < srcset_start[srcset_extras + 1])
+    {
+      xoff_t avail;
+      size_t want;
+      size_t got;
+
+      for (i = srcset_extras; srcset_start[i] > srcset_pos; i -= 1) { }
+
+      avail = srcset_start[i + 1] - srcset_pos;
+      want = (size_t) min ((xoff_t) (size - (*nread)), avail);
+
+      if ((ret = main_file_seek (srcset_file[i],
+				 srcset_pos - srcset_start[i])) ||
+	  (ret = main_file_read (srcset_file[i], buf + (*nread), want,
+				 & got, "source read failed")))
+	{
+	  return ret;
+	}
+
+      if (got != want)
+	{
+	  XPR(NT "source file changed size: %s\n",
+	      srcset_file[i]->filename);
+	  return XD3_INVALID_INPUT;
+	}
+
+      (*nread) += got;
+      srcset_pos += got;
+    }
+
+  return 0;
+}
+
+/* As above, then applies the --bcj filter to what was read. */
+static int
+main_source_read (main_file *sfile, uint8_t *buf, size_t size,
+		  size_t *nread)
+{
+  int ret;
+
+  if ((ret = main_source_read_raw (sfile, buf, size, nread)) == 0 &&
+      option_bcj != MAIN_BCJ_NONE)
+    {
+      main_bcj_filter (option_bcj, buf, (usize_t) *nread,
+		       sfile->source_position, 1);
+    }
+
+  return ret;
+}
+
 /* This is called at different times for encoding and decoding.  The
  * encoder calls it immediately, the decoder delays until the
  * application header is received.  */
@@ -124,6 +304,30 @@ main_set_source (xd3_stream *stream, xd3_cmd cmd,
       /* If the file is regular we know it's size.  If the file turns
        * out to be externally compressed, size_known may change. */
       sfile->size_known = (main_file_stat (sfile, &source_size) == 0);
+
+      if (srcset_extras != 0 &&
+	  (ret = main_srcset_open (sfile, &source_size)))
+	{
+	  return ret;
+	}
+    }
+
+  /* A delta encoded with --monotone reads the source in order.  A
+   * FIFO of MAX_LRU_SIZE blocks holding twice the copy distance keeps
+   * every block a copy can reach, so the source need not seek. */
+  if (cmd == CMD_DECODE && option_monotone != 0)
+    {
+      if (option_srcwinsz < 2 * option_monotone)
+	{
+	  if (option_verbose)
+	    {
+	      XPR(NT "source window raised to %"Q"u for --monotone=%"Q"u\n",
+		  2 * option_monotone, option_monotone);
+	    }
+	  option_srcwinsz = 2 * option_monotone;
+	}
+
+      do_src_fifo = 1;
     }
 
   /* Note: The API requires a power-of-two blocksize and srcwinsz
@@ -169,6 +373,7 @@ main_set_source (xd3_stream *stream, xd3_cmd cmd,
   source->curblkno = (xoff_t) -1;
   source->curblk   = NULL;
   source->max_winsize = option_srcwinsz;
+  source->max_backward = option_monotone;
 
   if ((ret = main_getblk_func (stream, source, 0)) != 0)
     {
@@ -243,6 +448,7 @@ main_set_source (xd3_stream *stream, xd3_cmd cmd,
       static shortbuf winszbuf;
       static shortbuf blkszbuf;
       static shortbuf nbufs;
+      static shortbuf nsrcs;
 
       if (sfile->size_known)
 	{
@@ -256,14 +462,21 @@ main_set_source (xd3_stream *stream, xd3_cmd cmd,
 	}
 
       nbufs.buf[0] = 0;
+      nsrcs.buf[0] = 0;
+
+      if (srcset_extras != 0)
+	{
+	  short_sprintf (nsrcs, " (+%u files)", srcset_extras);
+	}
 
       if (option_verbose > 1)
 	{
 	  short_sprintf (nbufs, " #bufs %u", lru_size);
 	}
 
-      XPR(NT "source %s %s blksize %s window %s%s%s\n",
+      XPR(NT "source %s%s %s blksize %s window %s%s%s\n",
 	  sfile->filename,
+	  nsrcs.buf,
 	  srcszbuf.buf,
 	  main_format_bcnt (blksize, &blkszbuf),
 	  main_format_bcnt (option_srcwinsz, &winszbuf),
@@ -347,7 +560,7 @@ main_read_seek_source (xd3_stream *stream,
 
   if (!sfile->seek_failed)
     {
-      ret = main_file_seek (sfile, pos);
+      ret = main_source_seek (sfile, pos);
 
       if (ret == 0)
 	{
@@ -421,10 +634,10 @@ main_read_seek_source (xd3_stream *stream,
 	  XD3_ASSERT (is_new);
 	  blru->blkno = skip_blkno;
 
-	  if ((ret = main_read_primary_input (sfile,
-					      (uint8_t*) blru->blk,
-					      source->blksize,
-					      & nread)))
+	  if ((ret = main_source_read (sfile,
+				       (uint8_t*) blru->blk,
+				       source->blksize,
+				       & nread)))
 	    {
 	      return ret;
 	    }
@@ -519,10 +732,10 @@ main_getblk_func (xd3_stream *stream,
       return ret;
     }
 
-  if ((ret = main_read_primary_input (sfile,
-				      (uint8_t*) blru->blk,
-				      source->blksize,
-				      & nread)))
+  if ((ret = main_source_read (sfile,
+			       (uint8_t*) blru->blk,
+			       source->blksize,
+			       & nread)))
     {
       return ret;
     }
@@ -30,6 +30,7 @@
 #define SLCHAIN       stream->smatcher.small_lchain
 #define MAXLAZY       stream->smatcher.max_lazy
 #define LONGENOUGH    stream->smatcher.long_enough
+#define SBTREE        stream->smatcher.small_tree
 
 #define SOFTCFG 1
 #include "xdelta3.c"
@@ -43,6 +44,7 @@
 #undef  SLCHAIN
 #undef  MAXLAZY
 #undef  LONGENOUGH
+#undef  SBTREE
 #endif
 
 #define SOFTCFG 0
@@ -59,6 +61,7 @@
 #define SLCHAIN       1
 #define MAXLAZY       6
 #define LONGENOUGH    6
+#define SBTREE        0
 
 #include "xdelta3.c"
 
@@ -70,6 +73,7 @@
 #undef  SLCHAIN
 #undef  MAXLAZY
 #undef  LONGENOUGH
+#undef  SBTREE
 #endif
 
 /************************************************************
@@ -84,6 +88,7 @@
 #define SLCHAIN       1
 #define MAXLAZY       18
 #define LONGENOUGH    18
+#define SBTREE        0
 
 #include "xdelta3.c"
 
@@ -95,6 +100,7 @@
 #undef  SLCHAIN
 #undef  MAXLAZY
 #undef  LONGENOUGH
+#undef  SBTREE
 #endif
 
 /******************************************************
@@ -109,6 +115,7 @@
 #define SLCHAIN       1
 #define MAXLAZY       18
 #define LONGENOUGH    35
+#define SBTREE        0
 
 #include "xdelta3.c"
 
@@ -120,6 +127,7 @@
 #undef  SLCHAIN
 #undef  MAXLAZY
 #undef  LONGENOUGH
+#undef  SBTREE
 #endif
 
 /**************************************************
@@ -134,6 +142,7 @@
 #define SLCHAIN       13
 #define MAXLAZY       90
 #define LONGENOUGH    70
+#define SBTREE        1
 
 #include "xdelta3.c"
 
@@ -145,6 +154,7 @@
 #undef  SLCHAIN
 #undef  MAXLAZY
 #undef  LONGENOUGH
+#undef  SBTREE
 #endif
 
 /********************************************************
@@ -159,6 +169,7 @@
 #define SLCHAIN       2
 #define MAXLAZY       36
 #define LONGENOUGH    70
+#define SBTREE        0
 
 #include "xdelta3.c"
 
@@ -170,4 +181,5 @@
 #undef  SLCHAIN
 #undef  MAXLAZY
 #undef  LONGENOUGH
+#undef  SBTREE
 #endif
@@ -0,0 +1,313 @@
+/* xdelta 3 - delta compression tools and library
+ * Copyright (C) 2007.  Joshua P. MacDonald
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Checkpoints for long encodes and decodes (--checkpoint, --resume).
+ * VCDIFF windows are coded independently, so after each window the
+ * stream can be restarted from three offsets: the input consumed, the
+ * output written and the window count.  The encoder also carries
+ * maxsrcaddr and the source index position (see xd3_winstate), and
+ * the decoder needs the VCDIFF header again, which it re-reads from
+ * the start of the delta.
+ *
+ * The checkpoint is a short text file, replaced by rename() after
+ * every window and removed when the command finishes:
+ *
+ *   xdelta3 checkpoint 1
+ *   command encode|decode
+ *   winsize N      input read size, must match on resume (encode)
+ *   hdrsize N      VCDIFF header size (decode)
+ *   windows N
+ *   in N
+ *   out N
+ *   maxsrcaddr N
+ *   cksumpos N
+ *
+ * --resume truncates the output to "out" bytes, which discards a
+ * partially written window, and continues.  The offsets are those of
+ * the files as stored, so external (de)compression is disabled. */
+
+#ifndef _XDELTA3_CHECKPOINT_H_
+#define _XDELTA3_CHECKPOINT_H_
+
+#define MAIN_CKPT_VERSION 1
+#define MAIN_CKPT_MAXSIZE 512  /* longer than any checkpoint */
+
+static const char*
+main_checkpoint_cmdname (xd3_cmd cmd)
+{
+  return IS_ENCODE (cmd) ? "encode" : "decode";
+}
+
+/* Called at each XD3_WINFINISH, after the window's output is
+ * written.  The output is synced first, then the new checkpoint, so
+ * that a checkpoint never points past data that is not on disk, and
+ * rename() replaces the old one atomically. */
+static int
+main_checkpoint_write (xd3_stream *stream, xd3_cmd cmd, main_file *ofile)
+{
+  xd3_winstate state;
+  main_file cfile;
+  size_t len = strlen (option_checkpoint);
+  char text[MAIN_CKPT_MAXSIZE];
+  char *tmp;
+  int n;
+  int ret = 0;
+
+  if (main_file_isopen (ofile) && (ret = main_file_sync (ofile)))
+    {
+      return ret;
+    }
+
+  xd3_get_winstate (stream, & state);
+
+  n = snprintf_func (text, sizeof (text),
+		     "xdelta3 checkpoint %d\n"
+		     "command %s\n"
+		     "winsize %u\n"
+		     "hdrsize %u\n"
+		     "windows %"Q"u\n"
+		     "in %"Q"u\n"
+		     "out %"Q"u\n"
+		     "maxsrcaddr %"Q"u\n"
+		     "cksumpos %"Q"u\n",
+		     MAIN_CKPT_VERSION,
+		     main_checkpoint_cmdname (cmd),
+		     IS_ENCODE (cmd) ? main_bsize : stream->winsize,
+		     IS_ENCODE (cmd) ? 0 : stream->dec_hdrsize,
+		     state.windows,
+		     state.total_in,
+		     state.total_out,
+		     state.maxsrcaddr,
+		     state.srcwin_cksum_pos);
+
+  if (n < 0 || n >= (int) sizeof (text))
+    {
+      XPR(NT "checkpoint %s: internal error\n", option_checkpoint);
+      return XD3_INTERNAL;
+    }
+
+  if ((tmp = (char*) main_malloc (len + 5)) == NULL)
+    {
+      return ENOMEM;
+    }
+
+  memcpy (tmp, option_checkpoint, len);
+  memcpy (tmp + len, ".tmp", 5);
+
+  /* A stale file from an earlier crash would stop CREATE_NEW. */
+  remove (tmp);
+
+  main_file_init (& cfile);
+
+  if ((ret = main_file_open (& cfile, tmp, XO_WRITE)) == 0)
+    {
+      if ((ret = main_file_write (& cfile, (uint8_t*) text, (usize_t) n,
+				  "checkpoint write failed")) == 0)
+	{
+	  ret = main_file_sync (& cfile);
+	}
+
+      if (main_file_close (& cfile) != 0 && ret == 0)
+	{
+	  ret = XD3_INTERNAL;
+	}
+    }
+
+  main_file_cleanup (& cfile);
+
+#if XD3_WIN32
+  /* rename() does not replace an existing file here. */
+  if (ret == 0) { remove (option_checkpoint); }
+#endif
+
+  if (ret == 0 && rename (tmp, option_checkpoint) != 0)
+    {
+      ret = get_errno ();
+      XPR(NT "checkpoint %s: %s\n", option_checkpoint, xd3_mainerror (ret));
+    }
+
+  main_free (tmp);
+  return ret;
+}
+
+static int
+main_checkpoint_read (xd3_cmd cmd, xd3_winstate *state, usize_t *hdrsize)
+{
+  main_file cfile;
+  char text[MAIN_CKPT_MAXSIZE];
+  size_t nread = 0;
+  int version = 0;
+  char command[16];
+  usize_t winsize;
+  int got;
+  int ret;
+
+  main_file_init (& cfile);
+
+  if ((ret = main_file_open (& cfile, option_checkpoint, XO_READ)) == 0)
+    {
+      ret = main_file_read (& cfile, (uint8_t*) text, sizeof (text) - 1,
+			    & nread, "checkpoint read failed");
+      main_file_close (& cfile);
+    }
+
+  main_file_cleanup (& cfile);
+
+  if (ret)
+    {
+      return ret;
+    }
+
+  text[nread] = 0;
+
+  got = sscanf (text,
+		"xdelta3 checkpoint %d command %15s winsize %u hdrsize %u "
+		"windows %"Q"u in %"Q"u out %"Q"u maxsrcaddr %"Q"u "
+		"cksumpos %"Q"u",
+		& version, command, & winsize, hdrsize,
+		& state->windows, & state->total_in, & state->total_out,
+		& state->maxsrcaddr, & state->srcwin_cksum_pos);
+
+  if (got != 9 || version != MAIN_CKPT_VERSION)
+    {
+      XPR(NT "checkpoint %s: invalid checkpoint\n", option_checkpoint);
+      return XD3_INVALID_INPUT;
+    }
+
+  if (strcmp (command, main_checkpoint_cmdname (cmd)) != 0)
+    {
+      XPR(NT "checkpoint %s: written by %s, not %s\n", option_checkpoint,
+	  command, main_checkpoint_cmdname (cmd));
+      return XD3_INVALID_INPUT;
+    }
+
+  /* Encoder windows must fall on the same input offsets. */
+  if (IS_ENCODE (cmd) && winsize != main_bsize)
+    {
+      XPR(NT "checkpoint %s: window size %u differs from %u\n",
+	  option_checkpoint, winsize, main_bsize);
+      return XD3_INVALID_INPUT;
+    }
+
+  return 0;
+}
+
+/* Restores the stream from the checkpoint before the first input,
+ * positions the input, and opens and truncates the output. */
+static int
+main_resume (xd3_stream *stream, xd3_cmd cmd, main_file *ifile,
+	     main_file *ofile, main_file *sfile, xd3_source *source)
+{
+  xd3_winstate state;
+  usize_t hdrsize;
+  xoff_t osize;
+  int ret;
+
+  if ((ret = main_checkpoint_read (cmd, & state, & hdrsize)))
+    {
+      return ret;
+    }
+
+  if (cmd == CMD_DECODE)
+    {
+      size_t nread = 0;
+
+      /* Decode the header again, for the secondary compressor, code
+       * table and application header.  A mapped input has no
+       * main_bdata and is read in place. */
+      if (ifile->map != NULL)
+	{
+	  nread = (size_t) min ((xoff_t) hdrsize, ifile->mapsize);
+	  xd3_avail_input (stream, ifile->map, (usize_t) nread);
+	  ret = xd3_decode_input (stream);
+	}
+      else if (hdrsize <= main_bsize &&
+	       main_read_primary_input (ifile, main_bdata,
+					hdrsize, & nread) == 0)
+	{
+	  xd3_avail_input (stream, main_bdata, (usize_t) nread);
+	  ret = xd3_decode_input (stream);
+	}
+
+      if (nread != hdrsize ||
+	  ret != XD3_INPUT ||
+	  stream->dec_hdrsize != hdrsize)
+	{
+	  XPR(NT "checkpoint %s: delta header does not match: %s\n",
+	      option_checkpoint, ifile->filename);
+	  return XD3_INVALID_INPUT;
+	}
+
+      main_get_appheader (stream, ifile, ofile, sfile);
+
+      if (sfile->filename != NULL &&
+	  (ret = main_set_source (stream, cmd, sfile, source)))
+	{
+	  return ret;
+	}
+    }
+
+  if ((ret = xd3_set_winstate (stream, & state)))
+    {
+      XPR(NT XD3_LIB_ERRMSG (stream, ret));
+      return ret;
+    }
+
+  if ((ret = main_file_seek (ifile, state.total_in)))
+    {
+      XPR(NT "--resume requires a seekable input: %s\n", ifile->filename);
+      return ret;
+    }
+
+  ifile->nread = state.total_in;
+
+  if (ofile->filename == NULL || option_no_output)
+    {
+      XPR(NT "--resume requires an output file\n");
+      return XD3_INVALID;
+    }
+
+  if ((ret = main_open_output (stream, ofile)) ||
+      (ret = main_file_stat (ofile, & osize)))
+    {
+      return ret;
+    }
+
+  /* A sparse output may end in a hole that was not yet written. */
+  if (osize < state.total_out && ! option_sparse)
+    {
+      XPR(NT "checkpoint %s: output is shorter than %"Q"u bytes: %s\n",
+	  option_checkpoint, state.total_out, ofile->filename);
+      return XD3_INVALID_INPUT;
+    }
+
+  if ((ret = main_file_truncate (ofile, state.total_out)))
+    {
+      return ret;
+    }
+
+  if (option_verbose)
+    {
+      XPR(NT "resuming at window %"Q"u: input %"Q"u: output %"Q"u\n",
+	  state.windows, state.total_in, state.total_out);
+    }
+
+  return 0;
+}
+
+#endif /* _XDELTA3_CHECKPOINT_H_ */
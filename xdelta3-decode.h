@@ -16,6 +16,7 @@
  *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#ifndef __XDELTA3_DECODE_TEMPLATE_PASS__
 #ifndef _XDELTA3_DECODE_H_
 #define _XDELTA3_DECODE_H_
 
@@ -43,12 +44,46 @@ xd3_decode_init_window (xd3_stream *stream)
   return 0;
 }
 
+int
+xd3_set_dec_output (xd3_stream *stream,
+		    uint8_t    *buf,
+		    usize_t     size)
+{
+  if (stream->dec_state != DEC_DATA)
+    {
+      stream->msg = "output buffer set outside a window header";
+      return XD3_INTERNAL;
+    }
+
+  stream->dec_userbuf   = buf;
+  stream->dec_userspace = size;
+  return 0;
+}
+
 /* Allocates buffer space for the target window and possibly the
  * VCD_TARGET copy-window.  Also sets the base of the two copy
  * segments. */
 static int
 xd3_decode_setup_buffers (xd3_stream *stream)
 {
+  /* Decode into the caller's buffer, if it was given and fits.  The
+   * stream's own buffer is restored in DEC_FINISH. */
+  if (stream->dec_userbuf != NULL &&
+      (stream->dec_win_ind & VCD_TARGET) == 0 &&
+      stream->dec_userspace >= stream->dec_tgtlen)
+    {
+      stream->dec_ownout   = stream->next_out;
+      stream->dec_ownspace = stream->space_out;
+      stream->dec_userout  = 1;
+      stream->next_out     = stream->dec_userbuf;
+      stream->space_out    = stream->dec_userspace;
+      stream->dec_userbuf  = NULL;
+      stream->dec_tgtaddrbase = stream->next_out - stream->dec_cpylen;
+      return 0;
+    }
+
+  stream->dec_userbuf = NULL;
+
   /* If VCD_TARGET is set then the previous buffer may be reused. */
   if (stream->dec_win_ind & VCD_TARGET)
     {
@@ -199,138 +234,60 @@ xd3_decode_section (xd3_stream *stream,
   return 0;
 }
 
-/* Decode the size and address for half of an instruction (i.e., a
- * single opcode).  This updates the stream->dec_position, which are
- * bytes already output prior to processing this instruction.  Perform
- * bounds checking for sizes and copy addresses, which uses the
- * dec_position (which is why these checks are done here). */
-static int
-xd3_decode_parse_halfinst (xd3_stream *stream, xd3_hinst *inst)
+/* The instruction decoder is compiled twice from the template at the
+ * end of this file: xd3_decode_instruction_generic() reads the code
+ * table and address cache sizes from the stream, while
+ * xd3_decode_instruction_rfc3284() has the RFC 3284 default table and
+ * its 4 near and 3 same cache modes as compile-time constants.  The
+ * default is used whenever the header has no VCD_CODETABLE. */
+#define XD3_DECODE_TEMPLATE(x)    XD3_DECODE_TEMPLATE2(x,DECODE_TEMPLATE)
+#define XD3_DECODE_TEMPLATE2(x,n) XD3_DECODE_TEMPLATE3(x,n)
+#define XD3_DECODE_TEMPLATE3(x,n) x ## n
+
+#define __XDELTA3_DECODE_TEMPLATE_PASS__
+
+#define DECODE_TEMPLATE    generic
+#define DECODE_CODE_TABLE  (stream->code_table)
+#define DECODE_NEAR_MODES  (stream->acache.s_near)
+#define DECODE_SAME_MODES  (stream->acache.s_same)
+#include "xdelta3-decode.h"
+#undef DECODE_TEMPLATE
+#undef DECODE_CODE_TABLE
+#undef DECODE_NEAR_MODES
+#undef DECODE_SAME_MODES
+
+#define DECODE_TEMPLATE    rfc3284
+#define DECODE_CODE_TABLE  __rfc3284_code_table
+#define DECODE_NEAR_MODES  RFC3284_NEAR_MODES
+#define DECODE_SAME_MODES  RFC3284_SAME_MODES
+#include "xdelta3-decode.h"
+#undef DECODE_TEMPLATE
+#undef DECODE_CODE_TABLE
+#undef DECODE_NEAR_MODES
+#undef DECODE_SAME_MODES
+
+#undef __XDELTA3_DECODE_TEMPLATE_PASS__
+
+typedef int (xd3_decode_inst_func) (xd3_stream *stream);
+
+/* Returns the instruction decoder for the stream's code table. */
+static inline xd3_decode_inst_func*
+xd3_decode_instruction_func (xd3_stream *stream)
 {
-  int ret;
-
-  /* If the size from the instruction table is zero then read a size value. */
-  if ((inst->size == 0) &&
-      (ret = xd3_read_size (stream,
- 			    & stream->inst_sect.buf,
-			      stream->inst_sect.buf_max,
-			    & inst->size)))
-    {
-      return XD3_INVALID_INPUT;
-    }
-
-  /* For copy instructions, read address. */
-  if (inst->type >= XD3_CPY)
-    {
-      IF_DEBUG2 ({
-	static int cnt = 0;
-	XPR(NT "DECODE:%u: COPY at %"Q"u (winoffset %u) size %u winaddr %u\n",
-		 cnt++,
-		 stream->total_out + (stream->dec_position -
-				      stream->dec_cpylen),
-		 (stream->dec_position - stream->dec_cpylen),
-		 inst->size,
-		 inst->addr);
-      });
-
-      if ((ret = xd3_decode_address (stream,
-				     stream->dec_position,
-				     inst->type - XD3_CPY,
-				     & stream->addr_sect.buf,
-				     stream->addr_sect.buf_max,
-				     & inst->addr)))
-	{
-	  return ret;
-	}
-
-      /* Cannot copy an address before it is filled-in. */
-      if (inst->addr >= stream->dec_position)
-	{
-	  stream->msg = "address too large";
-	  return XD3_INVALID_INPUT;
-	}
-
-      /* Check: a VCD_TARGET or VCD_SOURCE copy cannot exceed the remaining
-       * buffer space in its own segment. */
-      if (inst->addr < stream->dec_cpylen &&
-	  inst->addr + inst->size > stream->dec_cpylen)
-	{
-	  stream->msg = "size too large";
-	  return XD3_INVALID_INPUT;
-	}
-    }
-  else
-    {
-      IF_DEBUG2 ({
-	if (inst->type == XD3_ADD)
-	  {
-	    static int cnt;
-	    XPR(NT "DECODE:%d: ADD at %"Q"u (winoffset %u) size %u\n",
-	       cnt++,
-	       (stream->total_out + stream->dec_position - stream->dec_cpylen),
-	       stream->dec_position - stream->dec_cpylen,
-	       inst->size);
-	  }
-	else
-	  {
-	    static int cnt;
-	    XD3_ASSERT (inst->type == XD3_RUN);
-	    XPR(NT "DECODE:%d: RUN at %"Q"u (winoffset %u) size %u\n",
-	       cnt++,
-	       stream->total_out + stream->dec_position - stream->dec_cpylen,
-	       stream->dec_position - stream->dec_cpylen,
-	       inst->size);
-	  }
-      });
-    }
-
-  /* Check: The instruction will not overflow the output buffer. */
-  if (stream->dec_position + inst->size > stream->dec_maxpos)
-    {
-      stream->msg = "size too large";
-      return XD3_INVALID_INPUT;
-    }
-
-  stream->dec_position += inst->size;
-  return 0;
+  return (stream->code_table == __rfc3284_code_table) ?
+    xd3_decode_instruction_rfc3284 :
+    xd3_decode_instruction_generic;
 }
 
-/* Decode a single opcode and then decode the two half-instructions. */
+#if VCDIFF_TOOLS
+/* Decode a single opcode and then decode the two half-instructions,
+ * for the VCDIFF tools. */
 static int
 xd3_decode_instruction (xd3_stream *stream)
 {
-  int ret;
-  const xd3_dinst *inst;
-
-  if (stream->inst_sect.buf == stream->inst_sect.buf_max)
-    {
-      stream->msg = "instruction underflow";
-      return XD3_INVALID_INPUT;
-    }
-
-  inst = &stream->code_table[*stream->inst_sect.buf++];
-
-  stream->dec_current1.type = inst->type1;
-  stream->dec_current2.type = inst->type2;
-  stream->dec_current1.size = inst->size1;
-  stream->dec_current2.size = inst->size2;
-
-  /* For each instruction with a real operation, decode the
-   * corresponding size and addresses if necessary.  Assume a
-   * code-table may have NOOP in either position, although this is
-   * unlikely. */
-  if (inst->type1 != XD3_NOOP &&
-      (ret = xd3_decode_parse_halfinst (stream, & stream->dec_current1)))
-    {
-      return ret;
-    }
-  if (inst->type2 != XD3_NOOP &&
-      (ret = xd3_decode_parse_halfinst (stream, & stream->dec_current2)))
-    {
-      return ret;
-    }
-  return 0;
+  return xd3_decode_instruction_func (stream) (stream);
 }
+#endif
 
 /* Output the result of a single half-instruction. OPT: This the
    decoder hotspot.  Modifies "hinst", see below.  */
@@ -643,6 +600,8 @@ static int
 xd3_decode_emit (xd3_stream *stream)
 {
   int ret;
+  xd3_decode_inst_func *decode_instruction =
+    xd3_decode_instruction_func (stream);
 
   /* Produce output: originally structured to allow reentrant code
    * that fills as much of the output buffer as possible, but VCDIFF
@@ -664,7 +623,7 @@ xd3_decode_emit (xd3_stream *stream)
       /* Decode next instruction pair. */
       if ((stream->dec_current1.type == XD3_NOOP) &&
 	  (stream->dec_current2.type == XD3_NOOP) &&
-	  (ret = xd3_decode_instruction (stream))) { return ret; }
+	  (ret = decode_instruction (stream))) { return ret; }
 
       /* Output dec_current1 */
       while ((stream->dec_current1.type != XD3_NOOP))
@@ -824,7 +783,7 @@ xd3_decode_input (xd3_stream *stream)
       if ((stream->dec_hdr_ind & VCD_CODETABLE) != 0) {
 	if (stream->dec_codetblsz <= 2) {
 	  stream->msg = "invalid code table size";
-	  return ENOMEM;
+	  return XD3_INVALID_INPUT;
 	}
 	stream->dec_codetblsz -= 2;
       }
@@ -989,8 +948,13 @@ xd3_decode_input (xd3_stream *stream)
 	  return XD3_INVALID_INPUT;
 	}
 
-      /* Check for malicious files. */
-      if (stream->dec_tgtlen > XD3_HARDMAXWINSIZE)
+      /* Check for malicious files.  The application may raise
+       * dec_maxwinsize on XD3_GOTHEADER, as main does for the "win/N"
+       * appheader pair, so the first window is only held to
+       * XD3_LARGEMAXWINSIZE here and checked again at DEC_DATA. */
+      if (stream->dec_tgtlen > (stream->current_window == 0 ?
+				XD3_LARGEMAXWINSIZE :
+				stream->dec_maxwinsize))
 	{
 	  stream->msg = "hard window size exceeded";
 	  return XD3_INVALID_INPUT;
@@ -1063,6 +1027,8 @@ xd3_decode_input (xd3_stream *stream)
 	  }
       }
 
+      IF_PERF (stream, xd3_perf_winstart (stream));
+
       /* Returning here gives the application a chance to inspect the
        * header, skip the window, etc. */
       if (stream->current_window == 0) { return XD3_GOTHEADER; }
@@ -1071,6 +1037,14 @@ xd3_decode_input (xd3_stream *stream)
     case DEC_DATA:
     case DEC_INST:
     case DEC_ADDR:
+      /* The first window's limit, see DEC_TGTLEN. */
+      if (stream->current_window == 0 &&
+	  stream->dec_tgtlen > stream->dec_maxwinsize)
+	{
+	  stream->msg = "hard window size exceeded";
+	  return XD3_INVALID_INPUT;
+	}
+
       /* Next read the three sections. */
      if ((ret = xd3_decode_sections (stream))) { return ret; }
 
@@ -1113,6 +1087,15 @@ xd3_decode_input (xd3_stream *stream)
 
     case DEC_FINISH:
       {
+	if (stream->dec_userout)
+	  {
+	    stream->next_out    = stream->dec_ownout;
+	    stream->space_out   = stream->dec_ownspace;
+	    stream->dec_userout = 0;
+	  }
+
+	stream->dec_userbuf = NULL;
+
 	if (stream->dec_win_ind & VCD_TARGET)
 	  {
 	    if (stream->dec_lastwin == NULL)
@@ -1146,3 +1129,236 @@ xd3_decode_input (xd3_stream *stream)
 }
 
 #endif // _XDELTA3_DECODE_H_
+
+#else /* __XDELTA3_DECODE_TEMPLATE_PASS__ */
+
+/***********************************************************************
+ Instruction decoder template, see xd3_decode_instruction_func().
+ ***********************************************************************/
+
+/* Decodes the address of a copy in MODE at position HERE, and updates
+ * the address cache. */
+static int
+XD3_DECODE_TEMPLATE(xd3_decode_address_) (xd3_stream *stream, usize_t here,
+					  usize_t mode, const uint8_t **inpp,
+					  const uint8_t *max, uint32_t *valp)
+{
+  int ret;
+  xd3_addr_cache *acache = & stream->acache;
+  usize_t same_start = 2 + DECODE_NEAR_MODES;
+
+  if (mode < same_start)
+    {
+      if ((ret = xd3_read_size (stream, inpp, max, valp))) { return ret; }
+
+      switch (mode)
+	{
+	case VCD_SELF:
+	  break;
+	case VCD_HERE:
+	  (*valp) = here - (*valp);
+	  break;
+	default:
+	  (*valp) += acache->near_array[mode - 2];
+	  break;
+	}
+    }
+  else
+    {
+      if (*inpp == max)
+	{
+	  stream->msg = "address underflow";
+	  return XD3_INVALID_INPUT;
+	}
+
+      mode -= same_start;
+
+      (*valp) = xd3_same_cache_get (acache, mode*256 + (**inpp));
+
+      (*inpp) += 1;
+    }
+
+  /* As xd3_update_cache(), with the cache sizes of this template. */
+  if (DECODE_NEAR_MODES > 0)
+    {
+      acache->near_array[acache->next_slot] = *valp;
+      acache->next_slot = (acache->next_slot + 1) % DECODE_NEAR_MODES;
+    }
+
+  if (DECODE_SAME_MODES > 0)
+    {
+      usize_t i = (*valp) % (DECODE_SAME_MODES*256);
+      acache->same_array[i] = *valp;
+      acache->same_gen[i] = acache->generation;
+    }
+
+  return 0;
+}
+
+/* Decode the size and address for half of an instruction (i.e., a
+ * single opcode).  This updates the stream->dec_position, which are
+ * bytes already output prior to processing this instruction.  Perform
+ * bounds checking for sizes and copy addresses, which uses the
+ * dec_position (which is why these checks are done here). */
+static int
+XD3_DECODE_TEMPLATE(xd3_decode_parse_halfinst_) (xd3_stream *stream,
+						xd3_hinst *inst)
+{
+  int ret;
+
+  /* If the size from the instruction table is zero then read a size value. */
+  if ((inst->size == 0) &&
+      (ret = xd3_read_size (stream,
+ 			    & stream->inst_sect.buf,
+			      stream->inst_sect.buf_max,
+			    & inst->size)))
+    {
+      return XD3_INVALID_INPUT;
+    }
+
+  /* For copy instructions, read address. */
+  if (inst->type >= XD3_CPY)
+    {
+      IF_DEBUG2 ({
+	static int cnt = 0;
+	XPR(NT "DECODE:%u: COPY at %"Q"u (winoffset %u) size %u winaddr %u\n",
+		 cnt++,
+		 stream->total_out + (stream->dec_position -
+				      stream->dec_cpylen),
+		 (stream->dec_position - stream->dec_cpylen),
+		 inst->size,
+		 inst->addr);
+      });
+
+      if ((ret = XD3_DECODE_TEMPLATE(xd3_decode_address_) (stream,
+				     stream->dec_position,
+				     inst->type - XD3_CPY,
+				     & stream->addr_sect.buf,
+				     stream->addr_sect.buf_max,
+				     & inst->addr)))
+	{
+	  return ret;
+	}
+
+      /* Cannot copy an address before it is filled-in. */
+      if (inst->addr >= stream->dec_position)
+	{
+	  stream->msg = "address too large";
+	  return XD3_INVALID_INPUT;
+	}
+
+      /* Check: a VCD_TARGET or VCD_SOURCE copy cannot exceed the remaining
+       * buffer space in its own segment. */
+      if (inst->addr < stream->dec_cpylen &&
+	  inst->addr + inst->size > stream->dec_cpylen)
+	{
+	  stream->msg = "size too large";
+	  return XD3_INVALID_INPUT;
+	}
+
+      /* The instruction counts are statistics, kept with XD3_PERF. */
+      if (PERF_ON (stream))
+	{
+	  if ((stream->dec_win_ind & VCD_SOURCE) &&
+	      inst->addr < stream->dec_cpylen)
+	    {
+	      stream->n_scpy += 1;
+	      stream->l_scpy += inst->size;
+	    }
+	  else
+	    {
+	      stream->n_tcpy += 1;
+	      stream->l_tcpy += inst->size;
+	    }
+	}
+    }
+  else
+    {
+      if (PERF_ON (stream))
+	{
+	  if (inst->type == XD3_ADD)
+	    {
+	      stream->n_add += 1;
+	      stream->l_add += inst->size;
+	    }
+	  else
+	    {
+	      stream->n_run += 1;
+	      stream->l_run += inst->size;
+	    }
+	}
+
+      IF_DEBUG2 ({
+	if (inst->type == XD3_ADD)
+	  {
+	    static int cnt;
+	    XPR(NT "DECODE:%d: ADD at %"Q"u (winoffset %u) size %u\n",
+	       cnt++,
+	       (stream->total_out + stream->dec_position - stream->dec_cpylen),
+	       stream->dec_position - stream->dec_cpylen,
+	       inst->size);
+	  }
+	else
+	  {
+	    static int cnt;
+	    XD3_ASSERT (inst->type == XD3_RUN);
+	    XPR(NT "DECODE:%d: RUN at %"Q"u (winoffset %u) size %u\n",
+	       cnt++,
+	       stream->total_out + stream->dec_position - stream->dec_cpylen,
+	       stream->dec_position - stream->dec_cpylen,
+	       inst->size);
+	  }
+      });
+    }
+
+  /* Check: The instruction will not overflow the output buffer. */
+  if (stream->dec_position + inst->size > stream->dec_maxpos)
+    {
+      stream->msg = "size too large";
+      return XD3_INVALID_INPUT;
+    }
+
+  stream->dec_position += inst->size;
+  return 0;
+}
+
+/* Decode a single opcode and then decode the two half-instructions. */
+static int
+XD3_DECODE_TEMPLATE(xd3_decode_instruction_) (xd3_stream *stream)
+{
+  int ret;
+  const xd3_dinst *inst;
+
+  if (stream->inst_sect.buf == stream->inst_sect.buf_max)
+    {
+      stream->msg = "instruction underflow";
+      return XD3_INVALID_INPUT;
+    }
+
+  inst = & DECODE_CODE_TABLE[*stream->inst_sect.buf++];
+
+  stream->dec_current1.type = inst->type1;
+  stream->dec_current2.type = inst->type2;
+  stream->dec_current1.size = inst->size1;
+  stream->dec_current2.size = inst->size2;
+
+  /* For each instruction with a real operation, decode the
+   * corresponding size and addresses if necessary.  Assume a
+   * code-table may have NOOP in either position, although this is
+   * unlikely. */
+  if (inst->type1 != XD3_NOOP &&
+      (ret = XD3_DECODE_TEMPLATE(xd3_decode_parse_halfinst_)
+       (stream, & stream->dec_current1)))
+    {
+      return ret;
+    }
+  if (inst->type2 != XD3_NOOP &&
+      (ret = XD3_DECODE_TEMPLATE(xd3_decode_parse_halfinst_)
+       (stream, & stream->dec_current2)))
+    {
+      return ret;
+    }
+  return 0;
+}
+
+#endif /* __XDELTA3_DECODE_TEMPLATE_PASS__ */
@@ -132,6 +132,17 @@ xd3_lcksum (const uint8_t *seg, const usize_t ln)
 }
 #endif
 
+/* True for about one large checksum in 2^(32 - shift): the
+ * content-defined anchors indexed when anchor_interval is set.  The
+ * test uses the high bits of a second multiplier so that the selected
+ * checksums still spread over the whole large hash table. */
+static inline int
+xd3_is_anchor (uint32_t cksum, usize_t shift)
+{
+  cksum ^= cksum >> 16;
+  return ((cksum * 0x85ebca6bU) >> shift) == 0;
+}
+
 #if XD3_ENCODER
 static usize_t
 xd3_size_log2 (usize_t slots)
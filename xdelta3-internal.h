@@ -54,8 +54,9 @@ int xd3_main_cmdline (int argc, char **argv);
 /* main_file->mode values */
 typedef enum
 {
-  XO_READ  = 0,
-  XO_WRITE = 1
+  XO_READ   = 0,
+  XO_WRITE  = 1,
+  XO_RESUME = 2   /* write, keeping existing content */
 } main_file_modes;
 
 struct _main_file
@@ -83,6 +84,11 @@ struct _main_file
   int                 size_known;    /* Set by main_set_souze */
   xoff_t              source_position;  /* for avoiding seek in getblk_func */
   int                 seek_failed;   /* after seek fails once, try FIFO */
+  int                 sparse_ok;     /* regular file truncated by
+				      * main_file_open, see --sparse */
+  int                 sparse_hole;   /* output ends in a skipped block */
+  const uint8_t      *map;           /* input mapped by main_file_map */
+  xoff_t              mapsize;
 };
 
 /* According to the internet, Windows vsnprintf() differs from most
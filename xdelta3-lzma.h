@@ -83,6 +83,32 @@ xd3_lzma_init (xd3_stream *stream, xd3_lzma_stream *sec, int is_encode)
   return 0;
 }
 
+#if XD3_ENCODER
+/* Returns the memory used by one LZMA encoder at the stream's
+ * compression level, for xd3_config_memory(). */
+static xoff_t
+xd3_lzma_encoder_memory (xd3_stream *stream)
+{
+  int preset = (stream->flags & XD3_COMPLEVEL_MASK) >> XD3_COMPLEVEL_SHIFT;
+  lzma_options_lzma options;
+  lzma_filter filters[2];
+  uint64_t usage;
+
+  if (lzma_lzma_preset (&options, preset))
+    {
+      return 0;
+    }
+
+  filters[0].id = LZMA_FILTER_LZMA2;
+  filters[0].options = &options;
+  filters[1].id = LZMA_VLI_UNKNOWN;
+
+  usage = lzma_raw_encoder_memusage (filters);
+
+  return usage == UINT64_MAX ? 0 : (xoff_t) usage;
+}
+#endif
+
 int xd3_decode_lzma (xd3_stream *stream, xd3_lzma_stream *sec,
 		     const uint8_t **input_pos,
 		     const uint8_t  *const input_end,
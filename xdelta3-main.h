@@ -98,6 +98,9 @@ xsnprintf_func (char *str, int n, const char *fmt, ...)
 /* The number of soft-config variables.  */
 #define XD3_SOFTCFG_VARCNT 7
 
+/* The number of code-table variables.  */
+#define XD3_CODETBL_VARCNT 10
+
 /* this is used as in XPR(NT XD3_LIB_ERRMSG (stream, ret)) to print an
  * error message from the library. */
 #define XD3_LIB_ERRMSG(stream, ret) "%s: %s\n", \
@@ -106,6 +109,7 @@ xsnprintf_func (char *str, int n, const char *fmt, ...)
 #if XD3_POSIX
 #include <unistd.h> /* close, read, write... */
 #include <sys/types.h>
+#include <sys/mman.h> /* mmap() */
 #include <fcntl.h>
 #endif
 
@@ -176,6 +180,11 @@ typedef enum
   CMD_MERGE,
 #if XD3_ENCODER
   CMD_ENCODE,
+  CMD_TRAIN_CODETABLE,
+  CMD_BENCH,
+  CMD_TUNE_SMATCHER,
+  CMD_PICK_BASE,
+  CMD_SIGNATURE,
 #endif
   CMD_DECODE,
   CMD_TEST,
@@ -231,6 +240,52 @@ XD3_MAKELIST(main_merge_list,main_merge,link);
 
 #define DEFAULT_VERBOSE 0
 
+/* Long options, "--name=value".  Each has an id in main_longopt_id
+ * and is handled in main(). */
+typedef enum
+{
+  LONGOPT_CODETABLE,
+  LONGOPT_PERF,
+  LONGOPT_STATS_JSON,
+  LONGOPT_SIGNATURE,
+  LONGOPT_ANCHORS,
+  LONGOPT_ESTIMATE,
+  LONGOPT_SPARSE,
+  LONGOPT_BCJ,
+  LONGOPT_MONOTONE,
+  LONGOPT_MEMORY_LIMIT,
+  LONGOPT_CHECKPOINT,
+  LONGOPT_RESUME,
+  LONGOPT_PROBE,
+} main_longopt_id;
+
+typedef struct _main_longopt main_longopt;
+
+struct _main_longopt
+{
+  const char      *name;
+  int              has_arg;
+  main_longopt_id  id;
+};
+
+static const main_longopt main_longopts[] =
+{
+  { "codetable", 1, LONGOPT_CODETABLE },
+  { "perf",      0, LONGOPT_PERF },
+  { "stats-json", 1, LONGOPT_STATS_JSON },
+  { "signature", 1, LONGOPT_SIGNATURE },
+  { "anchors",   1, LONGOPT_ANCHORS },
+  { "estimate",  0, LONGOPT_ESTIMATE },
+  { "sparse",    0, LONGOPT_SPARSE },
+  { "bcj",       1, LONGOPT_BCJ },
+  { "monotone",  1, LONGOPT_MONOTONE },
+  { "memory-limit", 1, LONGOPT_MEMORY_LIMIT },
+  { "checkpoint", 1, LONGOPT_CHECKPOINT },
+  { "resume",    0, LONGOPT_RESUME },
+  { "probe",     0, LONGOPT_PROBE },
+  { NULL,        0, LONGOPT_CODETABLE },
+};
+
 /* Program options: various command line flags and options. */
 static int         option_stdout             = 0;
 static int         option_force              = 0;
@@ -243,8 +298,25 @@ static const char* option_secondary          = NULL;
 static int         option_use_checksum       = 1;
 static int         option_use_altcodetable   = 0;
 static const char* option_smatch_config      = NULL;
+static const char* option_codetable          = NULL;
 static int         option_no_compress        = 0;
 static int         option_no_output          = 0; /* do not write output */
+static int         option_perf               = 0; /* print xd3_perf */
+static const char *option_stats_json         = NULL;
+static const char *option_signature          = NULL;
+static usize_t     option_anchor_interval    = 0;
+static int         option_estimate           = 0; /* print size only */
+static int         option_probe              = 0; /* XD3_PROBE */
+static int         option_sparse             = 0; /* seek over zeros */
+static int         option_bcj                = 0; /* main_bcj_type */
+static xoff_t      option_monotone           = 0; /* source copy lag */
+static xoff_t      option_memory_limit       = 0; /* encoder budget */
+static const char *option_checkpoint         = NULL;
+static int         option_resume             = 0;
+
+#define MAIN_SPARSE_BLKSIZE 4096
+#define MAIN_MAP_INPUT (1U << 30) /* largest mapped input given
+				   * to the decoder at once */
 static const char *option_source_filename    = NULL;
 
 static int         option_level              = XD3_DEFAULT_LEVEL;
@@ -271,6 +343,28 @@ static int         option_recompress_outputs = 1;
 static int option_print_cpymode = 1; /* Note: see reset_defaults(). */
 #endif
 
+/* State for --perf and --stats-json: the output file, the clock and
+ * stream totals at the end of the last window, and this window's time
+ * spent reading and writing, in microseconds. */
+typedef struct _main_stats main_stats;
+
+struct _main_stats
+{
+  main_file file;
+  xoff_t    t_start;
+  xoff_t    t_window;
+  xoff_t    t_read;
+  xoff_t    t_write;
+  xoff_t    total_in;
+  xoff_t    total_out;
+  xoff_t    n_scpy, l_scpy;
+  xoff_t    n_tcpy, l_tcpy;
+  xoff_t    n_add, l_add;
+  xoff_t    n_run, l_run;
+};
+
+static main_stats main_winstats;
+
 /* Static variables */
 IF_DEBUG(static int main_mallocs = 0;)
 
@@ -326,6 +420,8 @@ static int xd3_merge_input_output (xd3_stream *stream,
 				   xd3_whole_state *source);
 #endif
 
+#include "xdelta3-bcj.h"
+
 /* The code in xdelta3-blk.h is essentially part of this unit, see
  * comments there. */
 #include "xdelta3-blkcache.h"
@@ -392,6 +488,7 @@ main_config (void)
   XPR(NTR "XD3_DEFAULT_SRCWINSZ=%d\n", XD3_DEFAULT_SRCWINSZ);
   XPR(NTR "XD3_DEFAULT_WINSIZE=%d\n", XD3_DEFAULT_WINSIZE);
   XPR(NTR "XD3_HARDMAXWINSIZE=%d\n", XD3_HARDMAXWINSIZE);
+  XPR(NTR "XD3_LARGEMAXWINSIZE=%d\n", XD3_LARGEMAXWINSIZE);
   XPR(NTR "sizeof(void*)=%d\n", (int)sizeof(void*));
   XPR(NTR "sizeof(int)=%d\n", (int)sizeof(int));
   XPR(NTR "sizeof(size_t)=%d\n", (int)sizeof(size_t));
@@ -415,9 +512,24 @@ reset_defaults(void)
   option_secondary = NULL;
   option_use_altcodetable = 0;
   option_smatch_config = NULL;
+  option_codetable = NULL;
   option_no_compress = 0;
   option_no_output = 0;
+  option_perf = 0;
+  option_stats_json = NULL;
+  option_signature = NULL;
+  option_anchor_interval = 0;
+  option_estimate = 0;
+  option_probe = 0;
+  option_sparse = 0;
+  option_bcj = 0;
+  option_monotone = 0;
+  option_memory_limit = 0;
+  option_checkpoint = NULL;
+  option_resume = 0;
   option_source_filename = NULL;
+  memset (& main_winstats, 0, sizeof (main_winstats));
+  main_file_init (& main_winstats.file);
   program_name = NULL;
   appheader_used = NULL;
   main_bdata = NULL;
@@ -726,6 +838,63 @@ main_atoux (const char* arg, xoff_t *xo, xoff_t low,
   return 0;
 }
 
+/* Parses a size with an optional K, M or G (binary) suffix. */
+static int
+main_size_parse (const char *arg, xoff_t *xo)
+{
+  char *e;
+  unsigned long long x = strtoull (arg, & e, 10);
+  int shift = 0;
+
+  switch (*e)
+    {
+    case 'K': case 'k': shift = 10; e += 1; break;
+    case 'M': case 'm': shift = 20; e += 1; break;
+    case 'G': case 'g': shift = 30; e += 1; break;
+    }
+
+  if (e == arg || *e != 0 || x == 0 || x > (XOFF_T_MAX >> shift))
+    {
+      return XD3_INVALID;
+    }
+
+  (*xo) = (xoff_t) x << shift;
+  return 0;
+}
+
+/* Parses a --monotone distance, from the command line or the
+ * application header. */
+static int
+main_monotone_parse (const char *arg, xoff_t *xo)
+{
+  char *e;
+  unsigned long long x = strtoull (arg, & e, 10);
+
+  if (e == arg || *e != 0 || x == 0 || x > XD3_MAXSRCWINSZ / 2)
+    {
+      return XD3_INVALID;
+    }
+
+  (*xo) = (xoff_t) x;
+  return 0;
+}
+
+/* Parses the window size of a "win/N" application header pair. */
+static int
+main_winsize_parse (const char *arg, usize_t *uo)
+{
+  char *e;
+  unsigned long long x = strtoull (arg, & e, 10);
+
+  if (e == arg || *e != 0 || x < XD3_ALLOCSIZE || x > XD3_LARGEMAXWINSIZE)
+    {
+      return XD3_INVALID;
+    }
+
+  (*uo) = (usize_t) x;
+  return 0;
+}
+
 static int
 main_atou (const char* arg, usize_t *uo, usize_t low,
 	   usize_t high, char which) 
@@ -750,9 +919,11 @@ main_atou (const char* arg, usize_t *uo, usize_t low,
  * wrappers exist. */
 
 #define XOPEN_OPNAME (xfile->mode == XO_READ ? "read" : "write")
-#define XOPEN_STDIO  (xfile->mode == XO_READ ? "rb" : "wb")
-#define XOPEN_POSIX  (xfile->mode == XO_READ ? \
-		      O_RDONLY : O_WRONLY | O_CREAT | O_TRUNC)
+#define XOPEN_STDIO  (xfile->mode == XO_READ ? "rb" : \
+		      xfile->mode == XO_RESUME ? "r+b" : "wb")
+#define XOPEN_POSIX  (xfile->mode == XO_READ ? O_RDONLY : \
+		      xfile->mode == XO_RESUME ? O_WRONLY : \
+		      O_WRONLY | O_CREAT | O_TRUNC)
 #define XOPEN_MODE   (xfile->mode == XO_READ ? 0 : 0666)
 
 #define XF_ERROR(op, name, ret) \
@@ -820,6 +991,17 @@ main_file_close (main_file *xfile)
       return 0;
     }
 
+  xfile->sparse_ok = 0;
+
+#if XD3_POSIX
+  if (xfile->map != NULL)
+    {
+      munmap ((void*) xfile->map, (size_t) xfile->mapsize);
+      xfile->map = NULL;
+      xfile->mapsize = 0;
+    }
+#endif
+
 #if XD3_STDIO
   ret = fclose (xfile->file);
   xfile->file = NULL;
@@ -899,7 +1081,7 @@ main_file_open (main_file *xfile, const char* name, int mode)
 			   (mode == XO_READ) ? GENERIC_READ : GENERIC_WRITE,
 			   FILE_SHARE_READ,
 			   NULL,
-			   (mode == XO_READ) ?
+			   (mode == XO_READ || mode == XO_RESUME) ?
 			   OPEN_EXISTING :
 			   (option_force ? CREATE_ALWAYS : CREATE_NEW),
 			   FILE_ATTRIBUTE_NORMAL,
@@ -911,6 +1093,14 @@ main_file_open (main_file *xfile, const char* name, int mode)
 #endif
   if (ret) { XF_ERROR ("open", name, ret); }
   else     { xfile->realname = name; xfile->nread = 0; }
+
+  /* XO_WRITE truncates, so blocks that --sparse seeks over read back
+   * as zeros, provided this is a regular file. */
+  if (ret == 0 && mode == XO_WRITE)
+    {
+      xoff_t size;
+      xfile->sparse_ok = (main_file_stat (xfile, & size) == 0 && size == 0);
+    }
   return ret;
 }
 
@@ -959,6 +1149,56 @@ main_file_stat (main_file *xfile, xoff_t *size)
   return ret;
 }
 
+/* Maps a regular VCDIFF input file, so that the decoder reads its
+ * sections in place instead of through main_bdata, and the file is
+ * paged in as it is decoded.  Other inputs, including externally
+ * compressed ones, are left to main_file_read().
+ *
+ * Note: SIGBUS is not handled.  If another process truncates the
+ * input while it is being decoded, touching the pages past the new
+ * end of file kills the process instead of returning an error. */
+static void
+main_file_map (main_file *xfile)
+{
+#if XD3_POSIX
+  xoff_t size;
+  void *map;
+  const uint8_t *p;
+
+  if (main_file_stat (xfile, & size) != 0 ||
+      size < 3 ||
+      size != (xoff_t) (size_t) size ||
+      (map = mmap (NULL, (size_t) size, PROT_READ, MAP_PRIVATE,
+		   xfile->file, 0)) == MAP_FAILED)
+    {
+      return;
+    }
+
+  p = (const uint8_t*) map;
+
+  if (p[0] != VCDIFF_MAGIC1 ||
+      p[1] != VCDIFF_MAGIC2 ||
+      p[2] != VCDIFF_MAGIC3)
+    {
+      munmap (map, (size_t) size);
+      return;
+    }
+
+#ifdef POSIX_MADV_SEQUENTIAL
+  posix_madvise (map, (size_t) size, POSIX_MADV_SEQUENTIAL);
+#endif
+
+  xfile->map = p;
+  xfile->mapsize = size;
+  xfile->flags &= ~RD_FIRST;
+
+  if (option_verbose > 1)
+    {
+      XPR(NT "mapped input: %s\n", xfile->filename);
+    }
+#endif
+}
+
 int
 main_file_exists (main_file *xfile)
 {
@@ -1149,6 +1389,157 @@ main_file_seek (main_file *xfile, xoff_t pos)
   return ret;
 }
 
+/* Writes a file's data through to the disk.  Pipes and terminals
+ * have nothing to write through. */
+static int
+main_file_sync (main_file *xfile)
+{
+  int ret = 0;
+
+#if XD3_STDIO
+  if (fflush (xfile->file) != 0 ||
+      (fsync (XFNO (xfile)) != 0 && errno != EINVAL))
+    {
+      ret = get_errno ();
+    }
+
+#elif XD3_POSIX
+  if (fsync (xfile->file) != 0 && errno != EINVAL) { ret = get_errno (); }
+
+#elif XD3_WIN32
+  if (GetFileType (xfile->file) == FILE_TYPE_DISK &&
+      FlushFileBuffers (xfile->file) == 0)
+    {
+      ret = get_errno ();
+    }
+#endif
+
+  if (ret) { XF_ERROR ("sync", xfile->filename, ret); }
+  return ret;
+}
+
+/* Cuts or extends a file opened with XO_RESUME to SIZE bytes and
+ * positions it there. */
+static int
+main_file_truncate (main_file *xfile, xoff_t size)
+{
+  int ret = 0;
+
+#if XD3_STDIO
+  if (fflush (xfile->file) != 0 ||
+      ftruncate (XFNO (xfile), size) != 0)
+    {
+      ret = get_errno ();
+    }
+
+#elif XD3_POSIX
+  if (ftruncate (xfile->file, size) != 0) { ret = get_errno (); }
+
+#elif XD3_WIN32
+  if ((ret = main_file_seek (xfile, size)) == 0 &&
+      SetEndOfFile (xfile->file) == 0)
+    {
+      ret = get_errno ();
+    }
+#endif
+
+  if (ret == 0) { ret = main_file_seek (xfile, size); }
+  if (ret) { XF_ERROR ("truncate", xfile->filename, ret); }
+  else     { xfile->nwrite = size; }
+  return ret;
+}
+
+/* Writes a decoded window, seeking over aligned blocks of zeros so
+ * that a regular output file is left with holes.  Only used when
+ * main_file_open() created or truncated the output (sparse_ok);
+ * standard output, which may be a pipe, a file opened for append or
+ * one with existing contents, is written in full.  Still falls back to
+ * a plain write if a seek fails. */
+static int
+main_file_write_sparse (main_file *ofile, uint8_t *buf, usize_t size)
+{
+  xoff_t  base = ofile->nwrite;
+  usize_t start = 0;
+  usize_t pos = 0;
+  int ret;
+
+  while (pos < size && ! ofile->seek_failed)
+    {
+      usize_t blk = MAIN_SPARSE_BLKSIZE -
+	(usize_t) ((base + pos) % MAIN_SPARSE_BLKSIZE);
+
+      if (blk > size - pos)
+	{
+	  break;
+	}
+
+      if (blk == MAIN_SPARSE_BLKSIZE &&
+	  xd3_runlen (buf + pos, blk, 0) == blk)
+	{
+	  if (pos > start)
+	    {
+	      if ((ret = main_file_write (ofile, buf + start, pos - start,
+					  "write failed")))
+		{
+		  return ret;
+		}
+	      ofile->sparse_hole = 0;
+	    }
+
+	  start = pos;
+
+	  if (main_file_seek (ofile, base + pos + blk) != 0)
+	    {
+	      ofile->seek_failed = 1;
+	      break;
+	    }
+
+	  ofile->nwrite += blk;
+	  ofile->sparse_hole = 1;
+	  start = pos + blk;
+	}
+
+      pos += blk;
+    }
+
+  if (size > start)
+    {
+      if ((ret = main_file_write (ofile, buf + start, size - start,
+				  "write failed")))
+	{
+	  return ret;
+	}
+      ofile->sparse_hole = 0;
+    }
+
+  return 0;
+}
+
+/* A hole at the end of the output has no data written after it, so
+ * write its last zero byte to extend the file to its full length. */
+static int
+main_file_sparse_finish (main_file *ofile)
+{
+  uint8_t zero = 0;
+  int ret;
+
+  if (! ofile->sparse_hole)
+    {
+      return 0;
+    }
+
+  ofile->sparse_hole = 0;
+  ofile->nwrite -= 1;
+
+  if ((ret = main_file_seek (ofile, ofile->nwrite)))
+    {
+      XPR(NT "seek failed: %s: %s\n", ofile->filename, xd3_mainerror (ret));
+      return ret;
+    }
+
+  return main_file_write (ofile, & zero, 1, "write failed");
+}
+
 /* This function simply writes the stream output buffer, if there is
  * any, for encode, decode and recode commands.  (The VCDIFF tools use
  * main_print_func()). */
@@ -1162,6 +1553,12 @@ main_write_output (xd3_stream* stream, main_file *ofile)
       return 0;
     }
 
+  if (option_sparse && ofile->sparse_ok)
+    {
+      return main_file_write_sparse (ofile, stream->next_out,
+				     stream->avail_out);
+    }
+
   if (stream->avail_out > 0 &&
       (ret = main_file_write (ofile, stream->next_out,
 			      stream->avail_out, "write failed")))
@@ -1172,6 +1569,21 @@ main_write_output (xd3_stream* stream, main_file *ofile)
   return 0;
 }
 
+/* Writes a decoded window, undoing the --bcj filter first.  The
+ * window is filtered in place, the decoder never copies from it
+ * because xdelta3 does not use VCD_TARGET. */
+static int
+main_decode_output (xd3_stream* stream, main_file *ofile)
+{
+  if (option_bcj != MAIN_BCJ_NONE && ! option_no_output)
+    {
+      main_bcj_filter (option_bcj, stream->next_out, stream->avail_out,
+		       stream->dec_winstart, 0);
+    }
+
+  return main_write_output (stream, ofile);
+}
+
 static int
 main_set_secondary_flags (xd3_config *config)
 {
@@ -1246,13 +1658,6 @@ main_set_secondary_flags (xd3_config *config)
   return 0;
 }
 
-/******************************************************************
- VCDIFF TOOLS
- *****************************************************************/
-
-#if VCDIFF_TOOLS
-#include "xdelta3-merge.h"
-
 /* The following macros let VCDIFF print using main_file_write(),
  * for example:
  *
@@ -1274,6 +1679,23 @@ main_print_overflow (int x)
   return XD3_INTERNAL;
 }
 
+#if XD3_ENCODER
+#include "xdelta3-sig.h"
+#endif
+
+/******************************************************************
+ VCDIFF TOOLS
+ *****************************************************************/
+
+#if VCDIFF_TOOLS
+#include "xdelta3-merge.h"
+#if XD3_ENCODER
+#include "xdelta3-train.h"
+#include "xdelta3-bench.h"
+#include "xdelta3-tune.h"
+#include "xdelta3-pick.h"
+#endif
+
 /* This function prints a single VCDIFF window. */
 static int
 main_print_window (xd3_stream* stream, main_file *xfile)
@@ -2464,6 +2886,14 @@ main_secondary_decompress_check (main_file  *file,
 	}
     }
 
+  /* Checkpoint offsets are offsets in the files as stored. */
+  if (decompressor != NULL && option_checkpoint != NULL)
+    {
+      XPR(NT "--checkpoint requires -D for externally compressed "
+	  "input: %s\n", file->filename);
+      return XD3_INVALID;
+    }
+
   if (decompressor != NULL)
     {
       if (! option_quiet)
@@ -2700,6 +3130,7 @@ main_set_appheader (xd3_stream *stream, main_file *input, main_file *sfile)
       const char *sname;
       const char *scomp;
       usize_t len;
+      usize_t i;
 
       iname = main_apphead_string (input->filename);
       icomp = (input->compressor == NULL) ? "" : input->compressor->ident;
@@ -2716,6 +3147,33 @@ main_set_appheader (xd3_stream *stream, main_file *input, main_file *sfile)
 	  sname = scomp = "";
 	}
 
+      /* Additional sources are listed by name, they are never
+       * decompressed. */
+      for (i = 0; i < srcset_extras; i += 1)
+	{
+	  len += (usize_t) strlen (main_apphead_string
+				   (srcset_extra[i].filename)) + 2;
+	}
+
+      /* The filter is a final "bcj/NAME" pair. */
+      if (option_bcj != MAIN_BCJ_NONE)
+	{
+	  len += (usize_t) strlen (main_bcj_names[option_bcj]) + 5;
+	}
+
+      /* The --monotone distance is a final "mono/N" pair. */
+      if (option_monotone != 0)
+	{
+	  len += 6 + 20;
+	}
+
+      /* A window the decoder would reject by default is a final
+       * "win/N" pair. */
+      if (stream->winsize > XD3_HARDMAXWINSIZE)
+	{
+	  len += 5 + 10;
+	}
+
       if ((appheader_used = (uint8_t*) main_malloc (len)) == NULL)
 	{
 	  return ENOMEM;
@@ -2730,6 +3188,38 @@ main_set_appheader (xd3_stream *stream, main_file *input, main_file *sfile)
 	  snprintf_func ((char*)appheader_used, len, "%s/%s/%s/%s",
 		    iname, icomp, sname, scomp);
 	}
+
+      for (i = 0; i < srcset_extras; i += 1)
+	{
+	  usize_t used = (usize_t) strlen ((char*)appheader_used);
+
+	  snprintf_func ((char*)appheader_used + used, len - used, "/%s/",
+			 main_apphead_string (srcset_extra[i].filename));
+	}
+
+      if (option_bcj != MAIN_BCJ_NONE)
+	{
+	  usize_t used = (usize_t) strlen ((char*)appheader_used);
+
+	  snprintf_func ((char*)appheader_used + used, len - used, "/bcj/%s",
+			 main_bcj_names[option_bcj]);
+	}
+
+      if (option_monotone != 0)
+	{
+	  usize_t used = (usize_t) strlen ((char*)appheader_used);
+
+	  snprintf_func ((char*)appheader_used + used, len - used,
+			 "/mono/%"Q"u", option_monotone);
+	}
+
+      if (stream->winsize > XD3_HARDMAXWINSIZE)
+	{
+	  usize_t used = (usize_t) strlen ((char*)appheader_used);
+
+	  snprintf_func ((char*)appheader_used + used, len - used,
+			 "/win/%u", stream->winsize);
+	}
     }
 
   xd3_set_appheader (stream, appheader_used,
@@ -2813,11 +3303,13 @@ main_get_appheader (xd3_stream *stream, main_file *ifile,
       char *start = (char*)apphead;
       char *slash;
       int   place = 0;
-      char *parsed[4];
+      int   i;
+      char *parsed[6 + 2 * MAX_SRCSET_SIZE];
 
       memset (parsed, 0, sizeof (parsed));
 
-      while ((slash = strchr (start, '/')) != NULL)
+      while ((slash = strchr (start, '/')) != NULL &&
+	     place < (int) (sizeof (parsed) / sizeof (parsed[0])) - 1)
 	{
 	  *slash = 0;
 	  parsed[place++] = start;
@@ -2826,17 +3318,64 @@ main_get_appheader (xd3_stream *stream, main_file *ifile,
 
       parsed[place++] = start;
 
+      /* Ignore a header with too many or an odd number of fields. */
+      if (slash != NULL || (place & 1) != 0) { place = 0; }
+
+      /* Final "bcj/NAME", "mono/N" and "win/N" pairs name the
+       * executable filter, the --monotone distance and a window size
+       * above XD3_HARDMAXWINSIZE; no compressor is named like these. */
+      while (place >= 4)
+	{
+	  xoff_t mono;
+	  usize_t win;
+
+	  if (strcmp (parsed[place - 2], "bcj") == 0 &&
+	      (i = main_bcj_lookup (parsed[place - 1])) > 0)
+	    {
+	      if (option_bcj == MAIN_BCJ_NONE) { option_bcj = i; }
+	    }
+	  else if (strcmp (parsed[place - 2], "mono") == 0 &&
+		   main_monotone_parse (parsed[place - 1], & mono) == 0)
+	    {
+	      if (option_monotone == 0) { option_monotone = mono; }
+	    }
+	  else if (strcmp (parsed[place - 2], "win") == 0 &&
+		   main_winsize_parse (parsed[place - 1], & win) == 0)
+	    {
+	      stream->dec_maxwinsize = max (stream->dec_maxwinsize, win);
+	    }
+	  else
+	    {
+	      break;
+	    }
+
+	  place -= 2;
+	}
+
       /* First take the output parameters. */
-      if (place == 2 || place == 4)
+      if (place >= 2)
 	{
 	  main_get_appheader_params (output, parsed, 1, "output", ifile);
 	}
 
       /* Then take the source parameters. */
-      if (place == 4)
+      if (place >= 4)
 	{
 	  main_get_appheader_params (sfile, parsed+2, 0, "source", ifile);
 	}
+
+      /* Then the additional sources, in the order they were given. */
+      for (i = 6; i <= place; i += 2)
+	{
+	  if ((usize_t) (i - 6) / 2 == srcset_extras &&
+	      main_srcset_add (NULL) != 0)
+	    {
+	      break;
+	    }
+
+	  main_get_appheader_params (& srcset_extra[(i - 6) / 2],
+				     parsed + i - 2, 0, "source", ifile);
+	}
     }
 
   option_use_appheader = 0;
@@ -2881,7 +3420,19 @@ main_open_output (xd3_stream *stream, main_file *ofile)
       return 0;
     }
 
-  if (ofile->filename == NULL)
+#if EXTERNAL_COMPRESSION
+  /* Checked before the output is opened, which would truncate it. */
+  if (ofile->compressor != NULL && option_recompress_outputs == 1 &&
+      option_checkpoint != NULL)
+    {
+      XPR(NT "--checkpoint requires -R for externally compressed "
+	  "output: %s\n", ofile->filename != NULL ?
+	  ofile->filename : "(stdout)");
+      return XD3_INVALID;
+    }
+#endif
+
+  if (ofile->filename == NULL)
     {
       XSTDOUT_XF (ofile);
 
@@ -2890,6 +3441,14 @@ main_open_output (xd3_stream *stream, main_file *ofile)
 	  XPR(NT "using standard output: %s\n", ofile->filename);
 	}
     }
+  else if (option_resume)
+    {
+      /* main_resume() truncates it. */
+      if ((ret = main_file_open (ofile, ofile->filename, XO_RESUME)))
+	{
+	  return ret;
+	}
+    }
   else
     {
       /* Stat the file to check for overwrite. */
@@ -2934,6 +3493,53 @@ main_open_output (xd3_stream *stream, main_file *ofile)
   return 0;
 }
 
+#include "xdelta3-checkpoint.h"
+
+#if XD3_ENCODER
+/* Replaces -W, -B, -P and -I with the configuration that
+ * xd3_config_memory_limit() chooses for --memory-limit. */
+static int
+main_memory_limit (xd3_config *config, int stream_flags, main_file *sfile)
+{
+  xd3_config tmp = *config;
+  int has_source = (sfile != NULL && sfile->filename != NULL);
+  xoff_t srcwinsz = 0;
+  xoff_t estimate = 0;
+
+  tmp.flags = stream_flags;
+
+  if (main_set_secondary_flags (& tmp) != 0 ||
+      xd3_config_memory_limit (& tmp, option_memory_limit,
+			       has_source ? & srcwinsz : NULL) != 0 ||
+      (has_source && srcwinsz < XD3_MINSRCWINSZ) ||
+      xd3_config_memory (& tmp, srcwinsz, & estimate) != 0)
+    {
+      XPR(NT "--memory-limit: %"Q"u bytes is too small\n",
+	  option_memory_limit);
+      return EXIT_FAILURE;
+    }
+
+  option_winsize = config->winsize = tmp.winsize;
+  option_sprevsz = config->sprevsz = tmp.sprevsz;
+  option_iopt_size = config->iopt_size = tmp.iopt_size;
+
+  if (has_source)
+    {
+      option_srcwinsz = srcwinsz;
+    }
+
+  if (option_verbose)
+    {
+      XPR(NT "memory limit %"Q"u: -W %u -B %"Q"u -P %u -I %u "
+	  "(estimated %"Q"u bytes)\n", option_memory_limit,
+	  option_winsize, srcwinsz, option_sprevsz, option_iopt_size,
+	  estimate);
+    }
+
+  return 0;
+}
+#endif
+
 static usize_t
 main_get_winsize (main_file *ifile) {
   xoff_t file_size = 0;
@@ -2957,6 +3563,232 @@ main_get_winsize (main_file *ifile) {
   return size;
 }
 
+/* Formats the xd3_perf counters as JSON members, for --perf and
+ * --stats-json. */
+static void
+main_format_perf (xd3_stream *stream, char *buf, int size)
+{
+  const xd3_perf *perf = xd3_get_perf (stream);
+
+  xsnprintf_func (buf, size,
+		  "\"t_read\":%"Q"u,\"t_write\":%"Q"u,\"t_getblk\":%"Q"u,"
+		  "\"t_srcindex\":%"Q"u,\"t_match\":%"Q"u,"
+		  "\"t_extend\":%"Q"u,\"t_iopt\":%"Q"u,"
+		  "\"t_secondary\":%"Q"u,"
+		  "\"small_fill\":%u,\"small_size\":%u,"
+		  "\"small_collide\":%"Q"u,"
+		  "\"large_fill\":%u,\"large_size\":%u,"
+		  "\"large_collide\":%"Q"u,"
+		  "\"chain_steps\":%"Q"u,\"lazy_retries\":%"Q"u,"
+		  "\"blk_hits\":%"Q"u,\"blk_misses\":%"Q"u",
+		  main_winstats.t_read, main_winstats.t_write,
+		  perf->t_getblk, perf->t_srcindex, perf->t_match,
+		  perf->t_extend, perf->t_iopt, perf->t_secondary,
+		  perf->small_fill, stream->small_hash.size,
+		  perf->small_collide,
+		  perf->large_fill, stream->large_hash.size,
+		  perf->large_collide,
+		  perf->chain_steps, perf->lazy_retries,
+		  perf->blk_hits, perf->blk_misses);
+}
+
+/* Opens the --stats-json output, a file name or a descriptor
+ * number.  It stays open until main_cleanup(), so several main_input()
+ * calls append to one file.  A descriptor is duplicated, so closing
+ * the stats file leaves the caller's descriptor open. */
+static int
+main_stats_open (void)
+{
+  main_file *xfile = & main_winstats.file;
+  const char *s = option_stats_json;
+  int ret;
+
+  main_file_init (xfile);
+
+  while (*s >= '0' && *s <= '9') { s += 1; }
+
+  if (*s != 0)
+    {
+      if ((ret = main_file_open (xfile, option_stats_json, XO_WRITE)))
+	{
+	  return ret;
+	}
+    }
+  else
+    {
+#if XD3_POSIX || XD3_STDIO
+      int fd = dup (atoi (option_stats_json));
+
+      if (fd < 0)
+	{
+	  ret = get_errno ();
+	  XF_ERROR ("dup", option_stats_json, ret);
+	  return ret;
+	}
+#if XD3_POSIX
+      xfile->file = fd;
+#else
+      if ((xfile->file = fdopen (fd, "wb")) == NULL)
+	{
+	  ret = get_errno ();
+	  close (fd);
+	  XF_ERROR ("open", option_stats_json, ret);
+	  return ret;
+	}
+#endif
+#else
+      XPR(NT "--stats-json: file descriptors are not supported\n");
+      return XD3_INVALID;
+#endif
+      xfile->mode = XO_WRITE;
+      xfile->filename = option_stats_json;
+    }
+
+  if ((xfile->snprintf_buf =
+       (uint8_t*) main_malloc (SNPRINTF_BUFSIZE)) == NULL)
+    {
+      return ENOMEM;
+    }
+
+  return 0;
+}
+
+/* Called at each XD3_WINFINISH for --perf and --stats-json.  The
+ * source window comes from the encoder or decoder state, by cmd. */
+static int
+main_stats_window (xd3_cmd cmd, xd3_stream *stream)
+{
+  main_file *xfile = & main_winstats.file;
+  char perfbuf[512];
+  xoff_t now = xd3_perf_usecs ();
+  xoff_t usecs = now - main_winstats.t_window;
+  xoff_t this_in = stream->total_in - main_winstats.total_in;
+  xoff_t this_out = stream->total_out - main_winstats.total_out;
+  xoff_t srcbase = 0;
+  xoff_t srclen = 0;
+  int ret = 0;
+
+  main_format_perf (stream, perfbuf, sizeof (perfbuf));
+
+  if (option_perf)
+    {
+      XPR(NTR "{\"window\":%"Q"u,%s}\n", stream->current_window, perfbuf);
+    }
+
+  if (main_file_isopen (xfile))
+    {
+      if (IS_ENCODE (cmd))
+	{
+	  if (xd3_encoder_used_source (stream))
+	    {
+	      srcbase = xd3_encoder_srcbase (stream);
+	      srclen  = xd3_encoder_srclen (stream);
+	    }
+	}
+      else if (stream->dec_win_ind & VCD_SOURCE)
+	{
+	  srcbase = stream->dec_cpyoff;
+	  srclen  = stream->dec_cpylen;
+	}
+
+      VC(UT "{\"type\":\"window\",\"window\":%"Q"u,"
+	 "\"in\":%"Q"u,\"out\":%"Q"u,"
+	 "\"srcbase\":%"Q"u,\"srclen\":%"Q"u,"
+	 "\"n_scpy\":%"Q"u,\"l_scpy\":%"Q"u,"
+	 "\"n_tcpy\":%"Q"u,\"l_tcpy\":%"Q"u,"
+	 "\"n_add\":%"Q"u,\"l_add\":%"Q"u,"
+	 "\"n_run\":%"Q"u,\"l_run\":%"Q"u,"
+	 "\"usecs\":%"Q"u,\"in_rate\":%"Q"u,",
+	 stream->current_window, this_in, this_out, srcbase, srclen,
+	 stream->n_scpy - main_winstats.n_scpy,
+	 stream->l_scpy - main_winstats.l_scpy,
+	 stream->n_tcpy - main_winstats.n_tcpy,
+	 stream->l_tcpy - main_winstats.l_tcpy,
+	 stream->n_add - main_winstats.n_add,
+	 stream->l_add - main_winstats.l_add,
+	 stream->n_run - main_winstats.n_run,
+	 stream->l_run - main_winstats.l_run,
+	 usecs, usecs ? this_in * 1000000 / usecs : 0)VE;
+      VC(UT "%s}\n", perfbuf)VE;
+    }
+
+  main_winstats.t_window = now;
+  main_winstats.t_read = 0;
+  main_winstats.t_write = 0;
+  main_winstats.total_in = stream->total_in;
+  main_winstats.total_out = stream->total_out;
+  main_winstats.n_scpy = stream->n_scpy;
+  main_winstats.l_scpy = stream->l_scpy;
+  main_winstats.n_tcpy = stream->n_tcpy;
+  main_winstats.l_tcpy = stream->l_tcpy;
+  main_winstats.n_add = stream->n_add;
+  main_winstats.l_add = stream->l_add;
+  main_winstats.n_run = stream->n_run;
+  main_winstats.l_run = stream->l_run;
+  return 0;
+}
+
+/* Writes the --stats-json summary for one main_input() call. */
+static int
+main_stats_summary (xd3_stream *stream)
+{
+  main_file *xfile = & main_winstats.file;
+  xoff_t usecs = xd3_perf_usecs () - main_winstats.t_start;
+  int ret = 0;
+
+  if (! main_file_isopen (xfile))
+    {
+      return 0;
+    }
+
+  VC(UT "{\"type\":\"summary\",\"windows\":%"Q"u,"
+     "\"in\":%"Q"u,\"out\":%"Q"u,"
+     "\"n_scpy\":%"Q"u,\"l_scpy\":%"Q"u,"
+     "\"n_tcpy\":%"Q"u,\"l_tcpy\":%"Q"u,"
+     "\"n_add\":%"Q"u,\"l_add\":%"Q"u,"
+     "\"n_run\":%"Q"u,\"l_run\":%"Q"u,"
+     "\"usecs\":%"Q"u,\"in_rate\":%"Q"u}\n",
+     stream->current_window, stream->total_in, stream->total_out,
+     stream->n_scpy, stream->l_scpy, stream->n_tcpy, stream->l_tcpy,
+     stream->n_add, stream->l_add, stream->n_run, stream->l_run,
+     usecs, usecs ? stream->total_in * 1000000 / usecs : 0)VE;
+
+  return 0;
+}
+
+#if XD3_ENCODER
+/* Prints the --estimate result on standard output. */
+static int
+main_print_estimate (xd3_stream *stream)
+{
+  main_file tfile;
+  main_file *xfile = & tfile;
+  int ret;
+
+  main_file_init (& tfile);
+
+  if ((tfile.snprintf_buf = (uint8_t*) main_malloc (SNPRINTF_BUFSIZE)) == NULL)
+    {
+      return ENOMEM;
+    }
+
+  XSTDOUT_XF (& tfile);
+
+  VC(UT "estimated size: %"Q"u bytes (input %"Q"u)\n",
+     stream->total_out, stream->total_in)VE;
+  VC(UT "source copies: %"Q"u (%"Q"u bytes)\n",
+     stream->n_scpy, stream->l_scpy)VE;
+  VC(UT "target copies: %"Q"u (%"Q"u bytes)\n",
+     stream->n_tcpy, stream->l_tcpy)VE;
+  VC(UT "adds: %"Q"u (%"Q"u bytes)\n", stream->n_add, stream->l_add)VE;
+  VC(UT "runs: %"Q"u (%"Q"u bytes)\n", stream->n_run, stream->l_run)VE;
+
+  /* Leave standard output open. */
+  main_free (tfile.snprintf_buf);
+  return 0;
+}
+#endif
+
 /*********************************************************************
  Main routines
  ********************************************************************/
@@ -2978,8 +3810,12 @@ main_input (xd3_cmd     cmd,
   int        stream_flags = 0;
   xd3_config config;
   xd3_source source;
+#if XD3_ENCODER
+  xd3_code_table_desc codetbl_desc;
+#endif
   xoff_t     last_total_in = 0;
   xoff_t     last_total_out = 0;
+  xoff_t     perf_t0;
   long       start_time;
   int        stdout_only = 0;
   int (*input_func) (xd3_stream*);
@@ -2994,12 +3830,14 @@ main_input (xd3_cmd     cmd,
 
   config.iopt_size = option_iopt_size;
   config.sprevsz = option_sprevsz;
+  config.anchor_interval = option_anchor_interval;
 
   do_src_fifo = 0;
 
   start_time = get_millisecs_now ();
 
   if (option_use_checksum) { stream_flags |= XD3_ADLER32; }
+  if (option_perf || option_stats_json) { stream_flags |= XD3_PERF; }
 
   /* main_input setup. */
   switch ((int) cmd)
@@ -3031,6 +3869,16 @@ main_input (xd3_cmd     cmd,
       if (cmd == CMD_RECODE) { output_func = main_recode_func; }
       else                   { output_func = main_merge_func; }
       break;
+
+#if XD3_ENCODER
+    case CMD_TRAIN_CODETABLE:
+      /* No source will be read */
+      stream_flags |= XD3_ADLER32_NOVER | XD3_SKIP_EMIT;
+      ifile->flags |= RD_NONEXTERNAL;
+      input_func  = xd3_decode_input;
+      output_func = main_train_func;
+      break;
+#endif
 #endif /* VCDIFF_TOOLS */
 
 #if XD3_ENCODER
@@ -3040,7 +3888,69 @@ main_input (xd3_cmd     cmd,
       output_func = main_write_output;
 
       if (option_no_compress)      { stream_flags |= XD3_NOCOMPRESS; }
+      if (option_estimate)         { stream_flags |= XD3_ESTIMATE; }
+      if (option_probe)            { stream_flags |= XD3_PROBE; }
+      if (option_monotone)         { stream_flags |= XD3_MONOTONE; }
       if (option_use_altcodetable) { stream_flags |= XD3_ALT_CODE_TABLE; }
+      if (option_signature)
+	{
+	  if (sfile->filename != NULL)
+	    {
+	      XPR(NT "--signature and -s cannot be used together\n");
+	      return EXIT_FAILURE;
+	    }
+
+	  if (main_sig_load (option_signature))
+	    {
+	      return EXIT_FAILURE;
+	    }
+
+	  input_func = main_sig_encode_input;
+	}
+      if (option_codetable)
+	{
+	  const char *s = option_codetable;
+	  char *e;
+	  int values[XD3_CODETBL_VARCNT];
+	  int got;
+
+	  for (got = 0; got < XD3_CODETBL_VARCNT; got += 1, s = e + 1)
+	    {
+	      values[got] = strtol (s, &e, 10);
+
+	      if ((values[got] < 0) ||
+		  (values[got] > 255) ||
+		  (e == s) ||
+		  (got < XD3_CODETBL_VARCNT-1 && *e == 0) ||
+		  (got == XD3_CODETBL_VARCNT-1 && *e != 0))
+		{
+		  XPR(NT "invalid code table specifier (--codetable) %d: %s\n",
+		      got, s);
+		  return EXIT_FAILURE;
+		}
+	    }
+
+	  memset (& codetbl_desc, 0, sizeof (codetbl_desc));
+	  codetbl_desc.add_sizes            = (uint8_t) values[0];
+	  codetbl_desc.near_modes           = (uint8_t) values[1];
+	  codetbl_desc.same_modes           = (uint8_t) values[2];
+	  codetbl_desc.cpy_sizes            = (uint8_t) values[3];
+	  codetbl_desc.addcopy_add_max      = (uint8_t) values[4];
+	  codetbl_desc.addcopy_near_cpy_max = (uint8_t) values[5];
+	  codetbl_desc.addcopy_same_cpy_max = (uint8_t) values[6];
+	  codetbl_desc.copyadd_add_max      = (uint8_t) values[7];
+	  codetbl_desc.copyadd_near_cpy_max = (uint8_t) values[8];
+	  codetbl_desc.copyadd_same_cpy_max = (uint8_t) values[9];
+
+	  if (xd3_init_code_table_desc (& codetbl_desc))
+	    {
+	      XPR(NT "invalid code table (--codetable): %s\n",
+		  option_codetable);
+	      return EXIT_FAILURE;
+	    }
+
+	  config.code_table_desc = & codetbl_desc;
+	}
       if (option_smatch_config)
 	{
 	  const char *s = option_smatch_config;
@@ -3101,21 +4011,52 @@ main_input (xd3_cmd     cmd,
       if (option_use_checksum == 0) { stream_flags |= XD3_ADLER32_NOVER; }
       ifile->flags |= RD_NONEXTERNAL;
       input_func    = xd3_decode_input;
-      output_func   = main_write_output;
+      output_func   = main_decode_output;
+      main_file_map (ifile);
       break;
     default:
       XPR(NT "internal error\n");
       return EXIT_FAILURE;
     }
 
-  main_bsize = winsize = main_get_winsize (ifile);
+#if XD3_ENCODER
+  if (cmd == CMD_ENCODE && option_memory_limit != 0 &&
+      main_memory_limit (& config, stream_flags, sfile) != 0)
+    {
+      return EXIT_FAILURE;
+    }
+#endif
+
+  winsize = main_get_winsize (ifile);
 
-  if ((main_bdata = (uint8_t*) main_bufalloc (winsize)) == NULL)
+  /* A mapped input is read in place and needs no input buffer. */
+  if (ifile->map == NULL)
+    {
+      if ((main_bdata = (uint8_t*) main_bufalloc (winsize)) == NULL)
+	{
+	  return EXIT_FAILURE;
+	}
+      main_bsize = winsize;
+    }
+
+  if (option_stats_json != NULL &&
+      ! main_file_isopen (& main_winstats.file) &&
+      main_stats_open () != 0)
     {
       return EXIT_FAILURE;
     }
 
+  /* Window deltas restart with each stream. */
+  main_winstats.t_start = main_winstats.t_window = xd3_perf_usecs ();
+  main_winstats.t_read = main_winstats.t_write = 0;
+  main_winstats.total_in = main_winstats.total_out = 0;
+  main_winstats.n_scpy = main_winstats.l_scpy = 0;
+  main_winstats.n_tcpy = main_winstats.l_tcpy = 0;
+  main_winstats.n_add = main_winstats.l_add = 0;
+  main_winstats.n_run = main_winstats.l_run = 0;
+
   config.winsize = winsize;
+  config.dec_maxwinsize = option_winsize;
   config.getblk = main_getblk_func;
   config.flags = stream_flags;
 
@@ -3163,6 +4104,17 @@ main_input (xd3_cmd     cmd,
 	}
     }
 
+  if (option_resume)
+    {
+      if (main_resume (& stream, cmd, ifile, ofile, sfile, & source) != 0)
+	{
+	  return EXIT_FAILURE;
+	}
+
+      last_total_in = stream.total_in;
+      last_total_out = stream.total_out;
+    }
+
   /* This times each window. */
   get_millisecs_since ();
 
@@ -3172,23 +4124,48 @@ main_input (xd3_cmd     cmd,
       xoff_t input_offset;
       xoff_t input_remain;
       usize_t try_read;
+      const uint8_t *input_buf = main_bdata;
 
       input_offset = ifile->nread;
 
-      input_remain = XOFF_T_MAX - input_offset;
-
-      try_read = (usize_t) min ((xoff_t) config.winsize, input_remain);
-
-      if ((ret = main_read_primary_input (ifile, main_bdata,
-					  try_read, & nread)))
+      if (ifile->map != NULL)
 	{
-	  return EXIT_FAILURE;
+	  /* The decoder takes the rest of a mapped input at once, so
+	   * no section straddles two inputs and none is copied. */
+	  input_remain = ifile->mapsize - input_offset;
+	  nread = (usize_t) min (input_remain, (xoff_t) MAIN_MAP_INPUT);
+	  input_buf = ifile->map + input_offset;
+	  ifile->nread += nread;
+
+	  if (nread == input_remain)
+	    {
+	      stream.flags |= XD3_FLUSH;
+	    }
 	}
-
-      /* If we've reached EOF tell the stream to flush. */
-      if (nread < try_read)
+      else
 	{
-	  stream.flags |= XD3_FLUSH;
+	  input_remain = XOFF_T_MAX - input_offset;
+
+	  try_read = (usize_t) min ((xoff_t) config.winsize, input_remain);
+
+	  perf_t0 = PERF_NOW (& stream);
+
+	  if ((ret = main_read_primary_input (ifile, main_bdata,
+					      try_read, & nread)))
+	    {
+	      return EXIT_FAILURE;
+	    }
+
+	  if (PERF_ON (& stream))
+	    {
+	      main_winstats.t_read += xd3_perf_usecs () - perf_t0;
+	    }
+
+	  /* If we've reached EOF tell the stream to flush. */
+	  if (nread < try_read)
+	    {
+	      stream.flags |= XD3_FLUSH;
+	    }
 	}
 
 #if XD3_ENCODER
@@ -3200,8 +4177,14 @@ main_input (xd3_cmd     cmd,
 	{
 	  return EXIT_FAILURE;
 	}
+
+      if (cmd == CMD_ENCODE && option_bcj != MAIN_BCJ_NONE)
+	{
+	  main_bcj_filter (option_bcj, main_bdata, (usize_t) nread,
+			   input_offset, 1);
+	}
 #endif
-      xd3_avail_input (& stream, main_bdata, nread);
+      xd3_avail_input (& stream, input_buf, nread);
 
       /* If we read zero bytes after encoding at least one window... */
       if (nread == 0 && stream.current_window > 0) {
@@ -3259,12 +4242,19 @@ main_input (xd3_cmd     cmd,
 		return EXIT_FAILURE;
 	      }
 
+	    perf_t0 = PERF_NOW (& stream);
+
 	    if ((ret = output_func (& stream, ofile)) &&
 		(ret != PRINTHDR_SPECIAL))
 	      {
 		return EXIT_FAILURE;
 	      }
 
+	    if (PERF_ON (& stream))
+	      {
+		main_winstats.t_write += xd3_perf_usecs () - perf_t0;
+	      }
+
 	    if (ret == PRINTHDR_SPECIAL)
 	      {
 		xd3_abort_stream (& stream);
@@ -3280,6 +4270,12 @@ main_input (xd3_cmd     cmd,
 
 	case XD3_WINFINISH:
 	  {
+	    if (PERF_ON (& stream) &&
+		(ret = main_stats_window (cmd, & stream)))
+	      {
+		return EXIT_FAILURE;
+	      }
+
 	    if (IS_ENCODE (cmd) || cmd == CMD_DECODE || cmd == CMD_RECODE)
 	      {
 		if (! option_quiet && IS_ENCODE (cmd) &&
@@ -3349,6 +4345,12 @@ main_input (xd3_cmd     cmd,
 			    main_format_millis (millis, &tm));
 		      }
 		  }
+
+		if (option_checkpoint != NULL &&
+		    main_checkpoint_write (& stream, cmd, ofile) != 0)
+		  {
+		    return EXIT_FAILURE;
+		  }
 	      }
 	    goto again;
 	  }
@@ -3402,12 +4404,19 @@ done:
 
       /* Have to close the output before calling
        * main_external_compression_finish, or else it hangs. */
-      if (main_file_close (ofile) != 0)
+      if (main_file_sparse_finish (ofile) != 0 ||
+	  main_file_close (ofile) != 0)
 	{
 	  return EXIT_FAILURE;
 	}
     }
 
+  /* The output is complete, there is nothing to resume. */
+  if (option_checkpoint != NULL)
+    {
+      remove (option_checkpoint);
+    }
+
 #if EXTERNAL_COMPRESSION
   if ((ret = main_external_compression_finish ()))
     {
@@ -3422,6 +4431,18 @@ done:
       return EXIT_FAILURE;
     }
 
+  if ((ret = main_stats_summary (& stream)))
+    {
+      return EXIT_FAILURE;
+    }
+
+#if XD3_ENCODER
+  if (option_estimate && main_print_estimate (& stream))
+    {
+      return EXIT_FAILURE;
+    }
+#endif
+
 #if XD3_ENCODER
   if (option_verbose > 1 && cmd == CMD_ENCODE)
     {
@@ -3476,6 +4497,11 @@ main_cleanup (void)
   main_bsize = 0;
 
   main_lru_cleanup();
+  main_srcset_cleanup();
+
+#if XD3_ENCODER
+  main_sig_cleanup ();
+#endif
 
   if (recode_stream != NULL)
     {
@@ -3491,6 +4517,8 @@ main_cleanup (void)
       merge_stream = NULL;
     }
 
+  main_file_cleanup (& main_winstats.file);
+
   XD3_ASSERT (main_mallocs == 0);
 }
 
@@ -3604,14 +4632,109 @@ int main (int argc, char **argv)
   /* This doesn't use getopt() because it makes trouble for -P & python which
    * reenter main() and thus care about freeing all memory.  I never had much
    * trust for getopt anyway, it's too opaque.  This implements a fairly
-   * standard non-long-option getopt with support for named operations (e.g.,
-   * "xdelta3 [encode|decode|printhdr...] < in > out"). */
+   * standard getopt with support for named operations (e.g.,
+   * "xdelta3 [encode|decode|printhdr...] < in > out") and for the long
+   * options listed in main_longopts. */
   if (my_optstr)
     {
       if (*my_optstr == '-')    { my_optstr += 1; }
       else if (cmd == CMD_NONE) { goto nonflag; }
       else                      { my_optstr = NULL; }
     }
+
+  /* Long options: "--name=value" or "--name value". */
+  if (my_optstr && my_optstr[0] == '-' && my_optstr[1] != 0)
+    {
+      const main_longopt *lo;
+      const char *name = my_optstr + 1;
+      size_t namelen = strcspn (name, "=");
+
+      for (lo = main_longopts; lo->name != NULL; lo += 1)
+	{
+	  if (strlen (lo->name) == namelen &&
+	      strncmp (lo->name, name, namelen) == 0)
+	    {
+	      break;
+	    }
+	}
+
+      if (lo->name == NULL)
+	{
+	  XPR(NT "unrecognized option: --%s\n", name);
+	  ret = main_help (); goto exit;
+	}
+
+      if (name[namelen] == '=')
+	{
+	  if (! lo->has_arg)
+	    {
+	      XPR(NT "--%s: does not take an argument\n", lo->name);
+	      goto cleanup;
+	    }
+	  my_optarg = name + namelen + 1;
+	}
+      else if (lo->has_arg)
+	{
+	  if (my_optind >= argc - 1)
+	    {
+	      XPR(NT "--%s: requires an argument\n", lo->name);
+	      goto cleanup;
+	    }
+	  my_optarg = argv[++my_optind];
+	}
+
+      switch (lo->id)
+	{
+	case LONGOPT_CODETABLE: option_codetable = my_optarg; break;
+	case LONGOPT_PERF: option_perf = 1; break;
+	case LONGOPT_STATS_JSON: option_stats_json = my_optarg; break;
+	case LONGOPT_SIGNATURE: option_signature = my_optarg; break;
+	case LONGOPT_ANCHORS:
+	  {
+	    char *e;
+	    unsigned long x = strtoul (my_optarg, & e, 10);
+
+	    if (e == my_optarg || *e != 0 || x > USIZE_T_MAX)
+	      {
+		XPR(NT "--anchors: invalid integer: %s\n", my_optarg);
+		goto cleanup;
+	      }
+
+	    option_anchor_interval = (usize_t) x;
+	  }
+	  break;
+	case LONGOPT_ESTIMATE: option_estimate = 1; break;
+	case LONGOPT_PROBE: option_probe = 1; break;
+	case LONGOPT_SPARSE: option_sparse = 1; break;
+	case LONGOPT_BCJ:
+	  if ((option_bcj = main_bcj_lookup (my_optarg)) < 0)
+	    {
+	      XPR(NT "--bcj: unknown filter: %s\n", my_optarg);
+	      goto cleanup;
+	    }
+	  break;
+	case LONGOPT_MONOTONE:
+	  if (main_monotone_parse (my_optarg, & option_monotone) != 0)
+	    {
+	      XPR(NT "--monotone: distance must be 1 to %"Q"u: %s\n",
+		  (xoff_t) XD3_MAXSRCWINSZ / 2, my_optarg);
+	      goto cleanup;
+	    }
+	  break;
+	case LONGOPT_MEMORY_LIMIT:
+	  if (main_size_parse (my_optarg, & option_memory_limit) != 0)
+	    {
+	      XPR(NT "--memory-limit: invalid size: %s\n", my_optarg);
+	      goto cleanup;
+	    }
+	  break;
+	case LONGOPT_CHECKPOINT: option_checkpoint = my_optarg; break;
+	case LONGOPT_RESUME: option_resume = 1; break;
+	}
+
+      my_optind += 1;
+      goto takearg;
+    }
   while (my_optstr)
     {
       const char *s;
@@ -3695,6 +4818,10 @@ int main (int argc, char **argv)
 #endif
 	    }
 	  else if (strcmp (my_optstr, "config") == 0) { cmd = CMD_CONFIG; }
+#if XD3_ENCODER
+	  else if (strcmp (my_optstr, "signature") == 0)
+	    { cmd = CMD_SIGNATURE; }
+#endif
 #if REGRESSION_TEST
 	  else if (strcmp (my_optstr, "test") == 0) { cmd = CMD_TEST; }
 #endif
@@ -3706,6 +4833,15 @@ int main (int argc, char **argv)
 	    { cmd = CMD_PRINTDELTA; }
 	  else if (strcmp (my_optstr, "recode") == 0) { cmd = CMD_RECODE; }
 	  else if (strcmp (my_optstr, "merge") == 0) { cmd = CMD_MERGE; }
+#if XD3_ENCODER
+	  else if (strcmp (my_optstr, "train-codetable") == 0)
+	    { cmd = CMD_TRAIN_CODETABLE; }
+	  else if (strcmp (my_optstr, "bench") == 0) { cmd = CMD_BENCH; }
+	  else if (strcmp (my_optstr, "tune-smatcher") == 0)
+	    { cmd = CMD_TUNE_SMATCHER; }
+	  else if (strcmp (my_optstr, "pick-base") == 0)
+	    { cmd = CMD_PICK_BASE; }
+#endif
 #endif
 
 	  /* If no option was found and still no command, let the default
@@ -3799,7 +4935,7 @@ int main (int argc, char **argv)
 	  break;
 	case 'W':
 	  if ((ret = main_atou (my_optarg, & option_winsize, XD3_ALLOCSIZE,
-				XD3_HARDMAXWINSIZE, 'W')))
+				XD3_LARGEMAXWINSIZE, 'W')))
 	  {
 	    goto exit;
 	  }
@@ -3827,10 +4963,11 @@ int main (int argc, char **argv)
 #endif
 	  break;
 	case 's':
+	  /* Further sources are concatenated after the first. */
 	  if (sfilename != NULL)
 	    {
-	      XPR(NT "specify only one source file\n");
-	      goto cleanup;
+	      if (main_srcset_add (my_optarg)) { goto cleanup; }
+	      break;
 	    }
 
 	  sfilename = my_optarg;
@@ -3859,6 +4996,137 @@ int main (int argc, char **argv)
   argc -= my_optind;
   argv += my_optind;
 
+  if (option_bcj != MAIN_BCJ_NONE && ! IS_ENCODE (cmd) && cmd != CMD_DECODE)
+    {
+      XPR(NT "--bcj is only used when encoding or decoding\n");
+      goto cleanup;
+    }
+
+  /* Encoder windows must start on a filter block boundary. */
+  if (option_bcj != MAIN_BCJ_NONE)
+    {
+      option_winsize -= option_winsize % MAIN_BCJ_BLKSIZE;
+    }
+
+  if (option_monotone != 0 && ! IS_ENCODE (cmd) && cmd != CMD_DECODE)
+    {
+      XPR(NT "--monotone is only used when encoding or decoding\n");
+      goto cleanup;
+    }
+
+  if (option_sparse && cmd != CMD_DECODE)
+    {
+      XPR(NT "--sparse is only used when decoding\n");
+      goto cleanup;
+    }
+
+  if (option_checkpoint != NULL && ! IS_ENCODE (cmd) && cmd != CMD_DECODE)
+    {
+      XPR(NT "--checkpoint is only used when encoding or decoding\n");
+      goto cleanup;
+    }
+
+  if (option_resume && option_checkpoint == NULL)
+    {
+      XPR(NT "--resume requires --checkpoint\n");
+      goto cleanup;
+    }
+
+  if (srcset_extras != 0 && ! IS_ENCODE (cmd) && cmd != CMD_DECODE)
+    {
+      XPR(NT "multiple sources are only used when encoding or decoding\n");
+      goto cleanup;
+    }
+
+#if XD3_ENCODER
+  if (option_signature != NULL && cmd != CMD_ENCODE)
+    {
+      XPR(NT "--signature is only used when encoding\n");
+      goto cleanup;
+    }
+
+  /* Signatures are computed from the unfiltered source. */
+  if (option_signature != NULL && option_bcj != MAIN_BCJ_NONE)
+    {
+      XPR(NT "--signature and --bcj cannot be used together\n");
+      goto cleanup;
+    }
+
+  /* Signature matches are not limited by --monotone. */
+  if (option_signature != NULL && option_monotone != 0)
+    {
+      XPR(NT "--signature and --monotone cannot be used together\n");
+      goto cleanup;
+    }
+
+  if (option_signature != NULL && option_checkpoint != NULL)
+    {
+      XPR(NT "--signature and --checkpoint cannot be used together\n");
+      goto cleanup;
+    }
+
+  if (option_memory_limit != 0 && cmd != CMD_ENCODE)
+    {
+      XPR(NT "--memory-limit is only used when encoding\n");
+      goto cleanup;
+    }
+
+  if (option_probe && cmd != CMD_ENCODE)
+    {
+      XPR(NT "--probe is only used when encoding\n");
+      goto cleanup;
+    }
+
+  /* The estimate is printed instead of writing the delta. */
+  if (option_estimate)
+    {
+      if (cmd != CMD_ENCODE)
+	{
+	  XPR(NT "--estimate is only used when encoding\n");
+	  goto cleanup;
+	}
+
+      option_no_output = 1;
+    }
+
+  /* -s names the source, the remaining argument is the output. */
+  if (cmd == CMD_SIGNATURE)
+    {
+      ret = main_signature (argc, argv);
+      goto exit;
+    }
+#endif
+
+#if VCDIFF_TOOLS && XD3_ENCODER
+  /* The remaining arguments are all inputs. */
+  if (cmd == CMD_TRAIN_CODETABLE)
+    {
+      ret = main_train_codetable (argc, argv);
+      goto exit;
+    }
+
+  /* The remaining arguments are name=value parameters. */
+  if (cmd == CMD_BENCH)
+    {
+      ret = main_bench (argc, argv);
+      goto exit;
+    }
+
+  /* Parameters, then SOURCE TARGET pairs. */
+  if (cmd == CMD_TUNE_SMATCHER)
+    {
+      ret = main_tune_smatcher (argc, argv);
+      goto exit;
+    }
+
+  /* Parameters, then the target and its candidate sources. */
+  if (cmd == CMD_PICK_BASE)
+    {
+      ret = main_pick_base (argc, argv);
+      goto exit;
+    }
+#endif
+
   /* There may be up to two more arguments. */
   if (argc > 2)
     {
@@ -3991,9 +5259,21 @@ main_help (void)
   XPR(NTR "    decode      decompress the input\n");
   XPR(NTR "    encode      compress the input%s\n",
      XD3_ENCODER ? "" : " [Not compiled]");
+#if XD3_ENCODER
+  XPR(NTR "    signature   write a signature of the -s source for\n");
+  XPR(NTR "                encoding with --signature\n");
+#endif
 #if REGRESSION_TEST
   XPR(NTR "    test        run the builtin tests\n");
 #endif
+#if VCDIFF_TOOLS && XD3_ENCODER
+  XPR(NTR "    bench       time encoding and decoding of a synthetic\n");
+  XPR(NTR "                workload (see the manual page)\n");
+  XPR(NTR "    tune-smatcher  search -C settings on SOURCE TARGET\n");
+  XPR(NTR "                pairs and print tuned presets\n");
+  XPR(NTR "    pick-base   rank candidate sources for a target by\n");
+  XPR(NTR "                estimated delta size\n");
+#endif
 #if VCDIFF_TOOLS
   XPR(NTR "special commands for VCDIFF inputs:\n");
   XPR(NTR "    printdelta  print information about the entire delta\n");
@@ -4001,6 +5281,10 @@ main_help (void)
   XPR(NTR "    printhdrs   print information about all windows\n");
   XPR(NTR "    recode      encode with new application/secondary settings\n");
   XPR(NTR "    merge       merge VCDIFF inputs (see below)\n");
+#if XD3_ENCODER
+  XPR(NTR "    train-codetable  print a code table for --codetable\n");
+  XPR(NTR "                trained on the VCDIFF inputs\n");
+#endif
 #endif
   XPR(NTR "merge patches:\n");
   XPR(NTR "\n");
@@ -4023,12 +5307,14 @@ main_help (void)
 
   XPR(NTR "memory options:\n");
   XPR(NTR "   -B bytes     source window size\n");
-  XPR(NTR "   -W bytes     input window size\n");
+  XPR(NTR "   -W bytes     input window size (up to 1G), and the largest\n");
+  XPR(NTR "                window decoded if above 16M\n");
   XPR(NTR "   -P size      compression duplicates window\n");
   XPR(NTR "   -I size      instruction buffer size (0 = unlimited)\n");
 
   XPR(NTR "compression options:\n");
   XPR(NTR "   -s source    source file to copy from (if any)\n");
+  XPR(NTR "                (repeat to use several files as one)\n");
   XPR(NTR "   -S [djw|fgk] enable/disable secondary compression\n");
   XPR(NTR "   -N           disable small string-matching compression\n");
   XPR(NTR "   -D           disable external decompression (encode/decode)\n");
@@ -4038,6 +5324,37 @@ main_help (void)
   XPR(NTR "   -A [apphead] disable/provide application header (encode)\n");
   XPR(NTR "   -J           disable output (check/compute only)\n");
   XPR(NTR "   -T           use alternate code table (test)\n");
+  XPR(NTR "   --codetable=a,n,s,c,aa,an,as,ca,cn,cs\n");
+  XPR(NTR "                use a custom code table (encode)\n");
+  XPR(NTR "   --perf       print performance counters per window\n");
+  XPR(NTR "   --stats-json=FILE|FD\n");
+  XPR(NTR "                write statistics per window as JSON lines\n");
+  XPR(NTR "   --sparse     leave holes for zero blocks in the output\n");
+  XPR(NTR "                file (decode)\n");
+  XPR(NTR "   --bcj=x86|arm64\n");
+  XPR(NTR "                filter relative calls in executables, the\n");
+  XPR(NTR "                decoder reads the filter from the header\n");
+  XPR(NTR "   --monotone=N start source copies at most N bytes behind\n");
+  XPR(NTR "                earlier copies, so the decoder can read the\n");
+  XPR(NTR "                source in order with a 2N buffer\n");
+  XPR(NTR "   --checkpoint=FILE\n");
+  XPR(NTR "                record progress in FILE after each window\n");
+  XPR(NTR "   --resume     continue from the --checkpoint FILE\n");
+#if XD3_ENCODER
+  XPR(NTR "   --memory-limit=SIZE\n");
+  XPR(NTR "                choose -W, -B, -P and -I to fit the encoder\n");
+  XPR(NTR "                in SIZE bytes (K, M, G suffixes allowed)\n");
+  XPR(NTR "   --estimate   print the delta size without secondary\n");
+  XPR(NTR "                compression instead of writing it (encode)\n");
+  XPR(NTR "   --probe      compare the source in place first, for disk\n");
+  XPR(NTR "                images and other in-place changes (encode)\n");
+  XPR(NTR "   --anchors=N  index the source only at content-defined\n");
+  XPR(NTR "                anchors N bytes apart (encode)\n");
+  XPR(NTR "   --signature=FILE\n");
+  XPR(NTR "                encode against a source signature instead\n");
+  XPR(NTR "                of -s (encode); in a window with block\n");
+  XPR(NTR "                matches, the rest is stored as plain data\n");
+#endif
   XPR(NTR "   -m           arguments for \"merge\"\n");
 
   XPR(NTR "the XDELTA environment variable may contain extra args:\n");
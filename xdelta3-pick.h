@@ -0,0 +1,630 @@
+/* xdelta 3 - delta compression tools and library
+ * Copyright (C) 2007.  Joshua P. MacDonald
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* The "pick-base" command ranks candidate sources for a target by
+ * estimated delta size, without encoding:
+ *
+ *   xdelta3 pick-base [name=value ...] TARGET CANDIDATE [CANDIDATE ...]
+ *
+ *   k=256             sketch size
+ *   chunk=1024        average chunk size (a power of two)
+ *   cache=FILE        file to keep sketches in between runs
+ *
+ * Each file is cut into content-defined chunks, ending where the
+ * large rolling checksum (xd3_lcksum) of the last MAIN_PICK_LOOK bytes
+ * is an anchor (xd3_is_anchor), and each chunk is hashed with FNV-1a.
+ * The sketch of a file is the k smallest distinct chunk hashes (a
+ * bottom-k MinHash sketch).  The fraction of the target's chunks
+ * found in a candidate is estimated from the target hashes that are
+ * below the largest hash in the candidate's sketch, and the estimated
+ * delta size is the target size times the fraction not found.
+ *
+ * The cache holds one record per file, keyed by the name as given and
+ * checked against the file's size and modification time:
+ *
+ *   4 bytes   "XD3K"
+ *   4 bytes   version (1)
+ *   4 bytes   k
+ *   4 bytes   chunk size
+ *   per file: 2 bytes name length, the name, 8 bytes size, 8 bytes
+ *             mtime, 4 bytes hash count, then 8 bytes per hash
+ *
+ * Integers are big-endian, as in source signatures (xdelta3-sig.h). */
+
+#ifndef _XDELTA3_PICK_H_
+#define _XDELTA3_PICK_H_
+
+#define MAIN_PICK_VERSION     1
+#define MAIN_PICK_HDRSIZE     16
+#define MAIN_PICK_K           256
+#define MAIN_PICK_MAX_K       (1U << 16)
+#define MAIN_PICK_CHUNK       1024
+#define MAIN_PICK_LOOK        32
+#define MAIN_PICK_BUFSIZE     (1U << 20)
+
+typedef struct _main_pick_sketch main_pick_sketch;
+
+struct _main_pick_sketch
+{
+  const char *name;
+  xoff_t      size;
+  xoff_t      mtime;
+  uint64_t   *hashes;    /* ascending */
+  usize_t     count;
+  double      found;
+  xoff_t      estimate;
+};
+
+/* Returns the modification time used to validate cache records. */
+static int
+main_pick_mtime (main_file *xfile, xoff_t *mtime)
+{
+#if XD3_WIN32
+  FILETIME ft;
+  if (GetFileTime (xfile->file, NULL, NULL, & ft) == 0)
+    {
+      return get_errno ();
+    }
+  (*mtime) = ((xoff_t) ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+#else
+  struct stat sbuf;
+  if (fstat (XFNO (xfile), & sbuf) < 0)
+    {
+      return get_errno ();
+    }
+  (*mtime) = (xoff_t) sbuf.st_mtime;
+#endif
+  return 0;
+}
+
+/* Adds a chunk hash to a bottom-k sketch. */
+static void
+main_pick_insert (main_pick_sketch *sk, usize_t k, uint64_t h)
+{
+  usize_t lo = 0, hi = sk->count;
+
+  if (sk->count == k && h >= sk->hashes[k - 1])
+    {
+      return;
+    }
+
+  while (lo < hi)
+    {
+      usize_t mid = lo + (hi - lo) / 2;
+
+      if (sk->hashes[mid] < h) { lo = mid + 1; }
+      else                     { hi = mid; }
+    }
+
+  if (lo < sk->count && sk->hashes[lo] == h)
+    {
+      return;
+    }
+
+  if (sk->count < k) { sk->count += 1; }
+
+  memmove (sk->hashes + lo + 1, sk->hashes + lo,
+	   sizeof (uint64_t) * (sk->count - 1 - lo));
+  sk->hashes[lo] = h;
+}
+
+/* Reads a file and computes its sketch.  The last MAIN_PICK_LOOK bytes
+ * of each read are kept at the front of the buffer so that the
+ * rolling checksum can continue across reads. */
+static int
+main_pick_sketch_file (main_file *file, main_pick_sketch *sk,
+		       usize_t k, usize_t shift, usize_t chunk,
+		       uint8_t *buf)
+{
+  uint64_t h = MAIN_SIG_FNV_BASIS;
+  uint32_t cksum = 0;
+  usize_t len = 0, keep = 0;
+  xoff_t total = 0;
+  size_t nread;
+  int ret;
+
+  sk->count = 0;
+
+  do
+    {
+      usize_t i, end;
+
+      if ((ret = main_file_read (file, buf + keep, MAIN_PICK_BUFSIZE,
+				 & nread, "read failed")))
+	{
+	  return ret;
+	}
+
+      end = keep + (usize_t) nread;
+
+      for (i = keep; i < end; i += 1)
+	{
+	  h = (h ^ buf[i]) * MAIN_SIG_FNV_PRIME;
+	  len += 1;
+	  total += 1;
+
+	  if (total < MAIN_PICK_LOOK)
+	    {
+	      continue;
+	    }
+
+	  if (total == MAIN_PICK_LOOK)
+	    {
+	      cksum = xd3_lcksum (buf + i + 1 - MAIN_PICK_LOOK, MAIN_PICK_LOOK);
+	    }
+	  else
+	    {
+	      cksum = xd3_large_cksum_update (cksum, buf + i - MAIN_PICK_LOOK,
+					      MAIN_PICK_LOOK);
+	    }
+
+	  /* Chunks are between chunk/4 and chunk*4 bytes. */
+	  if ((len >= chunk / 4 && xd3_is_anchor (cksum, shift)) ||
+	      len >= chunk * 4)
+	    {
+	      main_pick_insert (sk, k, h);
+	      h = MAIN_SIG_FNV_BASIS;
+	      len = 0;
+	    }
+	}
+
+      keep = min (end, (usize_t) MAIN_PICK_LOOK);
+      memmove (buf, buf + end - keep, keep);
+    }
+  while (nread == MAIN_PICK_BUFSIZE);
+
+  if (len > 0)
+    {
+      main_pick_insert (sk, k, h);
+    }
+
+  return 0;
+}
+
+/* Finds the record for sk in the cache and copies its hashes if the
+ * file has not changed.  Returns 0 when found. */
+static int
+main_pick_lookup (const uint8_t *cache, usize_t cache_size,
+		  main_pick_sketch *sk, usize_t k)
+{
+  const uint8_t *p = cache + MAIN_PICK_HDRSIZE;
+  const uint8_t *end = cache + cache_size;
+
+  while (end - p >= 2)
+    {
+      usize_t nlen = (usize_t) main_sig_get (p, 2);
+      usize_t count;
+
+      if ((usize_t) (end - p) < 2 + nlen + 20)
+	{
+	  break;
+	}
+
+      count = (usize_t) main_sig_get (p + 2 + nlen + 16, 4);
+
+      if ((usize_t) (end - p - 2 - nlen - 20) / 8 < count)
+	{
+	  break;
+	}
+
+      if (nlen == strlen (sk->name) &&
+	  memcmp (p + 2, sk->name, nlen) == 0 &&
+	  main_sig_get (p + 2 + nlen, 8) == (uint64_t) sk->size &&
+	  main_sig_get (p + 2 + nlen + 8, 8) == (uint64_t) sk->mtime &&
+	  count <= k)
+	{
+	  usize_t i;
+
+	  p += 2 + nlen + 20;
+	  for (i = 0; i < count; i += 1)
+	    {
+	      sk->hashes[i] = main_sig_get (p + 8 * i, 8);
+	    }
+	  sk->count = count;
+	  return 0;
+	}
+
+      p += 2 + nlen + 20 + 8 * count;
+    }
+
+  return 1;
+}
+
+static int
+main_pick_write_record (main_file *xfile, const main_pick_sketch *sk)
+{
+  uint8_t hdr[2 + 20];
+  uint8_t ent[8];
+  usize_t nlen = (usize_t) strlen (sk->name);
+  usize_t i;
+  int ret;
+
+  main_sig_put (hdr, nlen, 2);
+  if ((ret = main_file_write (xfile, hdr, 2, "cache write failed")) ||
+      (ret = main_file_write (xfile, (uint8_t*) sk->name, nlen,
+			      "cache write failed")))
+    {
+      return ret;
+    }
+
+  main_sig_put (hdr, sk->size, 8);
+  main_sig_put (hdr + 8, sk->mtime, 8);
+  main_sig_put (hdr + 16, sk->count, 4);
+  if ((ret = main_file_write (xfile, hdr, 20, "cache write failed")))
+    {
+      return ret;
+    }
+
+  for (i = 0; i < sk->count; i += 1)
+    {
+      main_sig_put (ent, sk->hashes[i], 8);
+      if ((ret = main_file_write (xfile, ent, 8, "cache write failed")))
+	{
+	  return ret;
+	}
+    }
+
+  return 0;
+}
+
+/* Rewrites the cache with the sketches of this run first, followed by
+ * the old records for other files. */
+static int
+main_pick_save (const char *name, const uint8_t *cache, usize_t cache_size,
+		main_pick_sketch *sks, usize_t n, usize_t k, usize_t chunk)
+{
+  main_file cfile;
+  uint8_t hdr[MAIN_PICK_HDRSIZE];
+  const uint8_t *p, *end;
+  usize_t i;
+  int ret;
+
+  main_file_init (& cfile);
+
+  if ((ret = main_file_open (& cfile, name, XO_WRITE)))
+    {
+      goto done;
+    }
+
+  memcpy (hdr, "XD3K", 4);
+  main_sig_put (hdr + 4, MAIN_PICK_VERSION, 4);
+  main_sig_put (hdr + 8, k, 4);
+  main_sig_put (hdr + 12, chunk, 4);
+
+  if ((ret = main_file_write (& cfile, hdr, MAIN_PICK_HDRSIZE,
+			      "cache write failed")))
+    {
+      goto done;
+    }
+
+  for (i = 0; i < n; i += 1)
+    {
+      if ((ret = main_pick_write_record (& cfile, & sks[i])))
+	{
+	  goto done;
+	}
+    }
+
+  p = (cache != NULL) ? cache + MAIN_PICK_HDRSIZE : NULL;
+  end = cache + cache_size;
+
+  while (p != NULL && end - p >= 2)
+    {
+      usize_t nlen = (usize_t) main_sig_get (p, 2);
+      usize_t rlen;
+
+      if ((usize_t) (end - p) < 2 + nlen + 20)
+	{
+	  break;
+	}
+
+      rlen = 2 + nlen + 20 + 8 * (usize_t) main_sig_get (p + 2 + nlen + 16, 4);
+
+      if ((usize_t) (end - p) < rlen)
+	{
+	  break;
+	}
+
+      for (i = 0; i < n; i += 1)
+	{
+	  if (nlen == strlen (sks[i].name) &&
+	      memcmp (p + 2, sks[i].name, nlen) == 0)
+	    {
+	      break;
+	    }
+	}
+
+      if (i == n &&
+	  (ret = main_file_write (& cfile, (uint8_t*) p, rlen,
+				  "cache write failed")))
+	{
+	  goto done;
+	}
+
+      p += rlen;
+    }
+
+  ret = main_file_close (& cfile);
+
+ done:
+  main_file_cleanup (& cfile);
+  return ret;
+}
+
+/* Estimates the fraction of the target's chunks found in a candidate.
+ * When the candidate's sketch is full, only target hashes below its
+ * largest hash can be compared. */
+static double
+main_pick_found (const main_pick_sketch *t, const main_pick_sketch *c,
+		 usize_t k)
+{
+  usize_t i = 0, j = 0, below = 0, both = 0;
+
+  while (i < t->count)
+    {
+      if (c->count == k && t->hashes[i] > c->hashes[k - 1])
+	{
+	  break;
+	}
+
+      while (j < c->count && c->hashes[j] < t->hashes[i]) { j += 1; }
+
+      if (j < c->count && c->hashes[j] == t->hashes[i]) { both += 1; }
+
+      below += 1;
+      i += 1;
+    }
+
+  return below == 0 ? 0.0 : (double) both / below;
+}
+
+static int
+main_pick_compare (const void *a, const void *b)
+{
+  const main_pick_sketch *x = *(const main_pick_sketch* const*) a;
+  const main_pick_sketch *y = *(const main_pick_sketch* const*) b;
+
+  if (x->estimate != y->estimate)
+    {
+      return x->estimate < y->estimate ? -1 : 1;
+    }
+
+  /* Keep the command-line order for ties. */
+  return x < y ? -1 : (x > y);
+}
+
+static int
+main_pick_print (main_file *xfile, main_pick_sketch **order, usize_t n)
+{
+  usize_t i;
+  int ret;
+
+  VC(UT "rank     estimate   found  candidate\n")VE;
+
+  for (i = 0; i < n; i += 1)
+    {
+      VC(UT "%4u %12"Q"u  %5.1f%%  %s\n", i + 1, order[i]->estimate,
+	 100.0 * order[i]->found, order[i]->name)VE;
+    }
+
+  return 0;
+}
+
+static int
+main_pick_base (int argc, char **argv)
+{
+  main_pick_sketch *sks = NULL;
+  main_pick_sketch **order = NULL;
+  main_file tfile, file;
+  usize_t k = MAIN_PICK_K, chunk = MAIN_PICK_CHUNK, bits, n = 0, i;
+  usize_t cache_size = 0, cached = 0;
+  uint8_t *cache = NULL;
+  uint8_t *buf = NULL;
+  const char *cache_name = NULL;
+  xoff_t t0 = xd3_perf_usecs ();
+  int ret = EXIT_FAILURE;
+  int a, err;
+
+  main_file_init (& tfile);
+  main_file_init (& file);
+
+  if ((sks = (main_pick_sketch*)
+       main_malloc (sizeof (main_pick_sketch) * (argc + 1))) == NULL ||
+      (order = (main_pick_sketch**)
+       main_malloc (sizeof (main_pick_sketch*) * (argc + 1))) == NULL)
+    {
+      goto done;
+    }
+
+  memset (sks, 0, sizeof (main_pick_sketch) * (argc + 1));
+
+  for (a = 0; a < argc; a += 1)
+    {
+      const char *val = strchr (argv[a], '=');
+
+      if (val == NULL)
+	{
+	  sks[n++].name = argv[a];
+	  continue;
+	}
+
+      val += 1;
+
+      if (strncmp (argv[a], "k=", 2) == 0)
+	{
+	  if (main_bench_size ("k", val, & k)) { goto done; }
+	}
+      else if (strncmp (argv[a], "chunk=", 6) == 0)
+	{
+	  if (main_bench_size ("chunk", val, & chunk)) { goto done; }
+	}
+      else if (strncmp (argv[a], "cache=", 6) == 0)
+	{
+	  cache_name = val;
+	}
+      else
+	{
+	  XPR(NT "pick-base: unrecognized parameter: %s\n", argv[a]);
+	  goto done;
+	}
+    }
+
+  if (n < 2)
+    {
+      XPR(NT "pick-base: requires a TARGET and CANDIDATE files\n");
+      goto done;
+    }
+
+  if (k == 0 || k > MAIN_PICK_MAX_K)
+    {
+      XPR(NT "pick-base: k must be between 1 and %u\n", MAIN_PICK_MAX_K);
+      goto done;
+    }
+
+  if (chunk < 64 || chunk > (1U << 24) ||
+      xd3_check_pow2 (chunk, & bits) != 0)
+    {
+      XPR(NT "pick-base: chunk must be a power of two from 64 to 16M\n");
+      goto done;
+    }
+
+  /* The cache is only used if it was written with the same k and chunk
+   * size. */
+  if (cache_name != NULL)
+    {
+      file.filename = cache_name;
+
+      if (main_file_exists (& file) &&
+	  (main_tune_read (cache_name, & cache, & cache_size) != 0 ||
+	   cache_size < MAIN_PICK_HDRSIZE ||
+	   memcmp (cache, "XD3K", 4) != 0 ||
+	   main_sig_get (cache + 4, 4) != MAIN_PICK_VERSION ||
+	   main_sig_get (cache + 8, 4) != k ||
+	   main_sig_get (cache + 12, 4) != chunk))
+	{
+	  if (! option_quiet)
+	    {
+	      XPR(NT "pick-base: ignoring cache: %s\n", cache_name);
+	    }
+	  main_buffree (cache);
+	  cache = NULL;
+	  cache_size = 0;
+	}
+
+      file.filename = NULL;
+    }
+
+  if ((buf = (uint8_t*) main_bufalloc (MAIN_PICK_BUFSIZE +
+				       MAIN_PICK_LOOK)) == NULL)
+    {
+      goto done;
+    }
+
+  for (i = 0; i < n; i += 1)
+    {
+      main_pick_sketch *sk = & sks[i];
+
+      if ((sk->hashes = (uint64_t*) main_malloc (sizeof (uint64_t) * k))
+	  == NULL)
+	{
+	  goto done;
+	}
+
+      main_file_init (& file);
+
+      /* main_file_open reports its own errors. */
+      if (main_file_open (& file, sk->name, XO_READ))
+	{
+	  goto done;
+	}
+
+      if ((err = main_file_stat (& file, & sk->size)) ||
+	  (err = main_pick_mtime (& file, & sk->mtime)))
+	{
+	  XPR(NT "pick-base: %s: %s\n", sk->name,
+	      err == ESPIPE ? "not a regular file" : xd3_mainerror (err));
+	  goto done;
+	}
+
+      if (cache != NULL && main_pick_lookup (cache, cache_size, sk, k) == 0)
+	{
+	  cached += 1;
+	}
+      else
+	{
+	  if (main_pick_sketch_file (& file, sk, k, 32 - bits, chunk, buf))
+	    {
+	      goto done;
+	    }
+	}
+
+      main_file_cleanup (& file);
+
+      if (i > 0)
+	{
+	  sk->found = main_pick_found (& sks[0], sk, k);
+	  sk->estimate = (xoff_t) (sks[0].size * (1.0 - sk->found));
+	  order[i - 1] = sk;
+	}
+    }
+
+  qsort (order, n - 1, sizeof (order[0]), main_pick_compare);
+
+  if ((tfile.snprintf_buf = (uint8_t*) main_malloc (SNPRINTF_BUFSIZE)) == NULL)
+    {
+      goto done;
+    }
+
+  XSTDOUT_XF (& tfile);
+
+  if (main_pick_print (& tfile, order, n - 1))
+    {
+      goto done;
+    }
+
+  if (option_verbose)
+    {
+      XPR(NT "pick-base: %u files, %u from cache, %.1f ms\n", n, cached,
+	  (double) (xd3_perf_usecs () - t0) / 1000.0);
+    }
+
+  if (cache_name != NULL && cached < n &&
+      main_pick_save (cache_name, cache, cache_size, sks, n, k, chunk))
+    {
+      goto done;
+    }
+
+  ret = 0;
+
+ done:
+  main_file_cleanup (& file);
+  main_file_cleanup (& tfile);
+  main_buffree (buf);
+  main_buffree (cache);
+
+  for (i = 0; sks != NULL && i < (usize_t) argc; i += 1)
+    {
+      main_free (sks[i].hashes);
+    }
+
+  main_free (sks);
+  main_free (order);
+  return ret;
+}
+
+#endif /* _XDELTA3_PICK_H_ */
@@ -253,7 +253,7 @@ xd3_encode_secondary (xd3_stream      *stream,
 
   int ret;
 
-  orig_size = xd3_sizeof_output (*head);
+  orig_size = xd3_sizeof_output_tail (*tail);
 
   if (orig_size < SECONDARY_MIN_INPUT) { return 0; }
 
@@ -278,17 +278,13 @@ xd3_encode_secondary (xd3_stream      *stream,
    * XD3_NOSECOND. */
 
   /* Setup tmp_tail, comp_size */
-  tmp_tail  = tmp_head;
-  comp_size = tmp_head->next;
+  for (tmp_tail = tmp_head;
+       tmp_tail->next_page != NULL;
+       tmp_tail = tmp_tail->next_page) { }
 
-  while (tmp_tail->next_page != NULL)
-    {
-      tmp_tail = tmp_tail->next_page;
-      comp_size += tmp_tail->next;
-    }
+  comp_size = xd3_sizeof_output_tail (tmp_tail);
 
   XD3_ASSERT (comp_size == xd3_sizeof_output (tmp_head));
-  XD3_ASSERT (tmp_tail != NULL);
 
   if (comp_size < (orig_size - SECONDARY_MIN_SAVINGS) || cfg->inefficient)
     {
@@ -296,7 +292,8 @@ xd3_encode_secondary (xd3_stream      *stream,
 		   orig_size - comp_size, orig_size, comp_size,
 	       100.0 * (double) comp_size / (double) orig_size));
 
-      xd3_free_output (stream, *head);
+      /* Recycle the replaced pages for the next window. */
+      xd3_freelist_output (stream, *head);
 
       *head = tmp_head;
       *tail = tmp_tail;
@@ -306,7 +303,7 @@ xd3_encode_secondary (xd3_stream      *stream,
     {
     getout:
       if (ret == XD3_NOSECOND) { ret = 0; }
-      xd3_free_output (stream, tmp_head);
+      xd3_freelist_output (stream, tmp_head);
     }
 
   return ret;
@@ -0,0 +1,544 @@
+/* xdelta 3 - delta compression tools and library
+ * Copyright (C) 2007.  Joshua P. MacDonald
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Signature-based encoding, for when the encoder cannot read the
+ * source.  "xdelta3 signature -s SOURCE [SIGFILE]" writes one weak and
+ * one strong hash for each full block of the source, and
+ * "xdelta3 -e --signature SIGFILE TARGET [DELTA]" finds block-sized
+ * source copies in the target using only those hashes, as rsync does.
+ * The delta is ordinary VCDIFF and is decoded with -d -s SOURCE.
+ *
+ * The signature format, with integers in big-endian order:
+ *
+ *   4 bytes   "XD3S"
+ *   4 bytes   version (1)
+ *   4 bytes   block size
+ *   8 bytes   source size
+ *   12 bytes  per full block: the xd3_lcksum() rolling checksum of
+ *             the block, then its 64-bit FNV-1a hash
+ *
+ * The block size is chosen so that there are at most
+ * MAIN_SIG_MAX_BLOCKS blocks.  Matches are found by rolling the weak
+ * checksum through each target window and confirming candidates with
+ * the strong hash; consecutive source blocks are joined into one
+ * copy.  The strong hash is not cryptographic, so window checksums
+ * (on unless -n is given) are what let the decoder detect a false
+ * match.  Windows with no block matches are left to the ordinary
+ * target-only string matcher. */
+
+#ifndef _XDELTA3_SIG_H_
+#define _XDELTA3_SIG_H_
+
+#define MAIN_SIG_VERSION       1
+#define MAIN_SIG_HDRSIZE       20
+#define MAIN_SIG_ENTSIZE       12
+#define MAIN_SIG_MIN_BLKSIZE   1024
+#define MAIN_SIG_MAX_BLOCKS    (1U << 20)
+#define MAIN_SIG_BUFENTS       4096
+
+/* 64-bit FNV-1a, also used for the chunk hashes of pick-base. */
+#define MAIN_SIG_FNV_BASIS     (((uint64_t) 0xcbf29ce4U << 32) | 0x84222325U)
+#define MAIN_SIG_FNV_PRIME     (((uint64_t) 1 << 40) | 0x1b3U)
+
+typedef struct _main_sig_info  main_sig_info;
+typedef struct _main_sig_match main_sig_match;
+
+struct _main_sig_match
+{
+  usize_t pos;
+  usize_t size;
+  xoff_t  addr;
+};
+
+struct _main_sig_info
+{
+  usize_t         blksize;
+  xoff_t          size;
+  usize_t         nblocks;
+  uint32_t       *weak;
+  uint64_t       *strong;
+  usize_t        *head;      /* block number + 1, by weak checksum */
+  usize_t        *next;      /* block number + 1, chained */
+  xd3_hash_cfg    hash;
+  main_sig_match *matches;
+  usize_t         nmatches;
+  xd3_source      source;
+};
+
+static main_sig_info main_sig;
+
+static uint64_t
+main_sig_strong (const uint8_t *p, usize_t n)
+{
+  uint64_t h = MAIN_SIG_FNV_BASIS;
+  usize_t i;
+
+  for (i = 0; i < n; i += 1)
+    {
+      h = (h ^ p[i]) * MAIN_SIG_FNV_PRIME;
+    }
+
+  return h;
+}
+
+static void
+main_sig_put (uint8_t *buf, uint64_t val, int bytes)
+{
+  int i;
+
+  for (i = bytes - 1; i >= 0; i -= 1)
+    {
+      buf[i] = (uint8_t) val;
+      val >>= 8;
+    }
+}
+
+static uint64_t
+main_sig_get (const uint8_t *buf, int bytes)
+{
+  uint64_t val = 0;
+  int i;
+
+  for (i = 0; i < bytes; i += 1)
+    {
+      val = (val << 8) | buf[i];
+    }
+
+  return val;
+}
+
+static usize_t
+main_sig_blksize (xoff_t size)
+{
+  usize_t blksize = MAIN_SIG_MIN_BLKSIZE;
+
+  while (blksize < XD3_HARDMAXWINSIZE &&
+	 size / blksize > MAIN_SIG_MAX_BLOCKS)
+    {
+      blksize <<= 1;
+    }
+
+  return blksize;
+}
+
+static void
+main_sig_cleanup (void)
+{
+  main_free (main_sig.weak);
+  main_free (main_sig.strong);
+  main_free (main_sig.head);
+  main_free (main_sig.next);
+  main_free (main_sig.matches);
+  memset (& main_sig, 0, sizeof (main_sig));
+}
+
+/* The "signature" command. */
+static int
+main_signature (int argc, char **argv)
+{
+  main_file sfile, ofile;
+  uint8_t *block = NULL;
+  uint8_t *out = NULL;
+  usize_t blksize, nblocks, i, outpos;
+  xoff_t size;
+  size_t nread;
+  int ret = EXIT_FAILURE;
+
+  main_file_init (& sfile);
+  main_file_init (& ofile);
+
+  if (option_source_filename == NULL || argc > 1)
+    {
+      XPR(NT "usage: signature -s SOURCE [SIGFILE]\n");
+      return EXIT_FAILURE;
+    }
+
+  if (main_file_open (& sfile, option_source_filename, XO_READ) ||
+      main_file_stat (& sfile, & size))
+    {
+      goto done;
+    }
+
+  blksize = main_sig_blksize (size);
+  nblocks = (usize_t) (size / blksize);
+
+  if ((block = (uint8_t*) main_bufalloc (blksize)) == NULL ||
+      (out = (uint8_t*) main_malloc (MAIN_SIG_ENTSIZE *
+				     MAIN_SIG_BUFENTS)) == NULL)
+    {
+      goto done;
+    }
+
+  if (argc == 1 && ! option_stdout)
+    {
+      ofile.filename = argv[0];
+
+      if (option_force == 0 && main_file_exists (& ofile))
+	{
+	  if (!option_quiet)
+	    {
+	      XPR(NT "to overwrite output file specify -f: %s\n",
+		  ofile.filename);
+	    }
+	  goto done;
+	}
+
+      if (main_file_open (& ofile, ofile.filename, XO_WRITE))
+	{
+	  goto done;
+	}
+    }
+  else
+    {
+      XSTDOUT_XF (& ofile);
+    }
+
+  memcpy (out, "XD3S", 4);
+  main_sig_put (out + 4, MAIN_SIG_VERSION, 4);
+  main_sig_put (out + 8, blksize, 4);
+  main_sig_put (out + 12, size, 8);
+
+  outpos = MAIN_SIG_HDRSIZE;
+
+  for (i = 0; i < nblocks; i += 1)
+    {
+      if (outpos + MAIN_SIG_ENTSIZE > MAIN_SIG_ENTSIZE * MAIN_SIG_BUFENTS)
+	{
+	  if (main_file_write (& ofile, out, outpos, "signature write"))
+	    {
+	      goto done;
+	    }
+	  outpos = 0;
+	}
+
+      if (main_file_read (& sfile, block, blksize, & nread, "source read"))
+	{
+	  goto done;
+	}
+
+      if (nread != blksize)
+	{
+	  XPR(NT "source changed size: %s\n", sfile.filename);
+	  goto done;
+	}
+
+      main_sig_put (out + outpos, xd3_lcksum (block, blksize), 4);
+      main_sig_put (out + outpos + 4, main_sig_strong (block, blksize), 8);
+      outpos += MAIN_SIG_ENTSIZE;
+    }
+
+  if (main_file_write (& ofile, out, outpos, "signature write"))
+    {
+      goto done;
+    }
+
+  if (option_verbose)
+    {
+      XPR(NT "signature: %u blocks of %u bytes\n", nblocks, blksize);
+    }
+
+  ret = main_file_close (& ofile) ? EXIT_FAILURE : EXIT_SUCCESS;
+
+ done:
+  main_buffree (block);
+  main_free (out);
+  main_file_cleanup (& sfile);
+  main_file_cleanup (& ofile);
+  return ret;
+}
+
+/* Reads a signature file and builds the weak checksum index. */
+static int
+main_sig_load (const char *name)
+{
+  main_file file;
+  uint8_t hdr[MAIN_SIG_HDRSIZE];
+  uint8_t *ents = NULL;
+  xoff_t fsize;
+  size_t nread;
+  usize_t i;
+  int ret;
+
+  main_file_init (& file);
+  main_sig_cleanup ();
+
+  if ((ret = main_file_open (& file, name, XO_READ)) ||
+      (ret = main_file_stat (& file, & fsize)) ||
+      (ret = main_file_read (& file, hdr, MAIN_SIG_HDRSIZE, & nread,
+			     "signature read")))
+    {
+      goto done;
+    }
+
+  ret = XD3_INVALID_INPUT;
+
+  if (nread != MAIN_SIG_HDRSIZE ||
+      memcmp (hdr, "XD3S", 4) != 0 ||
+      main_sig_get (hdr + 4, 4) != MAIN_SIG_VERSION)
+    {
+      XPR(NT "not a signature file: %s\n", name);
+      goto done;
+    }
+
+  main_sig.blksize = (usize_t) main_sig_get (hdr + 8, 4);
+  main_sig.size = main_sig_get (hdr + 12, 8);
+
+  if (main_sig.blksize < MAIN_SIG_MIN_BLKSIZE ||
+      main_sig.blksize > XD3_HARDMAXWINSIZE ||
+      main_sig.size / main_sig.blksize > MAIN_SIG_MAX_BLOCKS ||
+      fsize != MAIN_SIG_HDRSIZE +
+      (main_sig.size / main_sig.blksize) * MAIN_SIG_ENTSIZE)
+    {
+      XPR(NT "invalid signature file: %s\n", name);
+      goto done;
+    }
+
+  main_sig.nblocks = (usize_t) (main_sig.size / main_sig.blksize);
+  xd3_size_hashtable (NULL, max (main_sig.nblocks, 1U), & main_sig.hash);
+
+  ret = ENOMEM;
+
+  if ((ents = (uint8_t*) main_malloc (main_sig.nblocks * MAIN_SIG_ENTSIZE + 1))
+      == NULL ||
+      (main_sig.weak = (uint32_t*)
+       main_malloc (sizeof (uint32_t) * main_sig.nblocks + 1)) == NULL ||
+      (main_sig.strong = (uint64_t*)
+       main_malloc (sizeof (uint64_t) * main_sig.nblocks + 1)) == NULL ||
+      (main_sig.next = (usize_t*)
+       main_malloc (sizeof (usize_t) * main_sig.nblocks + 1)) == NULL ||
+      (main_sig.head = (usize_t*)
+       main_malloc (sizeof (usize_t) * main_sig.hash.size)) == NULL)
+    {
+      goto done;
+    }
+
+  if ((ret = main_file_read (& file, ents, main_sig.nblocks * MAIN_SIG_ENTSIZE,
+			     & nread, "signature read")))
+    {
+      goto done;
+    }
+
+  if (nread != main_sig.nblocks * MAIN_SIG_ENTSIZE)
+    {
+      XPR(NT "short signature file: %s\n", name);
+      ret = XD3_INVALID_INPUT;
+      goto done;
+    }
+
+  memset (main_sig.head, 0, sizeof (usize_t) * main_sig.hash.size);
+
+  /* Insert in reverse so that each chain lists lower blocks first. */
+  for (i = main_sig.nblocks; i-- != 0; )
+    {
+      const uint8_t *ent = ents + i * MAIN_SIG_ENTSIZE;
+      usize_t h;
+
+      main_sig.weak[i] = (uint32_t) main_sig_get (ent, 4);
+      main_sig.strong[i] = main_sig_get (ent + 4, 8);
+
+      h = xd3_checksum_hash (& main_sig.hash, main_sig.weak[i]);
+      main_sig.next[i] = main_sig.head[h];
+      main_sig.head[h] = i + 1;
+    }
+
+  main_sig.source.blksize = main_sig.blksize;
+  main_sig.source.name = name;
+
+  if (option_verbose > 1)
+    {
+      XPR(NT "signature: %u blocks of %u bytes\n",
+	  main_sig.nblocks, main_sig.blksize);
+    }
+
+ done:
+  main_free (ents);
+  main_file_cleanup (& file);
+  return ret;
+}
+
+/* Returns the source block matching the target bytes at P, or nblocks.
+ * EXPECT, the block after the previous match, is tried first so that
+ * runs of identical blocks still produce one long copy. */
+static usize_t
+main_sig_find (uint32_t weak, const uint8_t *p, usize_t expect)
+{
+  uint64_t strong = 0;
+  int have_strong = 0;
+  usize_t b;
+
+  if (expect < main_sig.nblocks && main_sig.weak[expect] == weak)
+    {
+      strong = main_sig_strong (p, main_sig.blksize);
+      have_strong = 1;
+
+      if (main_sig.strong[expect] == strong) { return expect; }
+    }
+
+  for (b = main_sig.head[xd3_checksum_hash (& main_sig.hash, weak)];
+       b != 0; b = main_sig.next[b - 1])
+    {
+      if (main_sig.weak[b - 1] != weak) { continue; }
+
+      if (! have_strong)
+	{
+	  strong = main_sig_strong (p, main_sig.blksize);
+	  have_strong = 1;
+	}
+
+      if (main_sig.strong[b - 1] == strong) { return b - 1; }
+    }
+
+  return main_sig.nblocks;
+}
+
+/* Called at XD3_WINSTART: finds the block copies in the window and
+ * hands them to the encoder in place of its own string matching, the
+ * way main_merge_output() does.  The string matcher is then skipped
+ * for the whole window, so the gaps between block copies are added
+ * as data rather than searched for target copies.  A window without
+ * block matches is matched as usual. */
+static int
+main_sig_window (xd3_stream *stream)
+{
+  const uint8_t *inp = stream->next_in;
+  usize_t len = stream->avail_in;
+  usize_t bs = main_sig.blksize;
+  usize_t limit = USIZE_T_MAX - stream->winsize;
+  usize_t pos = 0, expect = main_sig.nblocks, i;
+  xoff_t srcmin = 0, srcmax = 0;
+  uint32_t weak = 0;
+  const char *name;
+  int fresh = 1;
+  int ret;
+
+  stream->src = NULL;
+  main_sig.nmatches = 0;
+
+  if (main_sig.matches == NULL)
+    {
+      if ((main_sig.matches = (main_sig_match*)
+	   main_malloc (sizeof (main_sig_match) *
+			(stream->winsize / bs + 1))) == NULL)
+	{
+	  return ENOMEM;
+	}
+    }
+
+  while (main_sig.nblocks != 0 && pos + bs <= len)
+    {
+      usize_t blk;
+      xoff_t addr;
+
+      if (fresh)
+	{
+	  weak = xd3_lcksum (inp + pos, bs);
+	  fresh = 0;
+	}
+
+      blk = main_sig_find (weak, inp + pos, expect);
+      addr = (xoff_t) blk * bs;
+
+      if (blk < main_sig.nblocks &&
+	  (main_sig.nmatches == 0 ||
+	   max (srcmax, addr + bs) - min (srcmin, addr) <= limit))
+	{
+	  main_sig_match *m = main_sig.matches + main_sig.nmatches;
+
+	  if (main_sig.nmatches == 0)
+	    {
+	      srcmin = addr;
+	      srcmax = addr + bs;
+	    }
+	  else
+	    {
+	      srcmin = min (srcmin, addr);
+	      srcmax = max (srcmax, addr + bs);
+	    }
+
+	  if (main_sig.nmatches != 0 &&
+	      m[-1].pos + m[-1].size == pos &&
+	      m[-1].addr + m[-1].size == addr)
+	    {
+	      m[-1].size += bs;
+	    }
+	  else
+	    {
+	      m->pos = pos;
+	      m->size = bs;
+	      m->addr = addr;
+	      main_sig.nmatches += 1;
+	    }
+
+	  expect = blk + 1;
+	  pos += bs;
+	  fresh = 1;
+	  continue;
+	}
+
+      if (pos + bs == len) { break; }
+
+      weak = xd3_large_cksum_update (weak, inp + pos, bs);
+      pos += 1;
+    }
+
+  if (main_sig.nmatches == 0)
+    {
+      return 0;
+    }
+
+  /* Reset the per-window fields, keeping the name from main_sig_load. */
+  name = main_sig.source.name;
+  memset (& main_sig.source, 0, sizeof (main_sig.source));
+  main_sig.source.name = name;
+  main_sig.source.blksize = bs;
+  main_sig.source.srcbase = srcmin;
+  main_sig.source.srclen = (usize_t) (srcmax - srcmin);
+
+  stream->src = & main_sig.source;
+  stream->srcwin_decided = 1;
+  stream->taroff = main_sig.source.srclen;
+
+  for (i = 0; i < main_sig.nmatches; i += 1)
+    {
+      main_sig_match *m = & main_sig.matches[i];
+
+      if ((ret = xd3_found_match (stream, m->pos, m->size, m->addr, 1)))
+	{
+	  return ret;
+	}
+    }
+
+  stream->enc_state = ENC_INSTR;
+  return 0;
+}
+
+/* The input function for "-e --signature". */
+static int
+main_sig_encode_input (xd3_stream *stream)
+{
+  int ret = xd3_encode_input (stream);
+
+  if (ret == XD3_WINSTART && (ret = main_sig_window (stream)) == 0)
+    {
+      ret = XD3_WINSTART;
+    }
+
+  return ret;
+}
+
+#endif /* _XDELTA3_SIG_H_ */
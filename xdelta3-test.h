@@ -658,6 +658,53 @@ test_usize_t_overflow (xd3_stream *stream, int unused)
   return XD3_INTERNAL;
 }
 
+/* Checks that a chain's length, tracked from its tail, agrees with
+ * walking the pages, including after the pages are recycled. */
+static int
+test_output_chain_size (xd3_stream *stream, int unused)
+{
+  uint8_t buf[1000];
+  xd3_output *head;
+  xd3_output *tail;
+  usize_t total;
+  int round, i, ret;
+
+  memset (buf, 0x5a, sizeof (buf));
+
+  for (round = 0; round < 2; round += 1)
+    {
+      if ((head = tail = xd3_alloc_output (stream, NULL)) == NULL)
+	{
+	  return ENOMEM;
+	}
+
+      total = 0;
+
+      for (i = 0; total < 3 * XD3_ALLOCSIZE + 17; i += 1)
+	{
+	  usize_t size = 1 + (i * 37) % sizeof (buf);
+
+	  if ((ret = xd3_emit_bytes (stream, & tail, buf, size)))
+	    {
+	      xd3_free_output (stream, head);
+	      return ret;
+	    }
+
+	  total += size;
+
+	  CHECK (xd3_sizeof_output_tail (tail) == total);
+	}
+
+      CHECK (xd3_sizeof_output (head) == total);
+      CHECK (head->next_page != NULL);
+
+      /* The second round reuses these pages from the free list. */
+      xd3_freelist_output (stream, head);
+    }
+
+  return 0;
+}
+
 static int
 test_forward_match (xd3_stream *stream, int unused)
 {
@@ -757,7 +804,7 @@ test_address_cache (xd3_stream *stream, int unused)
     {
       uint32_t addr;
 
-      if ((ret = xd3_decode_address (stream, offset, modes[offset], & buf, buf_max, & addr))) { return ret; }
+      if ((ret = xd3_decode_address_generic (stream, offset, modes[offset], & buf, buf_max, & addr))) { return ret; }
 
       if (addr != addrs[offset])
 	{
@@ -789,6 +836,83 @@ test_address_cache (xd3_stream *stream, int unused)
   return 0;
 }
 
+/* The same cache is reset by advancing its generation rather than
+ * clearing it: check that stale entries read as zero, including
+ * across a wrap of the generation counter. */
+static int
+test_address_cache_generation (xd3_stream *stream, int unused)
+{
+  int ret;
+  usize_t i, same_size;
+  xd3_addr_cache *acache = & stream->acache;
+
+  stream->acache.s_near = stream->code_table_desc->near_modes;
+  stream->acache.s_same = stream->code_table_desc->same_modes;
+
+  if ((ret = xd3_encode_init_partial (stream))) { return ret; }
+
+  same_size = acache->s_same * 256;
+
+  if (same_size == 0)
+    {
+      return 0;
+    }
+
+  xd3_init_cache (acache);
+
+  for (i = 0; i < same_size; i += 1)
+    {
+      xd3_update_cache (acache, i + same_size);
+    }
+
+  for (i = 0; i < same_size; i += 1)
+    {
+      if (xd3_same_cache_get (acache, i) != i + same_size)
+	{
+	  stream->msg = "same cache entry lost";
+	  return XD3_INTERNAL;
+	}
+    }
+
+  xd3_init_cache (acache);
+
+  for (i = 0; i < same_size; i += 1)
+    {
+      if (xd3_same_cache_get (acache, i) != 0)
+	{
+	  stream->msg = "same cache entry survived reset";
+	  return XD3_INTERNAL;
+	}
+    }
+
+  /* Fill the cache in the last generation, then wrap. */
+  acache->generation = USIZE_T_MAX;
+
+  for (i = 0; i < same_size; i += 1)
+    {
+      xd3_update_cache (acache, i + same_size);
+    }
+
+  xd3_init_cache (acache);
+
+  if (acache->generation != 1)
+    {
+      stream->msg = "same cache generation did not wrap";
+      return XD3_INTERNAL;
+    }
+
+  for (i = 0; i < same_size; i += 1)
+    {
+      if (xd3_same_cache_get (acache, i) != 0)
+	{
+	  stream->msg = "same cache entry survived wrap";
+	  return XD3_INTERNAL;
+	}
+    }
+
+  return 0;
+}
+
 /***********************************************************************
  Encode and decode with single bit error
  ***********************************************************************/
@@ -1541,6 +1665,25 @@ test_choose_instruction (xd3_stream *stream, int ignore)
   return 0;
 }
 
+/* Test that the compile-time default table, which the specialized
+ * decoder reads, is the one its description generates. */
+static int
+test_rfc3284_code_table (xd3_stream *stream, int ignore)
+{
+  xd3_dinst table[256];
+
+  memset (table, 0, sizeof (table));
+  xd3_build_code_table (& __rfc3284_code_table_desc, table);
+
+  if (memcmp (table, __rfc3284_code_table, sizeof (table)) != 0)
+    {
+      stream->msg = "wrong default code table";
+      return XD3_INTERNAL;
+    }
+
+  return 0;
+}
+
 /***********************************************************************
  TEST INSTRUCTION TABLE CODING
  ***********************************************************************/
@@ -1577,6 +1720,191 @@ test_encode_code_table (xd3_stream *stream, int ignore)
 }
 #endif
 
+/* Test that a custom table described by xd3_code_table_desc is
+ * consistent with xd3_choose_instruction_desc(), that it is carried
+ * by the VCDIFF header, and that corrupt table encodings are
+ * rejected. */
+static int
+test_custom_code_table (xd3_stream *stream, int ignore)
+{
+  xd3_code_table_desc desc = __rfc3284_code_table_desc;
+  xd3_dinst table[256];
+  xd3_stream estream;
+  xd3_config cfg;
+  uint8_t encoded[4*sizeof (test_text)];
+  uint8_t decoded[sizeof (test_text)];
+  uint8_t corrupt[CODE_TABLE_VCDIFF_SIZE];
+  usize_t encoded_size, decoded_size;
+  const uint8_t *comp_data;
+  usize_t comp_size;
+  int i, ret;
+
+  /* The default description initializes to itself. */
+  CHECK (xd3_init_code_table_desc (& desc) == 0);
+  CHECK (memcmp (& desc, & __rfc3284_code_table_desc, sizeof (desc)) == 0);
+
+  /* Trade a same mode for a near mode, and the freed instructions for
+   * immediate adds. */
+  desc.near_modes = 5;
+  desc.same_modes = 2;
+  desc.add_sizes = 10;
+  CHECK (xd3_init_code_table_desc (& desc) == XD3_INVALID);
+  desc.add_sizes = 9;
+  CHECK (xd3_init_code_table_desc (& desc) == 0);
+
+  memset (table, 0, sizeof (table));
+  xd3_build_code_table (& desc, table);
+
+  for (i = 0; i < 256; i += 1)
+    {
+      const xd3_dinst *d = table + i;
+      xd3_rinst prev, inst;
+
+      memset (& prev, 0, sizeof (prev));
+      memset (& inst, 0, sizeof (inst));
+
+      if (d->type2 == 0)
+	{
+	  inst.type = d->type1;
+	  inst.size = d->size1 ? d->size1 : TESTBUFSIZE;
+	  xd3_choose_instruction_desc (& desc, NULL, & inst);
+	  CHECK (inst.code2 == 0 && inst.code1 == i);
+	}
+      else
+	{
+	  prev.type = d->type1;
+	  prev.size = d->size1;
+	  inst.type = d->type2;
+	  inst.size = d->size2;
+	  xd3_choose_instruction_desc (& desc, & prev, & inst);
+	  CHECK (prev.code2 == i);
+	}
+    }
+
+  /* Encode with the custom table, decode with a default stream. */
+  memset (& estream, 0, sizeof (estream));
+  xd3_init_config (& cfg, XD3_FLUSH);
+  cfg.code_table_desc = & desc;
+
+  if ((ret = xd3_config_stream (& estream, & cfg)) ||
+      (ret = xd3_encode_stream (& estream, test_text, sizeof (test_text),
+				encoded, & encoded_size, sizeof (encoded))) ||
+      (ret = xd3_close_stream (& estream)))
+    {
+      stream->msg = estream.msg;
+      goto fail;
+    }
+
+  CHECK ((encoded[4] & VCD_CODETABLE) != 0);
+
+  if ((ret = xd3_decode_memory (encoded, encoded_size, NULL, 0,
+				decoded, & decoded_size, sizeof (decoded), 0)))
+    {
+      goto fail;
+    }
+
+  if (decoded_size != sizeof (test_text) ||
+      memcmp (decoded, test_text, sizeof (test_text)) != 0)
+    {
+      stream->msg = "wrong custom code table decoding";
+      ret = XD3_INTERNAL;
+      goto fail;
+    }
+
+  /* The table encoding applies, and corrupt versions do not. */
+  if ((ret = xd3_compute_custom_table_encoding (& estream,
+						& comp_data, & comp_size)))
+    {
+      stream->msg = estream.msg;
+      goto fail;
+    }
+
+  stream->acache.s_near = desc.near_modes;
+  stream->acache.s_same = desc.same_modes;
+
+  if ((ret = xd3_apply_table_encoding (stream, comp_data, comp_size)))
+    {
+      goto fail;
+    }
+
+  CHECK (memcmp (stream->code_table, table, sizeof (table)) == 0);
+
+  memcpy (corrupt, comp_data, comp_size);
+  corrupt[4] |= VCD_CODETABLE;
+
+  if (xd3_apply_table_encoding (stream, corrupt, comp_size) !=
+	XD3_INVALID_INPUT ||
+      xd3_apply_table_encoding (stream, comp_data, 4) !=
+	XD3_INVALID_INPUT ||
+      xd3_apply_table_encoding (stream, comp_data, comp_size - 1) !=
+	XD3_INVALID_INPUT)
+    {
+      stream->msg = "corrupt code table accepted";
+      ret = XD3_INTERNAL;
+      goto fail;
+    }
+
+  ret = 0;
+ fail:
+  xd3_free_stream (& estream);
+  return ret;
+}
+
+/* Encodes with and without XD3_PERF: the counters are only collected
+ * when asked for, and describe the window's search. */
+static int
+test_perf_counters (xd3_stream *stream, int ignore)
+{
+  uint8_t encoded[4*sizeof (test_text)];
+  usize_t encoded_size;
+  xd3_perf zero;
+  int pass, ret;
+
+  memset (& zero, 0, sizeof (zero));
+
+  for (pass = 0; pass < 2; pass += 1)
+    {
+      xd3_stream estream;
+      xd3_config cfg;
+      const xd3_perf *perf;
+
+      memset (& estream, 0, sizeof (estream));
+      xd3_init_config (& cfg, XD3_FLUSH | (pass ? XD3_PERF : 0));
+
+      if ((ret = xd3_config_stream (& estream, & cfg)) ||
+	  (ret = xd3_encode_stream (& estream, test_text, sizeof (test_text),
+				    encoded, & encoded_size,
+				    sizeof (encoded))))
+	{
+	  stream->msg = estream.msg;
+	  xd3_free_stream (& estream);
+	  return ret;
+	}
+
+      perf = xd3_get_perf (& estream);
+
+      if (! pass || ! XD3_PERF_COUNTERS)
+	{
+	  CHECK (memcmp (perf, & zero, sizeof (zero)) == 0);
+	}
+      else
+	{
+	  /* The text repeats, so there are small matches, and every
+	   * match first tried a chain candidate. */
+	  CHECK (perf->small_fill > 0);
+	  CHECK (perf->small_fill <= estream.small_hash.size);
+	  CHECK (perf->small_fill + perf->small_collide <= sizeof (test_text));
+	  CHECK (perf->chain_steps >= estream.n_tcpy);
+	  CHECK (perf->large_fill == 0 && perf->blk_misses == 0);
+	}
+
+      xd3_close_stream (& estream);
+      xd3_free_stream (& estream);
+    }
+
+  return 0;
+}
+
 /***********************************************************************
  64BIT STREAMING
  ***********************************************************************/
@@ -2361,93 +2689,1444 @@ test_no_output (xd3_stream *stream, int ignore)
   return 0;
 }
 
-/***********************************************************************
- Source identical optimization
- ***********************************************************************/
-
-/* Computing a delta should be fastest when the two inputs are
- * identical, this checks it.  The library is called to compute a
- * delta between a 10000 byte file, 1000 byte winsize, 500 byte source
- * blocksize.  The same buffer is used for both source and target. */
+/* Counts the window and summary objects written by --stats-json, and
+ * copies the summary's instruction counts into counts. */
 static int
-test_identical_behavior (xd3_stream *stream, int ignore)
+test_count_stats_json (const char *file, xoff_t *windows, xoff_t *summaries,
+		       char *counts)
 {
-#define IDB_TGTSZ 10000  /* Not a power of two b/c of hard-coded expectations below. */
-#define IDB_BLKSZ 512
-#define IDB_WINSZ 1000
-#define IDB_DELSZ 1000
-#define IDB_WINCNT (IDB_TGTSZ / IDB_WINSZ)
+  char line[TESTBUFSIZE];
+  char *b, *e;
+  FILE *f;
 
-  int ret, i;
-  uint8_t buf[IDB_TGTSZ];
-  uint8_t del[IDB_DELSZ];
-  uint8_t rec[IDB_TGTSZ];
-  xd3_source source;
-  int nextencwin = 0;
-  int winstarts = 0, winfinishes = 0;
-  usize_t delpos = 0, recsize;
-  xd3_config config;
-  memset(&source, 0, sizeof(source));
+  *windows = *summaries = 0;
 
-  for (i = 0; i < IDB_TGTSZ; i += 1)
+  if ((f = fopen (file, "r")) == NULL)
     {
-      buf[i] = (uint8_t) mt_random (&static_mtrand);
+      return get_errno ();
     }
 
-  stream->winsize = IDB_WINSZ;
-
-  source.blksize  = IDB_BLKSZ;
-  source.name     = "";
-  source.curblk   = NULL;
-  source.curblkno = 0;
-
-  if ((ret = xd3_set_source (stream, & source))) { goto fail; }
-
-  /* Compute an delta between identical source and targets. */
-  for (;;)
+  while (fgets (line, sizeof (line), f) != NULL)
     {
-      ret = xd3_encode_input (stream);
+      CHECK (line[0] == '{' && strstr (line, "}\n") != NULL);
 
-      if (ret == XD3_INPUT)
+      if (strstr (line, "\"type\":\"window\"") != NULL)
 	{
-	  xd3_avail_input (stream, buf + (IDB_WINSZ * nextencwin), IDB_WINSZ);
-	  nextencwin += 1;
-	  continue;
+	  CHECK (strstr (line, "\"t_match\":") != NULL);
+	  *windows += 1;
 	}
-
-      if (ret == XD3_GETSRCBLK)
+      else if (strstr (line, "\"type\":\"summary\"") != NULL)
 	{
-	  source.curblkno = source.getblkno;
-	  source.onblk    = IDB_BLKSZ;
-	  source.curblk   = buf + source.getblkno * IDB_BLKSZ;
-	  continue;
+	  CHECK ((b = strstr (line, "\"n_scpy\":")) != NULL);
+	  CHECK ((e = strstr (line, ",\"usecs\":")) != NULL && e > b);
+	  memcpy (counts, b, e - b);
+	  counts[e - b] = 0;
+	  *summaries += 1;
 	}
+    }
 
-      if (ret == XD3_WINSTART)
-	{
-	  winstarts++;
-	  continue;
-	}
-      if (ret == XD3_WINFINISH)
-	{
-	  winfinishes++;
-	  if (winfinishes == IDB_WINCNT)
-	    {
-	      break;
-	    }
-	  continue;
-	}
+  fclose (f);
+  return 0;
+}
 
-      if (ret != XD3_OUTPUT) { goto fail; }
+/* Checks that train-codetable prints the default table when embedding
+ * a trained one would cost more header bytes than it saves, as it does
+ * for a small delta. */
+static int
+test_train_codetable (xd3_stream *stream, int ignore)
+{
+  int ret;
+  char buf[TESTBUFSIZE];
+  char line[TESTBUFSIZE];
+  xoff_t ssize, tsize;
+  FILE *f;
 
-      CHECK(delpos + stream->avail_out <= IDB_DELSZ);
+  test_setup ();
 
-      memcpy (del + delpos, stream->next_out, stream->avail_out);
+  if ((ret = test_make_inputs (stream, & ssize, & tsize))) { return ret; }
 
-      delpos += stream->avail_out;
+  snprintf_func (buf, TESTBUFSIZE, "%s -q -f -e -s %s %s %s", program_name,
+		 TEST_SOURCE_FILE, TEST_TARGET_FILE, TEST_DELTA_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
 
-      xd3_consume_output (stream);
-    }
+  snprintf_func (buf, TESTBUFSIZE, "%s train-codetable %s > %s",
+		 program_name, TEST_DELTA_FILE, TEST_RECON_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  if ((f = fopen (TEST_RECON_FILE, "r")) == NULL)
+    {
+      return get_errno ();
+    }
+
+  line[0] = 0;
+  ret = (fgets (line, sizeof (line), f) == NULL);
+  fclose (f);
+  CHECK (ret == 0);
+  CHECK (strcmp (line, "17,4,3,15,4,6,4,1,4,4\n") == 0);
+
+  snprintf_func (buf, TESTBUFSIZE, "%s train-codetable", program_name);
+  if ((ret = do_fail (stream, buf))) { return ret; }
+
+  test_cleanup ();
+  return 0;
+}
+
+/* Checks that --stats-json writes one object per window and a
+ * summary, to a named file and to a file descriptor, and that the
+ * decoder reports the same instruction counts as the encoder. */
+static int
+test_stats_json (xd3_stream *stream, int ignore)
+{
+  int ret;
+  char buf[TESTBUFSIZE];
+  char enc_counts[TESTBUFSIZE];
+  char dec_counts[TESTBUFSIZE];
+  xoff_t tsize, windows, summaries;
+
+  test_setup ();
+
+  if ((ret = test_make_inputs (stream, NULL, & tsize))) { return ret; }
+
+  snprintf_func (buf, TESTBUFSIZE,
+		 "%s -q -f -W %u --stats-json=%s -e %s %s", program_name,
+		 XD3_ALLOCSIZE, TEST_RECON2_FILE,
+		 TEST_TARGET_FILE, TEST_DELTA_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  if ((ret = test_count_stats_json (TEST_RECON2_FILE,
+				    & windows, & summaries, enc_counts)))
+    {
+      return ret;
+    }
+
+  CHECK (windows == (tsize + XD3_ALLOCSIZE - 1) / XD3_ALLOCSIZE);
+  CHECK (summaries == 1);
+
+  snprintf_func (buf, TESTBUFSIZE,
+		 "%s -q -f --stats-json 3 -d %s %s 3>%s", program_name,
+		 TEST_DELTA_FILE, TEST_RECON_FILE, TEST_RECON2_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  if ((ret = test_count_stats_json (TEST_RECON2_FILE,
+				    & windows, & summaries, dec_counts)))
+    {
+      return ret;
+    }
+
+  CHECK (windows == (tsize + XD3_ALLOCSIZE - 1) / XD3_ALLOCSIZE);
+  CHECK (summaries == 1);
+  CHECK (strcmp (enc_counts, dec_counts) == 0);
+  CHECK (strstr (dec_counts, "\"n_add\":0,") == NULL);
+
+  test_cleanup ();
+  return 0;
+}
+
+/* Runs a small "bench" and checks that its CSV has one row for each
+ * combination, and that unknown parameters are rejected. */
+static int
+test_bench (xd3_stream *stream, int ignore)
+{
+  int ret;
+  char buf[TESTBUFSIZE];
+  char line[TESTBUFSIZE];
+  int rows = 0;
+  FILE *f;
+
+  test_setup ();
+
+  snprintf_func (buf, TESTBUFSIZE,
+		 "%s bench size=64K seed=7 levels=0,1 csv=%s > /dev/null",
+		 program_name, TEST_RECON_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  if ((f = fopen (TEST_RECON_FILE, "r")) == NULL)
+    {
+      return get_errno ();
+    }
+
+  CHECK (fgets (line, sizeof (line), f) != NULL);
+  CHECK (strncmp (line, "level,winsize,secondary,", 24) == 0);
+
+  while (fgets (line, sizeof (line), f) != NULL)
+    {
+      CHECK (line[0] == (rows == 0 ? '0' : '1'));
+      CHECK (strstr (line, ",none,65536,") != NULL);
+      rows += 1;
+    }
+
+  fclose (f);
+  CHECK (rows == 2);
+
+  snprintf_func (buf, TESTBUFSIZE, "%s bench size=64K bogus=1",
+		 program_name);
+  if ((ret = do_fail (stream, buf))) { return ret; }
+
+  test_cleanup ();
+  return 0;
+}
+
+/* Writes a random 64KB source and a target made of source blocks
+ * that have been shifted, copied and moved, for tests that need long
+ * matches at unaligned offsets. */
+static int
+test_make_shifted_inputs (xd3_stream *stream, usize_t *ts_out)
+{
+  static const usize_t ss = 1 << 16;
+  uint8_t *sbuf, *tbuf;
+  usize_t ts = 0, i;
+  FILE *f;
+
+  if ((sbuf = (uint8_t*) malloc (ss * 2)) == NULL) { return ENOMEM; }
+  tbuf = sbuf + ss;
+
+  for (i = 0; i < ss; i += 1)
+    {
+      sbuf[i] = (uint8_t) mt_random (&static_mtrand);
+    }
+
+  /* A copy, an insertion that shifts the rest, a copy and a move. */
+  memcpy (tbuf, sbuf, 20000);
+  ts = 20000;
+  for (i = 0; i < 37; i += 1)
+    {
+      tbuf[ts++] = (uint8_t) mt_random (&static_mtrand);
+    }
+  memcpy (tbuf + ts, sbuf + 20000, 30000);
+  ts += 30000;
+  memcpy (tbuf + ts, sbuf, 8192);
+  ts += 8192;
+
+  if ((f = fopen (TEST_SOURCE_FILE, "w")) == NULL ||
+      fwrite (sbuf, 1, ss, f) != ss ||
+      fclose (f) != 0 ||
+      (f = fopen (TEST_TARGET_FILE, "w")) == NULL ||
+      fwrite (tbuf, 1, ts, f) != ts ||
+      fclose (f) != 0)
+    {
+      free (sbuf);
+      stream->msg = "write failed";
+      return get_errno ();
+    }
+
+  free (sbuf);
+  *ts_out = ts;
+  return 0;
+}
+
+/* Encodes with a source signature, checks that block copies were
+ * found, and decodes against the real source. */
+static int
+test_signature (xd3_stream *stream, int ignore)
+{
+  int ret;
+  char buf[TESTBUFSIZE];
+  usize_t ts;
+  xoff_t dsize;
+
+  test_setup ();
+
+  if ((ret = test_make_shifted_inputs (stream, & ts))) { return ret; }
+
+  snprintf_func (buf, TESTBUFSIZE, "%s signature -s %s %s", program_name,
+		 TEST_SOURCE_FILE, TEST_COPY_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  snprintf_func (buf, TESTBUFSIZE, "%s -e --signature=%s %s %s",
+		 program_name, TEST_COPY_FILE, TEST_TARGET_FILE,
+		 TEST_DELTA_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  snprintf_func (buf, TESTBUFSIZE, "%s -d -s %s %s %s", program_name,
+		 TEST_SOURCE_FILE, TEST_DELTA_FILE, TEST_RECON_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  if ((ret = test_compare_files (TEST_TARGET_FILE, TEST_RECON_FILE)))
+    {
+      return ret;
+    }
+
+  if ((ret = test_file_size (TEST_DELTA_FILE, & dsize))) { return ret; }
+
+  /* Only the insertion and the partial blocks around it are added. */
+  CHECK (dsize > 0 && dsize < ts / 8);
+
+  snprintf_func (buf, TESTBUFSIZE, "%s -e -f --signature=%s -s %s %s %s",
+		 program_name, TEST_COPY_FILE, TEST_SOURCE_FILE,
+		 TEST_TARGET_FILE, TEST_DELTA_FILE);
+  if ((ret = do_fail (stream, buf))) { return ret; }
+
+  test_cleanup ();
+  return 0;
+}
+
+/* Encodes with content-defined anchors and checks that the shifted
+ * source data is still found. */
+static int
+test_anchors (xd3_stream *stream, int ignore)
+{
+  int ret;
+  char buf[TESTBUFSIZE];
+  usize_t ts;
+  xoff_t dsize;
+
+  test_setup ();
+
+  if ((ret = test_make_shifted_inputs (stream, & ts))) { return ret; }
+
+  snprintf_func (buf, TESTBUFSIZE, "%s -e --anchors=64 -s %s %s %s",
+		 program_name, TEST_SOURCE_FILE, TEST_TARGET_FILE,
+		 TEST_DELTA_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  snprintf_func (buf, TESTBUFSIZE, "%s -d -s %s %s %s", program_name,
+		 TEST_SOURCE_FILE, TEST_DELTA_FILE, TEST_RECON_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  if ((ret = test_compare_files (TEST_TARGET_FILE, TEST_RECON_FILE)))
+    {
+      return ret;
+    }
+
+  if ((ret = test_file_size (TEST_DELTA_FILE, & dsize))) { return ret; }
+  CHECK (dsize > 0 && dsize < ts / 4);
+
+  snprintf_func (buf, TESTBUFSIZE, "%s -e -f --anchors=48 -s %s %s %s",
+		 program_name, TEST_SOURCE_FILE, TEST_TARGET_FILE,
+		 TEST_DELTA_FILE);
+  if ((ret = do_fail (stream, buf))) { return ret; }
+
+  test_cleanup ();
+  return 0;
+}
+
+/* Encodes against two sources with a target that copies from both,
+ * then decodes with the sources named by -s and by the application
+ * header. */
+static int
+test_multiple_sources (xd3_stream *stream, int ignore)
+{
+  static const usize_t cs = 1 << 15;
+  int ret;
+  char buf[TESTBUFSIZE];
+  uint8_t *cbuf;
+  usize_t ts, i;
+  xoff_t dsize;
+  FILE *f;
+
+  test_setup ();
+
+  if ((ret = test_make_shifted_inputs (stream, & ts))) { return ret; }
+
+  /* The second source is appended to the target. */
+  if ((cbuf = (uint8_t*) malloc (cs)) == NULL) { return ENOMEM; }
+
+  for (i = 0; i < cs; i += 1)
+    {
+      cbuf[i] = (uint8_t) mt_random (&static_mtrand);
+    }
+
+  if ((f = fopen (TEST_COPY_FILE, "w")) == NULL ||
+      fwrite (cbuf, 1, cs, f) != cs ||
+      fclose (f) != 0 ||
+      (f = fopen (TEST_TARGET_FILE, "a")) == NULL ||
+      fwrite (cbuf, 1, cs, f) != cs ||
+      fclose (f) != 0)
+    {
+      free (cbuf);
+      stream->msg = "write failed";
+      return get_errno ();
+    }
+
+  free (cbuf);
+  ts += cs;
+
+  snprintf_func (buf, TESTBUFSIZE, "%s -e -s %s -s %s %s %s",
+		 program_name, TEST_SOURCE_FILE, TEST_COPY_FILE,
+		 TEST_TARGET_FILE, TEST_DELTA_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  if ((ret = test_file_size (TEST_DELTA_FILE, & dsize))) { return ret; }
+  CHECK (dsize > 0 && dsize < ts / 4);
+
+  snprintf_func (buf, TESTBUFSIZE, "%s -d -s %s -s %s %s %s", program_name,
+		 TEST_SOURCE_FILE, TEST_COPY_FILE, TEST_DELTA_FILE,
+		 TEST_RECON_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  if ((ret = test_compare_files (TEST_TARGET_FILE, TEST_RECON_FILE)))
+    {
+      return ret;
+    }
+
+  /* The test files share a directory with the delta. */
+  snprintf_func (buf, TESTBUFSIZE, "%s -d %s %s", program_name,
+		 TEST_DELTA_FILE, TEST_RECON2_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  if ((ret = test_compare_files (TEST_TARGET_FILE, TEST_RECON2_FILE)))
+    {
+      return ret;
+    }
+
+  /* Without the second source the checksum fails. */
+  snprintf_func (buf, TESTBUFSIZE, "%s -d -f -A= -s %s %s %s",
+		 program_name, TEST_SOURCE_FILE, TEST_DELTA_FILE,
+		 TEST_RECON_FILE);
+  if ((ret = do_fail (stream, buf))) { return ret; }
+
+  snprintf_func (buf, TESTBUFSIZE, "%s printhdr -s %s -s %s %s",
+		 program_name, TEST_SOURCE_FILE, TEST_COPY_FILE,
+		 TEST_DELTA_FILE);
+  if ((ret = do_fail (stream, buf))) { return ret; }
+
+  test_cleanup ();
+  return 0;
+}
+
+/* Checks that --estimate prints the size of the delta that is written
+ * without secondary compression. */
+static int
+test_estimate (xd3_stream *stream, int ignore)
+{
+  int ret;
+  char buf[TESTBUFSIZE];
+  usize_t ts;
+  xoff_t dsize;
+  unsigned long long est;
+  FILE *f;
+
+  test_setup ();
+
+  if ((ret = test_make_shifted_inputs (stream, & ts))) { return ret; }
+
+  snprintf_func (buf, TESTBUFSIZE, "%s -e -S none -s %s %s %s",
+		 program_name, TEST_SOURCE_FILE, TEST_TARGET_FILE,
+		 TEST_DELTA_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  snprintf_func (buf, TESTBUFSIZE, "%s -e --estimate -S none -s %s %s > %s",
+		 program_name, TEST_SOURCE_FILE, TEST_TARGET_FILE,
+		 TEST_RECON_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  if ((f = fopen (TEST_RECON_FILE, "r")) == NULL)
+    {
+      stream->msg = "open failed";
+      return get_errno ();
+    }
+
+  ret = fscanf (f, "estimated size: %llu bytes", & est);
+  fclose (f);
+  CHECK (ret == 1);
+
+  if ((ret = test_file_size (TEST_DELTA_FILE, & dsize))) { return ret; }
+  CHECK (est == dsize);
+
+  snprintf_func (buf, TESTBUFSIZE, "%s -d --estimate -s %s %s",
+		 program_name, TEST_SOURCE_FILE, TEST_DELTA_FILE);
+  if ((ret = do_fail (stream, buf))) { return ret; }
+
+  test_cleanup ();
+  return 0;
+}
+
+/* Checks that --sparse decodes a target with long zero runs, including
+ * a run at the end, to the same bytes, and that output main did not
+ * truncate itself (here, standard output appending to a file) is
+ * written in full. */
+static int
+test_sparse (xd3_stream *stream, int ignore)
+{
+  int ret;
+  usize_t i;
+  char buf[TESTBUFSIZE];
+  uint8_t *tbuf;
+  usize_t tsize = 3 * (1 << 16) + 100;
+  FILE *f;
+
+  test_setup ();
+
+  if ((tbuf = (uint8_t*) main_malloc (tsize)) == NULL) { return ENOMEM; }
+
+  memset (tbuf, 0, tsize);
+  for (i = 0; i < 3000; i++) { tbuf[i] = (uint8_t) mt_random (&static_mtrand); }
+  for (i = 70000; i < 70100; i++) { tbuf[i] = (uint8_t) i; }
+
+  if ((f = fopen (TEST_TARGET_FILE, "w")) == NULL)
+    {
+      main_free (tbuf);
+      stream->msg = "open failed";
+      return get_errno ();
+    }
+
+  ret = (fwrite (tbuf, 1, tsize, f) != tsize);
+  fclose (f);
+  main_free (tbuf);
+  if (ret)
+    {
+      stream->msg = "write failed";
+      return XD3_INTERNAL;
+    }
+
+  snprintf_func (buf, TESTBUFSIZE, "%s -e %s %s", program_name,
+		 TEST_TARGET_FILE, TEST_DELTA_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  snprintf_func (buf, TESTBUFSIZE, "%s -d --sparse %s %s",
+		 program_name, TEST_DELTA_FILE, TEST_RECON_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  if ((ret = test_compare_files (TEST_TARGET_FILE, TEST_RECON_FILE)))
+    {
+      return ret;
+    }
+
+  /* Through a pipe, where seeking fails. */
+  snprintf_func (buf, TESTBUFSIZE, "%s -dc --sparse %s | cat > %s",
+		 program_name, TEST_DELTA_FILE, TEST_RECON_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  if ((ret = test_compare_files (TEST_TARGET_FILE, TEST_RECON_FILE)))
+    {
+      return ret;
+    }
+
+  /* Standard output opened for append, where skipped blocks would be
+   * lost. */
+  snprintf_func (buf, TESTBUFSIZE, "cat %s %s > %s", TEST_TARGET_FILE,
+		 TEST_TARGET_FILE, TEST_RECON2_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  snprintf_func (buf, TESTBUFSIZE, "cp -f %s %s && %s -dc --sparse %s >> %s",
+		 TEST_TARGET_FILE, TEST_RECON_FILE, program_name,
+		 TEST_DELTA_FILE, TEST_RECON_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  if ((ret = test_compare_files (TEST_RECON2_FILE, TEST_RECON_FILE)))
+    {
+      return ret;
+    }
+
+  snprintf_func (buf, TESTBUFSIZE, "%s -e --sparse %s %s", program_name,
+		 TEST_TARGET_FILE, TEST_DELTA_FILE);
+  if ((ret = do_fail (stream, buf))) { return ret; }
+
+  test_cleanup ();
+  return 0;
+}
+
+/* Writes a fake x86 program: a header, EXTRA inserted bytes, then
+ * code that calls functions in the header.  The code is the same for
+ * any EXTRA, but every relative call target differs. */
+static int
+test_bcj_program (const char *file, usize_t extra)
+{
+  usize_t size = 1 << 18;
+  usize_t pos = 0;
+  uint8_t *buf;
+  mtrand r;
+  int ret = 0;
+  FILE *f;
+
+  if ((buf = (uint8_t*) main_malloc (size + extra)) == NULL)
+    {
+      return ENOMEM;
+    }
+
+  mt_init (& r, 0x4bc15e11);
+
+  while (pos < 1024 + extra)
+    {
+      buf[pos++] = (uint8_t) (mt_random (& r) % 0xe0);
+    }
+
+  while (pos + 64 <= size)
+    {
+      usize_t fill = 8 + mt_random (& r) % 32;
+      uint32_t call = (mt_random (& r) % 64) * 16;
+      uint32_t rel;
+
+      while (fill-- > 0)
+	{
+	  buf[pos++] = (uint8_t) (mt_random (& r) % 0xe0);
+	}
+
+      rel = call - (uint32_t) (pos + 5);
+      buf[pos++] = 0xe8;
+      buf[pos++] = (uint8_t) rel;
+      buf[pos++] = (uint8_t) (rel >> 8);
+      buf[pos++] = (uint8_t) (rel >> 16);
+      buf[pos++] = (uint8_t) (rel >> 24);
+    }
+
+  if ((f = fopen (file, "w")) == NULL ||
+      fwrite (buf, 1, pos, f) != pos ||
+      fclose (f) != 0)
+    {
+      ret = XD3_INTERNAL;
+    }
+
+  main_free (buf);
+  return ret;
+}
+
+/* Checks that the --bcj filters are inverted exactly, that the x86
+ * filter makes a shifted program's delta smaller, and that the decoder
+ * takes the filter from the application header. */
+static int
+test_bcj (xd3_stream *stream, int ignore)
+{
+  int ret;
+  int type;
+  usize_t i;
+  char buf[TESTBUFSIZE];
+  uint8_t data[3 * MAIN_BCJ_BLKSIZE + 77];
+  uint8_t orig[sizeof (data)];
+  xoff_t plain_size, bcj_size;
+
+  for (type = MAIN_BCJ_X86; type <= MAIN_BCJ_ARM64; type += 1)
+    {
+      for (i = 0; i < sizeof (data); i += 1)
+	{
+	  data[i] = (uint8_t) mt_random (&static_mtrand);
+
+	  /* Plenty of E8, E9 and BL opcodes. */
+	  if (i % 7 == 0) { data[i] = 0xe8; }
+	  if (i % 4 == 3 && i % 8 == 3) { data[i] = 0x97; }
+	}
+
+      memcpy (orig, data, sizeof (data));
+
+      main_bcj_filter (type, data, sizeof (data), 2 * MAIN_BCJ_BLKSIZE, 1);
+      CHECK (memcmp (orig, data, sizeof (data)) != 0);
+
+      main_bcj_filter (type, data, sizeof (data), 2 * MAIN_BCJ_BLKSIZE, 0);
+      CHECK (memcmp (orig, data, sizeof (data)) == 0);
+    }
+
+  test_setup ();
+
+  if ((ret = test_bcj_program (TEST_SOURCE_FILE, 0)) ||
+      (ret = test_bcj_program (TEST_TARGET_FILE, 100)))
+    {
+      return ret;
+    }
+
+  snprintf_func (buf, TESTBUFSIZE, "%s -e -S none -s %s %s %s",
+		 program_name, TEST_SOURCE_FILE, TEST_TARGET_FILE,
+		 TEST_DELTA_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+  if ((ret = test_file_size (TEST_DELTA_FILE, & plain_size))) { return ret; }
+
+  snprintf_func (buf, TESTBUFSIZE, "%s -ef -S none --bcj=x86 -s %s %s %s",
+		 program_name, TEST_SOURCE_FILE, TEST_TARGET_FILE,
+		 TEST_DELTA_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+  if ((ret = test_file_size (TEST_DELTA_FILE, & bcj_size))) { return ret; }
+
+  CHECK (bcj_size * 4 < plain_size);
+
+  snprintf_func (buf, TESTBUFSIZE, "%s -d -s %s %s %s", program_name,
+		 TEST_SOURCE_FILE, TEST_DELTA_FILE, TEST_RECON_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  if ((ret = test_compare_files (TEST_TARGET_FILE, TEST_RECON_FILE)))
+    {
+      return ret;
+    }
+
+  /* Without the application header the decoder is told. */
+  snprintf_func (buf, TESTBUFSIZE,
+		 "%s -ef -A= --bcj=x86 -W 20000 -s %s %s %s", program_name,
+		 TEST_SOURCE_FILE, TEST_TARGET_FILE, TEST_DELTA_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  snprintf_func (buf, TESTBUFSIZE, "%s -df --bcj=x86 -s %s %s %s",
+		 program_name, TEST_SOURCE_FILE, TEST_DELTA_FILE,
+		 TEST_RECON_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  if ((ret = test_compare_files (TEST_TARGET_FILE, TEST_RECON_FILE)))
+    {
+      return ret;
+    }
+
+  snprintf_func (buf, TESTBUFSIZE, "%s -e --bcj=mips %s %s", program_name,
+		 TEST_TARGET_FILE, TEST_DELTA_FILE);
+  if ((ret = do_fail (stream, buf))) { return ret; }
+
+  test_cleanup ();
+  return 0;
+}
+
+/* Writes a random 1MB source and a target made of its 64KB chunks,
+ * either in reverse order or with adjacent chunks swapped. */
+static int
+test_monotone_inputs (xd3_stream *stream, int reverse)
+{
+  static const usize_t ss = 1 << 20;
+  static const usize_t chunk = 1 << 16;
+  uint8_t *sbuf, *tbuf;
+  usize_t i, c;
+  FILE *f;
+
+  if ((sbuf = (uint8_t*) malloc (ss * 2)) == NULL) { return ENOMEM; }
+  tbuf = sbuf + ss;
+
+  for (i = 0; i < ss; i += 1)
+    {
+      sbuf[i] = (uint8_t) mt_random (&static_mtrand);
+    }
+
+  for (i = 0; i < ss / chunk; i += 1)
+    {
+      c = reverse ? (ss / chunk - 1 - i) : (i ^ 1);
+      memcpy (tbuf + i * chunk, sbuf + c * chunk, chunk);
+    }
+
+  if ((f = fopen (TEST_SOURCE_FILE, "w")) == NULL ||
+      fwrite (sbuf, 1, ss, f) != ss ||
+      fclose (f) != 0 ||
+      (f = fopen (TEST_TARGET_FILE, "w")) == NULL ||
+      fwrite (tbuf, 1, ss, f) != ss ||
+      fclose (f) != 0)
+    {
+      free (sbuf);
+      stream->msg = "write failed";
+      return get_errno ();
+    }
+
+  free (sbuf);
+  return 0;
+}
+
+/* Checks that --monotone deltas decode from a source pipe, where an
+ * ordinary delta of a reordered target reaches too far back. */
+static int
+test_monotone (xd3_stream *stream, int ignore)
+{
+  int ret;
+  char buf[TESTBUFSIZE];
+  xoff_t dsize;
+
+  test_setup ();
+
+  if ((ret = test_monotone_inputs (stream, 1))) { return ret; }
+
+  snprintf_func (buf, TESTBUFSIZE, "%s -e -s %s %s %s", program_name,
+		 TEST_SOURCE_FILE, TEST_TARGET_FILE, TEST_DELTA_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  snprintf_func (buf, TESTBUFSIZE,
+		 "cat %s | %s -d -B %u -s /dev/stdin %s %s",
+		 TEST_SOURCE_FILE, program_name, XD3_MINSRCWINSZ,
+		 TEST_DELTA_FILE, TEST_RECON_FILE);
+  if ((ret = do_fail (stream, buf))) { return ret; }
+
+  snprintf_func (buf, TESTBUFSIZE, "%s -ef --monotone=%u -s %s %s %s",
+		 program_name, 1 << 17, TEST_SOURCE_FILE, TEST_TARGET_FILE,
+		 TEST_DELTA_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  snprintf_func (buf, TESTBUFSIZE,
+		 "cat %s | %s -df -B %u -s /dev/stdin %s %s",
+		 TEST_SOURCE_FILE, program_name, XD3_MINSRCWINSZ,
+		 TEST_DELTA_FILE, TEST_RECON_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  if ((ret = test_compare_files (TEST_TARGET_FILE, TEST_RECON_FILE)))
+    {
+      return ret;
+    }
+
+  /* Swapped neighbours are within the distance, so still copied. */
+  if ((ret = test_monotone_inputs (stream, 0))) { return ret; }
+
+  snprintf_func (buf, TESTBUFSIZE, "%s -ef --monotone=%u -s %s %s %s",
+		 program_name, 1 << 17, TEST_SOURCE_FILE, TEST_TARGET_FILE,
+		 TEST_DELTA_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  if ((ret = test_file_size (TEST_DELTA_FILE, & dsize))) { return ret; }
+  CHECK (dsize < (1 << 12));
+
+  snprintf_func (buf, TESTBUFSIZE,
+		 "cat %s | %s -df -s /dev/stdin %s %s",
+		 TEST_SOURCE_FILE, program_name,
+		 TEST_DELTA_FILE, TEST_RECON_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  if ((ret = test_compare_files (TEST_TARGET_FILE, TEST_RECON_FILE)))
+    {
+      return ret;
+    }
+
+  snprintf_func (buf, TESTBUFSIZE, "%s -e --monotone=0 %s %s",
+		 program_name, TEST_TARGET_FILE, TEST_DELTA_FILE);
+  if ((ret = do_fail (stream, buf))) { return ret; }
+
+  test_cleanup ();
+  return 0;
+}
+
+/* Checks that xd3_config_memory_limit() fits its budget, favouring
+ * the source window, and that --memory-limit encodes within it. */
+static int
+test_memory_limit (xd3_stream *stream, int ignore)
+{
+  int ret;
+  char buf[TESTBUFSIZE];
+  xd3_config config;
+  xoff_t srcwinsz, bytes;
+  usize_t ts;
+
+  xd3_init_config (& config, XD3_SEC_DJW);
+
+  if ((ret = xd3_config_memory_limit (& config, 64 << 20, & srcwinsz)) ||
+      (ret = xd3_config_memory (& config, srcwinsz, & bytes)))
+    {
+      return ret;
+    }
+
+  CHECK (bytes <= (64 << 20));
+  CHECK (srcwinsz >= 4 * (xoff_t) config.winsize);
+  CHECK (config.winsize >= XD3_ALLOCSIZE &&
+	 config.winsize <= XD3_DEFAULT_WINSIZE);
+
+  /* A larger source window would not fit. */
+  CHECK ((ret = xd3_config_memory (& config, 2 * srcwinsz, & bytes)) == 0 &&
+	 bytes > (64 << 20));
+
+  CHECK (xd3_config_memory_limit (& config, 1 << 16, & srcwinsz) ==
+	 XD3_INVALID);
+
+  test_setup ();
+
+  if ((ret = test_make_shifted_inputs (stream, & ts))) { return ret; }
+
+  snprintf_func (buf, TESTBUFSIZE, "%s -e --memory-limit=16M -s %s %s %s",
+		 program_name, TEST_SOURCE_FILE, TEST_TARGET_FILE,
+		 TEST_DELTA_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  snprintf_func (buf, TESTBUFSIZE, "%s -d -s %s %s %s", program_name,
+		 TEST_SOURCE_FILE, TEST_DELTA_FILE, TEST_RECON_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  if ((ret = test_compare_files (TEST_TARGET_FILE, TEST_RECON_FILE)))
+    {
+      return ret;
+    }
+
+  snprintf_func (buf, TESTBUFSIZE, "%s -ef --memory-limit=64K -s %s %s %s",
+		 program_name, TEST_SOURCE_FILE, TEST_TARGET_FILE,
+		 TEST_DELTA_FILE);
+  if ((ret = do_fail (stream, buf))) { return ret; }
+
+  snprintf_func (buf, TESTBUFSIZE, "%s -d --memory-limit=16M -s %s %s",
+		 program_name, TEST_SOURCE_FILE, TEST_DELTA_FILE);
+  if ((ret = do_fail (stream, buf))) { return ret; }
+
+  test_cleanup ();
+  return 0;
+}
+
+/* Writes a random 1MB source and a target of its 64KB chunks in
+ * reverse order, with every other chunk replaced by random data. */
+static int
+test_checkpoint_inputs (xd3_stream *stream)
+{
+  static const usize_t ss = 1 << 20;
+  static const usize_t chunk = 1 << 16;
+  uint8_t *sbuf, *tbuf;
+  usize_t i;
+  FILE *f;
+
+  if ((sbuf = (uint8_t*) malloc (ss * 2)) == NULL) { return ENOMEM; }
+  tbuf = sbuf + ss;
+
+  for (i = 0; i < ss * 2; i += 1)
+    {
+      sbuf[i] = (uint8_t) mt_random (&static_mtrand);
+    }
+
+  for (i = 0; i < ss / chunk; i += 2)
+    {
+      memcpy (tbuf + i * chunk, sbuf + (ss / chunk - 1 - i) * chunk, chunk);
+    }
+
+  if ((f = fopen (TEST_SOURCE_FILE, "w")) == NULL ||
+      fwrite (sbuf, 1, ss, f) != ss ||
+      fclose (f) != 0 ||
+      (f = fopen (TEST_TARGET_FILE, "w")) == NULL ||
+      fwrite (tbuf, 1, ss, f) != ss ||
+      fclose (f) != 0)
+    {
+      free (sbuf);
+      stream->msg = "write failed";
+      return get_errno ();
+    }
+
+  free (sbuf);
+  return 0;
+}
+
+/* Interrupts an encode and a decode with a file size limit, then
+ * checks that --resume finishes them: the resumed delta is identical
+ * to an uninterrupted one, and the resumed decode matches the
+ * target.  TEST_COPY_FILE holds the checkpoint. */
+static int
+test_checkpoint (xd3_stream *stream, int ignore)
+{
+  int ret;
+  char buf[TESTBUFSIZE];
+  xoff_t size;
+
+  test_setup ();
+
+  if ((ret = test_checkpoint_inputs (stream))) { return ret; }
+
+  snprintf_func (buf, TESTBUFSIZE, "%s -e -W 65536 -s %s %s %s",
+		 program_name, TEST_SOURCE_FILE, TEST_TARGET_FILE,
+		 TEST_DELTA_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  /* The limit is in 512-byte blocks, the delta is about 512KB. */
+  snprintf_func (buf, TESTBUFSIZE,
+		 "sh -c 'ulimit -f 512; exec %s -e -W 65536 --checkpoint=%s "
+		 "-s %s %s %s' 2>/dev/null; test -s %s", program_name,
+		 TEST_COPY_FILE, TEST_SOURCE_FILE, TEST_TARGET_FILE,
+		 TEST_RECON2_FILE, TEST_COPY_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  if ((ret = test_file_size (TEST_RECON2_FILE, & size))) { return ret; }
+  CHECK (size == 512 * 512);
+
+  /* The window size must match. */
+  snprintf_func (buf, TESTBUFSIZE,
+		 "%s -e -W 131072 --checkpoint=%s --resume -s %s %s %s",
+		 program_name, TEST_COPY_FILE, TEST_SOURCE_FILE,
+		 TEST_TARGET_FILE, TEST_RECON2_FILE);
+  if ((ret = do_fail (stream, buf))) { return ret; }
+
+  snprintf_func (buf, TESTBUFSIZE,
+		 "%s -e -W 65536 --checkpoint=%s --resume -s %s %s %s",
+		 program_name, TEST_COPY_FILE, TEST_SOURCE_FILE,
+		 TEST_TARGET_FILE, TEST_RECON2_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  if ((ret = test_compare_files (TEST_DELTA_FILE, TEST_RECON2_FILE)))
+    {
+      return ret;
+    }
+
+  /* Finishing removes the checkpoint. */
+  snprintf_func (buf, TESTBUFSIZE, "test ! -e %s", TEST_COPY_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  snprintf_func (buf, TESTBUFSIZE,
+		 "sh -c 'ulimit -f 1024; exec %s -d --checkpoint=%s "
+		 "-s %s %s %s' 2>/dev/null; test -s %s", program_name,
+		 TEST_COPY_FILE, TEST_SOURCE_FILE, TEST_DELTA_FILE,
+		 TEST_RECON_FILE, TEST_COPY_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  snprintf_func (buf, TESTBUFSIZE,
+		 "%s -e --checkpoint=%s --resume -s %s %s %s",
+		 program_name, TEST_COPY_FILE, TEST_SOURCE_FILE,
+		 TEST_TARGET_FILE, TEST_RECON2_FILE);
+  if ((ret = do_fail (stream, buf))) { return ret; }
+
+  snprintf_func (buf, TESTBUFSIZE,
+		 "%s -d --checkpoint=%s --resume -s %s %s %s",
+		 program_name, TEST_COPY_FILE, TEST_SOURCE_FILE,
+		 TEST_DELTA_FILE, TEST_RECON_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  if ((ret = test_compare_files (TEST_TARGET_FILE, TEST_RECON_FILE)))
+    {
+      return ret;
+    }
+
+  snprintf_func (buf, TESTBUFSIZE, "%s -d --resume %s %s", program_name,
+		 TEST_DELTA_FILE, TEST_RECON_FILE);
+  if ((ret = do_fail (stream, buf))) { return ret; }
+
+#if EXTERNAL_COMPRESSION
+  /* Externally compressed files need -D and -R, since the offsets
+   * are those of the files as stored. */
+  if (main_get_compressor ("G") != NULL)
+    {
+      snprintf_func (buf, TESTBUFSIZE, "gzip -c %s > %s",
+		     TEST_TARGET_FILE, TEST_RECON2_FILE);
+      if ((ret = do_cmd (stream, buf))) { return ret; }
+
+      snprintf_func (buf, TESTBUFSIZE,
+		     "%s -f -e --checkpoint=%s -s %s %s %s", program_name,
+		     TEST_COPY_FILE, TEST_SOURCE_FILE, TEST_RECON2_FILE,
+		     TEST_DELTA_FILE);
+      if ((ret = do_fail (stream, buf))) { return ret; }
+
+      snprintf_func (buf, TESTBUFSIZE,
+		     "%s -f -e -D --checkpoint=%s -s %s %s %s", program_name,
+		     TEST_COPY_FILE, TEST_SOURCE_FILE, TEST_RECON2_FILE,
+		     TEST_DELTA_FILE);
+      if ((ret = do_cmd (stream, buf))) { return ret; }
+
+      /* This delta records that its output is gzip compressed. */
+      snprintf_func (buf, TESTBUFSIZE, "%s -f -e -q -s %s %s %s",
+		     program_name, TEST_SOURCE_FILE, TEST_RECON2_FILE,
+		     TEST_DELTA_FILE);
+      if ((ret = do_cmd (stream, buf))) { return ret; }
+
+      snprintf_func (buf, TESTBUFSIZE,
+		     "%s -f -d --checkpoint=%s -s %s %s %s", program_name,
+		     TEST_COPY_FILE, TEST_SOURCE_FILE, TEST_DELTA_FILE,
+		     TEST_RECON_FILE);
+      if ((ret = do_fail (stream, buf))) { return ret; }
+
+      snprintf_func (buf, TESTBUFSIZE,
+		     "%s -f -d -R --checkpoint=%s -s %s %s %s", program_name,
+		     TEST_COPY_FILE, TEST_SOURCE_FILE, TEST_DELTA_FILE,
+		     TEST_RECON_FILE);
+      if ((ret = do_cmd (stream, buf))) { return ret; }
+
+      if ((ret = test_compare_files (TEST_TARGET_FILE, TEST_RECON_FILE)))
+	{
+	  return ret;
+	}
+    }
+#endif
+
+  test_cleanup ();
+  return 0;
+}
+
+/* Encodes a target larger than XD3_HARDMAXWINSIZE as one window, with
+ * a block repeated from the start at the end, and checks that the
+ * repeat is copied and that decoding takes the window size from the
+ * application header, or else needs -W as large. */
+static int
+test_large_window (xd3_stream *stream, int ignore)
+{
+  static const usize_t rs = 1 << 18;
+  static const usize_t ts = XD3_HARDMAXWINSIZE + (1 << 20);
+  int ret;
+  char buf[TESTBUFSIZE];
+  xd3_stream tstream;
+  xd3_config config;
+  uint8_t *tbuf;
+  xoff_t size;
+  usize_t i;
+  FILE *f;
+
+  memset (& tstream, 0, sizeof (tstream));
+  xd3_init_config (& config, 0);
+  config.winsize = XD3_LARGEMAXWINSIZE * 2;
+  CHECK (xd3_config_stream (& tstream, & config) != 0);
+  xd3_free_stream (& tstream);
+
+  test_setup ();
+
+  if ((tbuf = (uint8_t*) malloc (ts)) == NULL) { return ENOMEM; }
+
+  for (i = 0; i < ts - rs; i += 1)
+    {
+      tbuf[i] = (uint8_t) mt_random (&static_mtrand);
+    }
+
+  memcpy (tbuf + ts - rs, tbuf, rs);
+
+  if ((f = fopen (TEST_TARGET_FILE, "w")) == NULL ||
+      fwrite (tbuf, 1, ts, f) != ts ||
+      fclose (f) != 0)
+    {
+      free (tbuf);
+      stream->msg = "write failed";
+      return get_errno ();
+    }
+
+  free (tbuf);
+
+  snprintf_func (buf, TESTBUFSIZE, "%s -e -S none -W %u %s %s",
+		 program_name, 2 * XD3_HARDMAXWINSIZE, TEST_TARGET_FILE,
+		 TEST_DELTA_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  if ((ret = test_file_size (TEST_DELTA_FILE, & size))) { return ret; }
+  CHECK (size < ts - rs + 1024);
+
+  /* The application header records the window size. */
+  snprintf_func (buf, TESTBUFSIZE, "%s -d %s %s", program_name,
+		 TEST_DELTA_FILE, TEST_RECON_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  if ((ret = test_compare_files (TEST_TARGET_FILE, TEST_RECON_FILE)))
+    {
+      return ret;
+    }
+
+  /* Without one, decoding needs -W. */
+  snprintf_func (buf, TESTBUFSIZE, "%s -f -e -A -S none -W %u %s %s",
+		 program_name, 2 * XD3_HARDMAXWINSIZE, TEST_TARGET_FILE,
+		 TEST_DELTA_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  snprintf_func (buf, TESTBUFSIZE, "%s -f -d %s %s", program_name,
+		 TEST_DELTA_FILE, TEST_RECON_FILE);
+  if ((ret = do_fail (stream, buf))) { return ret; }
+
+  snprintf_func (buf, TESTBUFSIZE, "%s -f -d -W %u %s %s", program_name,
+		 2 * XD3_HARDMAXWINSIZE, TEST_DELTA_FILE, TEST_RECON_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  if ((ret = test_compare_files (TEST_TARGET_FILE, TEST_RECON_FILE)))
+    {
+      return ret;
+    }
+
+  test_cleanup ();
+  return 0;
+}
+
+/* Encodes with --probe a target that is its source with small
+ * changes in place, some of them across a PROBE_SIZE boundary, over
+ * several windows and with a source larger than -B, and checks that
+ * only the changes are coded. */
+static int
+test_unchanged_blocks (xd3_stream *stream, int ignore)
+{
+  static const usize_t ss = 1 << 22;
+  static const usize_t nchanges = 32;
+  static const usize_t clen = 16;
+  int ret;
+  char buf[TESTBUFSIZE];
+  uint8_t *sbuf;
+  xoff_t size;
+  usize_t i, j, pos;
+  FILE *f;
+
+  test_setup ();
+
+  if ((sbuf = (uint8_t*) malloc (ss)) == NULL) { return ENOMEM; }
+
+  for (i = 0; i < ss; i += 1)
+    {
+      sbuf[i] = (uint8_t) mt_random (&static_mtrand);
+    }
+
+  if ((f = fopen (TEST_SOURCE_FILE, "w")) == NULL ||
+      fwrite (sbuf, 1, ss, f) != ss ||
+      fclose (f) != 0)
+    {
+      free (sbuf);
+      stream->msg = "write failed";
+      return get_errno ();
+    }
+
+  for (i = 0; i < nchanges; i += 1)
+    {
+      pos = (i + 1) * (ss / (nchanges + 1)) - (i % 2) * (clen / 2);
+
+      for (j = 0; j < clen; j += 1)
+	{
+	  sbuf[pos + j] ^= 0xff;
+	}
+    }
+
+  if ((f = fopen (TEST_TARGET_FILE, "w")) == NULL ||
+      fwrite (sbuf, 1, ss, f) != ss ||
+      fclose (f) != 0)
+    {
+      free (sbuf);
+      stream->msg = "write failed";
+      return get_errno ();
+    }
+
+  free (sbuf);
+
+  snprintf_func (buf, TESTBUFSIZE,
+		 "%s -e -9 -S none --probe -W %u -B %u -s %s %s %s",
+		 program_name, ss / 4, ss / 4, TEST_SOURCE_FILE,
+		 TEST_TARGET_FILE, TEST_DELTA_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  if ((ret = test_file_size (TEST_DELTA_FILE, & size))) { return ret; }
+  CHECK (size < nchanges * (clen + 16) + 256);
+
+  snprintf_func (buf, TESTBUFSIZE, "%s -d -s %s %s %s", program_name,
+		 TEST_SOURCE_FILE, TEST_DELTA_FILE, TEST_RECON_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  if ((ret = test_compare_files (TEST_TARGET_FILE, TEST_RECON_FILE)))
+    {
+      return ret;
+    }
+
+  test_cleanup ();
+  return 0;
+}
+
+/* Decodes a several-window delta from a file, which is mapped, and
+ * from a pipe, which is read, and checks that a truncated delta file
+ * still fails. */
+static int
+test_mapped_input (xd3_stream *stream, int ignore)
+{
+  int ret;
+  char buf[TESTBUFSIZE];
+  xoff_t ss, ts, ds;
+
+  test_setup ();
+
+  if ((ret = test_make_inputs (stream, & ss, & ts))) { return ret; }
+
+  snprintf_func (buf, TESTBUFSIZE, "%s -e -W %u -s %s %s %s",
+		 program_name, XD3_ALLOCSIZE, TEST_SOURCE_FILE,
+		 TEST_TARGET_FILE, TEST_DELTA_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  snprintf_func (buf, TESTBUFSIZE, "%s -d -s %s %s %s", program_name,
+		 TEST_SOURCE_FILE, TEST_DELTA_FILE, TEST_RECON_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  if ((ret = test_compare_files (TEST_TARGET_FILE, TEST_RECON_FILE)))
+    {
+      return ret;
+    }
+
+  snprintf_func (buf, TESTBUFSIZE, "cat %s | %s -d -c -s %s > %s",
+		 TEST_DELTA_FILE, program_name, TEST_SOURCE_FILE,
+		 TEST_RECON2_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  if ((ret = test_compare_files (TEST_TARGET_FILE, TEST_RECON2_FILE)))
+    {
+      return ret;
+    }
+
+  if ((ret = test_file_size (TEST_DELTA_FILE, & ds))) { return ret; }
+
+  snprintf_func (buf, TESTBUFSIZE, "head -c %llu %s > %s",
+		 (unsigned long long) ds - 1, TEST_DELTA_FILE,
+		 TEST_COPY_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  snprintf_func (buf, TESTBUFSIZE, "%s -q -d -f -s %s %s %s", program_name,
+		 TEST_SOURCE_FILE, TEST_COPY_FILE, TEST_RECON_FILE);
+  if ((ret = do_fail (stream, buf))) { return ret; }
+
+  test_cleanup ();
+  return 0;
+}
+
+/* Runs a short tune-smatcher search and checks that a template block
+ * is written for each preset. */
+static int
+test_tune_smatcher (xd3_stream *stream, int ignore)
+{
+  static const char *names[] =
+    { "fastest", "faster", "fast", "default", "slow" };
+  int ret;
+  usize_t i = 0;
+  char buf[TESTBUFSIZE];
+  char line[TESTBUFSIZE];
+  char want[TESTBUFSIZE];
+  xoff_t ss, ts;
+  FILE *f;
+
+  test_setup ();
+
+  if ((ret = test_make_inputs (stream, & ss, & ts))) { return ret; }
+
+  snprintf_func (buf, TESTBUFSIZE,
+		 "%s tune-smatcher samples=2 reps=1 secondary=none,djw "
+		 "cfgs=%s %s %s > /dev/null", program_name, TEST_RECON_FILE,
+		 TEST_SOURCE_FILE, TEST_TARGET_FILE);
+  if ((ret = do_cmd (stream, buf))) { return ret; }
+
+  if ((f = fopen (TEST_RECON_FILE, "r")) == NULL)
+    {
+      return get_errno ();
+    }
+
+  while (fgets (line, sizeof (line), f) != NULL)
+    {
+      if (strncmp (line, "#define TEMPLATE", 16) != 0) { continue; }
+
+      CHECK (i < SIZEOF_ARRAY (names));
+      snprintf_func (want, TESTBUFSIZE, "#define TEMPLATE      %s\n",
+		     names[i++]);
+      CHECK (strcmp (line, want) == 0);
+    }
+
+  fclose (f);
+  CHECK (i == SIZEOF_ARRAY (names));
+
+  snprintf_func (buf, TESTBUFSIZE, "%s tune-smatcher %s",
+		 program_name, TEST_SOURCE_FILE);
+  if ((ret = do_fail (stream, buf))) { return ret; }
+
+  test_cleanup ();
+  return 0;
+}
+
+/* Ranks the real source above an unrelated file, and checks that a
+ * second run from the sketch cache gives the same ranking. */
+static int
+test_pick_base (xd3_stream *stream, int ignore)
+{
+  static const usize_t cs = 1 << 16;
+  int ret;
+  char buf[TESTBUFSIZE];
+  char line[TESTBUFSIZE];
+  char first[TESTBUFSIZE];
+  usize_t ts, i;
+  uint8_t *cbuf;
+  FILE *f;
+
+  test_setup ();
+
+  if ((ret = test_make_shifted_inputs (stream, & ts))) { return ret; }
+
+  if ((cbuf = (uint8_t*) malloc (cs)) == NULL) { return ENOMEM; }
+
+  for (i = 0; i < cs; i += 1)
+    {
+      cbuf[i] = (uint8_t) mt_random (&static_mtrand);
+    }
+
+  if ((f = fopen (TEST_COPY_FILE, "w")) == NULL ||
+      fwrite (cbuf, 1, cs, f) != cs ||
+      fclose (f) != 0)
+    {
+      free (cbuf);
+      stream->msg = "write failed";
+      return get_errno ();
+    }
+
+  free (cbuf);
+
+  for (i = 0; i < 2; i += 1)
+    {
+      snprintf_func (buf, TESTBUFSIZE, "%s pick-base cache=%s %s %s %s > %s",
+		     program_name, TEST_RECON2_FILE, TEST_TARGET_FILE,
+		     TEST_COPY_FILE, TEST_SOURCE_FILE, TEST_RECON_FILE);
+      if ((ret = do_cmd (stream, buf))) { return ret; }
+
+      if ((f = fopen (TEST_RECON_FILE, "r")) == NULL)
+	{
+	  stream->msg = "open failed";
+	  return get_errno ();
+	}
+
+      CHECK (fgets (line, sizeof (line), f) != NULL);
+      CHECK (fgets (line, sizeof (line), f) != NULL);
+      fclose (f);
+
+      CHECK (strncmp (line, "   1 ", 5) == 0);
+      CHECK (strstr (line, TEST_SOURCE_FILE) != NULL);
+
+      if (i == 0) { strcpy (first, line); }
+      else        { CHECK (strcmp (first, line) == 0); }
+    }
+
+  snprintf_func (buf, TESTBUFSIZE, "%s pick-base chunk=1000 %s %s",
+		 program_name, TEST_TARGET_FILE, TEST_SOURCE_FILE);
+  if ((ret = do_fail (stream, buf))) { return ret; }
+
+  test_cleanup ();
+  return 0;
+}
+
+/***********************************************************************
+ Source identical optimization
+ ***********************************************************************/
+
+/* Computing a delta should be fastest when the two inputs are
+ * identical, this checks it.  The library is called to compute a
+ * delta between a 10000 byte file, 1000 byte winsize, 500 byte source
+ * blocksize.  The same buffer is used for both source and target. */
+static int
+test_identical_behavior (xd3_stream *stream, int ignore)
+{
+#define IDB_TGTSZ 10000  /* Not a power of two b/c of hard-coded expectations below. */
+#define IDB_BLKSZ 512
+#define IDB_WINSZ 1000
+#define IDB_DELSZ 1000
+#define IDB_WINCNT (IDB_TGTSZ / IDB_WINSZ)
+
+  int ret, i;
+  uint8_t buf[IDB_TGTSZ];
+  uint8_t del[IDB_DELSZ];
+  uint8_t rec[IDB_TGTSZ];
+  xd3_source source;
+  int nextencwin = 0;
+  int winstarts = 0, winfinishes = 0;
+  usize_t delpos = 0, recsize;
+  xd3_config config;
+  memset(&source, 0, sizeof(source));
+
+  for (i = 0; i < IDB_TGTSZ; i += 1)
+    {
+      buf[i] = (uint8_t) mt_random (&static_mtrand);
+    }
+
+  stream->winsize = IDB_WINSZ;
+
+  source.blksize  = IDB_BLKSZ;
+  source.name     = "";
+  source.curblk   = NULL;
+  source.curblkno = 0;
+
+  if ((ret = xd3_set_source (stream, & source))) { goto fail; }
+
+  /* Compute an delta between identical source and targets. */
+  for (;;)
+    {
+      ret = xd3_encode_input (stream);
+
+      if (ret == XD3_INPUT)
+	{
+	  xd3_avail_input (stream, buf + (IDB_WINSZ * nextencwin), IDB_WINSZ);
+	  nextencwin += 1;
+	  continue;
+	}
+
+      if (ret == XD3_GETSRCBLK)
+	{
+	  source.curblkno = source.getblkno;
+	  source.onblk    = IDB_BLKSZ;
+	  source.curblk   = buf + source.getblkno * IDB_BLKSZ;
+	  continue;
+	}
+
+      if (ret == XD3_WINSTART)
+	{
+	  winstarts++;
+	  continue;
+	}
+      if (ret == XD3_WINFINISH)
+	{
+	  winfinishes++;
+	  if (winfinishes == IDB_WINCNT)
+	    {
+	      break;
+	    }
+	  continue;
+	}
+
+      if (ret != XD3_OUTPUT) { goto fail; }
+
+      CHECK(delpos + stream->avail_out <= IDB_DELSZ);
+
+      memcpy (del + delpos, stream->next_out, stream->avail_out);
+
+      delpos += stream->avail_out;
+
+      xd3_consume_output (stream);
+    }
 
   CHECK(winfinishes == IDB_WINCNT);
   CHECK(winstarts == IDB_WINCNT);
@@ -2499,6 +4178,7 @@ typedef enum
 {
   SM_NONE    = 0,
   SM_LAZY    = (1 << 1),
+  SM_TREE    = (1 << 2),
 } string_match_flags;
 
 struct _string_match_test
@@ -2553,6 +4233,10 @@ static const string_match_test match_tests[] =
   { "1234 1234_1234-1234=1234+1234[1234]1234{1234}1234<1234>1234 ", SM_NONE,
     "C5/4@0 C10/4@5 C15/4@10 C20/4@15 C25/4@20 C30/4@25 C35/4@30 C40/4@35 C45/4@40 C50/4@45 C55/4@50" },
 
+  /* the binary tree finds the longest match past the chain depth. */
+  { "1234 1234_1234-1234=1234+1234[1234]1234{1234}1234<1234>1234 ", SM_TREE,
+    "C5/4@0 C10/4@5 C15/4@10 C20/4@15 C25/4@20 C30/4@25 C35/4@30 C40/4@35 C45/4@40 C50/4@45 C55/5@0" },
+
   /* ssmatch test */
   { "ABCDE___ABCDE*** BCDE***", SM_NONE, "C8/5@0 C17/4@1" },
   /*{ "ABCDE___ABCDE*** BCDE***", SM_SSMATCH, "C8/5@0 C17/7@9" }, forgotten */
@@ -2583,6 +4267,7 @@ test_string_matching (xd3_stream *stream, int ignore)
       config.smatcher_soft.small_lchain = 10;
       config.smatcher_soft.max_lazy     = (test->flags & SM_LAZY) ? 10 : 0;
       config.smatcher_soft.long_enough  = 10;
+      config.smatcher_soft.small_tree   = (test->flags & SM_TREE) != 0;
 
       if ((ret = xd3_config_stream (stream, & config))) { return ret; }
       if ((ret = xd3_encode_init_full (stream))) { return ret; }
@@ -2784,6 +4469,95 @@ test_in_memory (xd3_stream *stream, int ignore)
   return 0;
 }
 
+/* Decodes a four-window delta into one buffer with
+ * xd3_set_dec_output().  Each window must be decoded in place, except
+ * the second, whose buffer is one byte short and so falls back to the
+ * stream's own. */
+static int
+test_dec_output (xd3_stream *stream, int ignore)
+{
+  uint8_t dbuf[2 * sizeof(test_text)];
+  uint8_t obuf[sizeof(test_text)];
+  usize_t size = sizeof(test_text);
+  usize_t dsize, opos = 0;
+  xoff_t windows = 0;
+  xd3_stream estream;
+  xd3_config config;
+  int ret;
+
+  memset (& estream, 0, sizeof (estream));
+  xd3_init_config (& config, 0);
+  config.winsize = size / 4;
+
+  if ((ret = xd3_config_stream (& estream, & config)) == 0)
+    {
+      ret = xd3_encode_stream (& estream, test_text, size,
+			       dbuf, & dsize, sizeof (dbuf));
+    }
+
+  xd3_free_stream (& estream);
+
+  if (ret) { return ret; }
+
+  CHECK (xd3_set_dec_output (stream, obuf, size) != 0);
+
+  stream->flags |= XD3_FLUSH;
+  xd3_avail_input (stream, dbuf, dsize);
+
+  for (;;)
+    {
+      switch ((ret = xd3_decode_input (stream)))
+	{
+	case XD3_GOTHEADER:
+	case XD3_WINSTART:
+	  CHECK (stream->dec_tgtlen <= size - opos);
+	  if ((ret = xd3_set_dec_output (stream, obuf + opos,
+					 windows == 1 ?
+					 stream->dec_tgtlen - 1 :
+					 size - opos)))
+	    {
+	      return ret;
+	    }
+	  continue;
+
+	case XD3_OUTPUT:
+	  if (windows == 1)
+	    {
+	      CHECK (stream->next_out != obuf + opos);
+	      memcpy (obuf + opos, stream->next_out, stream->avail_out);
+	    }
+	  else
+	    {
+	      CHECK (stream->next_out == obuf + opos);
+	    }
+	  opos += stream->avail_out;
+	  xd3_consume_output (stream);
+	  continue;
+
+	case XD3_WINFINISH:
+	  windows += 1;
+	  continue;
+
+	case XD3_INPUT:
+	  break;
+
+	default:
+	  return ret;
+	}
+      break;
+    }
+
+  CHECK (windows == 4);
+
+  if (opos != size || memcmp (obuf, test_text, size) != 0)
+    {
+      stream->msg = "decode output error";
+      return XD3_INTERNAL;
+    }
+
+  return xd3_close_stream (stream);
+}
+
 /***********************************************************************
  TEST MAIN
  ***********************************************************************/
@@ -2816,15 +4590,21 @@ xd3_selftest (void)
   DO_TEST (encode_decode_uint32_t, 0, 0);
   DO_TEST (encode_decode_uint64_t, 0, 0);
   DO_TEST (usize_t_overflow, 0, 0);
+  DO_TEST (output_chain_size, 0, 0);
   DO_TEST (forward_match, 0, 0);
 
   DO_TEST (address_cache, 0, 0);
   IF_GENCODETBL (DO_TEST (address_cache, XD3_ALT_CODE_TABLE, 0));
+  DO_TEST (address_cache_generation, 0, 0);
 
   DO_TEST (string_matching, 0, 0);
+  DO_TEST (rfc3284_code_table, 0, 0);
   DO_TEST (choose_instruction, 0, 0);
+  DO_TEST (custom_code_table, 0, 0);
+  DO_TEST (perf_counters, 0, 0);
   DO_TEST (identical_behavior, 0, 0);
   DO_TEST (in_memory, 0, 0);
+  DO_TEST (dec_output, 0, 0);
 
   IF_GENCODETBL (DO_TEST (choose_instruction, XD3_ALT_CODE_TABLE, 0));
   IF_GENCODETBL (DO_TEST (encode_code_table, 0, 0));
@@ -2848,6 +4628,25 @@ xd3_selftest (void)
   DO_TEST (force_behavior, 0, 0);
   DO_TEST (stdout_behavior, 0, 0);
   DO_TEST (no_output, 0, 0);
+  DO_TEST (stats_json, 0, 0);
+#if VCDIFF_TOOLS
+  DO_TEST (train_codetable, 0, 0);
+#endif
+  DO_TEST (bench, 0, 0);
+  DO_TEST (tune_smatcher, 0, 0);
+  DO_TEST (pick_base, 0, 0);
+  DO_TEST (signature, 0, 0);
+  DO_TEST (anchors, 0, 0);
+  DO_TEST (multiple_sources, 0, 0);
+  DO_TEST (estimate, 0, 0);
+  DO_TEST (sparse, 0, 0);
+  DO_TEST (bcj, 0, 0);
+  DO_TEST (monotone, 0, 0);
+  DO_TEST (memory_limit, 0, 0);
+  DO_TEST (checkpoint, 0, 0);
+  DO_TEST (large_window, 0, 0);
+  DO_TEST (unchanged_blocks, 0, 0);
+  DO_TEST (mapped_input, 0, 0);
   DO_TEST (command_line_arguments, 0, 0);
 
 #if EXTERNAL_COMPRESSION
@@ -0,0 +1,578 @@
+/* xdelta 3 - delta compression tools and library
+ * Copyright (C) 2007.  Joshua P. MacDonald
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* The "train-codetable" command reads a corpus of VCDIFF deltas,
+ * records their instruction streams, and searches the family of code
+ * tables described by xd3_code_table_desc for the one with the
+ * smallest estimated instruction and address sections.  The result is
+ * printed in the form accepted by "--codetable=".
+ *
+ * The estimate replays the encoder: addresses are re-encoded through
+ * xd3_choose_address() with each candidate cache configuration, and
+ * instructions are re-paired through xd3_choose_instruction_desc()
+ * the same way xd3_iopt_finish_encoding() pairs them.  Data sections
+ * do not depend on the code table and are not counted.  A custom table
+ * is embedded in the header of every delta, so the trained table is
+ * charged that once per input delta, and the default table is printed
+ * unless the trained one still comes out smaller. */
+
+#ifndef _XDELTA3_TRAIN_H_
+#define _XDELTA3_TRAIN_H_
+
+/* The corpus is truncated at this many instructions. */
+#define MAIN_TRAIN_MAX_INSTS (1U << 22)
+
+/* Coordinate descent gives up after this many passes. */
+#define MAIN_TRAIN_MAX_PASSES 64
+
+/* Number of cache configurations searched in full. */
+#define MAIN_TRAIN_CANDIDATES 3
+
+typedef struct _main_train_inst main_train_inst;
+
+struct _main_train_inst
+{
+  uint8_t type;   /* XD3_ADD, XD3_RUN, XD3_CPY, or XD3_NOOP to mark
+		   * the start of a window */
+  usize_t size;
+  usize_t addr;   /* copy address, including the source segment */
+  usize_t here;   /* copy position, including the source segment */
+};
+
+static main_train_inst *main_train_insts = NULL;
+static usize_t          main_train_count = 0;
+static usize_t          main_train_alloc = 0;
+
+static int
+main_train_push (uint8_t type, usize_t size, usize_t addr, usize_t here)
+{
+  main_train_inst *t;
+
+  if (main_train_count == MAIN_TRAIN_MAX_INSTS)
+    {
+      return 0;
+    }
+
+  if (main_train_count == main_train_alloc)
+    {
+      usize_t nalloc = max (main_train_alloc * 2, 1U << 12);
+      main_train_inst *ninsts;
+
+      if ((ninsts = (main_train_inst*)
+	   main_malloc (nalloc * sizeof (main_train_inst))) == NULL)
+	{
+	  return ENOMEM;
+	}
+
+      if (main_train_count > 0)
+	{
+	  memcpy (ninsts, main_train_insts,
+		  main_train_count * sizeof (main_train_inst));
+	}
+
+      main_free (main_train_insts);
+      main_train_insts = ninsts;
+      main_train_alloc = nalloc;
+    }
+
+  t = & main_train_insts[main_train_count++];
+  t->type = type;
+  t->size = size;
+  t->addr = addr;
+  t->here = here;
+  return 0;
+}
+
+/* Output function for main_input(): records one decoded window. */
+static int
+main_train_func (xd3_stream* stream, main_file *no_write)
+{
+  int ret;
+  usize_t pos = 0;
+
+  (void) no_write;
+
+  if ((ret = main_train_push (XD3_NOOP, 0, 0, 0)))
+    {
+      return ret;
+    }
+
+  while (stream->inst_sect.buf < stream->inst_sect.buf_max)
+    {
+      const xd3_hinst *insts[2];
+      int i;
+
+      if ((ret = xd3_decode_instruction (stream)))
+	{
+	  XPR(NT "instruction decode error at %"Q"u: %s\n",
+	      stream->dec_winstart + pos, stream->msg);
+	  return ret;
+	}
+
+      insts[0] = & stream->dec_current1;
+      insts[1] = & stream->dec_current2;
+
+      for (i = 0; i < 2; i += 1)
+	{
+	  uint8_t type = insts[i]->type;
+
+	  if (type == XD3_NOOP)
+	    {
+	      continue;
+	    }
+
+	  if ((ret = main_train_push (min (type, XD3_CPY), insts[i]->size,
+				      insts[i]->addr,
+				      stream->dec_cpylen + pos)))
+	    {
+	      return ret;
+	    }
+
+	  pos += insts[i]->size;
+	}
+    }
+
+  return 0;
+}
+
+/* Computes the address modes of every copy in the corpus for the
+ * cache configuration of DESC, storing them in MODES.  Returns the
+ * size of the address section. */
+static xoff_t
+main_train_address_cost (const xd3_code_table_desc *desc,
+			 xd3_addr_cache *acache,
+			 uint8_t *modes)
+{
+  xoff_t cost = 0;
+  usize_t i;
+
+  acache->s_near = desc->near_modes;
+  acache->s_same = desc->same_modes;
+  acache->generation = 0;
+  memset (acache->same_gen, 0, MAX_MODES * 256 * sizeof (usize_t));
+
+  for (i = 0; i < main_train_count; i += 1)
+    {
+      const main_train_inst *t = & main_train_insts[i];
+      usize_t mode, val;
+
+      if (t->type == XD3_NOOP)
+	{
+	  xd3_init_cache (acache);
+	  continue;
+	}
+
+      if (t->type != XD3_CPY)
+	{
+	  continue;
+	}
+
+      mode = xd3_choose_address (acache, t->addr, t->here, & val);
+
+      cost += (mode >= 2 + acache->s_near) ? 1 : xd3_sizeof_size (val);
+      modes[i] = (uint8_t) mode;
+
+      xd3_update_cache (acache, t->addr);
+    }
+
+  return cost;
+}
+
+/* Returns the encoded size of a single instruction. */
+static usize_t
+main_train_single_cost (const xd3_dinst *table, const xd3_rinst *single)
+{
+  return 1 + (table[single->code1].size1 == 0 ?
+	      xd3_sizeof_size (single->size) : 0);
+}
+
+/* Returns the size of the instruction section of the corpus when
+ * encoded with DESC, given the copy MODES. */
+static xoff_t
+main_train_inst_cost (const xd3_code_table_desc *desc,
+		      const uint8_t *modes)
+{
+  xd3_dinst table[256];
+  xd3_rinst buf[2];
+  xd3_rinst *prev = NULL;
+  xoff_t cost = 0;
+  usize_t i;
+
+  memset (table, 0, sizeof (table));
+  xd3_build_code_table (desc, table);
+
+  for (i = 0; i < main_train_count; i += 1)
+    {
+      const main_train_inst *t = & main_train_insts[i];
+      xd3_rinst *inst;
+
+      if (t->type == XD3_NOOP)
+	{
+	  if (prev != NULL) { cost += main_train_single_cost (table, prev); }
+	  prev = NULL;
+	  continue;
+	}
+
+      inst = (prev == & buf[0]) ? & buf[1] : & buf[0];
+      inst->type = t->type == XD3_CPY ? XD3_CPY + modes[i] : t->type;
+      inst->size = t->size;
+      inst->code2 = 0;
+
+      xd3_choose_instruction_desc (desc, prev, inst);
+
+      if (prev != NULL)
+	{
+	  if (prev->code2 != 0)
+	    {
+	      cost += 1;
+	      prev = NULL;
+	      continue;
+	    }
+
+	  cost += main_train_single_cost (table, prev);
+	}
+
+      prev = inst;
+    }
+
+  if (prev != NULL) { cost += main_train_single_cost (table, prev); }
+
+  return cost;
+}
+
+/* Fills the add_sizes of DESC with the instructions left over by its
+ * other parameters and initializes it.  Returns non-zero if the
+ * parameters do not describe a table. */
+static int
+main_train_complete_desc (xd3_code_table_desc *desc)
+{
+  usize_t count;
+
+  if (desc->addcopy_near_cpy_max >= MIN_MATCH + desc->cpy_sizes ||
+      desc->addcopy_same_cpy_max >= MIN_MATCH + desc->cpy_sizes ||
+      desc->copyadd_near_cpy_max >= MIN_MATCH + desc->cpy_sizes ||
+      desc->copyadd_same_cpy_max >= MIN_MATCH + desc->cpy_sizes)
+    {
+      return XD3_INVALID;
+    }
+
+  desc->add_sizes = 0;
+
+  if ((count = xd3_code_table_desc_count (desc)) > 256)
+    {
+      return XD3_INVALID;
+    }
+
+  desc->add_sizes = (uint8_t) (256 - count);
+
+  /* Double instructions only pair immediate adds. */
+  if (desc->addcopy_add_max > desc->add_sizes ||
+      desc->copyadd_add_max > desc->add_sizes)
+    {
+      return XD3_INVALID;
+    }
+
+  return xd3_init_code_table_desc (desc);
+}
+
+/* Returns the parameter of DESC numbered I, in "--codetable=" order. */
+static uint8_t*
+main_train_param (xd3_code_table_desc *desc, int i)
+{
+  switch (i)
+    {
+    case 0: return & desc->add_sizes;
+    case 1: return & desc->near_modes;
+    case 2: return & desc->same_modes;
+    case 3: return & desc->cpy_sizes;
+    case 4: return & desc->addcopy_add_max;
+    case 5: return & desc->addcopy_near_cpy_max;
+    case 6: return & desc->addcopy_same_cpy_max;
+    case 7: return & desc->copyadd_add_max;
+    case 8: return & desc->copyadd_near_cpy_max;
+    default: return & desc->copyadd_same_cpy_max;
+    }
+}
+
+/* Searches the table parameters of DESC, which has a fixed cache
+ * configuration and MODES computed by main_train_address_cost(), by
+ * coordinate descent.  Returns the instruction cost of the result. */
+static xoff_t
+main_train_descend (xd3_code_table_desc *desc, const uint8_t *modes)
+{
+  xoff_t best = main_train_inst_cost (desc, modes);
+  int pass, improved = 1;
+
+  for (pass = 0; improved && pass < MAIN_TRAIN_MAX_PASSES; pass += 1)
+    {
+      int i, step;
+
+      improved = 0;
+
+      /* Parameters 0-2 are fixed by the caller. */
+      for (i = 3; i < 10; i += 1)
+	{
+	  for (step = -1; step <= 1; step += 2)
+	    {
+	      xd3_code_table_desc cand = *desc;
+	      uint8_t *p = main_train_param (& cand, i);
+	      xoff_t cost;
+
+	      if (step < 0 && *p == 0)
+		{
+		  continue;
+		}
+
+	      *p += step;
+
+	      if (main_train_complete_desc (& cand) != 0)
+		{
+		  continue;
+		}
+
+	      if ((cost = main_train_inst_cost (& cand, modes)) < best)
+		{
+		  best = cost;
+		  *desc = cand;
+		  improved = 1;
+		}
+	    }
+	}
+    }
+
+  return best;
+}
+
+/* Initializes DESC with the double-instruction shape of the default
+ * table and the given cache configuration. */
+static int
+main_train_initial_desc (xd3_code_table_desc *desc,
+			 usize_t near_modes, usize_t same_modes)
+{
+  *desc = __rfc3284_code_table_desc;
+  desc->near_modes = (uint8_t) near_modes;
+  desc->same_modes = (uint8_t) same_modes;
+  return main_train_complete_desc (desc);
+}
+
+/* The VCD_CODETABLE header bytes that embedding DESC costs, as
+ * xd3_emit_hdr() writes them. */
+static int
+main_train_header_cost (const xd3_code_table_desc *desc, xoff_t *cost)
+{
+  xd3_dinst table[256];
+  uint8_t comp[CODE_TABLE_VCDIFF_SIZE];
+  usize_t comp_size;
+  int ret;
+
+  memset (table, 0, sizeof (table));
+  xd3_build_code_table (desc, table);
+
+  if ((ret = xd3_compute_code_table_encoding (table, comp, & comp_size)))
+    {
+      XPR(NT "code table encoding failed: %s\n", xd3_mainerror (ret));
+      return ret;
+    }
+
+  *cost = xd3_sizeof_size (comp_size + 2) + 2 + comp_size;
+  return 0;
+}
+
+static int
+main_train_codetable (int argc, char **argv)
+{
+  xd3_code_table_desc cands[MAIN_TRAIN_CANDIDATES];
+  xoff_t cand_cost[MAIN_TRAIN_CANDIDATES];
+  xd3_code_table_desc best_desc;
+  xoff_t best_cost = 0, default_cost, header_cost = 0;
+  usize_t near_array[MAX_MODES];
+  usize_t near_modes, same_modes;
+  xd3_addr_cache acache;
+  uint8_t *modes = NULL;
+  main_file tfile;
+  char buf[128];
+  int i, ret = EXIT_FAILURE;
+
+  if (argc == 0)
+    {
+      XPR(NT "train-codetable: requires at least one delta file\n");
+      return EXIT_FAILURE;
+    }
+
+  for (i = 0; i < argc; i += 1)
+    {
+      main_file ifile;
+      main_file_init (& ifile);
+      ifile.filename = argv[i];
+      ifile.flags = RD_FIRST | RD_NONEXTERNAL;
+
+      if ((ret = main_file_open (& ifile, argv[i], XO_READ)) == 0)
+	{
+	  ret = main_input (CMD_TRAIN_CODETABLE, & ifile, NULL, NULL);
+	}
+
+      main_file_cleanup (& ifile);
+
+      if (main_bdata != NULL)
+	{
+	  main_buffree (main_bdata);
+	  main_bdata = NULL;
+	  main_bsize = 0;
+	}
+
+      if (ret != 0)
+	{
+	  ret = EXIT_FAILURE;
+	  goto done;
+	}
+    }
+
+  if (main_train_count == MAIN_TRAIN_MAX_INSTS && ! option_quiet)
+    {
+      XPR(NT "warning: training input truncated at %u instructions\n",
+	  main_train_count);
+    }
+
+  memset (& acache, 0, sizeof (acache));
+  acache.near_array = near_array;
+
+  ret = EXIT_FAILURE;
+
+  if ((modes = (uint8_t*) main_malloc (main_train_count + 1)) == NULL ||
+      (acache.same_array = (usize_t*)
+       main_malloc (MAX_MODES * 256 * sizeof (usize_t))) == NULL ||
+      (acache.same_gen = (usize_t*)
+       main_malloc (MAX_MODES * 256 * sizeof (usize_t))) == NULL)
+    {
+      goto done;
+    }
+
+  /* The baseline is the default table. */
+  best_desc = __rfc3284_code_table_desc;
+  default_cost = main_train_address_cost (& best_desc, & acache, modes) +
+    main_train_inst_cost (& best_desc, modes);
+
+  /* Rank the cache configurations using the default table shape. */
+  for (i = 0; i < MAIN_TRAIN_CANDIDATES; i += 1)
+    {
+      cand_cost[i] = XOFF_T_MAX;
+    }
+
+  for (near_modes = 0; near_modes + 2 <= MAX_MODES; near_modes += 1)
+    {
+      for (same_modes = 0;
+	   near_modes + same_modes + 2 <= MAX_MODES;
+	   same_modes += 1)
+	{
+	  xd3_code_table_desc desc;
+	  xoff_t cost;
+	  int j;
+
+	  if (main_train_initial_desc (& desc, near_modes, same_modes))
+	    {
+	      continue;
+	    }
+
+	  cost = main_train_address_cost (& desc, & acache, modes) +
+	    main_train_inst_cost (& desc, modes);
+
+	  for (j = MAIN_TRAIN_CANDIDATES - 1;
+	       j >= 0 && cost < cand_cost[j]; j -= 1)
+	    {
+	      if (j + 1 < MAIN_TRAIN_CANDIDATES)
+		{
+		  cands[j+1] = cands[j];
+		  cand_cost[j+1] = cand_cost[j];
+		}
+	      cands[j] = desc;
+	      cand_cost[j] = cost;
+	    }
+	}
+    }
+
+  /* Refine the table shape of the leading configurations. */
+  for (i = 0; i < MAIN_TRAIN_CANDIDATES && cand_cost[i] != XOFF_T_MAX;
+       i += 1)
+    {
+      xoff_t cost = main_train_address_cost (& cands[i], & acache, modes);
+
+      cost += main_train_descend (& cands[i], modes);
+
+      if (i == 0 || cost < best_cost)
+	{
+	  best_desc = cands[i];
+	  best_cost = cost;
+	}
+    }
+
+  if (memcmp (& best_desc, & __rfc3284_code_table_desc,
+	      sizeof (best_desc)) != 0)
+    {
+      if (main_train_header_cost (& best_desc, & header_cost))
+	{
+	  goto done;
+	}
+
+      header_cost *= (xoff_t) argc;
+    }
+
+  if (option_verbose)
+    {
+      XPR(NT "%u instructions: default table %"Q"u bytes, "
+	  "trained table %"Q"u bytes + %"Q"u header bytes\n",
+	  main_train_count, default_cost, best_cost, header_cost);
+    }
+
+  if (best_cost + header_cost >= default_cost)
+    {
+      best_desc = __rfc3284_code_table_desc;
+    }
+
+  /* Print the table parameters in "--codetable=" order. */
+  for (i = 0, buf[0] = 0; i < 10; i += 1)
+    {
+      size_t len = strlen (buf);
+      xsnprintf_func (buf + len, sizeof (buf) - len, "%s%u",
+		      i == 0 ? "" : ",",
+		      (unsigned) *main_train_param (& best_desc, i));
+    }
+
+  main_file_init (& tfile);
+  XSTDOUT_XF (& tfile);
+  strcat (buf, "\n");
+
+  if (main_file_write (& tfile, (uint8_t*) buf, (usize_t) strlen (buf),
+		       "write failed") == 0)
+    {
+      ret = EXIT_SUCCESS;
+    }
+
+  main_file_cleanup (& tfile);
+
+ done:
+  main_free (modes);
+  main_free (acache.same_array);
+  main_free (acache.same_gen);
+  main_free (main_train_insts);
+  main_train_insts = NULL;
+  main_train_count = 0;
+  main_train_alloc = 0;
+  return ret;
+}
+
+#endif /* _XDELTA3_TRAIN_H_ */
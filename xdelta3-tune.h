@@ -0,0 +1,665 @@
+/* xdelta 3 - delta compression tools and library
+ * Copyright (C) 2007.  Joshua P. MacDonald
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* The "tune-smatcher" command searches the soft string-matcher
+ * configuration (-C) and secondary compressor settings for the best
+ * trade-offs between encode speed and delta size on a corpus of
+ * source/target pairs:
+ *
+ *   xdelta3 tune-smatcher [name=value ...] SOURCE TARGET [SOURCE TARGET ...]
+ *
+ *   samples=64        random configurations to try
+ *   seed=1            random seed for the search
+ *   reps=3            encodes of each pair, the fastest is kept
+ *   secondary=none    secondary compressors to consider (none, djw,
+ *                     fgk, lzma); DJW group and sector settings are
+ *                     searched as well
+ *   cfgs=FILE         where to write the preset blocks (default stdout)
+ *
+ * Every configuration is run through the soft matcher, including the
+ * built-in presets, so that their timings are comparable.  After the
+ * random samples, each neighbor of a point on the Pareto frontier is
+ * tried once.  The frontier is printed, and five points spread along
+ * it are written as the fastest, faster, fast, default and slow
+ * blocks of xdelta3-cfgs.h, ready to replace the existing ones.
+ * Secondary settings are noted in a comment on each block.  The
+ * binary-tree target matcher (SBTREE), which -C cannot select, is
+ * searched as an on/off setting. */
+
+#ifndef _XDELTA3_TUNE_H_
+#define _XDELTA3_TUNE_H_
+
+#define MAIN_TUNE_MAX_POINTS 1024
+#define MAIN_TUNE_MAX_VALUES 10
+#define MAIN_TUNE_STARS \
+  "********************************************************"
+
+typedef struct _main_tune_point main_tune_point;
+typedef struct _main_tune_pair  main_tune_pair;
+
+/* The -C parameters in order, with the values searched for each.
+ * SLOOK is fixed because xd3_scksum only handles 4 bytes. */
+static const struct
+{
+  const char *name;
+  usize_t     count;
+  usize_t     values[MAIN_TUNE_MAX_VALUES];
+} main_tune_params[XD3_SOFTCFG_VARCNT] =
+{
+  { "LLOOK",      5,  { 9, 11, 13, 16, 20 } },
+  { "LSTEP",      10, { 2, 3, 4, 6, 8, 11, 15, 20, 26, 34 } },
+  { "SLOOK",      1,  { 4 } },
+  { "SCHAIN",     8,  { 1, 2, 4, 8, 16, 32, 44, 64 } },
+  { "SLCHAIN",    5,  { 1, 2, 4, 8, 13 } },
+  { "MAXLAZY",    7,  { 6, 12, 18, 36, 60, 90, 128 } },
+  { "LONGENOUGH", 6,  { 6, 18, 35, 70, 128, 256 } },
+};
+
+static const usize_t main_tune_groups[] = { 0, 1, 2, 4, 8 };
+static const usize_t main_tune_sectors[] = { 0, 10, 20, 50, 100 };
+
+struct _main_tune_point
+{
+  usize_t     values[XD3_SOFTCFG_VARCNT];
+  usize_t     tree;          /* small_tree (SBTREE), not settable by -C */
+  int         secondary;
+  usize_t     ngroups;       /* DJW only, 0 for automatic */
+  usize_t     sector_size;   /* DJW only, 0 for automatic */
+  const char *preset;        /* name of a built-in preset, or NULL */
+  double      secs;
+  xoff_t      bytes;
+};
+
+struct _main_tune_pair
+{
+  uint8_t *source;
+  usize_t  source_size;
+  uint8_t *target;
+  usize_t  target_size;
+};
+
+static main_tune_point *main_tune_points = NULL;
+static usize_t          main_tune_npoints = 0;
+
+/* Reads a whole file into a buffer from main_bufalloc. */
+static int
+main_tune_read (const char *name, uint8_t **bufp, usize_t *sizep)
+{
+  main_file file;
+  xoff_t size;
+  size_t nread;
+  int ret;
+
+  main_file_init (& file);
+
+  if ((ret = main_file_open (& file, name, XO_READ)) ||
+      (ret = main_file_stat (& file, & size)))
+    {
+      goto done;
+    }
+
+  if (size > USIZE_T_MAX / 2)
+    {
+      XPR(NT "tune-smatcher: %s: file too large\n", name);
+      ret = EXIT_FAILURE;
+      goto done;
+    }
+
+  if ((*bufp = (uint8_t*) main_bufalloc (max ((usize_t) size, 1U))) == NULL)
+    {
+      ret = ENOMEM;
+      goto done;
+    }
+
+  if ((ret = main_file_read (& file, *bufp, (size_t) size, & nread,
+			     "read failed")) == 0)
+    {
+      *sizep = (usize_t) nread;
+    }
+
+ done:
+  main_file_cleanup (& file);
+  return ret;
+}
+
+static void
+main_tune_format (const main_tune_point *p, char *buf, size_t size)
+{
+  size_t len;
+  int i;
+
+  buf[0] = 0;
+
+  for (i = 0; i < XD3_SOFTCFG_VARCNT; i += 1)
+    {
+      len = strlen (buf);
+      snprintf_func (buf + len, size - len, "%s%u", i ? "," : "",
+		     p->values[i]);
+    }
+
+  if (p->tree)
+    {
+      len = strlen (buf);
+      snprintf_func (buf + len, size - len, " tree");
+    }
+
+  len = strlen (buf);
+  snprintf_func (buf + len, size - len, " -S %s",
+		 main_bench_secondary_name (p->secondary));
+
+  if (p->secondary == XD3_SEC_DJW)
+    {
+      len = strlen (buf);
+      snprintf_func (buf + len, size - len, " groups %u sector %u",
+		     p->ngroups, p->sector_size);
+    }
+}
+
+/* Encodes every pair with the configuration P and records the time
+ * and total delta size. */
+static int
+main_tune_eval (main_tune_point *p, main_tune_pair *pairs, usize_t npairs,
+		usize_t reps, uint8_t *delta, usize_t delta_max)
+{
+  xd3_config config;
+  usize_t i, r;
+  int ret;
+
+  xd3_init_config (& config, p->secondary);
+  config.winsize = XD3_DEFAULT_WINSIZE;
+  config.smatch_cfg = XD3_SMATCH_SOFT;
+  config.smatcher_soft.large_look   = p->values[0];
+  config.smatcher_soft.large_step   = p->values[1];
+  config.smatcher_soft.small_look   = p->values[2];
+  config.smatcher_soft.small_chain  = p->values[3];
+  config.smatcher_soft.small_lchain = p->values[4];
+  config.smatcher_soft.max_lazy     = p->values[5];
+  config.smatcher_soft.long_enough  = p->values[6];
+  config.smatcher_soft.small_tree   = p->tree;
+  config.sec_data.ngroups = config.sec_inst.ngroups =
+    config.sec_addr.ngroups = p->ngroups;
+  config.sec_data.sector_size = config.sec_inst.sector_size =
+    config.sec_addr.sector_size = p->sector_size;
+
+  p->secs = 0;
+  p->bytes = 0;
+
+  for (i = 0; i < npairs; i += 1)
+    {
+      xoff_t best = 0;
+      usize_t delta_size = 0;
+
+      for (r = 0; r < reps; r += 1)
+	{
+	  xoff_t start = main_bench_usecs ();
+
+	  if ((ret = main_bench_stream (& config,
+					pairs[i].source, pairs[i].source_size,
+					1, pairs[i].target,
+					pairs[i].target_size,
+					delta, & delta_size, delta_max)))
+	    {
+	      return ret;
+	    }
+
+	  start = main_bench_usecs () - start;
+	  best = (r == 0) ? start : min (best, start);
+	}
+
+      p->secs += best / 1e6;
+      p->bytes += delta_size;
+    }
+
+  return 0;
+}
+
+static int
+main_tune_same (const main_tune_point *a, const main_tune_point *b)
+{
+  return memcmp (a->values, b->values, sizeof (a->values)) == 0 &&
+    a->tree == b->tree &&
+    a->secondary == b->secondary &&
+    a->ngroups == b->ngroups &&
+    a->sector_size == b->sector_size;
+}
+
+/* Evaluates P unless an equal point was already tried. */
+static int
+main_tune_try (main_tune_point *p, main_tune_pair *pairs, usize_t npairs,
+	       usize_t reps, uint8_t *delta, usize_t delta_max)
+{
+  usize_t i;
+  int ret;
+
+  if (p->values[4] > p->values[3])
+    {
+      p->values[4] = p->values[3];
+    }
+
+  for (i = 0; i < main_tune_npoints; i += 1)
+    {
+      if (main_tune_same (& main_tune_points[i], p)) { return 0; }
+    }
+
+  if (main_tune_npoints == MAIN_TUNE_MAX_POINTS) { return 0; }
+
+  if ((ret = main_tune_eval (p, pairs, npairs, reps, delta, delta_max)))
+    {
+      return ret;
+    }
+
+  main_tune_points[main_tune_npoints++] = *p;
+  return 0;
+}
+
+static int
+main_tune_cmp_secs (const void *a, const void *b)
+{
+  double x = ((const main_tune_point*) a)->secs;
+  double y = ((const main_tune_point*) b)->secs;
+  return (x > y) - (x < y);
+}
+
+/* Sorts the points by time and moves the Pareto frontier (points that
+ * no other point beats in both time and size) to the front.  Returns
+ * the number of frontier points. */
+static usize_t
+main_tune_frontier (void)
+{
+  usize_t i, n = 0;
+  xoff_t best_bytes = 0;
+
+  qsort (main_tune_points, main_tune_npoints, sizeof (main_tune_point),
+	 main_tune_cmp_secs);
+
+  for (i = 0; i < main_tune_npoints; i += 1)
+    {
+      if (n == 0 || main_tune_points[i].bytes < best_bytes)
+	{
+	  main_tune_point tmp = main_tune_points[n];
+	  main_tune_points[n] = main_tune_points[i];
+	  main_tune_points[i] = tmp;
+	  best_bytes = main_tune_points[n].bytes;
+	  n += 1;
+	}
+    }
+
+  return n;
+}
+
+/* Picks a random configuration from the search space. */
+static void
+main_tune_random (main_bench_config *gen, main_bench_config *b,
+		  main_tune_point *p)
+{
+  int i;
+
+  memset (p, 0, sizeof (*p));
+
+  for (i = 0; i < XD3_SOFTCFG_VARCNT; i += 1)
+    {
+      p->values[i] = main_tune_params[i].values
+	[main_bench_random (gen) % main_tune_params[i].count];
+    }
+
+  p->tree = main_bench_random (gen) % 2;
+  p->secondary = b->secondary[main_bench_random (gen) % b->nsecondary];
+
+  if (p->secondary == XD3_SEC_DJW)
+    {
+      p->ngroups = main_tune_groups
+	[main_bench_random (gen) % SIZEOF_ARRAY (main_tune_groups)];
+      p->sector_size = main_tune_sectors
+	[main_bench_random (gen) % SIZEOF_ARRAY (main_tune_sectors)];
+    }
+}
+
+/* Returns the index of V in the value list of parameter I. */
+static usize_t
+main_tune_index (int i, usize_t v)
+{
+  usize_t j;
+
+  for (j = 0; j < main_tune_params[i].count; j += 1)
+    {
+      if (main_tune_params[i].values[j] >= v) { return j; }
+    }
+
+  return main_tune_params[i].count - 1;
+}
+
+/* Writes one xdelta3-cfgs.h template block. */
+static int
+main_tune_emit (main_file *xfile, const char *name, const main_tune_point *p,
+		double mbps, double ratio)
+{
+  char upper[16];
+  char desc[128];
+  int ret, i;
+
+  for (i = 0; name[i] != 0 && i < (int) sizeof (upper) - 1; i += 1)
+    {
+      upper[i] = (char) (name[i] - 'a' + 'A');
+    }
+  upper[i] = 0;
+
+  main_tune_format (p, desc, sizeof (desc));
+
+  VC(UT "/%.54s\n %s string matcher\n %.56s/\n"
+     "/* Tuned: %.1f MB/s, ratio %.4f, -C %s */\n"
+     "#if XD3_BUILD_%s\n#define TEMPLATE      %s\n",
+     MAIN_TUNE_STARS, upper, MAIN_TUNE_STARS, mbps, ratio, desc,
+     upper, name)VE;
+
+  for (i = 0; i < XD3_SOFTCFG_VARCNT; i += 1)
+    {
+      VC(UT "#define %-13s %u%s\n", main_tune_params[i].name,
+	 p->values[i], i == 2 ? "U" : "")VE;
+    }
+
+  VC(UT "#define %-13s %u\n", "SBTREE", p->tree)VE;
+  VC(UT "\n#include \"xdelta3.c\"\n\n#undef  TEMPLATE\n")VE;
+
+  for (i = 0; i < XD3_SOFTCFG_VARCNT; i += 1)
+    {
+      VC(UT "#undef  %s\n", main_tune_params[i].name)VE;
+    }
+
+  VC(UT "#undef  SBTREE\n")VE;
+
+  VC(UT "#endif\n\n")VE;
+  return 0;
+}
+
+static int
+main_tune_smatcher (int argc, char **argv)
+{
+  static const char *slots[] =
+    { "fastest", "faster", "fast", "default", "slow" };
+  const xd3_smatcher *presets[] =
+    {
+#if XD3_BUILD_FASTEST
+      & __smatcher_fastest,
+#endif
+#if XD3_BUILD_FASTER
+      & __smatcher_faster,
+#endif
+#if XD3_BUILD_FAST
+      & __smatcher_fast,
+#endif
+#if XD3_BUILD_DEFAULT
+      & __smatcher_default,
+#endif
+#if XD3_BUILD_SLOW
+      & __smatcher_slow,
+#endif
+      NULL
+    };
+  main_bench_config b, gen;
+  main_tune_pair *pairs = NULL;
+  main_tune_point p;
+  main_file tfile, cfile;
+  main_file *xfile;
+  usize_t samples = 64, reps = 3, npairs = 0, nfront;
+  usize_t i, j, k, delta_max = 0;
+  xoff_t total_in = 0;
+  uint8_t *delta = NULL;
+  const char *cfgs = NULL;
+  char desc[128];
+  int ret = EXIT_FAILURE;
+  int a;
+
+  main_file_init (& tfile);
+  main_file_init (& cfile);
+  memset (& b, 0, sizeof (b));
+  memset (& gen, 0, sizeof (gen));
+  b.nsecondary = 1;
+  gen.rand = 1;
+
+  if ((pairs = (main_tune_pair*)
+       main_malloc (sizeof (main_tune_pair) * (argc / 2 + 1))) == NULL ||
+      (main_tune_points = (main_tune_point*)
+       main_malloc (sizeof (main_tune_point) * MAIN_TUNE_MAX_POINTS)) == NULL)
+    {
+      goto done;
+    }
+
+  memset (pairs, 0, sizeof (main_tune_pair) * (argc / 2 + 1));
+  main_tune_npoints = 0;
+
+  for (a = 0; a < argc; a += 1)
+    {
+      const char *val = strchr (argv[a], '=');
+      usize_t seed;
+
+      if (val == NULL)
+	{
+	  if (a + 1 == argc)
+	    {
+	      XPR(NT "tune-smatcher: %s has no target\n", argv[a]);
+	      goto done;
+	    }
+
+	  if (main_tune_read (argv[a], & pairs[npairs].source,
+			      & pairs[npairs].source_size) ||
+	      main_tune_read (argv[a + 1], & pairs[npairs].target,
+			      & pairs[npairs].target_size))
+	    {
+	      npairs += 1;
+	      goto done;
+	    }
+
+	  total_in += pairs[npairs].target_size;
+	  delta_max = max (delta_max, pairs[npairs].target_size);
+	  npairs += 1;
+	  a += 1;
+	  continue;
+	}
+
+      val += 1;
+
+      if (strncmp (argv[a], "samples=", 8) == 0)
+	{
+	  if (main_bench_size ("samples", val, & samples)) { goto done; }
+	}
+      else if (strncmp (argv[a], "seed=", 5) == 0)
+	{
+	  if (main_bench_size ("seed", val, & seed)) { goto done; }
+	  gen.rand = seed ? seed : 1;
+	}
+      else if (strncmp (argv[a], "reps=", 5) == 0)
+	{
+	  if (main_bench_size ("reps", val, & reps)) { goto done; }
+	}
+      else if (strncmp (argv[a], "secondary=", 10) == 0)
+	{
+	  if (main_bench_secondary (val, & b)) { goto done; }
+	}
+      else if (strncmp (argv[a], "cfgs=", 5) == 0)
+	{
+	  cfgs = val;
+	}
+      else
+	{
+	  XPR(NT "tune-smatcher: unrecognized parameter: %s\n", argv[a]);
+	  goto done;
+	}
+    }
+
+  if (npairs == 0 || reps == 0 || total_in == 0)
+    {
+      XPR(NT "tune-smatcher: requires SOURCE TARGET pairs\n");
+      goto done;
+    }
+
+  delta_max += delta_max / 2 + XD3_ALLOCSIZE;
+
+  if ((delta = (uint8_t*) main_bufalloc (delta_max)) == NULL ||
+      (tfile.snprintf_buf = (uint8_t*) main_malloc (SNPRINTF_BUFSIZE)) == NULL)
+    {
+      goto done;
+    }
+
+  XSTDOUT_XF (& tfile);
+  xfile = & tfile;
+
+  /* The built-in presets, with each secondary compressor. */
+  for (i = 0; presets[i] != NULL; i += 1)
+    {
+      for (j = 0; j < b.nsecondary; j += 1)
+	{
+	  memset (& p, 0, sizeof (p));
+	  p.values[0] = presets[i]->large_look;
+	  p.values[1] = presets[i]->large_step;
+	  p.values[2] = presets[i]->small_look;
+	  p.values[3] = presets[i]->small_chain;
+	  p.values[4] = presets[i]->small_lchain;
+	  p.values[5] = presets[i]->max_lazy;
+	  p.values[6] = presets[i]->long_enough;
+	  p.tree = presets[i]->small_tree;
+	  p.secondary = b.secondary[j];
+	  p.preset = presets[i]->name;
+
+	  if (main_tune_try (& p, pairs, npairs, reps, delta, delta_max))
+	    {
+	      goto fail;
+	    }
+	}
+    }
+
+  for (i = 0; i < samples; i += 1)
+    {
+      main_tune_random (& gen, & b, & p);
+
+      if (main_tune_try (& p, pairs, npairs, reps, delta, delta_max))
+	{
+	  goto fail;
+	}
+    }
+
+  /* One step in each direction from every frontier point. */
+  nfront = main_tune_frontier ();
+
+  for (i = 0; i < nfront; i += 1)
+    {
+      for (k = 0; k < XD3_SOFTCFG_VARCNT; k += 1)
+	{
+	  usize_t idx = main_tune_index ((int) k, main_tune_points[i].values[k]);
+
+	  for (j = 0; j < 2; j += 1)
+	    {
+	      if ((j == 0 && idx == 0) ||
+		  (j == 1 && idx + 1 >= main_tune_params[k].count))
+		{
+		  continue;
+		}
+
+	      p = main_tune_points[i];
+	      p.preset = NULL;
+	      p.values[k] = main_tune_params[k].values[j ? idx + 1 : idx - 1];
+
+	      if (main_tune_try (& p, pairs, npairs, reps, delta, delta_max))
+		{
+		  goto fail;
+		}
+	    }
+	}
+
+      p = main_tune_points[i];
+      p.preset = NULL;
+      p.tree = ! p.tree;
+
+      if (main_tune_try (& p, pairs, npairs, reps, delta, delta_max))
+	{
+	  goto fail;
+	}
+    }
+
+  nfront = main_tune_frontier ();
+
+  VC(UT "%u pairs, %"Q"u target bytes, %u configurations, "
+     "%u on the frontier\n", npairs, total_in, main_tune_npoints, nfront)VE;
+  VC(UT "    MB/s      delta   ratio  -C\n")VE;
+
+  for (i = 0; i < nfront; i += 1)
+    {
+      main_tune_point *q = & main_tune_points[i];
+
+      main_tune_format (q, desc, sizeof (desc));
+      VC(UT "%8.2f %10"Q"u %7.4f  %s%s%s\n",
+	 total_in / 1e6 / max (q->secs, 1e-6), q->bytes,
+	 (double) q->bytes / total_in, desc,
+	 q->preset ? " preset " : "", q->preset ? q->preset : "")VE;
+    }
+
+  if (cfgs != NULL)
+    {
+      if (main_file_open (& cfile, cfgs, XO_WRITE) ||
+	  (cfile.snprintf_buf =
+	   (uint8_t*) main_malloc (SNPRINTF_BUFSIZE)) == NULL)
+	{
+	  goto done;
+	}
+
+      xfile = & cfile;
+    }
+  else
+    {
+      VC(UT "\n")VE;
+    }
+
+  /* Spread the five presets along the frontier, fastest first. */
+  for (i = 0; i < SIZEOF_ARRAY (slots); i += 1)
+    {
+      main_tune_point *q =
+	& main_tune_points[i * (nfront - 1) / (SIZEOF_ARRAY (slots) - 1)];
+
+      if (main_tune_emit (xfile, slots[i], q,
+			  total_in / 1e6 / max (q->secs, 1e-6),
+			  (double) q->bytes / total_in))
+	{
+	  goto fail;
+	}
+    }
+
+  ret = main_file_close (& cfile) ? EXIT_FAILURE : EXIT_SUCCESS;
+  goto done;
+
+ fail:
+  ret = EXIT_FAILURE;
+
+ done:
+  if (pairs != NULL)
+    {
+      for (i = 0; i < npairs; i += 1)
+	{
+	  main_buffree (pairs[i].source);
+	  main_buffree (pairs[i].target);
+	}
+    }
+
+  main_buffree (delta);
+  main_free (pairs);
+  main_free (main_tune_points);
+  main_tune_points = NULL;
+  main_file_cleanup (& cfile);
+  main_file_cleanup (& tfile);
+  return ret;
+}
+
+#endif /* _XDELTA3_TUNE_H_ */
@@ -264,6 +264,13 @@
 #ifndef __XDELTA3_C_HEADER_PASS__
 #define __XDELTA3_C_HEADER_PASS__
 
+/* For ftruncate() in xdelta3-main.h.  Feature-test macros only take
+ * effect before the first system header, which xdelta3.h includes,
+ * so this is set here rather than in the public header. */
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 500
+#endif
+
 #include "xdelta3.h"
 
 /***********************************************************************
@@ -310,6 +317,46 @@
 #define IF_ENCODER(x)
 #endif
 
+/* Performance counters: PERF_NOW reads the clock and PERF_ADD charges
+ * the time since to a field of stream->perf, both only when XD3_PERF
+ * is set. */
+#if XD3_PERF_COUNTERS
+#ifndef _WIN32
+#include <sys/time.h>
+#endif
+#define PERF_ON(stream)       (((stream)->flags & XD3_PERF) != 0)
+#define IF_PERF(stream,x)     do { if (PERF_ON (stream)) { x; } } while (0)
+#define PERF_NOW(stream)      (PERF_ON (stream) ? xd3_perf_usecs () : 0)
+#define PERF_ADD(stream,f,t0) \
+  IF_PERF (stream, (stream)->perf.f += xd3_perf_usecs () - (t0))
+
+static xoff_t
+xd3_perf_usecs (void)
+{
+#ifndef _WIN32
+  struct timeval tv;
+
+  gettimeofday (& tv, NULL);
+
+  return (xoff_t) tv.tv_sec * 1000000 + (xoff_t) tv.tv_usec;
+#else
+  LARGE_INTEGER count, freq;
+
+  QueryPerformanceCounter (& count);
+  QueryPerformanceFrequency (& freq);
+
+  return (xoff_t) (count.QuadPart / freq.QuadPart) * 1000000 +
+    (xoff_t) (count.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#endif
+}
+#else
+#define PERF_ON(stream)       0
+#define IF_PERF(stream,x)     do { } while (0)
+#define PERF_NOW(stream)      0
+#define PERF_ADD(stream,f,t0) ((void) (t0))
+#define xd3_perf_usecs()      ((xoff_t) 0)
+#endif
+
 /***********************************************************************/
 
   /* header indicator bits */
@@ -391,6 +438,16 @@ XD3_MAKELIST(xd3_rlist, xd3_rinst, link);
 #define HASH_CKOFFSET      1U   /* Table entries distinguish "no-entry" from
 				 * offset 0 using this offset. */
 
+#define TREE_NICE_LEN     273U  /* xd3_tree_match compares at least this
+				 * far before taking a match as long
+				 * enough, as in LZMA. */
+
+#define PROBE_SIZE        512U  /* Target positions aligned to this are
+				 * probed against the source in place
+				 * (see xd3_source_probe). */
+#define PROBE_MISSES      4U    /* Consecutive failed probes before the
+				 * source is indexed ahead again. */
+
 #define MIN_SMALL_LOOK    2U    /* Match-optimization stuff. */
 #define MIN_LARGE_LOOK    2U
 #define MIN_MATCH_OFFSET  1U
@@ -468,7 +525,8 @@ XD3_MAKELIST(xd3_rlist, xd3_rinst, link);
   stream->next_in  += (n);          \
   } while (0)
 
-/* Update the run-length state */
+/* Update the run-length state by one input byte.  This is O(1) per
+ * position; a candidate run is extended with xd3_runlen(). */
 #define NEXTRUN(c) do { if ((c) == run_c) { run_l += 1; } \
   else { run_c = (c); run_l = 1; } } while (0)
 
@@ -510,10 +568,13 @@ static int         xd3_emit_single (xd3_stream *stream, xd3_rinst *single,
 				    usize_t code);
 
 static usize_t      xd3_sizeof_output (xd3_output *output);
+static usize_t      xd3_sizeof_output_tail (const xd3_output *tail);
 static void        xd3_encode_reset (xd3_stream *stream);
+static void        xd3_encode_adler32 (xd3_stream *stream, usize_t pos);
 
 static int         xd3_source_match_setup (xd3_stream *stream, xoff_t srcpos);
 static int         xd3_source_extend_match (xd3_stream *stream);
+static int         xd3_source_probe (xd3_stream *stream);
 static int         xd3_srcwin_setup (xd3_stream *stream);
 static usize_t     xd3_iopt_last_matched (xd3_stream *stream);
 static int         xd3_emit_uint32_t (xd3_stream *stream, xd3_output **output,
@@ -523,6 +584,12 @@ static usize_t xd3_smatch (xd3_stream *stream,
 			   usize_t base,
 			   usize_t scksum,
 			   usize_t *match_offset);
+static usize_t xd3_tree_match (xd3_stream *stream,
+			       usize_t inx,
+			       usize_t *match_offset);
+static usize_t xd3_far_match (xd3_stream *stream,
+			      usize_t cand,
+			      usize_t *back);
 static int xd3_string_match_init (xd3_stream *stream);
 static uint32_t xd3_scksum (uint32_t *state, const uint8_t *seg,
 			    const usize_t ln);
@@ -563,6 +630,7 @@ static void        xd3_compute_code_table_string (const xd3_dinst *code_table,
 						  uint8_t *str);
 static void*       xd3_alloc (xd3_stream *stream, usize_t elts, usize_t size);
 static void        xd3_free  (xd3_stream *stream, void *ptr);
+static usize_t     xd3_runlen (const uint8_t *seg, usize_t size, uint8_t c);
 
 static int         xd3_read_uint32_t (xd3_stream *stream, const uint8_t **inpp,
 				      const uint8_t *max, uint32_t *valp);
@@ -716,6 +784,9 @@ extern const xd3_sec_type djw_sec_type;
 
 #if SECONDARY_LZMA
 extern const xd3_sec_type lzma_sec_type;
+#if XD3_ENCODER
+static xoff_t xd3_lzma_encoder_memory (xd3_stream *stream);
+#endif
 #define IF_LZMA(x) x
 #define LZMA_CASE(s) \
   s->sec_type = & lzma_sec_type; \
@@ -874,19 +945,24 @@ const uint16_t __single_hash[256] =
  *
  * For performance reasons, both the parametrized and non-parametrized
  * versions of xd3_choose_instruction remain.  The parametrized
- * version is only needed for testing multi-table decoding support.
- * If ever multi-table encoding is required, this can be optimized by
- * compiling static functions for each table.
+ * version, xd3_choose_instruction_desc, is used for the alternate
+ * table and for custom tables supplied through
+ * config->code_table_desc (e.g., by "xdelta3 train-codetable").
  */
 
-/* The XD3_CHOOSE_INSTRUCTION calls xd3_choose_instruction with the
- * table description when GENERIC_ENCODE_TABLES are in use.  The
+/* The XD3_CHOOSE_INSTRUCTION calls xd3_choose_instruction_desc with
+ * the table description when GENERIC_ENCODE_TABLES are in use,
+ * otherwise only when a custom table is configured.  The
  * IF_GENCODETBL macro enables generic-code-table specific code. */
 #if GENERIC_ENCODE_TABLES
-#define XD3_CHOOSE_INSTRUCTION(stream,prev,inst) xd3_choose_instruction (stream->code_table_desc, prev, inst)
+#define XD3_CHOOSE_INSTRUCTION(stream,prev,inst) \
+  xd3_choose_instruction_desc (stream->code_table_desc, prev, inst)
 #define IF_GENCODETBL(x) x
 #else
-#define XD3_CHOOSE_INSTRUCTION(stream,prev,inst) xd3_choose_instruction (prev, inst)
+#define XD3_CHOOSE_INSTRUCTION(stream,prev,inst) \
+  ((stream)->code_table_desc == & __rfc3284_code_table_desc ? \
+   xd3_choose_instruction (prev, inst) : \
+   xd3_choose_instruction_desc ((stream)->code_table_desc, prev, inst))
 #define IF_GENCODETBL(x)
 #endif
 
@@ -925,15 +1001,23 @@ struct _xd3_code_table_desc
   uint8_t copyadd_same_cpy_max; /* Maximum cpy size for a copy-add double instruction,
 				   VCD_SAME modes (default 4) */
 
+  /* These are computed from the fields above by
+   * xd3_init_code_table_desc(). */
   xd3_code_table_sizes addcopy_max_sizes[MAX_MODES];
   xd3_code_table_sizes copyadd_max_sizes[MAX_MODES];
 };
 
+/* The address cache of the rfc3284 code table.  These are constants
+ * so that the decoder specialized for the default table (see
+ * xdelta3-decode.h) can reduce its cache arithmetic. */
+#define RFC3284_NEAR_MODES 4
+#define RFC3284_SAME_MODES 3
+
 /* The rfc3284 code table is represented: */
 static const xd3_code_table_desc __rfc3284_code_table_desc = {
   17, /* add sizes */
-  4,  /* near modes */
-  3,  /* same modes */
+  RFC3284_NEAR_MODES,  /* near modes */
+  RFC3284_SAME_MODES,  /* same modes */
   15, /* copy sizes */
 
   4,  /* add-copy max add */
@@ -994,6 +1078,7 @@ static const xd3_code_table_desc __alternate_code_table_desc = {
 };
 #endif
 
+#if XD3_ENCODER
 /* Computes code table entries of TBL using the specified description. */
 static void
 xd3_build_code_table (const xd3_code_table_desc *desc, xd3_dinst *tbl)
@@ -1061,17 +1146,146 @@ xd3_build_code_table (const xd3_code_table_desc *desc, xd3_dinst *tbl)
   XD3_ASSERT (d - tbl == 256);
 }
 
-/* This function generates the static default code table. */
-static const xd3_dinst*
-xd3_rfc3284_code_table (void)
+/* Returns the number of instructions described by DESC, which is 256
+ * for a valid table. */
+static usize_t
+xd3_code_table_desc_count (const xd3_code_table_desc *desc)
+{
+  usize_t mode;
+  usize_t cpy_modes = 2 + desc->near_modes + desc->same_modes;
+  usize_t count = 2 + desc->add_sizes + cpy_modes * (1 + desc->cpy_sizes);
+
+  for (mode = 0; mode < cpy_modes; mode += 1)
+    {
+      int is_near = mode < 2U + desc->near_modes;
+      usize_t acmax = is_near ? desc->addcopy_near_cpy_max :
+	desc->addcopy_same_cpy_max;
+      usize_t camax = is_near ? desc->copyadd_near_cpy_max :
+	desc->copyadd_same_cpy_max;
+
+      if (acmax >= MIN_MATCH)
+	{
+	  count += (acmax + 1 - MIN_MATCH) * desc->addcopy_add_max;
+	}
+      if (camax >= MIN_MATCH)
+	{
+	  count += (camax + 1 - MIN_MATCH) * desc->copyadd_add_max;
+	}
+    }
+
+  return count;
+}
+
+/* Computes the addcopy_max_sizes and copyadd_max_sizes fields of a
+ * code table description from its other fields.  Returns XD3_INVALID
+ * unless the description yields exactly 256 instructions.  The
+ * result may be passed to the encoder as config->code_table_desc. */
+static int
+xd3_init_code_table_desc (xd3_code_table_desc *desc)
 {
-  static xd3_dinst __rfc3284_code_table[256];
+  usize_t mode;
+  usize_t cpy_modes = 2 + desc->near_modes + desc->same_modes;
+  usize_t offset = 2 + desc->add_sizes + cpy_modes * (1 + desc->cpy_sizes);
+
+  if (cpy_modes > MAX_MODES ||
+      MIN_MATCH + desc->cpy_sizes > 256 ||
+      xd3_code_table_desc_count (desc) != 256)
+    {
+      return XD3_INVALID;
+    }
+
+  memset (desc->addcopy_max_sizes, 0, sizeof (desc->addcopy_max_sizes));
+  memset (desc->copyadd_max_sizes, 0, sizeof (desc->copyadd_max_sizes));
+
+  /* The order of the double instructions follows xd3_build_code_table. */
+  for (mode = 0; mode < cpy_modes; mode += 1)
+    {
+      usize_t max = (mode < 2U + desc->near_modes) ?
+	desc->addcopy_near_cpy_max :
+	desc->addcopy_same_cpy_max;
+
+      if (max >= MIN_MATCH && desc->addcopy_add_max != 0)
+	{
+	  usize_t mult = max + 1 - MIN_MATCH;
+	  desc->addcopy_max_sizes[mode].cpy_max = max;
+	  desc->addcopy_max_sizes[mode].offset = offset;
+	  desc->addcopy_max_sizes[mode].mult = mult;
+	  offset += mult * desc->addcopy_add_max;
+	}
+    }
 
-  if (__rfc3284_code_table[0].type1 != XD3_RUN)
+  for (mode = 0; mode < cpy_modes; mode += 1)
     {
-      xd3_build_code_table (& __rfc3284_code_table_desc, __rfc3284_code_table);
+      usize_t max = (mode < 2U + desc->near_modes) ?
+	desc->copyadd_near_cpy_max :
+	desc->copyadd_same_cpy_max;
+
+      if (max >= MIN_MATCH && desc->copyadd_add_max != 0)
+	{
+	  desc->copyadd_max_sizes[mode].cpy_max = max;
+	  desc->copyadd_max_sizes[mode].offset = offset;
+	  desc->copyadd_max_sizes[mode].mult = desc->copyadd_add_max;
+	  offset += (max + 1 - MIN_MATCH) * desc->copyadd_add_max;
+	}
     }
 
+  XD3_ASSERT (offset == 256);
+  return 0;
+}
+#endif /* XD3_ENCODER */
+
+/* The default code table, as xd3_build_code_table() computes it from
+ * __rfc3284_code_table_desc (see test_rfc3284_code_table).  It is
+ * written out so that it is a compile-time constant for the decoder
+ * specialized for the default table. */
+#define RFC_ADD(s)       { XD3_ADD, s, XD3_NOOP, 0 }
+#define RFC_CPY(m,s)     { XD3_CPY + m, s, XD3_NOOP, 0 }
+#define RFC_ADDCPY(a,m,c) { XD3_ADD, a, XD3_CPY + m, c }
+#define RFC_CPYADD(m)    { XD3_CPY + m, 4, XD3_ADD, 1 }
+#define RFC_ADDS \
+  RFC_ADD(0), RFC_ADD(1), RFC_ADD(2), RFC_ADD(3), RFC_ADD(4), RFC_ADD(5), \
+  RFC_ADD(6), RFC_ADD(7), RFC_ADD(8), RFC_ADD(9), RFC_ADD(10), RFC_ADD(11), \
+  RFC_ADD(12), RFC_ADD(13), RFC_ADD(14), RFC_ADD(15), RFC_ADD(16), \
+  RFC_ADD(17)
+#define RFC_CPYS(m) \
+  RFC_CPY(m,0), RFC_CPY(m,4), RFC_CPY(m,5), RFC_CPY(m,6), RFC_CPY(m,7), \
+  RFC_CPY(m,8), RFC_CPY(m,9), RFC_CPY(m,10), RFC_CPY(m,11), RFC_CPY(m,12), \
+  RFC_CPY(m,13), RFC_CPY(m,14), RFC_CPY(m,15), RFC_CPY(m,16), \
+  RFC_CPY(m,17), RFC_CPY(m,18)
+#define RFC_ADDCPY_NEAR(m) \
+  RFC_ADDCPY(1,m,4), RFC_ADDCPY(1,m,5), RFC_ADDCPY(1,m,6), \
+  RFC_ADDCPY(2,m,4), RFC_ADDCPY(2,m,5), RFC_ADDCPY(2,m,6), \
+  RFC_ADDCPY(3,m,4), RFC_ADDCPY(3,m,5), RFC_ADDCPY(3,m,6), \
+  RFC_ADDCPY(4,m,4), RFC_ADDCPY(4,m,5), RFC_ADDCPY(4,m,6)
+#define RFC_ADDCPY_SAME(m) \
+  RFC_ADDCPY(1,m,4), RFC_ADDCPY(2,m,4), RFC_ADDCPY(3,m,4), RFC_ADDCPY(4,m,4)
+
+static const xd3_dinst __rfc3284_code_table[256] =
+{
+  { XD3_RUN, 0, XD3_NOOP, 0 },
+  RFC_ADDS,
+  RFC_CPYS(0), RFC_CPYS(1), RFC_CPYS(2), RFC_CPYS(3), RFC_CPYS(4),
+  RFC_CPYS(5), RFC_CPYS(6), RFC_CPYS(7), RFC_CPYS(8),
+  RFC_ADDCPY_NEAR(0), RFC_ADDCPY_NEAR(1), RFC_ADDCPY_NEAR(2),
+  RFC_ADDCPY_NEAR(3), RFC_ADDCPY_NEAR(4), RFC_ADDCPY_NEAR(5),
+  RFC_ADDCPY_SAME(6), RFC_ADDCPY_SAME(7), RFC_ADDCPY_SAME(8),
+  RFC_CPYADD(0), RFC_CPYADD(1), RFC_CPYADD(2), RFC_CPYADD(3), RFC_CPYADD(4),
+  RFC_CPYADD(5), RFC_CPYADD(6), RFC_CPYADD(7), RFC_CPYADD(8),
+};
+
+#undef RFC_ADD
+#undef RFC_CPY
+#undef RFC_ADDCPY
+#undef RFC_CPYADD
+#undef RFC_ADDS
+#undef RFC_CPYS
+#undef RFC_ADDCPY_NEAR
+#undef RFC_ADDCPY_SAME
+
+/* This function returns the static default code table. */
+static const xd3_dinst*
+xd3_rfc3284_code_table (void)
+{
   return __rfc3284_code_table;
 }
 
@@ -1090,13 +1304,15 @@ xd3_alternate_code_table (void)
 
   return __alternate_code_table;
 }
+#endif /* GENERIC_ENCODE_TABLES */
 
 /* This function computes the ideal second instruction INST based on
  * preceding instruction PREV.  If it is possible to issue a double
  * instruction based on this pair it sets PREV->code2, otherwise it
  * sets INST->code1. */
 static void
-xd3_choose_instruction (const xd3_code_table_desc *desc, xd3_rinst *prev, xd3_rinst *inst)
+xd3_choose_instruction_desc (const xd3_code_table_desc *desc,
+			     xd3_rinst *prev, xd3_rinst *inst)
 {
   switch (inst->type)
     {
@@ -1125,7 +1341,8 @@ xd3_choose_instruction (const xd3_code_table_desc *desc, xd3_rinst *prev, xd3_ri
 	      /* If previous is a copy.  Note: as long as the previous
 	       * is not a RUN instruction, it should be a copy because
 	       * it cannot be an add.  This check is more clear. */
-	      if (prev_mode >= 0 && inst->size <= desc->copyadd_add_max)
+	      if (prev_mode >= 0 && inst->size <= desc->copyadd_add_max &&
+		  prev->size >= MIN_MATCH)
 		{
 		  const xd3_code_table_sizes *sizes = 
 		    & desc->copyadd_max_sizes[prev_mode];
@@ -1185,7 +1402,8 @@ xd3_choose_instruction (const xd3_code_table_desc *desc, xd3_rinst *prev, xd3_ri
       }
     }
 }
-#else /* GENERIC_ENCODE_TABLES */
+
+#if GENERIC_ENCODE_TABLES == 0
 
 /* This version of xd3_choose_instruction is hard-coded for the default
    table. */
@@ -1254,7 +1472,7 @@ xd3_choose_instruction (xd3_rinst *prev, xd3_rinst *inst)
       break;
     }
 }
-#endif /* GENERIC_ENCODE_TABLES */
+#endif /* GENERIC_ENCODE_TABLES == 0 */
 
 /***********************************************************************
  Instruction table encoder/decoder
@@ -1292,31 +1510,6 @@ xd3_compute_alternate_table_encoding (xd3_stream *stream, const uint8_t **data,
 static uint8_t __alternate_code_table_compressed[CODE_TABLE_VCDIFF_SIZE];
 static usize_t  __alternate_code_table_compressed_size;
 
-/* This function generates a delta describing the code table for
- * encoding within a VCDIFF file.  This function is NOT thread safe
- * because it is only intended that this function is used to generate
- * statically-compiled strings.  "comp_string" must be sized
- * CODE_TABLE_VCDIFF_SIZE. */
-int xd3_compute_code_table_encoding (xd3_stream *in_stream,
-				     const xd3_dinst *code_table,
-				     uint8_t *comp_string,
-				     usize_t *comp_string_size)
-{
-  /* Use DJW secondary compression if it is on by default.  This saves
-   * about 20 bytes. */
-  uint8_t dflt_string[CODE_TABLE_STRING_SIZE];
-  uint8_t code_string[CODE_TABLE_STRING_SIZE];
-
-  xd3_compute_code_table_string (xd3_rfc3284_code_table (), dflt_string);
-  xd3_compute_code_table_string (code_table, code_string);
-
-  return xd3_encode_memory (code_string, CODE_TABLE_STRING_SIZE,
-			    dflt_string, CODE_TABLE_STRING_SIZE,
-			    comp_string, comp_string_size,
-			    CODE_TABLE_VCDIFF_SIZE,
-			    /* flags */ 0);
-}
-
 /* Compute a delta between alternate and rfc3284 tables.  As soon as
  * another alternate table is added, this code should become generic.
  * For now there is only one alternate table for testing. */
@@ -1327,7 +1520,7 @@ xd3_compute_alternate_table_encoding (xd3_stream *stream, const uint8_t **data,
 
   if (__alternate_code_table_compressed[0] == 0)
     {
-      if ((ret = xd3_compute_code_table_encoding (stream, xd3_alternate_code_table (),
+      if ((ret = xd3_compute_code_table_encoding (xd3_alternate_code_table (),
 						  __alternate_code_table_compressed,
 						  & __alternate_code_table_compressed_size)))
 	{
@@ -1367,6 +1560,59 @@ xd3_compute_alternate_table_encoding (xd3_stream *stream, const uint8_t **data,
 #endif /* GENERIC_ENCODE_TABLES_COMPUTE != 0 */
 #endif /* GENERIC_ENCODE_TABLES */
 
+/* This function generates a delta describing the code table for
+ * encoding within a VCDIFF file.  "comp_string" must be sized
+ * CODE_TABLE_VCDIFF_SIZE. */
+int xd3_compute_code_table_encoding (const xd3_dinst *code_table,
+				     uint8_t *comp_string,
+				     usize_t *comp_string_size)
+{
+  /* Use DJW secondary compression if it is on by default.  This saves
+   * about 20 bytes. */
+  uint8_t dflt_string[CODE_TABLE_STRING_SIZE];
+  uint8_t code_string[CODE_TABLE_STRING_SIZE];
+
+  xd3_compute_code_table_string (xd3_rfc3284_code_table (), dflt_string);
+  xd3_compute_code_table_string (code_table, code_string);
+
+  return xd3_encode_memory (code_string, CODE_TABLE_STRING_SIZE,
+			    dflt_string, CODE_TABLE_STRING_SIZE,
+			    comp_string, comp_string_size,
+			    CODE_TABLE_VCDIFF_SIZE,
+			    /* flags */ 0);
+}
+
+/* The encoding of a custom table (config->code_table_desc) is
+ * computed once per stream, when the first header is emitted. */
+static int
+xd3_compute_custom_table_encoding (xd3_stream *stream,
+				   const uint8_t **data,
+				   usize_t *size)
+{
+  int ret;
+
+  if (stream->code_table_enc == NULL)
+    {
+      if ((stream->code_table_enc = (uint8_t*)
+	   xd3_alloc (stream, CODE_TABLE_VCDIFF_SIZE, 1)) == NULL)
+	{
+	  return ENOMEM;
+	}
+
+      if ((ret = xd3_compute_code_table_encoding (stream->code_table_alloc,
+						  stream->code_table_enc,
+						  & stream->code_table_encsz)))
+	{
+	  stream->msg = "code table encoding failed";
+	  return ret;
+	}
+    }
+
+  (*data) = stream->code_table_enc;
+  (*size) = stream->code_table_encsz;
+  return 0;
+}
+
 #endif /* XD3_ENCODER */
 
 /* This function generates the 1536-byte string specified in sections 5.4 and
@@ -1404,6 +1650,15 @@ xd3_apply_table_string (xd3_stream *stream, const uint8_t *code_string)
   int modes = TOTAL_MODES (stream);
   xd3_dinst *code_table;
 
+  /* Copy modes are stored as XD3_CPY + mode in a byte. */
+  if (modes > (int) (256 - XD3_CPY))
+    {
+      stream->msg = "invalid code-table modes";
+      return XD3_INVALID_INPUT;
+    }
+
+  xd3_free (stream, stream->code_table_alloc);
+
   if ((code_table = stream->code_table_alloc =
        (xd3_dinst*) xd3_alloc (stream,
 			       (usize_t) sizeof (xd3_dinst),
@@ -1422,7 +1677,7 @@ xd3_apply_table_string (xd3_stream *stream, const uint8_t *code_string)
 	      if (*code_string > XD3_CPY)
 		{
 		  stream->msg = "invalid code-table opcode";
-		  return XD3_INTERNAL;
+		  return XD3_INVALID_INPUT;
 		}
 	      code_table[i].type1 = *code_string++;
 	      break;
@@ -1430,7 +1685,7 @@ xd3_apply_table_string (xd3_stream *stream, const uint8_t *code_string)
 	      if (*code_string > XD3_CPY)
 		{
 		  stream->msg = "invalid code-table opcode";
-		  return XD3_INTERNAL;
+		  return XD3_INVALID_INPUT;
 		}
 	      code_table[i].type2 = *code_string++;
 	      break;
@@ -1438,7 +1693,7 @@ xd3_apply_table_string (xd3_stream *stream, const uint8_t *code_string)
 	      if (*code_string != 0 && code_table[i].type1 == XD3_NOOP)
 		{
 		  stream->msg = "invalid code-table size";
-		  return XD3_INTERNAL;
+		  return XD3_INVALID_INPUT;
 		}
 	      code_table[i].size1 = *code_string++;
 	      break;
@@ -1446,7 +1701,7 @@ xd3_apply_table_string (xd3_stream *stream, const uint8_t *code_string)
 	      if (*code_string != 0 && code_table[i].type2 == XD3_NOOP)
 		{
 		  stream->msg = "invalid code-table size";
-		  return XD3_INTERNAL;
+		  return XD3_INVALID_INPUT;
 		}
 	      code_table[i].size2 = *code_string++;
 	      break;
@@ -1454,12 +1709,12 @@ xd3_apply_table_string (xd3_stream *stream, const uint8_t *code_string)
 	      if (*code_string >= modes)
 		{
 		  stream->msg = "invalid code-table mode";
-		  return XD3_INTERNAL;
+		  return XD3_INVALID_INPUT;
 		}
 	      if (*code_string != 0 && code_table[i].type1 != XD3_CPY)
 		{
 		  stream->msg = "invalid code-table mode";
-		  return XD3_INTERNAL;
+		  return XD3_INVALID_INPUT;
 		}
 	      code_table[i].type1 += *code_string++;
 	      break;
@@ -1467,12 +1722,12 @@ xd3_apply_table_string (xd3_stream *stream, const uint8_t *code_string)
 	      if (*code_string >= modes)
 		{
 		  stream->msg = "invalid code-table mode";
-		  return XD3_INTERNAL;
+		  return XD3_INVALID_INPUT;
 		}
 	      if (*code_string != 0 && code_table[i].type2 != XD3_CPY)
 		{
 		  stream->msg = "invalid code-table mode";
-		  return XD3_INTERNAL;
+		  return XD3_INVALID_INPUT;
 		}
 	      code_table[i].type2 += *code_string++;
 	      break;
@@ -1491,20 +1746,31 @@ xd3_apply_table_encoding (xd3_stream *in_stream, const uint8_t *data, usize_t si
   uint8_t dflt_string[CODE_TABLE_STRING_SIZE];
   uint8_t code_string[CODE_TABLE_STRING_SIZE];
   usize_t code_size;
-  int ret;
 
-  xd3_compute_code_table_string (xd3_rfc3284_code_table (), dflt_string);
+  /* The table is itself a VCDIFF delta against the default table
+   * string.  It must use the default table, otherwise a crafted input
+   * could nest code tables without bound. */
+  if (size < 5 ||
+      data[0] != VCDIFF_MAGIC1 ||
+      data[1] != VCDIFF_MAGIC2 ||
+      data[2] != VCDIFF_MAGIC3 ||
+      (data[4] & VCD_CODETABLE) != 0)
+    {
+      in_stream->msg = "corrupt code-table encoding";
+      return XD3_INVALID_INPUT;
+    }
 
-  if ((ret = xd3_decode_memory (data, size,
-				dflt_string, CODE_TABLE_STRING_SIZE,
-				code_string, &code_size,
-				CODE_TABLE_STRING_SIZE,
-				0))) { return ret; }
+  xd3_compute_code_table_string (xd3_rfc3284_code_table (), dflt_string);
 
-  if (code_size != sizeof (code_string))
+  if (xd3_decode_memory (data, size,
+			 dflt_string, CODE_TABLE_STRING_SIZE,
+			 code_string, &code_size,
+			 CODE_TABLE_STRING_SIZE,
+			 0) != 0 ||
+      code_size != sizeof (code_string))
     {
       in_stream->msg = "corrupt code-table encoding";
-      return XD3_INTERNAL;
+      return XD3_INVALID_INPUT;
     }
 
   return xd3_apply_table_string (in_stream, code_string);
@@ -1634,7 +1900,43 @@ static unsigned long adler32 (unsigned long adler, const uint8_t *buf,
  Run-length function
  ***********************************************************************/
 
+/* Returns the number of bytes at the start of SEG, up to SIZE, that
+ * equal C.  Long runs (zero-filled regions of disk images) are
+ * compared a word at a time, like xd3_forward_match().  Also used by
+ * --sparse in xdelta3-main.h to find zero blocks. */
+static usize_t
+xd3_runlen (const uint8_t *seg, usize_t size, uint8_t c)
+{
+  usize_t i = 0;
+#if UNALIGNED_OK
+  const size_t w = ((size_t) -1 / 0xff) * c;
+  const size_t *s = (const size_t*) seg;
+
+  while (size - i >= 4 * sizeof (size_t) &&
+	 s[0] == w && s[1] == w && s[2] == w && s[3] == w)
+    {
+      i += 4 * sizeof (size_t);
+      s += 4;
+    }
+
+  while (size - i >= sizeof (size_t) && s[0] == w)
+    {
+      i += sizeof (size_t);
+      s += 1;
+    }
+#endif
+
+  while (i < size && seg[i] == c)
+    {
+      i += 1;
+    }
+
+  return i;
+}
+
 #if XD3_ENCODER
+/* Computes the run state for the first SLOOK bytes, which is only a
+ * few bytes, so this is bytewise. */
 static usize_t
 xd3_comprun (const uint8_t *seg, usize_t slook, uint8_t *run_cp)
 {
@@ -1925,6 +2227,15 @@ xd3_alloc_cache (xd3_stream *stream)
       xd3_free (stream, stream->acache.same_array);
     }
 
+  if (stream->acache.same_gen != NULL)
+    {
+      xd3_free (stream, stream->acache.same_gen);
+    }
+
+  stream->acache.near_array = NULL;
+  stream->acache.same_array = NULL;
+  stream->acache.same_gen = NULL;
+
   if (((stream->acache.s_near > 0) &&
        (stream->acache.near_array = (usize_t*)
 	xd3_alloc (stream, stream->acache.s_near,
@@ -1934,11 +2245,23 @@ xd3_alloc_cache (xd3_stream *stream)
        (stream->acache.same_array = (usize_t*)
 	xd3_alloc (stream, stream->acache.s_same * 256,
 		   (usize_t) sizeof (usize_t)))
+       == NULL) ||
+      ((stream->acache.s_same > 0) &&
+       (stream->acache.same_gen = (usize_t*)
+	xd3_alloc (stream, stream->acache.s_same * 256,
+		   (usize_t) sizeof (usize_t)))
        == NULL))
     {
       return ENOMEM;
     }
 
+  if (stream->acache.s_same > 0)
+    {
+      memset (stream->acache.same_gen, 0,
+	      stream->acache.s_same * 256 * sizeof (usize_t));
+    }
+  stream->acache.generation = 0;
+
   return 0;
 }
 
@@ -1951,12 +2274,31 @@ xd3_init_cache (xd3_addr_cache* acache)
       acache->next_slot = 0;
     }
 
+  /* The same cache is not cleared: each entry carries the generation
+   * in which it was written, and entries from an earlier generation
+   * read as zero.  Only when the counter wraps are the tags reset. */
   if (acache->s_same > 0)
     {
-      memset (acache->same_array, 0, acache->s_same * 256 * sizeof (usize_t));
+      if (++acache->generation == 0)
+	{
+	  memset (acache->same_gen, 0,
+		  acache->s_same * 256 * sizeof (usize_t));
+	  acache->generation = 1;
+	}
     }
 }
 
+/* Returns the same cache entry at index I, or zero if it was not
+ * written since the last xd3_init_cache(). */
+static inline usize_t
+xd3_same_cache_get (const xd3_addr_cache* acache, usize_t i)
+{
+  return (acache->same_gen[i] == acache->generation) ?
+    acache->same_array[i] : 0;
+}
+
+#if XD3_ENCODER
+/* The decoder updates the cache in xd3_decode_address_*(). */
 static void
 xd3_update_cache (xd3_addr_cache* acache, usize_t addr)
 {
@@ -1968,21 +2310,29 @@ xd3_update_cache (xd3_addr_cache* acache, usize_t addr)
 
   if (acache->s_same > 0)
     {
-      acache->same_array[addr % (acache->s_same*256)] = addr;
+      usize_t i = addr % (acache->s_same*256);
+      acache->same_array[i] = addr;
+      acache->same_gen[i] = acache->generation;
     }
 }
 
-#if XD3_ENCODER
-/* OPT: this gets called a lot, can it be optimized? */
-static int
-xd3_encode_address (xd3_stream *stream,
+/* This gets called a lot.  It chooses the address mode that yields
+ * the smallest encoding of ADDR at position HERE, returns the mode
+ * and sets *VALP to the value to encode, which is a single byte for
+ * the same modes (mode >= 2 + s_near) and a variable-length size
+ * otherwise.  The near-mode search below is written without
+ * data-dependent branches so that the compiler can evaluate all
+ * s_near distances in one vectorized pass followed by a
+ * minimum-with-index reduction. */
+static inline usize_t
+xd3_choose_address (const xd3_addr_cache* acache,
 		    usize_t addr,
 		    usize_t here,
-		    uint8_t* mode)
+		    usize_t *valp)
 {
   usize_t d, bestd;
-  usize_t i, bestm, ret;
-  xd3_addr_cache* acache = & stream->acache;
+  usize_t i, bestm;
+  usize_t neard, nearm;
 
 #define SMALLEST_INT(x) do { if (((x) & ~127U) == 0) { goto good; } } while (0)
 
@@ -2004,97 +2354,78 @@ xd3_encode_address (xd3_stream *stream,
       SMALLEST_INT (bestd);
     }
 
+  /* Entries greater than addr cannot be encoded, their distance is
+   * forced to USIZE_T_MAX.  The reduction keeps the lowest index among
+   * equal distances. */
+  neard = USIZE_T_MAX;
+  nearm = 0;
+
   for (i = 0; i < acache->s_near; i += 1)
     {
-      /* Note: If we used signed computation here, we'd could compte d
-       * and then check (d >= 0 && d < bestd). */
-      if (addr >= acache->near_array[i])
-	{
-	  d = addr - acache->near_array[i];
+      usize_t n = acache->near_array[i];
+      usize_t x = (addr - n) | (0U - (usize_t) (addr < n));
+      usize_t lt = 0U - (usize_t) (x < neard);
 
-	  if (d < bestd)
-	    {
-	      bestd = d;
-	      bestm = i+2; /* 2 counts the VCD_SELF, VCD_HERE modes */
+      neard = (x & lt) | (neard & ~lt);
+      nearm = (i & lt) | (nearm & ~lt);
+    }
 
-	      SMALLEST_INT (bestd);
-	    }
-	}
+  if (neard < bestd)
+    {
+      bestd = neard;
+      bestm = nearm + 2; /* 2 counts the VCD_SELF, VCD_HERE modes */
+
+      SMALLEST_INT (bestd);
     }
 
   if (acache->s_same > 0 &&
-      acache->same_array[d = addr%(acache->s_same*256)] == addr)
+      xd3_same_cache_get (acache, d = addr%(acache->s_same*256)) == addr)
     {
       bestd = d%256;
       /* 2 + s_near offsets past the VCD_NEAR modes */
       bestm = acache->s_near + 2 + d/256;
-
-      if ((ret = xd3_emit_byte (stream, & ADDR_TAIL (stream), bestd)))
-	{
-	  return ret;
-	}
-    }
-  else
-    {
-    good:
-
-      if ((ret = xd3_emit_size (stream, & ADDR_TAIL (stream), bestd)))
-	{
-	  return ret;
-	}
     }
 
-  xd3_update_cache (acache, addr);
-
-  (*mode) += bestm;
-
-  return 0;
+ good:
+  (*valp) = bestd;
+  return bestm;
+#undef SMALLEST_INT
 }
-#endif
 
 static int
-xd3_decode_address (xd3_stream *stream, usize_t here,
-		    usize_t mode, const uint8_t **inpp,
-		    const uint8_t *max, uint32_t *valp)
+xd3_encode_address (xd3_stream *stream,
+		    usize_t addr,
+		    usize_t here,
+		    uint8_t* mode)
 {
+  usize_t bestd, bestm;
   int ret;
-  usize_t same_start = 2 + stream->acache.s_near;
+  xd3_addr_cache* acache = & stream->acache;
 
-  if (mode < same_start)
-    {
-      if ((ret = xd3_read_size (stream, inpp, max, valp))) { return ret; }
+  bestm = xd3_choose_address (acache, addr, here, & bestd);
 
-      switch (mode)
+  if (bestm >= 2 + acache->s_near)
+    {
+      if ((ret = xd3_emit_byte (stream, & ADDR_TAIL (stream), bestd)))
 	{
-	case VCD_SELF:
-	  break;
-	case VCD_HERE:
-	  (*valp) = here - (*valp);
-	  break;
-	default:
-	  (*valp) += stream->acache.near_array[mode - 2];
-	  break;
+	  return ret;
 	}
     }
   else
     {
-      if (*inpp == max)
+      if ((ret = xd3_emit_size (stream, & ADDR_TAIL (stream), bestd)))
 	{
-	  stream->msg = "address underflow";
-	  return XD3_INVALID_INPUT;
+	  return ret;
 	}
-
-      mode -= same_start;
-
-      (*valp) = stream->acache.same_array[mode*256 + (**inpp)];
-
-      (*inpp) += 1;
     }
 
-  xd3_update_cache (& stream->acache, *valp);
+  xd3_update_cache (acache, addr);
+
+  (*mode) += bestm;
 
   return 0;
 }
+#endif
 
 /***********************************************************************
  Alloc/free
@@ -2200,6 +2531,11 @@ xd3_alloc_output (xd3_stream *stream,
   if (old_output)
     {
       old_output->next_page = output;
+      output->chain_offset = old_output->chain_offset + old_output->next;
+    }
+  else
+    {
+      output->chain_offset = 0;
     }
 
   output->next_page = NULL;
@@ -2220,6 +2556,14 @@ xd3_sizeof_output (xd3_output *output)
   return s;
 }
 
+/* The chain length from its tail, without walking the pages.  Only
+ * valid for chains grown with xd3_alloc_output(). */
+static usize_t
+xd3_sizeof_output_tail (const xd3_output *tail)
+{
+  return tail->chain_offset + tail->next;
+}
+
 static void
 xd3_freelist_output (xd3_stream *stream,
 		     xd3_output *output)
@@ -2275,6 +2619,8 @@ xd3_free_stream (xd3_stream *stream)
   xd3_free (stream, stream->large_table);
   xd3_free (stream, stream->small_table);
   xd3_free (stream, stream->small_prev);
+  xd3_free (stream, stream->small_tree);
+  xd3_free (stream, stream->far_table);
 
 #if XD3_ENCODER
   {
@@ -2289,6 +2635,7 @@ xd3_free_stream (xd3_stream *stream)
 
   xd3_free (stream, stream->acache.near_array);
   xd3_free (stream, stream->acache.same_array);
+  xd3_free (stream, stream->acache.same_gen);
 
   xd3_free (stream, stream->inst_sect.copied1);
   xd3_free (stream, stream->addr_sect.copied1);
@@ -2301,6 +2648,8 @@ xd3_free_stream (xd3_stream *stream)
   xd3_free (stream, stream->dec_appheader);
   xd3_free (stream, stream->dec_codetbl);
   xd3_free (stream, stream->code_table_alloc);
+  xd3_free (stream, stream->code_table_enc);
+  xd3_free (stream, stream->code_table_custom);
 
 #if SECONDARY_ANY
   xd3_free (stream, stream->inst_sect.copied2);
@@ -2382,6 +2731,7 @@ xd3_config_stream(xd3_stream *stream,
 
   stream->winsize = config->winsize ? config->winsize : XD3_DEFAULT_WINSIZE;
   stream->sprevsz = config->sprevsz ? config->sprevsz : XD3_DEFAULT_SPREVSZ;
+  stream->dec_maxwinsize = max (config->dec_maxwinsize, XD3_HARDMAXWINSIZE);
 
   if (config->iopt_size == 0)
     {
@@ -2408,6 +2758,13 @@ xd3_config_stream(xd3_stream *stream,
   stream->sec_inst.data_type = INST_SECTION;
   stream->sec_addr.data_type = ADDR_SECTION;
 
+  if (stream->winsize > XD3_LARGEMAXWINSIZE ||
+      stream->dec_maxwinsize > XD3_LARGEMAXWINSIZE)
+    {
+      stream->msg = "window size is too large";
+      return XD3_INTERNAL;
+    }
+
   /* Check static sizes. */
   if (sizeof (usize_t) != SIZEOF_USIZE_T ||
       sizeof (xoff_t) != SIZEOF_XOFF_T ||
@@ -2456,23 +2813,83 @@ xd3_config_stream(xd3_stream *stream,
     return XD3_INTERNAL;
   }
 
-  /* Check sprevsz */
-  if (smatcher->small_chain == 1 &&
-      smatcher->small_lchain == 1)
-    {
-      stream->sprevsz = 0;
-    }
-  else
+#if XD3_ENCODER
+  /* A custom code table replaces the one chosen above, unless it
+   * describes the default table, which needs no header. */
+  if (config->code_table_desc != NULL &&
+      memcmp (config->code_table_desc, & __rfc3284_code_table_desc,
+	      sizeof (xd3_code_table_desc)) != 0)
     {
-      if ((ret = xd3_check_pow2 (stream->sprevsz, NULL)))
+      if (stream->flags & XD3_ALT_CODE_TABLE)
 	{
-	  stream->msg = "sprevsz is required to be a power of two";
+	  stream->msg = "alternate and custom code tables both set";
+	  return XD3_INTERNAL;
+	}
+
+      if ((stream->code_table_custom = (xd3_code_table_desc*)
+	   xd3_alloc (stream, sizeof (xd3_code_table_desc), 1)) == NULL)
+	{
+	  return ENOMEM;
+	}
+
+      *stream->code_table_custom = *config->code_table_desc;
+
+      if (xd3_init_code_table_desc (stream->code_table_custom) != 0)
+	{
+	  stream->msg = "invalid custom code table";
+	  return XD3_INVALID;
+	}
+
+      if ((stream->code_table_alloc = (xd3_dinst*)
+	   xd3_alloc (stream, sizeof (xd3_dinst), 256)) == NULL)
+	{
+	  return ENOMEM;
+	}
+
+      memset (stream->code_table_alloc, 0, sizeof (xd3_dinst) * 256);
+      xd3_build_code_table (stream->code_table_custom,
+			    stream->code_table_alloc);
+
+      stream->code_table_desc = stream->code_table_custom;
+      stream->code_table_func = NULL;
+      stream->comp_table_func = xd3_compute_custom_table_encoding;
+      stream->code_table      = stream->code_table_alloc;
+    }
+#endif
+
+  /* Check sprevsz */
+  if (smatcher->small_chain == 1 &&
+      smatcher->small_lchain == 1)
+    {
+      stream->sprevsz = 0;
+    }
+  else
+    {
+      if ((ret = xd3_check_pow2 (stream->sprevsz, NULL)))
+	{
+	  stream->msg = "sprevsz is required to be a power of two";
 	  return XD3_INTERNAL;
 	}
 
       stream->sprevmask = stream->sprevsz - 1;
     }
 
+  /* Content-defined anchors. */
+  if (config->anchor_interval != 0)
+    {
+      usize_t bits;
+
+      if (config->anchor_interval < 2 ||
+	  xd3_check_pow2 (config->anchor_interval, & bits))
+	{
+	  stream->msg = "anchor interval is required to be a power of two";
+	  return XD3_INTERNAL;
+	}
+
+      stream->anchor_interval = config->anchor_interval;
+      stream->anchor_shift = 32 - bits;
+    }
+
   /* Default scanner settings. */
 #if XD3_ENCODER
   switch (config->smatch_cfg)
@@ -2549,6 +2966,180 @@ xd3_config_stream(xd3_stream *stream,
   return 0;
 }
 
+#if XD3_ENCODER
+/* Windows up to XD3_HARDMAXWINSIZE index every target position in the
+ * small table.  Larger windows cap that table, which then only finds
+ * recent matches, and also keep the large checksums of content-defined
+ * anchors, as the source index does with anchor_interval, about one
+ * per step bytes so that the far table has at most XD3_FARSLOTS
+ * entries.  Only anchors are looked up.  Returns the far table size,
+ * or 0. */
+static usize_t
+xd3_size_far_table (xd3_stream *stream, usize_t winsize)
+{
+  usize_t step = 2;
+  usize_t bits = 1;
+
+  stream->far_shift = 0;
+
+  if (winsize <= XD3_HARDMAXWINSIZE)
+    {
+      return 0;
+    }
+
+  while (winsize / step > XD3_FARSLOTS)
+    {
+      step *= 2;
+      bits += 1;
+    }
+
+  stream->far_shift = 32 - bits;
+  xd3_size_hashtable (stream, winsize / step, & stream->far_hash);
+  return stream->far_hash.size;
+}
+
+/* The estimate of xd3_config_memory() for a configured stream. */
+static xoff_t
+xd3_stream_memory (xd3_stream *stream, xoff_t srcwinsz)
+{
+  xd3_hash_cfg hash;
+  xoff_t mem = 0;
+  usize_t winsize = stream->winsize;
+
+  /* Input window, and the instruction and output sections. */
+  mem += 3 * (xoff_t) winsize;
+
+  if (! (stream->flags & XD3_NOCOMPRESS))
+    {
+      xd3_size_hashtable (stream, min (winsize, XD3_HARDMAXWINSIZE), & hash);
+      mem += (xoff_t) hash.size * sizeof (usize_t);
+      mem += (xoff_t) stream->sprevsz * (stream->smatcher.small_tree ?
+					 2 * sizeof (usize_t) :
+					 sizeof (xd3_slist));
+      mem += (xoff_t) xd3_size_far_table (stream, winsize) * sizeof (usize_t);
+    }
+
+  mem += (xoff_t) stream->iopt_size * sizeof (xd3_rinst);
+
+  /* Secondary output, and the LZMA encoders for three sections. */
+  if (stream->flags & XD3_SEC_TYPE)
+    {
+      mem += winsize;
+    }
+#if SECONDARY_LZMA
+  if (stream->flags & XD3_SEC_LZMA)
+    {
+      mem += 3 * xd3_lzma_encoder_memory (stream);
+    }
+#endif
+
+  if (srcwinsz != 0)
+    {
+      usize_t step = (stream->anchor_interval ?
+		      stream->anchor_interval :
+		      stream->smatcher.large_step);
+      xoff_t slots = srcwinsz / step;
+
+      xd3_size_hashtable (stream, (usize_t) min (slots, (xoff_t) USIZE_T_MAX),
+			  & hash);
+      mem += srcwinsz + (xoff_t) hash.size * sizeof (usize_t);
+    }
+
+  return mem;
+}
+
+int
+xd3_config_memory (const xd3_config *config, xoff_t srcwinsz, xoff_t *bytes)
+{
+  xd3_stream stream;
+  xd3_config tmp = *config;
+  int ret;
+
+  memset (& stream, 0, sizeof (stream));
+
+  if ((ret = xd3_config_stream (& stream, & tmp)) == 0)
+    {
+      *bytes = xd3_stream_memory (& stream, srcwinsz);
+    }
+
+  xd3_free_stream (& stream);
+  return ret;
+}
+
+int
+xd3_config_memory_limit (xd3_config *config, xoff_t limit, xoff_t *srcwinsz)
+{
+  xd3_stream stream;
+  xd3_config tmp = *config;
+  usize_t winsize;
+  xoff_t source = 0;
+  int fits;
+  int ret;
+
+  for (winsize = XD3_DEFAULT_WINSIZE; ; winsize /= 2)
+    {
+      tmp.winsize = winsize;
+      tmp.sprevsz = min (winsize, XD3_DEFAULT_SPREVSZ);
+      tmp.iopt_size = max (min (winsize / 32, XD3_DEFAULT_IOPT_SIZE), 128U);
+
+      memset (& stream, 0, sizeof (stream));
+
+      if ((ret = xd3_config_stream (& stream, & tmp)))
+	{
+	  xd3_free_stream (& stream);
+	  return ret;
+	}
+
+      source = 0;
+
+      /* The largest power-of-two source window that fits. */
+      if (srcwinsz != NULL)
+	{
+	  xoff_t next;
+
+	  for (next = XD3_ALLOCSIZE;
+	       xd3_stream_memory (& stream, next) <= limit;
+	       next *= 2)
+	    {
+	      source = next;
+
+	      if (next >= XD3_MAXSRCWINSZ) { break; }
+	    }
+	}
+
+      fits = (xd3_stream_memory (& stream, source) <= limit &&
+	      (srcwinsz == NULL || source != 0));
+
+      xd3_free_stream (& stream);
+
+      /* Prefer source reach: accept the first window size that leaves
+       * a source window four times as large. */
+      if (fits && (srcwinsz == NULL || source >= 4 * (xoff_t) winsize))
+	{
+	  break;
+	}
+
+      if (winsize / 2 < XD3_ALLOCSIZE)
+	{
+	  if (fits) { break; }
+
+	  return XD3_INVALID;
+	}
+    }
+
+  config->winsize = tmp.winsize;
+  config->sprevsz = tmp.sprevsz;
+  config->iopt_size = tmp.iopt_size;
+
+  if (srcwinsz != NULL)
+    {
+      *srcwinsz = source;
+    }
+
+  return 0;
+}
+#endif
+
 /***********************************************************
  Getblk interface
  ***********************************************************/
@@ -2569,6 +3160,20 @@ usize_t xd3_bytes_on_srcblk (xd3_source *src, xoff_t blkno)
   return r;
 }
 
+/* Clears the per-window performance counters.  The table fill counts
+ * describe the hash tables, which outlive a window. */
+static void
+xd3_perf_winstart (xd3_stream *stream)
+{
+  usize_t small_fill = stream->perf.small_fill;
+  usize_t large_fill = stream->perf.large_fill;
+
+  memset (& stream->perf, 0, sizeof (stream->perf));
+
+  stream->perf.small_fill = small_fill;
+  stream->perf.large_fill = large_fill;
+}
+
 /* This function interfaces with the client getblk function, checks
  * its results, updates frontier_blkno, max_blkno, onlastblk, eof_known. */
 static int
@@ -2579,7 +3184,10 @@ xd3_getblk (xd3_stream *stream, xoff_t blkno)
 
   if (source->curblk == NULL || blkno != source->curblkno)
     {
+      xoff_t perf_t0;
+
       source->getblkno = blkno;
+      IF_PERF (stream, stream->perf.blk_misses += 1);
 
       if (stream->getblk == NULL)
 	{
@@ -2587,7 +3195,10 @@ xd3_getblk (xd3_stream *stream, xoff_t blkno)
 	  return XD3_GETSRCBLK;
 	}
 
+      perf_t0 = PERF_NOW (stream);
       ret = stream->getblk (stream, source, blkno);
+      PERF_ADD (stream, t_getblk, perf_t0);
+
       if (ret != 0)
 	{
 	  IF_DEBUG1 (DP(RINT "[getblk] app error blkno %"Q"u: %s\n",
@@ -2595,6 +3206,10 @@ xd3_getblk (xd3_stream *stream, xoff_t blkno)
 	  return ret;
 	}
     }
+  else
+    {
+      IF_PERF (stream, stream->perf.blk_hits += 1);
+    }
 
   if (blkno >= source->frontier_blkno)
     {
@@ -2758,6 +3373,58 @@ xd3_close_stream (xd3_stream *stream)
   return 0;
 }
 
+void
+xd3_get_winstate (xd3_stream *stream, xd3_winstate *state)
+{
+  memset (state, 0, sizeof (*state));
+
+  state->total_in  = stream->total_in;
+  state->total_out = stream->total_out;
+
+  if (stream->enc_state != 0)
+    {
+      state->windows = stream->current_window + 1;
+      state->maxsrcaddr = stream->maxsrcaddr;
+      state->srcwin_cksum_pos = stream->srcwin_cksum_pos;
+    }
+  else
+    {
+      state->windows = stream->dec_window_count;
+    }
+}
+
+int
+xd3_set_winstate (xd3_stream *stream, const xd3_winstate *state)
+{
+  if (stream->enc_state == ENC_INIT &&
+      stream->current_window == 0 &&
+      stream->total_in == 0)
+    {
+      stream->current_window    = state->windows;
+      stream->total_in          = state->total_in;
+      stream->total_out         = state->total_out;
+      stream->maxsrcaddr        = state->maxsrcaddr;
+      stream->srcwin_resume_pos = state->srcwin_cksum_pos;
+      return 0;
+    }
+
+  if (stream->dec_state == DEC_WININD &&
+      stream->dec_window_count == 0 &&
+      stream->avail_in == 0)
+    {
+      /* dec_winstart advances by dec_tgtlen at the next window. */
+      stream->dec_window_count = state->windows;
+      stream->dec_winstart     = state->total_out;
+      stream->dec_tgtlen       = 0;
+      stream->total_in         = state->total_in;
+      stream->total_out        = state->total_out;
+      return 0;
+    }
+
+  stream->msg = "stream is not at a window boundary";
+  return XD3_INVALID;
+}
+
 /**************************************************************
  Application header
  ****************************************************************/
@@ -2925,8 +3592,13 @@ xd3_iopt_finish_encoding (xd3_stream *stream, xd3_rinst *inst)
       }
     case XD3_ADD:
       {
-	if ((ret = xd3_emit_bytes (stream, & DATA_TAIL (stream),
-				   stream->next_in + inst->pos, inst->size))) { return ret; }
+	if (stream->flags & XD3_ESTIMATE)
+	  {
+	    stream->enc_est_adds += inst->size;
+	  }
+	else if ((ret = xd3_emit_bytes (stream, & DATA_TAIL (stream),
+					stream->next_in + inst->pos,
+					inst->size))) { return ret; }
 
 	stream->n_add += 1;
 	stream->l_add += inst->size;
@@ -3237,7 +3909,12 @@ xd3_iopt_get_slot (xd3_stream *stream, xd3_rinst** iptr)
 	}
       else
 	{
-	  if ((ret = xd3_iopt_flush_instructions (stream, 0))) { return ret; }
+	  xoff_t perf_t0 = PERF_NOW (stream);
+
+	  ret = xd3_iopt_flush_instructions (stream, 0);
+	  PERF_ADD (stream, t_iopt, perf_t0);
+
+	  if (ret != 0) { return ret; }
 
 	  XD3_ASSERT (! xd3_rlist_empty (& stream->iopt_free));
 	}
@@ -3401,6 +4078,28 @@ xd3_found_match (xd3_stream *stream, usize_t pos,
   return 0;
 }
 
+/* Extends the window checksum through input position POS.  This is
+ * called as the matcher advances, while the input it just compared
+ * is still in cache, so that xd3_emit_hdr() has little left to do. */
+static void
+xd3_encode_adler32 (xd3_stream *stream, usize_t pos)
+{
+  if ((stream->flags & (XD3_ADLER32 | XD3_ESTIMATE)) != XD3_ADLER32)
+    {
+      return;
+    }
+
+  pos = min (pos, stream->avail_in);
+
+  if (pos > stream->enc_adler32_pos)
+    {
+      stream->enc_adler32 = adler32 (stream->enc_adler32,
+				     stream->next_in + stream->enc_adler32_pos,
+				     pos - stream->enc_adler32_pos);
+      stream->enc_adler32_pos = pos;
+    }
+}
+
 static int
 xd3_emit_hdr (xd3_stream *stream)
 {
@@ -3420,7 +4119,7 @@ xd3_emit_hdr (xd3_stream *stream)
     {
       usize_t hdr_ind = 0;
       int use_appheader  = stream->enc_appheader != NULL;
-      int use_gencodetbl = GENERIC_ENCODE_TABLES &&
+      int use_gencodetbl =
 	(stream->code_table_desc != & __rfc3284_code_table_desc);
 
       if (use_secondary)  { hdr_ind |= VCD_SECONDARY; }
@@ -3496,6 +4195,7 @@ xd3_emit_hdr (xd3_stream *stream)
       int data_sec = 0;
       int inst_sec = 0;
       int addr_sec = 0;
+      xoff_t perf_t0 = PERF_NOW (stream);
 
 #     define ENCODE_SECONDARY_SECTION(UPPER,LOWER) \
              ((stream->flags & XD3_SEC_NO ## UPPER) == 0 && \
@@ -3513,6 +4213,8 @@ xd3_emit_hdr (xd3_stream *stream)
 	  return ret;
 	}
 
+      PERF_ADD (stream, t_secondary, perf_t0);
+
       del_ind |= (data_sec ? VCD_DATACOMP : 0);
       del_ind |= (inst_sec ? VCD_INSTCOMP : 0);
       del_ind |= (addr_sec ? VCD_ADDRCOMP : 0);
@@ -3540,9 +4242,13 @@ xd3_emit_hdr (xd3_stream *stream)
     }
 
   tgt_len  = stream->avail_in;
-  data_len = xd3_sizeof_output (DATA_HEAD (stream));
-  inst_len = xd3_sizeof_output (INST_HEAD (stream));
-  addr_len = xd3_sizeof_output (ADDR_HEAD (stream));
+  data_len = xd3_sizeof_output_tail (DATA_TAIL (stream));
+  inst_len = xd3_sizeof_output_tail (INST_TAIL (stream));
+  addr_len = xd3_sizeof_output_tail (ADDR_TAIL (stream));
+
+  XD3_ASSERT (data_len == xd3_sizeof_output (DATA_HEAD (stream)));
+  XD3_ASSERT (inst_len == xd3_sizeof_output (INST_HEAD (stream)));
+  XD3_ASSERT (addr_len == xd3_sizeof_output (ADDR_HEAD (stream)));
 
   /* The enc_len field is a redundency for future extensions.*/
   enc_len = (1 + (xd3_sizeof_size (tgt_len) +
@@ -3571,7 +4277,9 @@ xd3_emit_hdr (xd3_stream *stream)
 
       if (stream->flags & XD3_ADLER32)
 	{
-	  a32 = adler32 (1L, stream->next_in, stream->avail_in);
+	  /* Most of the input was summed during the search. */
+	  xd3_encode_adler32 (stream, stream->avail_in);
+	  a32 = stream->enc_adler32;
 	}
       else
 	{
@@ -3593,6 +4301,60 @@ xd3_emit_hdr (xd3_stream *stream)
   return 0;
 }
 
+/* Returns the number of bytes xd3_emit_hdr() and the three sections
+ * would take for this window, without secondary compression, for
+ * XD3_ESTIMATE.  A non-default code table is not counted. */
+static usize_t
+xd3_estimate_window (xd3_stream *stream)
+{
+  int  use_adler32 = stream->flags & (XD3_ADLER32 | XD3_ADLER32_RECODE);
+  usize_t tgt_len  = stream->avail_in;
+  usize_t data_len = (xd3_sizeof_output (DATA_HEAD (stream)) +
+		      stream->enc_est_adds);
+  usize_t inst_len = xd3_sizeof_output (INST_HEAD (stream));
+  usize_t addr_len = xd3_sizeof_output (ADDR_HEAD (stream));
+  usize_t enc_len;
+  usize_t size = 0;
+
+  if (stream->current_window == 0)
+    {
+      /* Magic, version, indicator and secondary ID. */
+      size = 5 + (stream->sec_type != NULL);
+
+      if (stream->enc_appheader != NULL)
+	{
+	  size += (xd3_sizeof_size (stream->enc_appheadsz) +
+		   stream->enc_appheadsz);
+	}
+    }
+
+  /* Window indicator, then the source segment size and position. */
+  size += 1;
+
+  if (xd3_encoder_used_source (stream))
+    {
+      xoff_t off;
+
+      size += xd3_sizeof_size (stream->src->srclen) + 1;
+
+      for (off = stream->src->srcbase; off >= 128; off >>= 7)
+	{
+	  size += 1;
+	}
+    }
+
+  enc_len = (1 + (xd3_sizeof_size (tgt_len) +
+		  xd3_sizeof_size (data_len) +
+		  xd3_sizeof_size (inst_len) +
+		  xd3_sizeof_size (addr_len)) +
+	     data_len +
+	     inst_len +
+	     addr_len +
+	     (use_adler32 ? 4 : 0));
+
+  return size + xd3_sizeof_size (enc_len) + enc_len;
+}
+
 /****************************************************************
  Encode routines
  ****************************************************************/
@@ -3698,7 +4460,9 @@ xd3_encode_init (xd3_stream *stream, int full_init)
       if (large_comp)
 	{
 	  usize_t hash_values = (stream->src->max_winsize /
-				 stream->smatcher.large_step);
+				 (stream->anchor_interval ?
+				  stream->anchor_interval :
+				  stream->smatcher.large_step));
 
 	  xd3_size_hashtable (stream,
 			      hash_values,
@@ -3710,11 +4474,13 @@ xd3_encode_init (xd3_stream *stream, int full_init)
 	  /* TODO: This is under devel: used to have min(sprevsz) here, which sort
 	   * of makes sense, but observed fast performance w/ larger tables, which
 	   * also sort of makes sense. @@@ */
-	  usize_t hash_values = stream->winsize;
+	  usize_t hash_values = min (stream->winsize, XD3_HARDMAXWINSIZE);
 
 	  xd3_size_hashtable (stream,
 			      hash_values,
 			      & stream->small_hash);
+
+	  xd3_size_far_table (stream, stream->winsize);
 	}
     }
 
@@ -3741,7 +4507,13 @@ xd3_encode_init (xd3_stream *stream, int full_init)
   /* address cache, code table */
   stream->acache.s_near = stream->code_table_desc->near_modes;
   stream->acache.s_same = stream->code_table_desc->same_modes;
-  stream->code_table    = stream->code_table_func ();
+  if (stream->code_table_func != NULL)
+    {
+      stream->code_table = stream->code_table_func ();
+    }
+
+  stream->enc_adler32     = 1;
+  stream->enc_adler32_pos = 0;
 
   return xd3_alloc_cache (stream);
 
@@ -3774,6 +4546,9 @@ xd3_encode_reset (xd3_stream *stream)
   stream->avail_in     = 0;
   stream->small_reset  = 1;
   stream->i_slots_used = 0;
+  stream->enc_adler32     = 1;
+  stream->enc_adler32_pos = 0;
+  stream->enc_est_adds    = 0;
 
   if (stream->src != NULL)
     {
@@ -3798,6 +4573,7 @@ xd3_encode_reset (xd3_stream *stream)
       olist = olist->next_page;
 
       stream->enc_heads[i]->next = 0;
+      stream->enc_heads[i]->chain_offset = 0;
       stream->enc_heads[i]->next_page = NULL;
 
       stream->enc_tails[i]->next_page = NULL;
@@ -3861,6 +4637,8 @@ xd3_encode_input (xd3_stream *stream)
       stream->min_match = MIN_MATCH;
       stream->unencoded_offset = 0;
 
+      IF_PERF (stream, xd3_perf_winstart (stream));
+
       stream->enc_state = ENC_SEARCH;
 
       IF_DEBUG2 (DP(RINT "[WINSTART:%"Q"u] input bytes %u offset %"Q"u\n",
@@ -3893,6 +4671,7 @@ xd3_encode_input (xd3_stream *stream)
 		  ret = xd3_source_match_setup (stream, stream->match_srcpos);
 		  XD3_ASSERT (ret == 0);
 		  stream->match_state = MATCH_FORWARD;
+		  stream->match_probe = (stream->flags & XD3_PROBE) != 0;
 		}
 	      else
 		{
@@ -3905,7 +4684,12 @@ xd3_encode_input (xd3_stream *stream)
 	    case MATCH_BACKWARD:
 	      if (stream->avail_in != 0)
 		{
-		  if ((ret = xd3_source_extend_match (stream)) != 0)
+		  xoff_t perf_t0 = PERF_NOW (stream);
+
+		  ret = xd3_source_extend_match (stream);
+		  PERF_ADD (stream, t_extend, perf_t0);
+
+		  if (ret != 0)
 		    {
 		      return ret;
 		    }
@@ -3917,6 +4701,7 @@ xd3_encode_input (xd3_stream *stream)
 		   * exactly the same search.
 		   */
 		  stream->input_position += stream->match_fwd;
+		  xd3_encode_adler32 (stream, stream->input_position);
 		}
 
 	    case MATCH_SEARCHING:
@@ -3929,10 +4714,17 @@ xd3_encode_input (xd3_stream *stream)
 	}
 
       /* String matching... */
-      if (stream->avail_in != 0 &&
-	  (ret = stream->smatcher.string_match (stream)))
+      if (stream->avail_in != 0)
 	{
-	  return ret;
+	  xoff_t perf_t0 = PERF_NOW (stream);
+
+	  ret = stream->smatcher.string_match (stream);
+	  PERF_ADD (stream, t_match, perf_t0);
+
+	  if (ret != 0)
+	    {
+	      return ret;
+	    }
 	}
 
       stream->enc_state = ENC_INSTR;
@@ -3943,7 +4735,14 @@ xd3_encode_input (xd3_stream *stream)
 
       /* Flush the instrution buffer, then possibly add one more
        * instruction, then emit the header. */
-      if ((ret = xd3_iopt_flush_instructions (stream, 1)) ||
+      {
+	xoff_t perf_t0 = PERF_NOW (stream);
+
+	ret = xd3_iopt_flush_instructions (stream, 1);
+	PERF_ADD (stream, t_iopt, perf_t0);
+      }
+
+      if (ret != 0 ||
           (ret = xd3_iopt_add_finalize (stream)))
 	{
 	  return ret;
@@ -3954,7 +4753,11 @@ xd3_encode_input (xd3_stream *stream)
     case ENC_FLUSH:
       /* Note: main_recode_func() bypasses string-matching by setting
        * ENC_FLUSH. */
-      if ((ret = xd3_emit_hdr (stream)))
+      if (stream->flags & XD3_ESTIMATE)
+	{
+	  stream->total_out += (xoff_t) xd3_estimate_window (stream);
+	}
+      else if ((ret = xd3_emit_hdr (stream)))
 	{
 	  return ret;
 	}
@@ -3971,6 +4774,12 @@ xd3_encode_input (xd3_stream *stream)
 	  stream->enc_heads[i] = NULL;
 	}
 
+      /* With XD3_ESTIMATE there is no output to return. */
+      if (stream->flags & XD3_ESTIMATE)
+	{
+	  goto enc_finish;
+	}
+
     enc_output:
 
       stream->enc_state  = ENC_POSTOUT;
@@ -4001,6 +4810,7 @@ xd3_encode_input (xd3_stream *stream)
 	  goto enc_output;
 	}
 
+    enc_finish:
       stream->total_in += (xoff_t) stream->avail_in;
       stream->enc_state = ENC_POSTWIN;
 
@@ -4072,8 +4882,18 @@ xd3_process_stream (int            is_encode,
 	  ipos += n;
 	  continue;
 	}
-	case XD3_GOTHEADER: { /* ignore */ continue; }
-	case XD3_WINSTART: { /* ignore */ continue; }
+	case XD3_GOTHEADER:
+	case XD3_WINSTART:
+	  {
+	    /* The decoder writes straight into the output. */
+	    if (! is_encode &&
+		(ret = xd3_set_dec_output (stream, output + *output_size,
+					   output_size_max - *output_size)))
+	      {
+		return ret;
+	      }
+	    continue;
+	  }
 	case XD3_WINFINISH: { /* ignore */ continue; }
 	case XD3_GETSRCBLK:
 	  {
@@ -4096,7 +4916,10 @@ xd3_process_stream (int            is_encode,
 	  return ENOSPC;
 	}
 
-      memcpy (output + *output_size, stream->next_out, stream->avail_out);
+      if (stream->next_out != output + *output_size)
+	{
+	  memcpy (output + *output_size, stream->next_out, stream->avail_out);
+	}
 
       *output_size += stream->avail_out;
 
@@ -4279,8 +5102,15 @@ xd3_string_match_init (xd3_stream *stream)
 	  if (stream->small_reset)
 	    {
 	      stream->small_reset = 0;
+	      stream->perf.small_fill = 0;
 	      memset (stream->small_table, 0,
 		      sizeof (usize_t) * stream->small_hash.size);
+
+	      if (stream->far_table != NULL)
+		{
+		  memset (stream->far_table, 0,
+			  sizeof (usize_t) * stream->far_hash.size);
+		}
 	    }
 
 	  return 0;
@@ -4294,9 +5124,28 @@ xd3_string_match_init (xd3_stream *stream)
 	  return ENOMEM;
 	}
 
+      if (stream->winsize > XD3_HARDMAXWINSIZE &&
+	  (stream->far_table =
+	   (usize_t*) xd3_alloc0 (stream,
+				  stream->far_hash.size,
+				  sizeof (usize_t))) == NULL)
+	{
+	  return ENOMEM;
+	}
+
       /* If there is a previous table needed. */
-      if (stream->smatcher.small_lchain > 1 ||
-	  stream->smatcher.small_chain > 1)
+      if (stream->smatcher.small_tree)
+	{
+	  if ((stream->small_tree =
+	       (usize_t*) xd3_alloc (stream,
+				     stream->sprevsz,
+				     2 * sizeof (usize_t))) == NULL)
+	    {
+	      return ENOMEM;
+	    }
+	}
+      else if (stream->smatcher.small_lchain > 1 ||
+	       stream->smatcher.small_chain > 1)
 	{
 	  if ((stream->small_prev =
 	       (xd3_slist*) xd3_alloc (stream,
@@ -4342,6 +5191,55 @@ xd3_source_cksum_offset(xd3_stream *stream, usize_t low)
 }
 #endif
 
+/* Indexes the content-defined anchors in the current source block,
+ * from FIRST through LAST, the final position with large_look bytes
+ * on the block.  Unlike the large_step loop this rolls the checksum
+ * through every position, so later anchors replace earlier ones that
+ * share a slot. */
+static void
+xd3_srcwin_index_anchors (xd3_stream *stream, xoff_t blkbaseoffset,
+			  ssize_t first, ssize_t last)
+{
+  const uint8_t *base = stream->src->curblk;
+  usize_t look = stream->smatcher.large_look;
+  uint32_t cksum;
+  ssize_t pos = first;
+
+  if (first > last) { return; }
+
+  cksum = xd3_lcksum (base + first, look);
+
+  for (;;)
+    {
+      if (xd3_is_anchor (cksum, stream->anchor_shift))
+	{
+	  usize_t hval = xd3_checksum_hash (& stream->large_hash, cksum);
+
+	  if (PERF_ON (stream))
+	    {
+	      if (stream->large_table[hval] == 0)
+		{
+		  stream->perf.large_fill += 1;
+		}
+	      else
+		{
+		  stream->perf.large_collide += 1;
+		}
+	    }
+
+	  stream->large_table[hval] =
+	    (usize_t) (blkbaseoffset + (xoff_t)(pos + HASH_CKOFFSET));
+
+	  IF_DEBUG (stream->large_ckcnt += 1);
+	}
+
+      if (pos >= last) { break; }
+
+      cksum = xd3_large_cksum_update (cksum, base + pos, look);
+      pos += 1;
+    }
+}
+
 /* This function sets up the stream->src fields srcbase, srclen.  The
  * call is delayed until these values are needed to encode a copy
  * address.  At this point the decision has to be made. */
@@ -4418,6 +5316,7 @@ xd3_source_match_setup (xd3_stream *stream, xoff_t srcpos)
   xd3_source *src = stream->src;
   usize_t greedy_or_not;
   xoff_t frontier_pos;
+  xoff_t low_pos = 0;
 
   stream->match_maxback = 0;
   stream->match_maxfwd  = 0;
@@ -4454,6 +5353,25 @@ xd3_source_match_setup (xd3_stream *stream, xoff_t srcpos)
     goto bad;
   }
 
+  /* With XD3_MONOTONE, implement src->max_backward: source copies may
+   * start no further than this behind maxsrcaddr, the furthest any
+   * copy has reached.  maxsrcaddr includes copies later erased from
+   * the iopt buffer, which only makes the limit stricter. */
+  if ((stream->flags & XD3_MONOTONE) &&
+      src->max_backward != 0 &&
+      stream->maxsrcaddr > src->max_backward)
+    {
+      low_pos = stream->maxsrcaddr - src->max_backward;
+
+      if (srcpos < low_pos)
+	{
+	  IF_DEBUG1(DP(RINT "[match_setup] rejected due to "
+		       "src->max_backward srcpos=%"Q"u low=%"Q"u\n",
+		       srcpos, low_pos));
+	  goto bad;
+	}
+    }
+
   /* Going backwards, the 1.5-pass algorithm allows some
    * already-matched input may be covered by a longer source match.
    * The greedy algorithm does not allow this. */
@@ -4477,6 +5395,12 @@ xd3_source_match_setup (xd3_stream *stream, xoff_t srcpos)
   XD3_ASSERT (stream->input_position >= greedy_or_not);
   stream->match_maxback = stream->input_position - greedy_or_not;
 
+  /* The match may not extend back past src->max_backward. */
+  if (srcpos - low_pos < (xoff_t) stream->match_maxback)
+    {
+      stream->match_maxback = (usize_t) (srcpos - low_pos);
+    }
+
   /* Forward target match limit. */
   XD3_ASSERT (stream->avail_in > stream->input_position);
   stream->match_maxfwd = stream->avail_in - stream->input_position;
@@ -4619,6 +5543,7 @@ xd3_source_extend_match (xd3_stream *stream)
   usize_t tryoff;
   usize_t tryrem;    /* tryrem is the number of matchable bytes */
   usize_t matched;
+  int probed;
 
   IF_DEBUG2(DP(RINT "[extend match] srcpos %"Q"u\n",
 	       stream->match_srcpos));
@@ -4731,13 +5656,18 @@ xd3_source_extend_match (xd3_stream *stream)
     }
 
   stream->match_state = MATCH_SEARCHING;
+  probed = stream->match_probe;
+  stream->match_probe = 0;
 
   /* If the match ends short of the last instruction end, we probably
    * don't want it.  There is the possibility that a copy ends short
    * of the last copy but also goes further back, in which case we
    * might want it.  This code does not implement such: if so we would
-   * need more complicated xd3_iopt_erase logic. */
-  if (stream->match_fwd < stream->min_match)
+   * need more complicated xd3_iopt_erase logic.  A probe must also
+   * match as much as a checksum match would have. */
+  if (stream->match_fwd < stream->min_match ||
+      (probed && (stream->match_fwd + stream->match_back <
+		  stream->smatcher.large_look)))
     {
       stream->match_fwd = 0;
     }
@@ -4802,6 +5732,17 @@ xd3_source_extend_match (xd3_stream *stream)
 	  return ret;
 	}
 
+      /* The next probe continues from here. */
+      stream->probe_srcpos = match_end;
+      stream->probe_tgtpos = stream->total_in + target_position + match_length;
+
+      if (probed && match_length >= PROBE_SIZE &&
+	  ! (src->eof_known && xd3_source_eof (src) <= src->max_winsize))
+	{
+	  stream->srcwin_probing = 1;
+	  stream->probe_misses = 0;
+	}
+
       /* If the match ends with the available input: */
       if (target_position + match_length == stream->avail_in)
 	{
@@ -4814,6 +5755,74 @@ xd3_source_extend_match (xd3_stream *stream)
   return 0;
 }
 
+/* The unchanged-block fast path, with XD3_PROBE.  Disk images and
+ * similar targets mostly match the source in place, at the same
+ * offset or where the last source match continues.  The string
+ * matcher calls this at target positions aligned to PROBE_SIZE,
+ * before its checksum lookups, to try those two source positions
+ * directly.  Comparing in memory costs less than hashing both sides.
+ * A source that fits in src->max_winsize is still indexed whole, so
+ * that moved blocks are found.  For a larger one, while probes keep
+ * finding long matches (srcwin_probing), xd3_srcwin_move_point() is
+ * not called, so unchanged source is not indexed.  After PROBE_MISSES
+ * failures in a row, indexing resumes.  Like
+ * xd3_source_extend_match(), this leaves stream->match_fwd non-zero
+ * if a match is taken. */
+static int
+xd3_source_probe (xd3_stream *stream)
+{
+  xd3_source *src = stream->src;
+  xoff_t tgtpos = stream->total_in + stream->input_position;
+  xoff_t srcmax;
+  xoff_t cand[2];
+  int ncand = 0;
+  int i, ret;
+
+  stream->match_fwd = 0;
+
+  /* Do not read ahead of the source for a probe. */
+  srcmax = src->eof_known ? xd3_source_eof (src) :
+    src->frontier_blkno * src->blksize;
+
+  if (stream->probe_tgtpos != 0 && tgtpos >= stream->probe_tgtpos)
+    {
+      cand[ncand++] = stream->probe_srcpos + (tgtpos - stream->probe_tgtpos);
+    }
+
+  if (ncand == 0 || cand[0] != tgtpos)
+    {
+      cand[ncand++] = tgtpos;
+    }
+
+  for (i = 0; i < ncand; i += 1)
+    {
+      if (cand[i] >= srcmax ||
+	  xd3_source_match_setup (stream, cand[i]) != 0)
+	{
+	  continue;
+	}
+
+      stream->match_probe = 1;
+
+      if ((ret = xd3_source_extend_match (stream)))
+	{
+	  return ret;
+	}
+
+      if (stream->match_fwd > 0)
+	{
+	  return 0;
+	}
+    }
+
+  if (++stream->probe_misses >= PROBE_MISSES)
+    {
+      stream->srcwin_probing = 0;
+    }
+
+  return 0;
+}
+
 /* Update the small hash.  Values in the small_table are offset by
  * HASH_CKOFFSET (1) to distinguish empty buckets from real offsets. */
 static void
@@ -4832,6 +5841,12 @@ xd3_scksum_insert (xd3_stream *stream,
       pos_list->last_pos = last_pos;
     }
 
+  if (PERF_ON (stream))
+    {
+      if (stream->small_table[inx] == 0) { stream->perf.small_fill += 1; }
+      else { stream->perf.small_collide += 1; }
+    }
+
   /* Enter the new position into the hash bucket. */
   stream->small_table[inx] = pos + HASH_CKOFFSET;
 }
@@ -4857,6 +5872,36 @@ xd3_check_smatch (const uint8_t *ref0, const uint8_t *inp0,
 }
 #endif /* XD3_DEBUG */
 
+/* Crude efficiency test: if the match is very short and very far back, it's
+ * unlikely to help, but the exact calculation requires knowing the state of
+ * the address cache and adjacent instructions, which we can't do here.
+ * Rather than encode a probably inefficient copy here and check it later
+ * (which complicates the code a lot), this returns 0 for those. */
+static usize_t
+xd3_smatch_worth (xd3_stream *stream,
+		  usize_t     match_length,
+		  usize_t     match_offset)
+{
+  if (match_length == 4 && stream->input_position - match_offset >= 1<<14)
+    {
+      /* It probably takes >2 bytes to encode an address >= 2^14 from here */
+      return 0;
+    }
+  if (match_length == 5 && stream->input_position - match_offset >= 1<<21)
+    {
+      /* It probably takes >3 bytes to encode an address >= 2^21 from here */
+      return 0;
+    }
+
+  if (match_length == 6 && stream->input_position - match_offset >= 1<<28)
+    {
+      /* Only windows larger than XD3_HARDMAXWINSIZE reach this far. */
+      return 0;
+    }
+
+  return match_length;
+}
+
 /* When the hash table indicates a possible small string match, it
  * calls this routine to find the best match.  The first matching
  * position is taken from the small_table, HASH_CKOFFSET is subtracted
@@ -4891,6 +5936,8 @@ xd3_smatch (xd3_stream *stream,
   IF_DEBUG2 (DP(RINT "smatch at base=%u inp=%u cksum=%u\n", base,
                 stream->input_position, scksum));
 
+  IF_PERF (stream, stream->perf.chain_steps += 1);
+
   /* For small matches, we can always go to the end-of-input because
    * the matching position must be less than the input position. */
   XD3_ASSERT (base < stream->input_position);
@@ -4963,26 +6010,166 @@ xd3_smatch (xd3_stream *stream,
     }
 
  done:
-  /* Crude efficiency test: if the match is very short and very far back, it's
-   * unlikely to help, but the exact calculation requires knowing the state of
-   * the address cache and adjacent instructions, which we can't do here.
-   * Rather than encode a probably inefficient copy here and check it later
-   * (which complicates the code a lot), do this:
-   */
-  if (match_length == 4 && stream->input_position - (*match_offset) >= 1<<14)
+  return xd3_smatch_worth (stream, match_length, *match_offset);
+}
+
+/* Searches the binary tree of earlier positions rooted at small_table
+ * slot INX for the longest match at the input position, and makes
+ * the input position the new root, as the LZMA "bt4" match finder
+ * does.  Each position has two children in small_tree, at twice its
+ * offset modulo sprevsz: positions whose following bytes sort lower
+ * on the left, higher on the right.  Because the search visits the
+ * nodes that share the longest prefix with the input, the longest
+ * match is found in about log(sprevsz) steps on repetitive data,
+ * where a hash chain visits every repeat.  Strings are compared up to
+ * TREE_NICE_LEN or long_enough bytes, the best match is then extended
+ * to the end of input.  After small_chain nodes (small_lchain during lazy matching)
+ * the tree below the new root is cut. */
+static usize_t
+xd3_tree_match (xd3_stream *stream,
+		usize_t     inx,
+		usize_t    *match_offset)
+{
+  const uint8_t *inp = stream->next_in + stream->input_position;
+  usize_t pos = stream->input_position;
+  usize_t avail = stream->avail_in - pos;
+  usize_t limit = min (avail, max (stream->smatcher.long_enough,
+				  TREE_NICE_LEN));
+  usize_t chain = (stream->min_match == MIN_MATCH ?
+		   stream->smatcher.small_chain :
+		   stream->smatcher.small_lchain);
+  usize_t cand = stream->small_table[inx];
+  usize_t *ptr0 = stream->small_tree + 2 * (pos & stream->sprevmask) + 1;
+  usize_t *ptr1 = stream->small_tree + 2 * (pos & stream->sprevmask);
+  usize_t len0 = 0;
+  usize_t len1 = 0;
+  usize_t match_length = 0;
+
+  if (PERF_ON (stream))
     {
-      /* It probably takes >2 bytes to encode an address >= 2^14 from here */
-      return 0;
+      if (cand == 0) { stream->perf.small_fill += 1; }
+      else { stream->perf.small_collide += 1; }
     }
-  if (match_length == 5 && stream->input_position - (*match_offset) >= 1<<21)
+
+  stream->small_table[inx] = pos + HASH_CKOFFSET;
+  chain = max (chain, 1U);
+
+  for (;;)
+    {
+      const uint8_t *ref;
+      usize_t *pair;
+      usize_t len;
+
+      if (cand == 0 || chain-- == 0)
+	{
+	  *ptr0 = *ptr1 = 0;
+	  break;
+	}
+
+      IF_PERF (stream, stream->perf.chain_steps += 1);
+
+      cand -= HASH_CKOFFSET;
+      ref = stream->next_in + cand;
+      len = min (len0, len1);
+
+      /* Positions further back than sprevsz have had their children
+       * overwritten, but like the head of a hash chain the position
+       * itself is still a candidate. */
+      if (pos - cand > stream->sprevmask)
+	{
+	  while (len < limit && ref[len] == inp[len]) { len += 1; }
+
+	  if (len > match_length)
+	    {
+	      match_length = len;
+	      *match_offset = cand;
+	    }
+
+	  *ptr0 = *ptr1 = 0;
+	  break;
+	}
+
+      pair = stream->small_tree + 2 * (cand & stream->sprevmask);
+
+      if (ref[len] == inp[len])
+	{
+	  while (++len != limit && ref[len] == inp[len]) { }
+
+	  if (len > match_length)
+	    {
+	      match_length = len;
+	      *match_offset = cand;
+
+	      /* The input replaces this node, taking its children. */
+	      if (len == limit)
+		{
+		  *ptr1 = pair[0];
+		  *ptr0 = pair[1];
+		  break;
+		}
+	    }
+	}
+
+      if (ref[len] < inp[len])
+	{
+	  *ptr1 = cand + HASH_CKOFFSET;
+	  ptr1 = pair + 1;
+	  cand = *ptr1;
+	  len1 = len;
+	}
+      else
+	{
+	  *ptr0 = cand + HASH_CKOFFSET;
+	  ptr0 = pair;
+	  cand = *ptr0;
+	  len0 = len;
+	}
+    }
+
+  if (match_length == limit && limit < avail)
+    {
+      match_length += (usize_t)
+	xd3_forward_match (stream->next_in + *match_offset + limit,
+			   inp + limit, (int) (avail - limit));
+    }
+
+  return xd3_smatch_worth (stream, match_length, *match_offset);
+}
+
+/* Checks a far table candidate (see xd3_size_far_table) for a target
+ * match at the input position.  The match is extended forward, and
+ * backward as far as the last pending match, which is returned in
+ * *BACK.  Returns the length found forward, 0 if none. */
+static usize_t
+xd3_far_match (xd3_stream *stream,
+	       usize_t     cand,
+	       usize_t    *back)
+{
+  usize_t pos = stream->input_position;
+  usize_t limit = max (stream->unencoded_offset,
+		       xd3_iopt_last_matched (stream));
+  usize_t fwd;
+  usize_t b = 0;
+
+  cand -= HASH_CKOFFSET;
+
+  if (cand >= pos)
     {
-      /* It probably takes >3 bytes to encode an address >= 2^21 from here */
       return 0;
     }
 
-  /* It's unlikely that a window is large enough for the (match_length == 6 &&
-   * address >= 2^28) check */
-  return match_length;
+  fwd = (usize_t) xd3_forward_match (stream->next_in + cand,
+				     stream->next_in + pos,
+				     (int) (stream->avail_in - pos));
+
+  while (b < cand && pos - b > limit &&
+	 stream->next_in[cand - b - 1] == stream->next_in[pos - b - 1])
+    {
+      b += 1;
+    }
+
+  *back = b;
+  return fwd;
 }
 
 #if XD3_DEBUG
@@ -5061,8 +6248,17 @@ xd3_srcwin_move_point (xd3_stream *stream, usize_t *next_move_point)
     }
 
   /* A long match may have extended past srcwin_cksum_pos.  Don't
-   * start checksumming already-matched source data. */
-  if (stream->maxsrcaddr > stream->srcwin_cksum_pos)
+   * start checksumming already-matched source data.  After
+   * xd3_set_winstate(), first rebuild the index up to where it
+   * stood. */
+  if (stream->srcwin_cksum_pos < stream->srcwin_resume_pos)
+    {
+      xoff_t resume_pos = stream->srcwin_resume_pos -
+	min (stream->srcwin_resume_pos, (xoff_t) stream->src->blksize);
+
+      logical_input_cksum_pos = max (logical_input_cksum_pos, resume_pos);
+    }
+  else if (stream->maxsrcaddr > stream->srcwin_cksum_pos)
     {
       stream->srcwin_cksum_pos = stream->maxsrcaddr;
     }
@@ -5097,6 +6293,7 @@ xd3_srcwin_move_point (xd3_stream *stream, usize_t *next_move_point)
       ssize_t oldpos;  /* Using ssize_t because of a  */
       ssize_t blkpos;  /* do { blkpos-- }
 			  while (blkpos >= oldpos); */
+      xoff_t perf_t0;
       int ret;
       xd3_blksize_div (stream->srcwin_cksum_pos,
 		       stream->src, &blkno, &blkrem);
@@ -5143,6 +6340,15 @@ xd3_srcwin_move_point (xd3_stream *stream, usize_t *next_move_point)
        * if-stmt above ensures at least one large_look of data. */
       blkpos -= stream->smatcher.large_look;
       blkbaseoffset = stream->src->blksize * blkno;
+      perf_t0 = PERF_NOW (stream);
+
+      if (stream->anchor_shift != 0)
+	{
+	  xd3_srcwin_index_anchors (stream, blkbaseoffset, oldpos, blkpos);
+	  PERF_ADD (stream, t_srcindex, perf_t0);
+	  stream->srcwin_cksum_pos = (blkno + 1) * stream->src->blksize;
+	  continue;
+	}
 
       do
 	{
@@ -5150,6 +6356,18 @@ xd3_srcwin_move_point (xd3_stream *stream, usize_t *next_move_point)
 				       stream->smatcher.large_look);
 	  usize_t hval = xd3_checksum_hash (& stream->large_hash, cksum);
 
+	  if (PERF_ON (stream))
+	    {
+	      if (stream->large_table[hval] == 0)
+		{
+		  stream->perf.large_fill += 1;
+		}
+	      else
+		{
+		  stream->perf.large_collide += 1;
+		}
+	    }
+
 	  stream->large_table[hval] =
 	    (usize_t) (blkbaseoffset +
 		       (xoff_t)(blkpos + HASH_CKOFFSET));
@@ -5160,6 +6378,8 @@ xd3_srcwin_move_point (xd3_stream *stream, usize_t *next_move_point)
 	}
       while (blkpos >= oldpos);
 
+      PERF_ADD (stream, t_srcindex, perf_t0);
+
       stream->srcwin_cksum_pos = (blkno + 1) * stream->src->blksize;
     }
 
@@ -5223,9 +6443,9 @@ static const xd3_smatcher XD3_TEMPLATE(__smatcher_) =
   XD3_STRINGIFY(TEMPLATE),
   XD3_TEMPLATE(xd3_string_match_),
 #if SOFTCFG == 1
-  0, 0, 0, 0, 0, 0, 0
+  0, 0, 0, 0, 0, 0, 0, 0
 #else
-  LLOOK, LSTEP, SLOOK, SCHAIN, SLCHAIN, MAXLAZY, LONGENOUGH
+  LLOOK, LSTEP, SLOOK, SCHAIN, SLCHAIN, MAXLAZY, LONGENOUGH, SBTREE
 #endif
 };
 
@@ -5235,6 +6455,10 @@ XD3_TEMPLATE(xd3_string_match_) (xd3_stream *stream)
   const int      DO_SMALL = ! (stream->flags & XD3_NOCOMPRESS);
   const int      DO_LARGE = (stream->src != NULL);
   const int      DO_RUN   = (1);
+  const int      DO_FAR   = (DO_SMALL &&
+			     stream->winsize > XD3_HARDMAXWINSIZE);
+  const int      DO_TREE  = (SBTREE);
+  const int      DO_PROBE = (DO_LARGE && (stream->flags & XD3_PROBE));
 
   const uint8_t *inp;
   uint32_t       scksum = 0;
@@ -5248,6 +6472,8 @@ XD3_TEMPLATE(xd3_string_match_) (xd3_stream *stream)
   usize_t        match_length;
   usize_t        match_offset = 0;
   usize_t        next_move_point;
+  usize_t        far_back;
+  usize_t        next_probe = 0;
 
   /* If there will be no compression due to settings or short input,
    * skip it entirely. */
@@ -5260,6 +6486,9 @@ XD3_TEMPLATE(xd3_string_match_) (xd3_stream *stream)
    * needs to be reset. */
  restartloop:
 
+  /* Fold the input scanned so far into the window checksum. */
+  xd3_encode_adler32 (stream, stream->input_position);
+
   /* If there is not enough input remaining for any kind of match,
      skip it. */
   if (stream->input_position + SLOOK > stream->avail_in) { goto loopnomore; }
@@ -5303,8 +6532,12 @@ XD3_TEMPLATE(xd3_string_match_) (xd3_stream *stream)
     {
       /* Source window: next_move_point is the point that
        * stream->input_position must reach before computing more
-       * source checksum. */
-      if ((ret = xd3_srcwin_move_point (stream, & next_move_point)))
+       * source checksum.  None is computed while probing. */
+      if (stream->srcwin_probing)
+	{
+	  next_move_point = stream->input_position;
+	}
+      else if ((ret = xd3_srcwin_move_point (stream, & next_move_point)))
 	{
 	  return ret;
 	}
@@ -5312,6 +6545,15 @@ XD3_TEMPLATE(xd3_string_match_) (xd3_stream *stream)
       lcksum = xd3_lcksum (inp, LLOOK);
     }
 
+  /* Probe state: the next aligned target position, not counting this
+   * one, which either follows a match or was just probed. */
+  if (DO_PROBE)
+    {
+      next_probe = stream->input_position + PROBE_SIZE -
+	(usize_t) ((stream->total_in + stream->input_position) &
+		   (PROBE_SIZE - 1));
+    }
+
   /* TRYLAZYLEN: True if a certain length match should be followed by
    * lazy search.  This checks that LEN is shorter than MAXLAZY and
    * that there is enough leftover data to consider lazy matching.
@@ -5325,7 +6567,8 @@ XD3_TEMPLATE(xd3_string_match_) (xd3_stream *stream)
    * loop is restarted, otherwise lazy matching may ensue. */
 #define HANDLELAZY(mlen) \
   if (TRYLAZYLEN ((mlen), (stream->input_position), (stream->avail_in))) \
-    { stream->min_match = (mlen) + LEAST_MATCH_INCR; goto updateone; } \
+    { stream->min_match = (mlen) + LEAST_MATCH_INCR; \
+      IF_PERF (stream, stream->perf.lazy_retries += 1); goto updateone; } \
   else \
     { stream->input_position += (mlen); goto restartloop; }
 
@@ -5348,7 +6591,7 @@ XD3_TEMPLATE(xd3_string_match_) (xd3_stream *stream)
 
 	  IF_DEBUG (xd3_verify_run_state (stream, inp, run_l, &run_c));
 
-	  while (run_l < max_len && inp[run_l] == run_c) { run_l += 1; }
+	  run_l += xd3_runlen (inp + run_l, max_len - run_l, run_c);
 
 	  /* Output a RUN instruction. */
 	  if (run_l >= stream->min_match && run_l >= MIN_RUN)
@@ -5360,10 +6603,27 @@ XD3_TEMPLATE(xd3_string_match_) (xd3_stream *stream)
 	    }
 	}
 
+      /* Probe the source in place, see xd3_source_probe(). */
+      if (DO_PROBE && stream->input_position == next_probe)
+	{
+	  next_probe += PROBE_SIZE;
+
+	  if ((ret = xd3_source_probe (stream)))
+	    {
+	      return ret;
+	    }
+
+	  if (stream->match_fwd > 0)
+	    {
+	      HANDLELAZY (stream->match_fwd);
+	    }
+	}
+
       /* If there is enough input remaining. */
       if (DO_LARGE && (stream->input_position + LLOOK <= stream->avail_in))
 	{
 	  if ((stream->input_position >= next_move_point) &&
+	      ! stream->srcwin_probing &&
 	      (ret = xd3_srcwin_move_point (stream, & next_move_point)))
 	    {
 	      return ret;
@@ -5373,7 +6633,11 @@ XD3_TEMPLATE(xd3_string_match_) (xd3_stream *stream)
 
 	  IF_DEBUG (xd3_verify_large_state (stream, inp, lcksum));
 
-	  if (stream->large_table[linx] != 0)
+	  /* With anchors, only positions that pass the same content
+	   * test as the source can be in the table. */
+	  if ((stream->anchor_shift == 0 ||
+	       xd3_is_anchor (lcksum, stream->anchor_shift)) &&
+	      stream->large_table[linx] != 0)
 	    {
 	      /* the match_setup will fail if the source window has
 	       * been decided and the match lies outside it.
@@ -5385,7 +6649,12 @@ XD3_TEMPLATE(xd3_string_match_) (xd3_stream *stream)
 					HASH_CKOFFSET);
 	      if (xd3_source_match_setup (stream, adj_offset) == 0)
 		{
-		  if ((ret = xd3_source_extend_match (stream)))
+		  xoff_t perf_t0 = PERF_NOW (stream);
+
+		  ret = xd3_source_extend_match (stream);
+		  PERF_ADD (stream, t_extend, perf_t0);
+
+		  if (ret != 0)
 		    {
 		      return ret;
 		    }
@@ -5400,6 +6669,37 @@ XD3_TEMPLATE(xd3_string_match_) (xd3_stream *stream)
 	    }
 	}
 
+      /* Far target matches, in windows larger than the small table
+       * covers.  Anchors are chosen by the small checksum, which is
+       * already rolling, and keyed by the large checksum. */
+      if (DO_FAR && xd3_is_anchor (scksum, stream->far_shift) &&
+	  (stream->input_position + LLOOK <= stream->avail_in))
+	{
+	  usize_t finx = xd3_checksum_hash (& stream->far_hash,
+					    xd3_lcksum (inp, LLOOK));
+	  usize_t fcand = stream->far_table[finx];
+
+	  stream->far_table[finx] = stream->input_position + HASH_CKOFFSET;
+
+	  if (fcand != 0 &&
+	      (match_length = xd3_far_match (stream, fcand, & far_back)) >= LLOOK &&
+	      match_length >= stream->min_match)
+	    {
+	      if ((ret = xd3_found_match (stream,
+					  /* decoder position */
+					  stream->input_position - far_back,
+					  /* length */ match_length + far_back,
+					  /* address */
+					  (xoff_t) (fcand - HASH_CKOFFSET - far_back),
+					  /* is_source */ 0)))
+		{
+		  return ret;
+		}
+
+	      HANDLELAZY (match_length);
+	    }
+	}
+
       /* Small matches. */
       if (DO_SMALL)
 	{
@@ -5409,20 +6709,28 @@ XD3_TEMPLATE(xd3_string_match_) (xd3_stream *stream)
 	  IF_DEBUG (xd3_verify_small_state (stream, inp, scksum));
 
 	  /* Search for the longest match */
-	  if (stream->small_table[sinx] != 0)
+	  if (DO_TREE)
 	    {
-	      match_length = xd3_smatch (stream,
-					 stream->small_table[sinx],
-					 scksum,
-					 & match_offset);
+	      /* Searches and inserts. */
+	      match_length = xd3_tree_match (stream, sinx, & match_offset);
 	    }
 	  else
 	    {
-	      match_length = 0;
-	    }
+	      if (stream->small_table[sinx] != 0)
+		{
+		  match_length = xd3_smatch (stream,
+					     stream->small_table[sinx],
+					     scksum,
+					     & match_offset);
+		}
+	      else
+		{
+		  match_length = 0;
+		}
 
-	  /* Insert a hash for this string. */
-	  xd3_scksum_insert (stream, sinx, scksum, stream->input_position);
+	      /* Insert a hash for this string. */
+	      xd3_scksum_insert (stream, sinx, scksum, stream->input_position);
+	    }
 
 	  /* Maybe output a COPY instruction */
 	  if (match_length >= stream->min_match)
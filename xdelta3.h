@@ -25,9 +25,15 @@
 #ifndef _XDELTA3_H_
 #define _XDELTA3_H_
 
+#ifndef _POSIX_SOURCE
 #define _POSIX_SOURCE
+#endif
+#ifndef _ISOC99_SOURCE
 #define _ISOC99_SOURCE
+#endif
+#ifndef _C99_SOURCE
 #define _C99_SOURCE
+#endif
 
 #if HAVE_CONFIG_H
 #include "config.h"
@@ -57,6 +63,10 @@
 #define XD3_DEFAULT_SRCWINSZ (1U << 26)
 #endif
 
+/* Maximum source window: offsets in the source hash table are 32
+ * bits. */
+#define XD3_MAXSRCWINSZ (1ULL << 31)
+
 /* When Xdelta requests a memory allocation for certain buffers, it
  * rounds up to units of at least this size.  The code assumes (and
  * asserts) that this is a power-of-two. */
@@ -66,13 +76,27 @@
 
 /* The XD3_HARDMAXWINSIZE parameter is a safety mechanism to protect
  * decoders against malicious files.  The decoder will never decode a
- * window larger than this.  If the file specifies VCD_TARGET the
- * decoder may require two buffers of this size.
+ * window larger than this, unless xd3_config.dec_maxwinsize raises
+ * the limit.  If the file specifies VCD_TARGET the decoder may
+ * require two buffers of this size.
  *
- * 8-16MB is reasonable, probably don't need to go larger. */
+ * 8-16MB is reasonable by default. */
 #ifndef XD3_HARDMAXWINSIZE
 #define XD3_HARDMAXWINSIZE (1U<<24)
 #endif
+
+/* The largest window the encoder accepts, and that the decoder
+ * accepts when xd3_config.dec_maxwinsize allows it.  Beyond
+ * XD3_HARDMAXWINSIZE the small checksum table stops growing; target
+ * matches further back than it covers are found through a sampled
+ * table of at most XD3_FARSLOTS entries (see xd3_size_far_table). */
+#ifndef XD3_LARGEMAXWINSIZE
+#define XD3_LARGEMAXWINSIZE (1U<<30)
+#endif
+
+#ifndef XD3_FARSLOTS
+#define XD3_FARSLOTS (1U<<20)
+#endif
 /* The IOPT_SIZE value sets the size of a buffer used to batch
  * overlapping copy instructions before they are optimized by picking
  * the best non-overlapping ranges.  The larger this buffer, the
@@ -242,6 +266,12 @@ typedef uint32_t xoff_t;
 #define XD3_BUILD_DEFAULT 1
 #endif
 
+/* Performance counters (xd3_perf) are compiled in by default and
+ * collected only when the XD3_PERF flag is set. */
+#ifndef XD3_PERF_COUNTERS
+#define XD3_PERF_COUNTERS 1
+#endif
+
 #if XD3_DEBUG
 #include <stdio.h>
 #endif
@@ -275,6 +305,8 @@ typedef struct _xd3_code_table_sizes   xd3_code_table_sizes;
 typedef struct _xd3_slist              xd3_slist;
 typedef struct _xd3_whole_state        xd3_whole_state;
 typedef struct _xd3_wininfo            xd3_wininfo;
+typedef struct _xd3_perf               xd3_perf;
+typedef struct _xd3_winstate           xd3_winstate;
 
 /* The stream configuration has three callbacks functions, all of
  * which may be supplied with NULL values.  If config->getblk is
@@ -397,6 +429,25 @@ typedef enum
 				    * default. */
   XD3_ADLER32_RECODE = (1 << 15),  /* used by "recode". */
 
+  XD3_PERF           = (1 << 16),  /* collect the performance
+				    * counters in stream->perf. */
+  XD3_ESTIMATE       = (1 << 17),  /* (encoder only) match and select
+				    * instructions, but produce no
+				    * output: stream->total_out counts
+				    * the bytes a delta without
+				    * secondary compression would
+				    * take. */
+  XD3_PROBE          = (1 << 18),  /* (encoder only) probe the source
+				    * in place at aligned target
+				    * positions, and while probes
+				    * succeed, do not index a source
+				    * larger than src->max_winsize
+				    * ahead of the input.  For disk
+				    * images and other in-place
+				    * changes. */
+  XD3_MONOTONE       = (1 << 19),  /* (encoder only) limit source
+				    * copies by src->max_backward. */
+
   /* 4 bits to set the compression level the same as the command-line
    * setting -1 through -9 (-0 corresponds to the XD3_NOCOMPRESS flag,
    * and is independent of compression level).  This is for
@@ -580,6 +631,7 @@ struct _xd3_output
   uint8_t    *base;
   usize_t     next;
   usize_t     avail;
+  usize_t     chain_offset;  /* bytes in the preceding pages */
   xd3_output *next_page;
 };
 
@@ -608,6 +660,8 @@ struct _xd3_addr_cache
   usize_t  next_slot;  /* the circular index for near */
   usize_t *near_array; /* array of size s_near        */
   usize_t *same_array; /* array of size s_same*256    */
+  usize_t *same_gen;   /* generation tag of each same_array entry */
+  usize_t  generation; /* current generation, advanced per window */
 };
 
 /* the IOPT buffer list is just a list of buffers, which may be allocated
@@ -631,6 +685,11 @@ struct _xd3_smatcher
   usize_t            small_lchain;
   usize_t            max_lazy;
   usize_t            long_enough;
+  usize_t            small_tree;   /* if set, target matches are found
+				      in a binary tree of the last
+				      sprevsz positions, searching
+				      small_chain nodes, instead of
+				      the hash chain */
 };
 
 /* hash table size & power-of-two hash function. */
@@ -647,6 +706,33 @@ struct _xd3_slist
   usize_t     last_pos;
 };
 
+/* Performance counters, see XD3_PERF.  The timings (in microseconds)
+ * and event counts cover the current window: they are cleared at each
+ * XD3_WINSTART and complete at XD3_WINFINISH.  The timings nest:
+ * t_match includes the source indexing and match extension done
+ * during the search, and those include any t_getblk.  The table fill
+ * counts are the number of occupied slots, for comparison with
+ * small_hash.size and large_hash.size. */
+struct _xd3_perf
+{
+  xoff_t  t_srcindex;     /* computing source checksums */
+  xoff_t  t_match;        /* string matching */
+  xoff_t  t_extend;       /* extending source matches */
+  xoff_t  t_iopt;         /* flushing the instruction buffer */
+  xoff_t  t_secondary;    /* secondary compression */
+  xoff_t  t_getblk;       /* waiting in the getblk callback */
+
+  usize_t small_fill;     /* occupied small_table slots */
+  usize_t large_fill;     /* occupied large_table slots */
+  xoff_t  small_collide;  /* inserts into an occupied small slot */
+  xoff_t  large_collide;  /* inserts into an occupied large slot */
+
+  xoff_t  chain_steps;    /* small match candidates compared */
+  xoff_t  lazy_retries;   /* matches followed by a lazy search */
+  xoff_t  blk_hits;       /* xd3_getblk satisfied by curblk */
+  xoff_t  blk_misses;     /* xd3_getblk requests to the application */
+};
+
 /* window info (for whole state) */
 struct _xd3_wininfo {
   xoff_t offset;
@@ -654,6 +740,16 @@ struct _xd3_wininfo {
   uint32_t adler32;
 };
 
+/* The state carried from one window to the next, for checkpointing
+ * a stream at a window boundary.  See xd3_get_winstate(). */
+struct _xd3_winstate {
+  xoff_t windows;           /* complete windows */
+  xoff_t total_in;          /* input consumed by those windows */
+  xoff_t total_out;         /* output they produced */
+  xoff_t maxsrcaddr;        /* encoder: furthest source copy */
+  xoff_t srcwin_cksum_pos;  /* encoder: source indexed so far */
+};
+
 /* whole state for, e.g., merge */
 struct _xd3_whole_state {
   usize_t addslen;
@@ -711,13 +807,33 @@ struct _xd3_config
   xd3_smatch_cfg     smatch_cfg;    /* See enum: use fields below  for
 				       soft config */
   xd3_smatcher       smatcher_soft;
+
+  const xd3_code_table_desc *code_table_desc; /* Optional encoder code
+						 table, as built for
+						 --codetable by
+						 xdelta3-main.h.  It is
+						 embedded in the VCDIFF
+						 header. */
+
+  usize_t            anchor_interval; /* 0 indexes the source every
+					 large_step bytes.  Otherwise a
+					 power of two: the source is
+					 indexed only at content-defined
+					 anchors, this many bytes apart
+					 on average. */
+
+  usize_t            dec_maxwinsize; /* Decoder: the largest target
+					window accepted.  0 means
+					XD3_HARDMAXWINSIZE, and at most
+					XD3_LARGEMAXWINSIZE. */
 };
 
 /* The primary source file object. You create one of these objects and
  * initialize the first four fields.  This library maintains the next
  * 5 fields.  The configured getblk implementation is responsible for
  * setting the final 3 fields when called (and/or when XD3_GETSRCBLK
- * is returned).
+ * is returned).  The last field, max_backward, is yours to set as
+ * well, and is only read with XD3_MONOTONE.
  */
 struct _xd3_source
 {
@@ -760,6 +876,13 @@ struct _xd3_source
   usize_t             onlastblk;  /* Number of bytes on max_blkno */
   int                 eof_known;  /* Set to true when the first
 				   * partial block is read. */
+
+  /* you set, with XD3_MONOTONE */
+  xoff_t              max_backward;  /* source copies start at most
+					this far behind the end of any
+					earlier source copy, so that a
+					decoder can read the source
+					sequentially */
 };
 
 /* The primary xd3_stream object, used for encoding and decoding.  You
@@ -814,14 +937,25 @@ struct _xd3_stream
 
   usize_t           *large_table;      /* table of large checksums */
   xd3_hash_cfg       large_hash;       /* large hash config */
+  usize_t            anchor_interval;  /* see xd3_config */
+  usize_t            anchor_shift;     /* 32 - log2(anchor_interval) */
 
   usize_t           *small_table;      /* table of small checksums */
   xd3_slist         *small_prev;       /* table of previous offsets,
 					  circular linked list */
+  usize_t           *small_tree;       /* binary tree of previous
+					  offsets, two children per
+					  sprevsz slot (small_tree) */
   int                small_reset;      /* true if small table should
 					  be reset */
 
   xd3_hash_cfg       small_hash;       /* small hash config */
+  usize_t           *far_table;        /* sampled target positions,
+					  for windows larger than
+					  XD3_HARDMAXWINSIZE */
+  xd3_hash_cfg       far_hash;         /* far hash config */
+  usize_t            far_shift;        /* anchor shift for sampled
+					  positions, see xd3_is_anchor */
   xd3_addr_cache     acache;           /* the vcdiff address cache */
   xd3_encode_state   enc_state;        /* state of the encoder */
 
@@ -845,6 +979,10 @@ struct _xd3_stream
 					       and srcbase were
 					       decided early. */
   xoff_t             srcwin_cksum_pos;  /* Source checksum position */
+  xoff_t             srcwin_resume_pos; /* Source checksum position to
+					   reach before skipping over
+					   matched source, after
+					   xd3_set_winstate() */
 
   /* MATCH */
   xd3_match_state    match_state;      /* encoder match state */
@@ -867,6 +1005,17 @@ struct _xd3_stream
   xoff_t             maxsrcaddr;      /* address of the last source
 					 match (across windows) */
 
+  /* PROBE */
+  int                match_probe;      /* boolean: the match being
+					  extended is a probe */
+  int                srcwin_probing;   /* boolean: probes are finding
+					  the source in place, so it is
+					  not indexed ahead */
+  usize_t            probe_misses;     /* consecutive failed probes */
+  xoff_t             probe_srcpos;     /* end of the last source match */
+  xoff_t             probe_tgtpos;     /* ... and its target position
+					  (across windows) */
+
   uint8_t          *buf_in;           /* for saving buffered input */
   usize_t           buf_avail;        /* amount of saved input */
   const uint8_t    *buf_leftover;     /* leftover content of next_in
@@ -881,6 +1030,10 @@ struct _xd3_stream
 					 tail of chain */
   uint32_t          recode_adler32;   /* set the adler32 checksum
 				       * during "recode". */
+  uint32_t          enc_adler32;      /* running adler32 of next_in */
+  usize_t           enc_adler32_pos;  /* input covered by enc_adler32 */
+  usize_t           enc_est_adds;     /* ADD bytes not copied, with
+				       * XD3_ESTIMATE */
 
   xd3_rlist         iopt_used;        /* instruction optimizing buffer */
   xd3_rlist         iopt_free;
@@ -942,6 +1095,7 @@ struct _xd3_stream
   usize_t            dec_winbytes;     /* bytes of the three sections
                                           so far consumed */
   usize_t            dec_hdrsize;      /* VCDIFF + app header size */
+  usize_t            dec_maxwinsize;   /* see xd3_config */
 
   const uint8_t    *dec_tgtaddrbase;  /* Base of decoded target
                                          addresses (addr >=
@@ -968,6 +1122,16 @@ struct _xd3_stream
                                          target window */
   usize_t            dec_lastspace;    /* allocated space of last
                                           target window, for reuse */
+  uint8_t          *dec_userbuf;      /* caller's buffer for the next
+                                         window, see
+                                         xd3_set_dec_output() */
+  usize_t            dec_userspace;    /* size of dec_userbuf */
+  int               dec_userout;      /* boolean: this window decodes
+                                         into the caller's buffer */
+  uint8_t          *dec_ownout;       /* next_out and space_out of
+                                         the stream's own buffer,
+                                         while dec_userout */
+  usize_t            dec_ownspace;
 
   xd3_desect        inst_sect;        /* staging area for decoding
                                          window sections */
@@ -979,6 +1143,9 @@ struct _xd3_stream
   const xd3_dinst           *code_table;
   const xd3_code_table_desc *code_table_desc;
   xd3_dinst                 *code_table_alloc;
+  xd3_code_table_desc       *code_table_custom; /* copy of config's table */
+  uint8_t                   *code_table_enc;    /* its VCDIFF encoding */
+  usize_t                    code_table_encsz;
 
   /* secondary compression */
   const xd3_sec_type *sec_type;
@@ -990,7 +1157,7 @@ struct _xd3_stream
    * supports loading USIZE_T_MAX instructions, adds, etc. */
   xd3_whole_state     whole_target;
 
-  /* statistics */
+  /* statistics, counted by the decoder only with XD3_PERF */
   xoff_t            n_scpy;
   xoff_t            n_tcpy;
   xoff_t            n_add;
@@ -1003,6 +1170,8 @@ struct _xd3_stream
 
   usize_t           i_slots_used;
 
+  xd3_perf          perf;             /* with XD3_PERF */
+
 #if XD3_DEBUG
   usize_t            large_ckcnt;
 
@@ -1150,6 +1319,59 @@ int     xd3_encode_input  (xd3_stream    *stream);
 int     xd3_config_stream (xd3_stream    *stream,
 			   xd3_config    *config);
 
+/* Estimates the encoder memory, in bytes, for a stream configured
+ * with CONFIG and a source window (xd3_source.max_winsize) of SRCWINSZ
+ * bytes, or no source if zero.  The estimate counts the buffers the
+ * application holds too, W being the window size and U being
+ * sizeof (usize_t):
+ *
+ *   3W                           input window and output sections
+ *   W                            secondary compression output, if on
+ *   U * pow2 (min (W, H))        target hash table (with compression),
+ *                                H being XD3_HARDMAXWINSIZE
+ *   U * XD3_FARSLOTS             far target table, when W > H
+ *   U * sprevsz                  target match chains (with compression)
+ *   sizeof (xd3_rinst) * iopt    instruction buffer
+ *   SRCWINSZ                     source window
+ *   U * pow2 (SRCWINSZ / step)   source hash table, step being the
+ *                                large_step or anchor interval
+ *
+ * pow2() rounds down to a power of two.  An LZMA secondary compressor
+ * adds the liblzma figure for each of the three sections.  Tables
+ * are a few KB more. */
+int     xd3_config_memory (const xd3_config *config,
+			   xoff_t            srcwinsz,
+			   xoff_t           *bytes);
+
+/* Chooses winsize, sprevsz and iopt_size for CONFIG, and a source
+ * window size if SRCWINSZ is not NULL, so that xd3_config_memory() is
+ * at most LIMIT.  Starting from the default window size, the window
+ * is halved until the largest power-of-two source window that fits
+ * is at least four times the window, maximizing source reach.
+ * Returns XD3_INVALID if the limit is too small. */
+int     xd3_config_memory_limit (xd3_config *config,
+				 xoff_t      limit,
+				 xoff_t     *srcwinsz);
+
+/* Reads the window state after XD3_WINFINISH, when total_in and
+ * total_out are consistent. */
+void    xd3_get_winstate  (xd3_stream    *stream,
+			   xd3_winstate  *state);
+
+/* Continues a stream from a window boundary saved by
+ * xd3_get_winstate(), with the same configuration and source.  The
+ * encoder must be called before its first input, which then starts
+ * at STATE->total_in; the VCDIFF header is not repeated.  The source
+ * index is rebuilt up to STATE->srcwin_cksum_pos as the first window
+ * is matched, which reads the source from the beginning.  The
+ * decoder must be called once it has consumed the VCDIFF header
+ * (stream->dec_hdrsize bytes) and returned XD3_INPUT, after which
+ * its input continues at STATE->total_in; XD3_GOTHEADER is not
+ * returned.  Returns XD3_INVALID if the stream is not at that
+ * point. */
+int     xd3_set_winstate  (xd3_stream         *stream,
+			   const xd3_winstate *state);
+
 /* Since Xdelta3 doesn't open any files, xd3_close_stream is just an
  * error check that the stream is in a proper state to be closed: this
  * means the encoder is flushed and the decoder is at a window
@@ -1201,6 +1423,18 @@ void    xd3_set_appheader (xd3_stream    *stream,
 			   const uint8_t *data,
 			   usize_t        size);
 
+/* Decodes the current window directly into BUF, which must hold at
+ * least stream->dec_tgtlen bytes, so that its output is written once.
+ * Call this on XD3_GOTHEADER or XD3_WINSTART; BUF is used for that
+ * window only, and XD3_OUTPUT then returns next_out == BUF.  BUF may
+ * be, for example, the window's part of a pre-sized or mmapped output
+ * file.  If SIZE is too small, or the window uses VCD_TARGET, the
+ * stream decodes into its own buffer as usual.  Returns XD3_INTERNAL
+ * if no window header was just decoded. */
+int     xd3_set_dec_output (xd3_stream *stream,
+			    uint8_t    *buf,
+			    usize_t     size);
+
 /* xd3_get_appheader may be called in the decoder after XD3_GOTHEADER.
  * For convenience, the decoder always adds a single byte padding to
  * the end of the application header, which is set to zero in case the
@@ -1293,6 +1527,12 @@ usize_t xd3_encoder_srclen (xd3_stream *stream) {
   return stream->src->srclen;
 }
 
+/* Performance counters for the current window, see XD3_PERF. */
+static inline
+const xd3_perf* xd3_get_perf (xd3_stream *stream) {
+  return & stream->perf;
+}
+
 /* Checks for legal flag changes. */
 static inline
 void xd3_set_flags (xd3_stream *stream, int flags)